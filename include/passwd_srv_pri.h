@@ -20,9 +20,12 @@
 #include <openssl/rsa.h>
 #include <openssl/pem.h>
 #include <openssl/err.h>
+#include <sys/types.h>
 #include <sys/un.h>
+#include <stdint.h>
 
 #include "passwd_srv_pub.h"
+#include "passwd_srv_probe.h"
 
 #define TRUE  1
 #define FALSE 0
@@ -31,13 +34,27 @@
 #define PASSWD_SHADOW_FILE   "/etc/shadow"      /* file with password info */
 #define PASSWD_GROUP_FILE    "/etc/group"       /* file with group info */
 #define PASSWD_LOGIN_FILE    "/etc/login.defs"  /* encryption method stored */
+#define PASSWD_LOCK_FILE     "/etc/.pwd.lock"   /* lock used by lckpwdf() */
+#define PASSWD_LOCK_TIMEOUT  15                 /* seconds, as lckpwdf() */
 
 #define PASSWD_RUN_DIR       "/var/run/ops-passwd-srv"
+#define PASSWD_HANDOFF_FILE  \
+    "/var/run/ops-passwd-srv/ops-passwd-srv.handoff" /* upgrade handoff */
+#define PASSWD_BACKOFF_FILE  \
+    "/var/lib/ops-passwd-srv/ops-passwd-srv.backoff" /* failed attempts */
 #define PASSWD_SRV_PRI_KEY_LOC \
     "/var/run/ops-passwd-srv/ops-passwd-srv-pri.pem" /*private key loc*/
 
 #define PASSWD_SRV_YAML_KEY_MAX 2
 
+/* longest username, the width of scanf conversions into a username */
+#define PASSWD_USERNAME_LEN  49
+_Static_assert(PASSWD_USERNAME_LEN + 1 == PASSWD_USERNAME_SIZE,
+               "PASSWD_USERNAME_LEN must follow PASSWD_USERNAME_SIZE");
+
+#define PASSWD_SRV_STR_(x)   #x
+#define PASSWD_SRV_STR(x)    PASSWD_SRV_STR_(x)  /* expands x, then quotes */
+
 /**
  * defines for adding user
  * defect #151 : supports for useradd to avoid using hardcoded salt.
@@ -46,40 +63,425 @@
 #define OVSDB_GROUP "ovsdb-client"
 #define NETOP_GROUP "ops_netop"
 #define ADMIN_GROUP "ops_admin"
+#define VERIFY_GROUP "ops_passwd_verify"
 #define VTYSH_PROMPT "/usr/bin/vtysh"
 #define USERDEL "/usr/sbin/userdel"
 #define USER_NAME_MAX_LENGTH 32
 
+/*
+ * files used by the password server, located under the root directory
+ */
+enum passwd_srv_file_e {
+    PASSWD_SRV_FILE_PASSWD = 0,
+    PASSWD_SRV_FILE_SHADOW,
+    PASSWD_SRV_FILE_GROUP,
+    PASSWD_SRV_FILE_LOGIN_DEFS,
+    PASSWD_SRV_FILE_PWD_LOCK,
+    PASSWD_SRV_FILE_RUN_DIR,
+    PASSWD_SRV_FILE_HANDOFF,
+    PASSWD_SRV_FILE_BACKOFF,
+    PASSWD_SRV_FILE_MAX
+};
+
+/*
+ * stages of a request timed for the request trace
+ */
+enum passwd_srv_stage_e {
+    PASSWD_SRV_STAGE_DECRYPT = 0,
+    PASSWD_SRV_STAGE_PEER,
+    PASSWD_SRV_STAGE_VALIDATE,
+    PASSWD_SRV_STAGE_FIND,
+    PASSWD_SRV_STAGE_CRYPT,
+    PASSWD_SRV_STAGE_STORE,
+    PASSWD_SRV_STAGE_USERADD,
+    PASSWD_SRV_STAGE_QUEUE,   /* admitted, waiting for its turn */
+    PASSWD_SRV_STAGE_MAX
+};
+
+/*
+ * settings read from the 'settings' section of the yaml file, applied live
+ * when the configuration is reloaded
+ */
+typedef struct passwd_srv_settings
+{
+    int max_connections;      /* client connections served at once */
+    int queue_depth;          /* requests admitted and waiting to be served */
+    int read_timeout;         /* msec to read a request once it is started */
+    int process_timeout;      /* msec a request may wait in the queue */
+    int write_timeout;        /* msec to send pending replies */
+    int idle_timeout;         /* msec an idle connection is kept */
+    int rate_limit_global;    /* requests/s of all clients, 0 unlimited */
+    int rate_limit_uid;       /* requests/s of one client uid */
+    int rate_limit_password;  /* CHG_PASSWORD requests/s of one uid */
+    int rate_limit_account;   /* ADD_USER/DEL_USER requests/s of one uid */
+    int rate_limit_verify;    /* VERIFY requests/s of one uid */
+    int rate_limit_query;     /* query requests/s of one uid */
+    int backoff_threshold;    /* failed attempts before a user backs off */
+    int backoff_base;         /* msec of the first backoff, then doubled */
+    int backoff_max;          /* msec of the longest backoff */
+    int sched_weight_interactive; /* turns of CHG_PASSWORD, VERIFY, queries */
+    int sched_weight_admin;   /* turns of ADD_USER/DEL_USER requests */
+    int sched_weight_batch;   /* turns of requests flagged as batch */
+    int idempotency_ttl;      /* msec the result of a keyed request is kept */
+    int verify_cache_ttl;     /* msec a successful VERIFY is cached, 0 off */
+} passwd_srv_settings_t;
+
+/*
+ * opcode classes with their own per-uid rate limit
+ */
+enum passwd_srv_limit_class_e {
+    PASSWD_SRV_LIMIT_CLASS_PASSWORD = 0,
+    PASSWD_SRV_LIMIT_CLASS_ACCOUNT,
+    PASSWD_SRV_LIMIT_CLASS_VERIFY,
+    PASSWD_SRV_LIMIT_CLASS_QUERY,
+    PASSWD_SRV_LIMIT_CLASS_MAX
+};
+
+/*
+ * counters of rate limited requests, reported by passwd-srv/limit-show
+ */
+typedef struct passwd_srv_limit_stats
+{
+    uint64_t throttled_global;
+    uint64_t throttled_uid;
+    uint64_t throttled_class[PASSWD_SRV_LIMIT_CLASS_MAX];
+} passwd_srv_limit_stats_t;
+
+/*
+ * counters of the admission queue, reported by passwd-srv/queue-show
+ */
+typedef struct passwd_srv_queue_stats
+{
+    int      depth;           /* requests waiting now */
+    int      max_depth;       /* highest depth seen */
+    uint64_t admitted;        /* requests queued */
+    uint64_t rejected;        /* requests answered with PASSWD_ERR_BUSY */
+    uint64_t wait_ns;         /* total time served requests waited */
+    uint64_t max_wait_ns;
+    uint64_t service_ns;      /* moving average of the time to serve one */
+} passwd_srv_queue_stats_t;
+
+/*
+ * classes of the request scheduler, served in turns by weight
+ */
+enum passwd_srv_sched_class_e {
+    PASSWD_SRV_SCHED_INTERACTIVE = 0,   /* CHG_PASSWORD, VERIFY, queries */
+    PASSWD_SRV_SCHED_ADMIN,             /* ADD_USER, DEL_USER and others */
+    PASSWD_SRV_SCHED_BATCH,             /* flagged PASSWD_SRV_FLAG_BATCH */
+    PASSWD_SRV_SCHED_CLASS_MAX
+};
+
+/*
+ * entry of the request scheduler, embedded in the object it queues
+ */
+typedef struct passwd_srv_sched_entry
+{
+    void *owner;              /* returned by passwd_srv_sched_pop() */
+    enum passwd_srv_sched_class_e sclass;
+    uint64_t t_queued;        /* passwd_srv_clock() when it was queued */
+    struct passwd_srv_sched_flow *flow;   /* requests of its uid, or NULL */
+    struct passwd_srv_sched_entry *next;
+} passwd_srv_sched_entry_t;
+
+/*
+ * counters of a scheduler class, reported by passwd-srv/queue-show
+ */
+typedef struct passwd_srv_sched_stats
+{
+    int      depth;           /* requests waiting now */
+    uint64_t queued;
+    uint64_t served;
+    uint64_t wait_ns;         /* total time served requests waited */
+    uint64_t max_wait_ns;
+} passwd_srv_sched_stats_t;
+
+/*
+ * state of an idempotency key
+ */
+enum passwd_srv_idem_e {
+    PASSWD_SRV_IDEM_NEW = 0,  /* unknown, the request is served */
+    PASSWD_SRV_IDEM_PENDING,  /* request with the key is in the queue */
+    PASSWD_SRV_IDEM_DONE      /* request is completed, status is stored */
+};
+
+/*
+ * counters of idempotency keys, reported by passwd-srv/idempotency-show
+ */
+typedef struct passwd_srv_idem_stats
+{
+    int      keys;            /* keys kept now */
+    uint64_t stored;          /* results stored */
+    uint64_t replayed;        /* duplicates answered with a stored result */
+    uint64_t in_progress;     /* duplicates of a request in the queue */
+    uint64_t evicted;         /* results dropped before they expired */
+    uint64_t untracked;       /* keys not kept, table set full */
+} passwd_srv_idem_stats_t;
+
+/*
+ * counters of the verification cache, reported by passwd-srv/vcache-show
+ */
+typedef struct passwd_srv_vcache_stats
+{
+    int      entries;         /* checks cached now */
+    int      capacity;
+    uint64_t hits;            /* checks answered without crypt() */
+    uint64_t misses;
+    uint64_t inserted;
+    uint64_t evicted;         /* checks dropped before they expired */
+    uint64_t invalidated;     /* checks dropped on a change of the user */
+} passwd_srv_vcache_stats_t;
+
+/*
+ * counters of the user database, reported by passwd-srv/userdb-show
+ */
+typedef struct passwd_srv_userdb_stats
+{
+    int      valid;           /* files are parsed and unchanged by the server */
+    size_t   users;
+    size_t   groups;
+    uint64_t loads;           /* times the files were parsed */
+    uint64_t queries;         /* queries answered */
+} passwd_srv_userdb_stats_t;
+
+/*
+ * counters of account change events, reported by passwd-srv/event-show
+ */
+typedef struct passwd_srv_event_stats
+{
+    uint64_t next_seq;        /* sequence number of the next event */
+    uint64_t kept;            /* events a subscriber can resume from */
+    int      subscribers;     /* connections streaming events now */
+    uint64_t posted;
+    uint64_t resumed;         /* events sent again to resuming subscribers */
+    uint64_t resyncs;         /* subscribers told they missed events */
+} passwd_srv_event_stats_t;
+
+/*
+ * counters of background jobs, reported by passwd-srv/job-show
+ */
+typedef struct passwd_srv_job_stats
+{
+    int      queued;          /* jobs waiting for their turn */
+    uint32_t running;         /* id of the job running now, 0 if none */
+    int      kept;            /* done jobs whose status is kept */
+    int      capacity;
+    uint64_t submitted;
+    uint64_t rejected;        /* not accepted, the table was full */
+    uint64_t completed;
+    uint64_t failed;          /* completed with an error */
+    uint64_t run_ns;          /* moving average of the time to run a job */
+} passwd_srv_job_stats_t;
+
+/*
+ * counters of client connections, reported by passwd-srv/conn-show
+ */
+typedef struct passwd_srv_conn_stats
+{
+    int      connections;     /* connections open now */
+    uint64_t accepted;
+    uint64_t read_timeouts;   /* connections closed per expired deadline */
+    uint64_t process_timeouts;
+    uint64_t write_timeouts;
+    uint64_t idle_timeouts;
+    uint64_t cancelled_queued;  /* dropped before being served */
+    uint64_t cancelled_started; /* stopped at a checkpoint while served */
+    uint64_t cancelled_ns;    /* time spent serving cancelled requests */
+    uint64_t wasted;          /* served, but the client was gone */
+    uint64_t wasted_ns;       /* time spent serving wasted requests */
+} passwd_srv_conn_stats_t;
+
+/*
+ * timer of the timer wheel, embedded in the object it times
+ */
+typedef struct passwd_srv_timer
+{
+    long long int expires;    /* time_msec() it fires at, 0 if not armed */
+    void *owner;              /* given to the callback */
+    struct passwd_srv_timer *next;
+    struct passwd_srv_timer **pprev;
+} passwd_srv_timer_t;
+
+typedef void passwd_srv_timer_cb(void *owner);
+
+/*
+ * message exchanged over the handoff socket when a new password server takes
+ * over the listening socket of the running one:
+ * - new server sends it with PASSWD_SRV_HANDOFF_KEY set to get the key pair,
+ * - running server answers with the listening socket in SCM_RIGHTS, followed
+ *   by key_len bytes of DER encoded private key,
+ * - new server sends it again once it serves, the running one then stops
+ *   accepting and exits when its connections are done.
+ */
+#define PASSWD_SRV_HANDOFF_MAGIC   0x50534844  /* "PSHD" */
+#define PASSWD_SRV_HANDOFF_KEY     0x1         /* key pair is handed off */
+#define PASSWD_SRV_HANDOFF_KEY_MAX 4096        /* DER private key size */
+
+typedef struct passwd_srv_handoff_hdr
+{
+    uint32_t magic;
+    uint32_t flags;           /* PASSWD_SRV_HANDOFF_* */
+    uint32_t key_len;         /* bytes of private key following the header */
+} passwd_srv_handoff_hdr_t;
+
 /*
  * password server user-object data structure
  */
 typedef struct passwd_client
 {
+    uint64_t req_id;          /* request id carried by USDT probes */
+    uint32_t seq;             /* seq of the request frame (version 2) */
     int socket;               /* client socket descriptor */
     passwd_srv_msg_t msg; 	  /* MSG from client */
     struct spwd      *passwd; /* shadow file password structure */
+    uint64_t t_arrival;       /* passwd_srv_stage_now() at arrival */
+    uint64_t stage_ns[PASSWD_SRV_STAGE_MAX]; /* time spent per stage */
+    uint32_t retry_after_ms;  /* hint sent with BUSY and RATE_LIMITED */
+    void     *reply;          /* payload of a successful query, freed once
+                                 sent */
+    uint32_t reply_len;
+    uint64_t resume_after;    /* last event seen by a SUBSCRIBE request */
+    uint32_t job_id;          /* job asked about by a JOB_STATUS request */
+    uid_t    uid;             /* uid of the connected process */
+    int      job;             /* frame has PASSWD_SRV_FLAG_JOB */
+    char     hash[PASSWD_SRV_HASH_SIZE]; /* hash of a SET_HASH request */
 } passwd_client_t;
 
 /*
  * password server internal APIs
  */
+int passwd_srv_config_init(const char *root_dir, const char *yaml_file);
+const char *passwd_srv_file(enum passwd_srv_file_e file);
+int passwd_srv_is_sandboxed();
+int passwd_srv_config_publish(RSA *keypair);
+int passwd_srv_config_reload(RSA *keypair);
+const passwd_srv_settings_t *passwd_srv_settings();
+
+int passwd_srv_trace_open(const char *trace_file);
+void passwd_srv_trace_close();
+void passwd_srv_trace_request(const passwd_client_t *client, int status);
+uint64_t passwd_srv_stage_now();
+uint64_t passwd_srv_clock();
+uint64_t passwd_srv_stage_end(passwd_client_t *client,
+                              enum passwd_srv_stage_e stage, uint64_t t_start);
+
 int process_client_request(passwd_client_t *client);
 
-int create_socket();
-void listen_socket();
+int open_listener(const char *sock_file, mode_t mode);
+int create_socket(RSA *keypair);
+int passwd_srv_conn_activation_fd();
+int passwd_srv_conn_adopt(RSA *keypair, int listen_fd);
+int passwd_srv_conn_listen_fd();
+int passwd_srv_conn_rebind(const char *sock_file);
+void passwd_srv_conn_drain();
+int passwd_srv_conn_drained();
+void passwd_srv_conn_queue_stats(passwd_srv_queue_stats_t *stats);
+void passwd_srv_conn_stats(passwd_srv_conn_stats_t *stats);
+void passwd_srv_conn_run();
+int passwd_srv_request_cancelled(const passwd_client_t *client,
+                                 enum passwd_srv_stage_e stage);
+void passwd_srv_conn_wait();
+void passwd_srv_conn_publish(const passwd_srv_event_t *event);
 void socket_term_signal_handler();
 
+int passwd_srv_handoff_listen();
+void passwd_srv_handoff_run(RSA *keypair);
+void passwd_srv_handoff_wait();
+int passwd_srv_takeover(int with_key, int *listen_fd, RSA **keypair);
+void passwd_srv_takeover_complete();
+
+uid_t passwd_srv_peer_uid(int fd);
+int passwd_srv_limit_request(uid_t uid, uint32_t *retry_ms);
+int passwd_srv_limit_opcode(uid_t uid, int opcode, uint32_t *retry_ms);
+void passwd_srv_limit_stats(passwd_srv_limit_stats_t *stats);
+void passwd_srv_limit_foreach(void (*cb)(uid_t uid, uint64_t throttled,
+                                         void *aux), void *aux);
+
+int passwd_srv_backoff_load();
+int passwd_srv_backoff_check(const char *username, uint32_t *retry_ms);
+void passwd_srv_backoff_failure(const char *username);
+void passwd_srv_backoff_success(const char *username);
+int passwd_srv_backoff_clear(const char *username);
+uint64_t passwd_srv_backoff_foreach(void (*cb)(const char *username,
+                                               uint32_t failures,
+                                               long long int left,
+                                               void *aux), void *aux);
+void passwd_srv_backoff_run();
+void passwd_srv_backoff_wait();
+void passwd_srv_backoff_flush();
+
+enum passwd_srv_sched_class_e passwd_srv_sched_class(int opcode, int flags);
+const char *
+passwd_srv_sched_class_name(enum passwd_srv_sched_class_e sclass);
+int passwd_srv_sched_push(passwd_srv_sched_entry_t *entry,
+                          enum passwd_srv_sched_class_e sclass, uid_t uid,
+                          uint64_t now);
+void passwd_srv_sched_remove(passwd_srv_sched_entry_t *entry);
+passwd_srv_sched_entry_t *passwd_srv_sched_pop(uint64_t *wait_ns);
+void passwd_srv_sched_stats(enum passwd_srv_sched_class_e sclass,
+                            passwd_srv_sched_stats_t *stats);
+
+enum passwd_srv_idem_e passwd_srv_idem_lookup(uid_t uid, const uint8_t *key,
+                                              int *status, uint32_t *job_id);
+void passwd_srv_idem_begin(uid_t uid, const uint8_t *key);
+void passwd_srv_idem_end(uid_t uid, const uint8_t *key, int status,
+                         uint32_t job_id);
+void passwd_srv_idem_forget(uid_t uid, const uint8_t *key);
+void passwd_srv_idem_stats(passwd_srv_idem_stats_t *stats);
+
+int passwd_srv_vcache_lookup(const char *username, const char *password,
+                             const char *hash);
+void passwd_srv_vcache_insert(const char *username, const char *password,
+                              const char *hash);
+void passwd_srv_vcache_invalidate(const char *username);
+void passwd_srv_vcache_stats(passwd_srv_vcache_stats_t *stats);
+
+int passwd_srv_userdb_query(passwd_client_t *client);
+void passwd_srv_userdb_invalidate();
+void passwd_srv_userdb_stats(passwd_srv_userdb_stats_t *stats);
+
+void passwd_srv_event_post(uint32_t type, const char *username);
+void passwd_srv_event_commit(const passwd_client_t *client, int status);
+size_t passwd_srv_event_since(uint64_t after, passwd_srv_event_t *events,
+                              size_t max);
+void passwd_srv_event_subscribers(int delta);
+void passwd_srv_event_stats(passwd_srv_event_stats_t *stats);
+
+int passwd_srv_job_init();
+int passwd_srv_job_submit(passwd_client_t *client);
+int passwd_srv_job_reply(passwd_client_t *client, uint32_t id);
+int passwd_srv_job_query(passwd_client_t *client);
+int passwd_srv_job_pending();
+void passwd_srv_job_run();
+void passwd_srv_job_wait();
+void passwd_srv_job_stats(passwd_srv_job_stats_t *stats);
+
+void passwd_srv_timer_arm(passwd_srv_timer_t *timer, long long int expires);
+void passwd_srv_timer_cancel(passwd_srv_timer_t *timer);
+void passwd_srv_timer_run(long long int now, passwd_srv_timer_cb *cb);
+void passwd_srv_timer_wait();
+
 int validate_password(passwd_client_t *client);
+int passwd_srv_hash_usable(const char *hash);
 int validate_user(int opcode, char *client);
 char *get_connected_username();
 int find_connected_client_inode(int passwd_srv_ino);
 
+int check_user_group(const char *user, const char *group_name);
+struct spwd *create_user(const char *username, int useradd);
+pid_t spawn_user_command(const char *username, int useradd);
+int lock_shadow_file();
+void unlock_shadow_file();
+
 int create_and_store_password(passwd_client_t *client);
+int store_password(char *user, char *pass);
+int update_shadow_file(const char *shadow_file, const char *user,
+                       const char *pass);
 struct spwd *find_password_info(const char *username);
+struct spwd *search_shadow_file(const char *shadow_file, const char *username);
 
 RSA *generate_RSA_keypair();
 
-void create_pubkey_file(RSA *rsa);
+int create_pubkey_file(RSA *rsa, const char *pub_key_path);
 
 /*
  * forward declaration
@@ -0,0 +1,85 @@
+/*
+ * (c) Copyright 2016 Hewlett Packard Enterprise Development LP
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef PASSWD_SRV_PROBE_H_
+#define PASSWD_SRV_PROBE_H_
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * USDT static tracepoints
+ *
+ * Probes are placed at every stage boundary of a client request so that
+ * bpftrace/perf can attach to a running password server, i.e.
+ *
+ *   bpftrace -e 'usdt:/usr/bin/ops-passwd-srv:ops_passwd_srv:crypt
+ *                { @ns = hist(arg2); }'
+ *
+ * A disabled probe is a single nop in the instruction stream.  When the
+ * server is built with -DENABLE_USDT=OFF (or sys/sdt.h is not available)
+ * the probes and the timestamps taken for them are compiled out.
+ */
+#define PASSWD_SRV_PROBE_PROVIDER ops_passwd_srv
+
+#ifdef PASSWD_SRV_USDT
+
+#include <sys/sdt.h>
+
+#define PASSWD_SRV_PROBE1(name, a1) \
+    DTRACE_PROBE1(ops_passwd_srv, name, a1)
+#define PASSWD_SRV_PROBE2(name, a1, a2) \
+    DTRACE_PROBE2(ops_passwd_srv, name, a1, a2)
+#define PASSWD_SRV_PROBE3(name, a1, a2, a3) \
+    DTRACE_PROBE3(ops_passwd_srv, name, a1, a2, a3)
+#define PASSWD_SRV_PROBE4(name, a1, a2, a3, a4) \
+    DTRACE_PROBE4(ops_passwd_srv, name, a1, a2, a3, a4)
+
+/**
+ * Monotonic timestamp used to compute stage durations carried by probes
+ *
+ * @return current time in nanoseconds
+ */
+static inline uint64_t
+passwd_srv_probe_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+#else /* PASSWD_SRV_USDT */
+
+/* arguments are still referenced to keep the call sites warning free */
+#define PASSWD_SRV_PROBE1(name, a1) \
+    do { (void)(a1); } while (0)
+#define PASSWD_SRV_PROBE2(name, a1, a2) \
+    do { (void)(a1); (void)(a2); } while (0)
+#define PASSWD_SRV_PROBE3(name, a1, a2, a3) \
+    do { (void)(a1); (void)(a2); (void)(a3); } while (0)
+#define PASSWD_SRV_PROBE4(name, a1, a2, a3, a4) \
+    do { (void)(a1); (void)(a2); (void)(a3); (void)(a4); } while (0)
+
+static inline uint64_t
+passwd_srv_probe_now()
+{
+    return 0;
+}
+
+#endif /* PASSWD_SRV_USDT */
+
+#endif /* PASSWD_SRV_PROBE_H_ */
@@ -17,6 +17,8 @@
 #ifndef PASSWD_SRV_PUB_H_
 #define PASSWD_SRV_PUB_H_
 
+#include <stdint.h>
+
 /*
  * global definitions
  */
@@ -26,6 +28,7 @@
 #define PASSWD_SRV_MAX_STR_SIZE   255
 #define PASSWD_SRV_PUB_KEY_LEN 2048                     /* key length in bits */
 #define PASSWDSRV_PAD_OVERHEAD  41
+#define PASSWD_SRV_TRACE_MAGIC "ops-passwd-srv trace v1" /* trace header */
 /*
  * Message type definition
  *
@@ -37,6 +40,13 @@
 #define PASSWD_MSG_CHG_PASSWORD 1 /* request to change password */
 #define PASSWD_MSG_ADD_USER     2 /* request to add user */
 #define PASSWD_MSG_DEL_USER     3 /* request to del user */
+#define PASSWD_MSG_VERIFY       4 /* request to check password of user */
+#define PASSWD_MSG_LIST_USERS   5 /* list a page of users after username */
+#define PASSWD_MSG_GET_USER     6 /* get user with its group membership */
+#define PASSWD_MSG_GET_AGING    7 /* get password aging fields of user */
+#define PASSWD_MSG_SUBSCRIBE    8 /* stream account change events */
+#define PASSWD_MSG_JOB_STATUS   9 /* get status of a job */
+#define PASSWD_MSG_SET_HASH    10 /* store a crypt() hash of user */
 
 /*
  * Error code definition
@@ -62,6 +72,12 @@
 #define PASSWD_ERR_USERDEL_FAILED     14 /* Failed to del user */
 #define PASSWD_ERR_DECRYPT_FAILED     15 /* Failed to decrypt client message */
 #define PASSWD_ERR_YAML_FILE          16 /* error accessing yaml file */
+#define PASSWD_ERR_PENDING            17 /* request not completed yet (client) */
+#define PASSWD_ERR_BUSY               18 /* server overloaded, retry later */
+#define PASSWD_ERR_RATE_LIMITED       19 /* client over its rate, retry later */
+#define PASSWD_ERR_BACKOFF            20 /* too many failed attempts for user */
+#define PASSWD_ERR_CANCELLED          21 /* client gone, never sent (server) */
+#define PASSWD_ERR_JOB_NOT_FOUND      22 /* job unknown or status expired */
 
 
 /*
@@ -74,6 +90,146 @@ typedef struct passwd_srv_msg {
     char newpasswd[PASSWD_PASSWORD_SIZE];
 } passwd_srv_msg_t;
 
+/*
+ * MSG structure of PASSWD_MSG_SET_HASH, a hash does not fit the password
+ * fields of passwd_srv_msg_t.  It starts as passwd_srv_msg_t does, it is
+ * sent by passing it cast to passwd_srv_msg_t and is encrypted as one block
+ * all the same.
+ *
+ * The hash is stored as it is, only its format is checked: $5$ (SHA-256)
+ * and $6$ (SHA-512) with an optional rounds=N, or $y$ (yescrypt).  The user
+ * must exist and must not have uid 0.
+ */
+#define PASSWD_SRV_HASH_SIZE 128                        /* size of hash */
+
+typedef struct passwd_srv_hash_msg {
+    int  op_code;                           /* PASSWD_MSG_SET_HASH */
+    char username[PASSWD_USERNAME_SIZE];
+    char hash[PASSWD_SRV_HASH_SIZE];        /* crypt() string of the user */
+} passwd_srv_hash_msg_t;
+
+/*
+ * MSG structure of the requests which name no user, PASSWD_MSG_SUBSCRIBE
+ * and PASSWD_MSG_JOB_STATUS.  Their argument follows op_code in place of
+ * username.  It is sent cast to passwd_srv_msg_t as passwd_srv_hash_msg_t
+ * is.
+ */
+typedef struct passwd_srv_ctl_msg {
+    int op_code;
+    union {
+        uint64_t after;   /* SUBSCRIBE: seq of the last event received */
+        uint32_t job_id;  /* JOB_STATUS: id of passwd_srv_job_t */
+    } arg;
+} passwd_srv_ctl_msg_t;
+
+/*
+ * Framed protocol (version 2)
+ *
+ * Every request and reply starts with passwd_srv_hdr_t followed by len bytes
+ * of payload.  A request carries the encrypted passwd_srv_msg_t, a reply
+ * carries the status in the header and the seq of the request, so several
+ * requests can be in flight on one connection.  The connection stays open
+ * until the client closes it.
+ *
+ * A client which sends the bare encrypted message (version 1) gets a 4 byte
+ * status back and the connection is closed.
+ */
+#define PASSWD_SRV_MAGIC         0x50535256             /* "PSRV" */
+#define PASSWD_SRV_PROTO_VERSION 2
+#define PASSWD_SRV_IDEM_KEY_SIZE 16     /* idempotency key of a request */
+#define PASSWD_SRV_MAX_PAYLOAD   (PASSWD_SRV_IDEM_KEY_SIZE + \
+                                  PASSWD_SRV_PUB_KEY_LEN / 8)
+#define PASSWD_SRV_FLAG_BATCH    0x1    /* bulk job, served after others */
+#define PASSWD_SRV_FLAG_IDEM_KEY 0x2    /* payload starts with a key */
+#define PASSWD_SRV_FLAG_JOB      0x4    /* ADD/DEL_USER run as a job */
+
+typedef struct passwd_srv_hdr {
+    uint32_t magic;         /* PASSWD_SRV_MAGIC */
+    uint16_t version;       /* PASSWD_SRV_PROTO_VERSION */
+    uint16_t flags;         /* request only, PASSWD_SRV_FLAG_* */
+    uint32_t seq;           /* chosen by the client, echoed in the reply */
+    int32_t  status;        /* reply only, PASSWD_ERR_* code */
+    uint32_t len;           /* bytes of payload following the header */
+} passwd_srv_hdr_t;
+
+/*
+ * payload of a PASSWD_ERR_BUSY reply, sent before the request is decrypted
+ * when the request queue of the server is full, and of PASSWD_ERR_RATE_LIMITED
+ * and PASSWD_ERR_BACKOFF replies
+ */
+typedef struct passwd_srv_busy {
+    uint32_t retry_after_ms;  /* queue is expected to have room by then */
+} passwd_srv_busy_t;
+
+/*
+ * payloads of successful query replies, version 2 only:
+ * - PASSWD_MSG_LIST_USERS: passwd_srv_user_page_t followed by count
+ *   passwd_srv_user_info_t of the users sorted after username, from the
+ *   first user if username is empty,
+ * - PASSWD_MSG_GET_USER: passwd_srv_user_info_t,
+ * - PASSWD_MSG_GET_AGING: passwd_srv_user_aging_t.
+ */
+#define PASSWD_SRV_GROUP_NAME_SIZE 33   /* group name with its NUL */
+#define PASSWD_SRV_USER_GROUPS     8    /* groups listed per user */
+#define PASSWD_SRV_USER_PAGE       16   /* users per LIST_USERS reply */
+
+typedef struct passwd_srv_user_info {
+    char     username[PASSWD_USERNAME_SIZE];
+    char     group[PASSWD_SRV_GROUP_NAME_SIZE];   /* primary group */
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t ngroups;         /* groups the user is member of, may be more */
+    char     groups[PASSWD_SRV_USER_GROUPS][PASSWD_SRV_GROUP_NAME_SIZE];
+} passwd_srv_user_info_t;
+
+typedef struct passwd_srv_user_page {
+    uint32_t count;           /* users following */
+    uint32_t more;            /* users sorted after the last one */
+} passwd_srv_user_page_t;
+
+/* fields of the shadow entry of a user, in days, -1 if not set */
+typedef struct passwd_srv_user_aging {
+    int64_t  lastchg;         /* days since the epoch of the last change */
+    int64_t  min;
+    int64_t  max;
+    int64_t  warn;
+    int64_t  inact;
+    int64_t  expire;          /* days since the epoch the account expires */
+} passwd_srv_user_aging_t;
+
+/*
+ * payload of the PASSWD_ERR_PENDING reply to a request sent with
+ * PASSWD_SRV_FLAG_JOB, and of the PASSWD_ERR_SUCCESS reply to
+ * PASSWD_MSG_JOB_STATUS
+ */
+typedef struct passwd_srv_job {
+    uint32_t id;              /* job id, never 0 */
+    int32_t  status;          /* PASSWD_ERR_PENDING until the job is done */
+} passwd_srv_job_t;
+
+#define PASSWD_SRV_MAX_REPLY (sizeof(passwd_srv_user_page_t) + \
+                              PASSWD_SRV_USER_PAGE * \
+                              sizeof(passwd_srv_user_info_t))
+
+/*
+ * PASSWD_MSG_SUBSCRIBE, version 2 only, sent in passwd_srv_ctl_msg_t: after
+ * is the sequence number of the last event received, 0 for events from now
+ * on.  The reply has no payload, the server then sends frames of events
+ * with the seq of the SUBSCRIBE request, status PASSWD_ERR_SUCCESS and a
+ * payload of passwd_srv_event_t, as many as fit in PASSWD_SRV_MAX_REPLY,
+ * until the connection is closed.  Other requests may still be sent on it.
+ */
+#define PASSWD_SRV_EVENT_ADD_USER 1     /* user added */
+#define PASSWD_SRV_EVENT_DEL_USER 2     /* user deleted */
+#define PASSWD_SRV_EVENT_PASSWORD 3     /* password of user changed */
+#define PASSWD_SRV_EVENT_RESYNC   4     /* events missed, reread the users */
+
+typedef struct passwd_srv_event {
+    uint64_t seq;             /* increasing, resume after it */
+    uint32_t type;            /* PASSWD_SRV_EVENT_* */
+    char     username[PASSWD_USERNAME_SIZE];  /* empty for RESYNC */
+} passwd_srv_event_t;
+
 /*
  * Definitions use to parse YAML file for file path
  */
@@ -84,6 +240,7 @@ enum PASSWD_yaml_path_type_e {
     PASSWD_SRV_YAML_PATH_NONE = 0x0,
     PASSWD_SRV_YAML_PATH_SOCK,
     PASSWD_SRV_YAML_PATH_PUB_KEY,
+    PASSWD_SRV_YAML_PATH_ROOT,
     PASSWD_SRV_YAML_PATH_MAX
 };
 
@@ -92,9 +249,41 @@ enum PASSWD_yaml_key_e {
     PASSWD_SRV_YAML_PATH_TYPE,
     PASSWD_SRV_YAML_PATH,
     PASSWD_SRV_YAML_DESC,
+    PASSWD_SRV_YAML_SETTING_NAME,
+    PASSWD_SRV_YAML_SETTING_VALUE,
     PASSWD_SRV_YAML_MAX
 };
 
+/*
+ * Binary snapshot of the resolved configuration, published by the password
+ * server in its run directory (under the root directory) so that clients
+ * do not parse the YAML file.  See DESIGN.md.
+ */
+#define PASSWD_SRV_SNAPSHOT_FILE    "/var/run/ops-passwd-srv/ops-passwd-srv.snap"
+#define PASSWD_SRV_SNAPSHOT_MAGIC   0x50535343          /* "PSSC" */
+#define PASSWD_SRV_SNAPSHOT_VERSION 1
+#define PASSWD_SRV_KEY_FP_SIZE      32                  /* SHA-256 */
+
+typedef struct passwd_srv_snapshot {
+    uint32_t magic;             /* PASSWD_SRV_SNAPSHOT_MAGIC */
+    uint32_t version;           /* PASSWD_SRV_SNAPSHOT_VERSION */
+    uint32_t size;              /* sizeof(passwd_srv_snapshot_t) */
+    uint32_t checksum;          /* CRC-32, computed with this field 0 */
+    uint64_t yaml_size;         /* YAML file the snapshot was made from */
+    int64_t  yaml_mtime_sec;
+    int64_t  yaml_mtime_nsec;
+    uint16_t proto_min;         /* protocol versions served */
+    uint16_t proto_max;
+    uint32_t max_payload;       /* limits */
+    uint32_t username_size;
+    uint32_t password_size;
+    uint32_t key_bits;
+    uint8_t  key_fp[PASSWD_SRV_KEY_FP_SIZE];    /* SHA-256 of DER pub key */
+    char     root_dir[PASSWD_SRV_MAX_STR_SIZE+1];
+    char     yaml_file[PASSWD_SRV_MAX_STR_SIZE + sizeof(PASSWD_SRV_YAML_FILE)];
+    char     path[PASSWD_SRV_YAML_PATH_MAX][PASSWD_SRV_MAX_STR_SIZE+1];
+} passwd_srv_snapshot_t;
+
 typedef struct passwd_yaml_file_path {
     enum PASSWD_yaml_path_type_e type;
     char    path[PASSWD_SRV_MAX_STR_SIZE+1];
@@ -102,11 +291,91 @@ typedef struct passwd_yaml_file_path {
     struct  passwd_yaml_file_path *next;
 } passwd_yaml_file_path_t;
 
+/* entry of the 'settings' section, interpreted by the password server */
+typedef struct passwd_yaml_setting {
+    char    name[PASSWD_SRV_MAX_STR_SIZE+1];
+    char    value[PASSWD_SRV_MAX_STR_SIZE+1];
+    struct  passwd_yaml_setting *next;
+} passwd_yaml_setting_t;
+
 extern int parse_passwd_srv_yaml();
+extern int parse_passwd_srv_yaml_file(const char *yaml_file);
 extern char *get_file_path(enum PASSWD_yaml_path_type_e type);
 extern char *get_socket_descriptor_path();
 extern char *get_public_key_path();
+extern const char *get_passwd_srv_setting(const char *name);
+extern int  reload_passwd_srv_yaml_file(const char *yaml_file);
+extern void commit_passwd_srv_yaml_reload();
+extern void rollback_passwd_srv_yaml_reload();
 extern int  init_yaml_parser();
 extern int  uninit_yaml_parser();
+extern int  set_passwd_srv_root_dir(const char *root_dir);
+extern const char *get_passwd_srv_root_dir();
+extern void set_passwd_srv_snapshot_enabled(int enabled);
+extern const passwd_srv_snapshot_t *get_passwd_srv_snapshot();
+extern uint32_t passwd_srv_snapshot_checksum(const passwd_srv_snapshot_t *snap);
+
+/*
+ * client API, see passwd_srv_client.c
+ */
+extern int  passwd_srv_client_init(const char *yaml_file);
+extern void passwd_srv_client_disconnect();
+extern int  passwd_srv_request(const passwd_srv_msg_t *msg, int *status);
+extern int  passwd_srv_request_idempotent(const passwd_srv_msg_t *msg,
+                                          const uint8_t *key, int *status);
+extern int  passwd_srv_query(const passwd_srv_msg_t *msg, int *status,
+                             void *reply, size_t *len);
+extern int  passwd_srv_change_password(const char *username,
+                                       const char *old_password,
+                                       const char *new_password);
+extern int  passwd_srv_add_user(const char *username, const char *password);
+extern int  passwd_srv_del_user(const char *username);
+extern int  passwd_srv_verify_password(const char *username,
+                                       const char *password);
+extern int  passwd_srv_set_password_hash(const char *username,
+                                         const char *hash);
+extern int  passwd_srv_list_users(const char *after,
+                                  passwd_srv_user_info_t *users, int *count,
+                                  int *more);
+extern int  passwd_srv_get_user(const char *username,
+                                passwd_srv_user_info_t *info);
+extern int  passwd_srv_get_aging(const char *username,
+                                 passwd_srv_user_aging_t *aging);
+extern int  passwd_srv_job_status(uint32_t job_id, int *status);
+extern uint32_t passwd_srv_retry_after();
+extern uint32_t passwd_srv_job_id();
+extern void passwd_srv_set_batch(int batch);
+extern void passwd_srv_set_job(int job);
+
+/*
+ * asynchronous client API for poll loops, see passwd_srv_client.c
+ */
+typedef struct passwd_srv_async passwd_srv_async_t;
+
+extern passwd_srv_async_t *passwd_srv_async_create();
+extern void passwd_srv_async_destroy(passwd_srv_async_t *conn);
+extern int  passwd_srv_async_submit(passwd_srv_async_t *conn,
+                                    const passwd_srv_msg_t *msg,
+                                    uint32_t *handle);
+extern int  passwd_srv_async_submit_idempotent(passwd_srv_async_t *conn,
+                                               const passwd_srv_msg_t *msg,
+                                               const uint8_t *key,
+                                               uint32_t *handle);
+extern int  passwd_srv_async_result(passwd_srv_async_t *conn,
+                                    uint32_t handle, int *status);
+extern int  passwd_srv_async_result_data(passwd_srv_async_t *conn,
+                                         uint32_t handle, int *status,
+                                         void *reply, size_t *len);
+extern int  passwd_srv_async_subscribe(passwd_srv_async_t *conn,
+                                       uint64_t after, uint32_t *handle);
+extern int  passwd_srv_async_next_event(passwd_srv_async_t *conn,
+                                        passwd_srv_event_t *event);
+extern void passwd_srv_async_run(passwd_srv_async_t *conn);
+extern void passwd_srv_async_wait(passwd_srv_async_t *conn);
+extern int  passwd_srv_async_get_fd(const passwd_srv_async_t *conn);
+extern uint32_t passwd_srv_async_retry_after(const passwd_srv_async_t *conn);
+extern void passwd_srv_async_set_batch(passwd_srv_async_t *conn, int batch);
+extern uint32_t passwd_srv_async_job_id(const passwd_srv_async_t *conn);
+extern void passwd_srv_async_set_job(passwd_srv_async_t *conn, int job);
 
 #endif /* PASSWD_SRV_PUB_H_ */
@@ -0,0 +1,620 @@
+# -*- coding: utf-8 -*-
+#
+# Copyright (C) 2016 Hewlett Packard Enterprise Development LP
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#   http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing,
+# software distributed under the License is distributed on an
+# "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+# KIND, either express or implied.  See the License for the
+# specific language governing permissions and limitations
+# under the License.
+
+"""
+OpenSwitch Test for the password server run against a sandboxed root
+directory
+
+The image must be built with -DINSTALL_TEST_TOOLS=ON so that
+ops-passwd-srv-gendata and ops-passwd-srv-ctest are installed.
+"""
+
+from pytest import mark
+
+TOPOLOGY = """
+# +-------+
+# |       |
+# |ops1   |
+# |       |
+# +-------+
+
+# Nodes
+# [image="genericx86-64:latest" type=openswitch name="OpenSwitch 1"] ops1
+[type=openswitch name="OpenSwitch 1"] ops1
+# Links
+"""
+
+SANDBOX = "/tmp/passwd-srv-ct"
+PASSWORD = "ctest-pw1"
+USER = "user0"
+CTL = SANDBOX + "/ops-passwd-srv.ctl"
+PIDFILE = SANDBOX + "/ops-passwd-srv.pid"
+YAML = SANDBOX + "/etc/ops-passwd-srv/ops-passwd-srv.yaml"
+RUN_DIR = SANDBOX + "/var/run/ops-passwd-srv"
+
+
+def start_sandbox_server(ops1, options=""):
+    """
+    Start a password server on the sandbox, beside the one of the switch
+    """
+    ops1("ops-passwd-srv --root=" + SANDBOX + " --unixctl=" + CTL +
+         " --detach --pidfile=" + PIDFILE + " " + options, shell="bash")
+    ops1("for i in 1 2 3 4 5 6 7 8 9 10; do "
+         "test -S " + RUN_DIR + "/ops-passwd-srv.sock"
+         " && test -f " + RUN_DIR + "/ops-passwd-srv-pub.pem && break; "
+         "sleep 1; done", shell="bash")
+
+
+def stop_sandbox_server(ops1):
+    """
+    Stop the sandbox server with SIGTERM and wait for it to exit
+    """
+    ops1("test -f " + PIDFILE + " && pid=$(cat " + PIDFILE + ") && "
+         "kill -TERM $pid && "
+         "while kill -0 $pid 2>/dev/null; do sleep 0.1; done", shell="bash")
+
+
+def create_sandbox(ops1, settings=(), start=True):
+    """
+    Populate the sandbox with a synthetic dataset, add settings to its yaml
+    file and start its server
+    """
+    ops1("rm -rf " + SANDBOX, shell="bash")
+    ops1("ops-passwd-srv-gendata --root=" + SANDBOX + " --users=10"
+         " --methods=sha512 --password=" + PASSWORD, shell="bash")
+
+    if settings:
+        ops1("echo 'settings:' >> " + YAML, shell="bash")
+    for name, value in settings:
+        ops1("printf \"  - name: %s\\n    value: '%s'\\n\" >> %s" %
+             (name, value, YAML), shell="bash")
+
+    if start:
+        start_sandbox_server(ops1)
+
+
+def destroy_sandbox(ops1):
+    """
+    Stop the sandbox server and remove the sandbox
+    """
+    stop_sandbox_server(ops1)
+    ops1("rm -rf " + SANDBOX, shell="bash")
+
+
+def run_ctest(ops1, check):
+    """
+    Run a check of ops-passwd-srv-ctest against the sandbox
+
+    :return: output of the check
+    """
+    return ops1("ops-passwd-srv-ctest --root=" + SANDBOX + " --user=" + USER +
+                " --password=" + PASSWORD + " " + check, shell="bash")
+
+
+def appctl(ops1, command):
+    """
+    Run a unixctl command of the sandbox server
+
+    :return: reply of the server
+    """
+    return ops1("ovs-appctl -t " + CTL + " passwd-srv/" + command,
+                shell="bash")
+
+
+@mark.platform_incompatible(['ostl'])
+def test_passwd_srv_sandbox(topology):
+    """
+    Change a password through a password server run on a sandbox
+
+    Using bash shell from the switch
+    1. populate a sandbox with ops-passwd-srv-gendata and start a password
+       server on it with --root
+    2. change the password of a user of the sandbox and make sure the
+       shadow file of the sandbox has it
+    """
+
+    ops1 = topology.get('ops1')
+    assert ops1 is not None
+
+    print("Create the sandbox")
+    create_sandbox(ops1)
+
+    try:
+        print("Change a password of the sandbox")
+        assert "sandbox: PASSED" in run_ctest(ops1, "sandbox")
+    finally:
+        destroy_sandbox(ops1)
+
+    print("Test test_passwd_srv_sandbox PASSED")
+
+
+@mark.platform_incompatible(['ostl'])
+def test_passwd_srv_framing(topology):
+    """
+    Send version 1, version 2 and pipelined requests to a sandbox server
+
+    Using bash shell from the switch
+    1. start a password server on a sandbox
+    2. send a version 1 request, a version 2 frame, a frame of an unknown
+       version and pipelined requests, and make sure each gets its reply
+    """
+
+    ops1 = topology.get('ops1')
+    assert ops1 is not None
+
+    create_sandbox(ops1)
+
+    try:
+        print("Check the framed protocol")
+        assert "framing: PASSED" in run_ctest(ops1, "framing")
+    finally:
+        destroy_sandbox(ops1)
+
+    print("Test test_passwd_srv_framing PASSED")
+
+
+@mark.platform_incompatible(['ostl'])
+def test_passwd_srv_reload(topology):
+    """
+    Reload the yaml file of a sandbox server
+
+    Using bash shell from the switch
+    1. start a password server on a sandbox
+    2. move its socket in the yaml file and reload it, make sure the socket
+       is moved and requests are served on it
+    3. set an invalid setting and reload, make sure the reload fails and the
+       server goes on with its previous configuration
+    """
+
+    ops1 = topology.get('ops1')
+    assert ops1 is not None
+
+    create_sandbox(ops1, [("QUEUE_DEPTH", "64")])
+
+    try:
+        print("Move the socket")
+        ops1("sed -i 's|ops-passwd-srv.sock|ops-passwd-srv-2.sock|' " + YAML,
+             shell="bash")
+        assert "failed" not in appctl(ops1, "reload")
+        assert "moved" in ops1("test -S " + RUN_DIR + "/ops-passwd-srv-2.sock"
+                               " && ! test -e " + RUN_DIR +
+                               "/ops-passwd-srv.sock && echo moved",
+                               shell="bash")
+        assert "sandbox: PASSED" in run_ctest(ops1, "sandbox")
+
+        print("Roll back an invalid setting")
+        ops1("sed -i \"s|value: '64'|value: '0'|\" " + YAML, shell="bash")
+        assert "reload failed" in appctl(ops1, "reload")
+        assert "limit 64)" in appctl(ops1, "queue-show")
+        assert "sandbox: PASSED" in run_ctest(ops1, "sandbox")
+    finally:
+        destroy_sandbox(ops1)
+
+    print("Test test_passwd_srv_reload PASSED")
+
+
+@mark.platform_incompatible(['ostl'])
+def test_passwd_srv_takeover(topology):
+    """
+    Hand the socket of a sandbox server off to a new server
+
+    Using bash shell from the switch
+    1. start a password server on a sandbox
+    2. start a second one with --takeover, make sure the first one exits
+       and the second one serves requests on the same socket
+    """
+
+    ops1 = topology.get('ops1')
+    assert ops1 is not None
+
+    create_sandbox(ops1)
+
+    try:
+        old_pid = ops1("cat " + PIDFILE, shell="bash").strip()
+        assert old_pid
+
+        print("Take the socket over")
+        ops1("rm -f " + PIDFILE, shell="bash")
+        start_sandbox_server(ops1, "--takeover")
+        ops1("while kill -0 " + old_pid + " 2>/dev/null; do sleep 0.1; done",
+             shell="bash")
+        assert old_pid != ops1("cat " + PIDFILE, shell="bash").strip()
+        assert "sandbox: PASSED" in run_ctest(ops1, "sandbox")
+    finally:
+        destroy_sandbox(ops1)
+
+    print("Test test_passwd_srv_takeover PASSED")
+
+
+@mark.platform_incompatible(['ostl'])
+def test_passwd_srv_activation(topology):
+    """
+    Start a sandbox server with a listening socket passed as by systemd
+
+    Using bash shell from the switch
+    1. populate a sandbox without starting its server
+    2. listen on its socket, start a server with LISTEN_FDS and make sure a
+       request sent before the server is up is served
+    """
+
+    ops1 = topology.get('ops1')
+    assert ops1 is not None
+
+    create_sandbox(ops1, start=False)
+
+    try:
+        print("Start the server with an inherited socket")
+        assert "activation: PASSED" in run_ctest(ops1, "activation")
+    finally:
+        destroy_sandbox(ops1)
+
+    print("Test test_passwd_srv_activation PASSED")
+
+
+@mark.platform_incompatible(['ostl'])
+def test_passwd_srv_busy(topology):
+    """
+    Overflow the request queue of a sandbox server
+
+    Using bash shell from the switch
+    1. start a password server on a sandbox with QUEUE_DEPTH 1
+    2. send requests of many clients at once, make sure the requests not
+       admitted get PASSWD_ERR_BUSY with a retry-after hint
+    """
+
+    ops1 = topology.get('ops1')
+    assert ops1 is not None
+
+    create_sandbox(ops1, [("QUEUE_DEPTH", "1")])
+
+    try:
+        print("Overflow the request queue")
+        assert "busy: PASSED" in run_ctest(ops1, "busy")
+        assert "rejected: 0" not in appctl(ops1, "queue-show")
+    finally:
+        destroy_sandbox(ops1)
+
+    print("Test test_passwd_srv_busy PASSED")
+
+
+@mark.platform_incompatible(['ostl'])
+def test_passwd_srv_deadline(topology):
+    """
+    Leave a request of a sandbox server incomplete
+
+    Using bash shell from the switch
+    1. start a password server on a sandbox
+    2. send half a request, make sure the connection is closed once
+       READ_TIMEOUT_MS expires and the timeout is counted
+    """
+
+    ops1 = topology.get('ops1')
+    assert ops1 is not None
+
+    create_sandbox(ops1)
+
+    try:
+        print("Send half a request")
+        assert "deadline: PASSED" in run_ctest(ops1, "deadline")
+        assert "read timeouts: 1 " in appctl(ops1, "conn-show")
+    finally:
+        destroy_sandbox(ops1)
+
+    print("Test test_passwd_srv_deadline PASSED")
+
+
+@mark.platform_incompatible(['ostl'])
+def test_passwd_srv_ratelimit(topology):
+    """
+    Send requests over the rate limit of a sandbox server
+
+    Using bash shell from the switch
+    1. start a password server on a sandbox with RATE_LIMIT_UID 2
+    2. send requests until one gets PASSWD_ERR_RATE_LIMITED with a
+       retry-after hint
+    """
+
+    ops1 = topology.get('ops1')
+    assert ops1 is not None
+
+    create_sandbox(ops1, [("RATE_LIMIT_UID", "2")])
+
+    try:
+        print("Send requests over the rate limit")
+        assert "ratelimit: PASSED" in run_ctest(ops1, "ratelimit")
+        assert "uid: 0 throttled" not in appctl(ops1, "limit-show")
+    finally:
+        destroy_sandbox(ops1)
+
+    print("Test test_passwd_srv_ratelimit PASSED")
+
+
+@mark.platform_incompatible(['ostl'])
+def test_passwd_srv_backoff(topology):
+    """
+    Put a user of a sandbox server in backoff
+
+    Using bash shell from the switch
+    1. start a password server on a sandbox with BACKOFF_THRESHOLD 3 and
+       BACKOFF_BASE_MS 60000
+    2. fail the password of a user 3 times, make sure even its right
+       password is then rejected with a retry-after hint
+    3. stop the server with SIGTERM, start it again and make sure the user
+       is still in backoff, then clear it
+    """
+
+    ops1 = topology.get('ops1')
+    assert ops1 is not None
+
+    create_sandbox(ops1, [("BACKOFF_THRESHOLD", "3"),
+                          ("BACKOFF_BASE_MS", "60000")])
+
+    try:
+        print("Check backoff of failed checks")
+        assert "backoff: PASSED" in run_ctest(ops1, "backoff")
+        assert USER + ": 3 failures" in appctl(ops1, "backoff-show")
+
+        print("Restart the server with SIGTERM")
+        stop_sandbox_server(ops1)
+        start_sandbox_server(ops1)
+        assert USER + ": 3 failures" in appctl(ops1, "backoff-show")
+
+        appctl(ops1, "backoff-clear " + USER)
+        assert USER + ":" not in appctl(ops1, "backoff-show")
+    finally:
+        destroy_sandbox(ops1)
+
+    print("Test test_passwd_srv_backoff PASSED")
+
+
+@mark.platform_incompatible(['ostl'])
+def test_passwd_srv_sched(topology):
+    """
+    Send an interactive request behind a bulk job to a sandbox server
+
+    Using bash shell from the switch
+    1. start a password server on a sandbox
+    2. queue requests of a bulk job, then an interactive one, make sure the
+       interactive one is served before most of the bulk ones
+    """
+
+    ops1 = topology.get('ops1')
+    assert ops1 is not None
+
+    create_sandbox(ops1)
+
+    try:
+        print("Schedule an interactive request")
+        assert "sched: PASSED" in run_ctest(ops1, "sched")
+        assert "batch: weight 1, depth 0, served 0," not in \
+            appctl(ops1, "queue-show")
+    finally:
+        destroy_sandbox(ops1)
+
+    print("Test test_passwd_srv_sched PASSED")
+
+
+@mark.platform_incompatible(['ostl'])
+def test_passwd_srv_cancel(topology):
+    """
+    Close connections of a sandbox server with requests in flight
+
+    Using bash shell from the switch
+    1. start a password server on a sandbox
+    2. send requests of many clients and close them at once, make sure the
+       requests are dropped and the server goes on serving
+    """
+
+    ops1 = topology.get('ops1')
+    assert ops1 is not None
+
+    create_sandbox(ops1)
+
+    try:
+        print("Cancel requests of closed connections")
+        assert "cancel: PASSED" in run_ctest(ops1, "cancel")
+        assert "cancelled: 0 queued, 0 started" not in \
+            appctl(ops1, "conn-show")
+    finally:
+        destroy_sandbox(ops1)
+
+    print("Test test_passwd_srv_cancel PASSED")
+
+
+@mark.platform_incompatible(['ostl'])
+def test_passwd_srv_idempotency(topology):
+    """
+    Send a request again with its idempotency key to a sandbox server
+
+    Using bash shell from the switch
+    1. start a password server on a sandbox
+    2. add a user three times with one key and once with another, make sure
+       the replays get the first status and the other key is served
+    """
+
+    ops1 = topology.get('ops1')
+    assert ops1 is not None
+
+    create_sandbox(ops1)
+
+    try:
+        print("Check idempotency keys")
+        assert "idempotency: PASSED" in run_ctest(ops1, "idempotency")
+        assert "replayed: 2" in appctl(ops1, "idempotency-show")
+    finally:
+        destroy_sandbox(ops1)
+
+    print("Test test_passwd_srv_idempotency PASSED")
+
+
+@mark.platform_incompatible(['ostl'])
+def test_passwd_srv_verify(topology):
+    """
+    Verify passwords of a sandbox server
+
+    Using bash shell from the switch
+    1. start a password server on a sandbox with BACKOFF_THRESHOLD 100
+    2. verify the right and a wrong password of a user, and the password of
+       an account whose hash is locked, disabled or empty
+    """
+
+    ops1 = topology.get('ops1')
+    assert ops1 is not None
+
+    create_sandbox(ops1, [("BACKOFF_THRESHOLD", "100")])
+
+    try:
+        print("Verify passwords")
+        assert "verify: PASSED" in run_ctest(ops1, "verify")
+    finally:
+        destroy_sandbox(ops1)
+
+    print("Test test_passwd_srv_verify PASSED")
+
+
+@mark.platform_incompatible(['ostl'])
+def test_passwd_srv_vcache(topology):
+    """
+    Change a password cached by the verification cache of a sandbox server
+
+    Using bash shell from the switch
+    1. start a password server on a sandbox with VERIFY_CACHE_TTL_MS 60000
+    2. verify a password twice, change it with CHG_PASSWORD and SET_HASH and
+       make sure the cached check of the old one no longer matches
+    3. make sure failed checks of a locked account are not cached
+    """
+
+    ops1 = topology.get('ops1')
+    assert ops1 is not None
+
+    create_sandbox(ops1, [("VERIFY_CACHE_TTL_MS", "60000")])
+
+    try:
+        print("Check the verification cache")
+        assert "vcache: PASSED" in run_ctest(ops1, "vcache")
+        show = appctl(ops1, "vcache-show")
+        assert "hits: 0 " not in show
+        assert "invalidated: 0" not in show
+        assert "inserted: 3\n" in show
+    finally:
+        destroy_sandbox(ops1)
+
+    print("Test test_passwd_srv_vcache PASSED")
+
+
+@mark.platform_incompatible(['ostl'])
+def test_passwd_srv_queries(topology):
+    """
+    Query the users of a sandbox server
+
+    Using bash shell from the switch
+    1. start a password server on a sandbox
+    2. list its users by pages, get a user and its password aging
+    """
+
+    ops1 = topology.get('ops1')
+    assert ops1 is not None
+
+    create_sandbox(ops1)
+
+    try:
+        print("Query users")
+        assert "queries: PASSED" in run_ctest(ops1, "queries")
+    finally:
+        destroy_sandbox(ops1)
+
+    print("Test test_passwd_srv_queries PASSED")
+
+
+@mark.platform_incompatible(['ostl'])
+def test_passwd_srv_events(topology):
+    """
+    Subscribe to user change events of a sandbox server
+
+    Using bash shell from the switch
+    1. start a password server on a sandbox
+    2. subscribe, add a user, change its password and delete it, and make
+       sure the events arrive in order, also to a resumed subscription
+    3. resume after an event no longer kept and make sure RESYNC arrives
+    """
+
+    ops1 = topology.get('ops1')
+    assert ops1 is not None
+
+    create_sandbox(ops1)
+
+    try:
+        print("Check event resume")
+        assert "events: PASSED" in run_ctest(ops1, "events")
+        show = appctl(ops1, "event-show")
+        assert "resumed: 0" not in show
+        assert "resyncs: 1" in show
+    finally:
+        destroy_sandbox(ops1)
+
+    print("Test test_passwd_srv_events PASSED")
+
+
+@mark.platform_incompatible(['ostl'])
+def test_passwd_srv_jobs(topology):
+    """
+    Run account changes of a sandbox server as jobs
+
+    Using bash shell from the switch
+    1. start a password server on a sandbox
+    2. add a user as a job, add it again and delete it, and make sure the
+       status of each job is polled once it is done
+    """
+
+    ops1 = topology.get('ops1')
+    assert ops1 is not None
+
+    create_sandbox(ops1)
+
+    try:
+        print("Run jobs")
+        assert "jobs: PASSED" in run_ctest(ops1, "jobs")
+        assert "completed: 3 (1 failed)" in appctl(ops1, "job-show")
+    finally:
+        destroy_sandbox(ops1)
+
+    print("Test test_passwd_srv_jobs PASSED")
+
+
+@mark.platform_incompatible(['ostl'])
+def test_passwd_srv_hash(topology):
+    """
+    Import password hashes to a sandbox server
+
+    Using bash shell from the switch
+    1. start a password server on a sandbox
+    2. send well formed and malformed hashes with SET_HASH, make sure only
+       the well formed ones are stored and verify
+    """
+
+    ops1 = topology.get('ops1')
+    assert ops1 is not None
+
+    create_sandbox(ops1)
+
+    try:
+        print("Check SET_HASH hash formats")
+        assert "hash: PASSED" in run_ctest(ops1, "hash")
+    finally:
+        destroy_sandbox(ops1)
+
+    print("Test test_passwd_srv_hash PASSED")
@@ -0,0 +1,1632 @@
+/*
+ * (c) Copyright 2016 Hewlett Packard Enterprise Development LP
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+/************************************************************************//**
+ * @ingroup passwd-srvd
+ *
+ * @file
+ * Client API of the Password Server.
+ *
+ *    Takes care of everything a client used to do by hand: reading the YAML
+ *     file, loading the public key, encrypting the request, talking to the
+ *     server over the UNIX socket and reading the status back.
+ *
+ *    The public key and the EVP context built from it are shared by all
+ *     threads of the process and are only reloaded when the key file
+ *     changes, i.e. when the password server restarts.  Each thread keeps
+ *     its own connection for the blocking calls, which is reused as long as
+ *     the server leaves it open.
+ *
+ *    Daemons built on the OVS poll loop use passwd_srv_async_*() instead:
+ *     requests are submitted without waiting, the connection is registered
+ *     with poll_fd_wait() and results are collected by handle once
+ *     passwd_srv_async_run() has read the replies.
+ ***************************************************************************/
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+
+#include <poll-loop.h>
+#include "openvswitch/vlog.h"
+#include "passwd_srv_pub.h"
+
+VLOG_DEFINE_THIS_MODULE(passwd_srv_client);
+
+#define PASSWD_SRV_KEY_WAIT_MSEC 5000   /* key of a server being started */
+#define PASSWD_SRV_KEY_POLL_MSEC 10
+
+/*
+ * public key cache shared by all threads, protected by s_key_mutex
+ */
+static pthread_mutex_t s_key_mutex = PTHREAD_MUTEX_INITIALIZER;
+static EVP_PKEY     *s_pkey = NULL;
+static EVP_PKEY_CTX *s_pkey_ctx = NULL;
+static struct stat  s_key_stat;         /* key file when it was loaded */
+static int          s_client_init = 0;
+static struct sockaddr_un s_sockaddr;
+static char         s_key_path[PASSWD_SRV_MAX_STR_SIZE+1];
+
+/*
+ * connection used by asynchronous requests
+ */
+typedef struct passwd_srv_async_req {
+    uint32_t seq;           /* handle of the request */
+    int      err;           /* PASSWD_ERR_PENDING until completed */
+    int      status;        /* status returned by the server */
+    unsigned char *reply;   /* payload of a successful query, NULL if none */
+    uint32_t reply_len;
+} passwd_srv_async_req_t;
+
+struct passwd_srv_async {
+    int      fd;            /* -1 until connected */
+    uint32_t next_seq;
+    uint16_t flags;         /* PASSWD_SRV_FLAG_* of the requests sent */
+    uint64_t served;        /* replies received on the connection */
+    size_t   in_flight;     /* requests sent or queued, not replied to */
+    uint32_t retry_after_ms;        /* hint of the last reply if retryable */
+    uint32_t job_id;        /* job of the last request accepted as one */
+    passwd_srv_async_req_t *reqs;   /* requests not collected yet */
+    size_t   n_reqs;
+    size_t   reqs_size;
+    unsigned char *tx;      /* frames not sent yet */
+    size_t   tx_len;
+    size_t   tx_size;
+    unsigned char rx[sizeof(passwd_srv_hdr_t) + PASSWD_SRV_MAX_REPLY];
+    size_t   rx_len;
+    uint32_t sub_seq;       /* handle of the subscription, 0 if none */
+    int      sub_err;       /* why the subscription ended */
+    passwd_srv_event_t *events;     /* events not collected yet */
+    size_t   event_next;    /* next event to collect */
+    size_t   n_events;
+    size_t   events_size;
+};
+
+/* connection used by the blocking calls of the calling thread */
+static __thread passwd_srv_async_t *s_conn = NULL;
+static __thread int s_batch = 0;    /* passwd_srv_set_batch() */
+static __thread int s_job = 0;      /* passwd_srv_set_job() */
+
+/**
+ * Read socket and public key location of the password server.  Called with
+ * s_key_mutex held.
+ *
+ * @param yaml_file YAML file to read, NULL for the default location
+ * @return PASSWD_ERR_SUCCESS if the server location is known
+ */
+static int
+client_init_locked(const char *yaml_file)
+{
+    char *sock_path, *key_path;
+    int err;
+
+    /* start from a clean list, entries are otherwise merged */
+    uninit_yaml_parser();
+    err = (NULL == yaml_file) ? parse_passwd_srv_yaml() :
+            parse_passwd_srv_yaml_file(yaml_file);
+
+    if ((PASSWD_ERR_SUCCESS != err) ||
+        (NULL == (sock_path = get_socket_descriptor_path())) ||
+        (NULL == (key_path = get_public_key_path())) ||
+        (sizeof(s_sockaddr.sun_path) <= strlen(sock_path)))
+    {
+        VLOG_ERR("Failed to read password server location");
+        return PASSWD_ERR_YAML_FILE;
+    }
+
+    memset(&s_sockaddr, 0, sizeof(s_sockaddr));
+    s_sockaddr.sun_family = AF_UNIX;
+    memcpy(s_sockaddr.sun_path, sock_path, strlen(sock_path) + 1);
+    snprintf(s_key_path, sizeof(s_key_path), "%s", key_path);
+
+    /* key of a previous location is stale */
+    memset(&s_key_stat, 0, sizeof(s_key_stat));
+    s_client_init = 1;
+
+    return PASSWD_ERR_SUCCESS;
+}
+
+/**
+ * Read socket and public key location of the password server.  Called
+ * implicitly with the default YAML file by the first request.
+ *
+ * @param yaml_file YAML file to read, NULL for the default location under
+ *                  the root directory
+ * @return PASSWD_ERR_SUCCESS if the server location is known
+ */
+int passwd_srv_client_init(const char *yaml_file)
+{
+    int err;
+
+    pthread_mutex_lock(&s_key_mutex);
+    err = client_init_locked(yaml_file);
+    pthread_mutex_unlock(&s_key_mutex);
+
+    passwd_srv_client_disconnect();
+    return err;
+}
+
+/**
+ * Load the public key if it is not loaded yet or the key file has changed
+ * since.  Called with s_key_mutex held.
+ *
+ * @param force reload even if the key file looks unchanged
+ * @return PASSWD_ERR_SUCCESS if an encryption context is available
+ */
+static int
+client_load_key(int force)
+{
+    struct stat st;
+    EVP_PKEY *pkey;
+    EVP_PKEY_CTX *ctx;
+    RSA *rsa;
+    FILE *fp;
+
+    if (0 != stat(s_key_path, &st))
+    {
+        if (ENOENT != errno)
+        {
+            VLOG_ERR("Cannot access public key %s", s_key_path);
+        }
+        return PASSWD_ERR_FATAL;
+    }
+
+    if (!force && s_pkey_ctx && (st.st_ino == s_key_stat.st_ino) &&
+        (st.st_size == s_key_stat.st_size) &&
+        (st.st_mtim.tv_sec == s_key_stat.st_mtim.tv_sec) &&
+        (st.st_mtim.tv_nsec == s_key_stat.st_mtim.tv_nsec))
+    {
+        return PASSWD_ERR_SUCCESS;
+    }
+
+    if (NULL == (fp = fopen(s_key_path, "r")))
+    {
+        return PASSWD_ERR_FATAL;
+    }
+    rsa = PEM_read_RSAPublicKey(fp, NULL, NULL, NULL);
+    fclose(fp);
+
+    if (NULL == rsa)
+    {
+        VLOG_ERR("Failed to read public key %s", s_key_path);
+        return PASSWD_ERR_FATAL;
+    }
+
+    pkey = EVP_PKEY_new();
+    if ((NULL == pkey) || (1 != EVP_PKEY_assign_RSA(pkey, rsa)))
+    {
+        RSA_free(rsa);
+        EVP_PKEY_free(pkey);
+        return PASSWD_ERR_INSUFFICIENT_MEM;
+    }
+
+    /* same padding as RSA_private_decrypt() in the server */
+    ctx = EVP_PKEY_CTX_new(pkey, NULL);
+    if ((NULL == ctx) || (1 != EVP_PKEY_encrypt_init(ctx)) ||
+        (1 != EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_OAEP_PADDING)))
+    {
+        EVP_PKEY_CTX_free(ctx);
+        EVP_PKEY_free(pkey);
+        return PASSWD_ERR_FATAL;
+    }
+
+    EVP_PKEY_CTX_free(s_pkey_ctx);
+    EVP_PKEY_free(s_pkey);
+    s_pkey_ctx = ctx;
+    s_pkey = pkey;
+    s_key_stat = st;
+
+    return PASSWD_ERR_SUCCESS;
+}
+
+/**
+ * Get the size of a request, which depends on its opcode
+ *
+ * @param msg request, passwd_srv_hash_msg_t for PASSWD_MSG_SET_HASH,
+ *            passwd_srv_ctl_msg_t for PASSWD_MSG_SUBSCRIBE and
+ *            PASSWD_MSG_JOB_STATUS
+ * @return bytes of the request
+ */
+static size_t
+client_msg_len(const passwd_srv_msg_t *msg)
+{
+    switch (msg->op_code)
+    {
+    case PASSWD_MSG_SET_HASH:
+        return sizeof(passwd_srv_hash_msg_t);
+    case PASSWD_MSG_SUBSCRIBE:
+    case PASSWD_MSG_JOB_STATUS:
+        return sizeof(passwd_srv_ctl_msg_t);
+    default:
+        return sizeof(*msg);
+    }
+}
+
+/**
+ * Encrypt a request with the cached public key
+ *
+ * @param msg     request to encrypt, see client_msg_len()
+ * @param enc_msg buffer of at least PASSWD_SRV_PUB_KEY_LEN/8 bytes
+ * @param force   reload the public key before encrypting
+ * @return length of encrypted request, -1 on failure
+ */
+static int
+client_encrypt(const passwd_srv_msg_t *msg, unsigned char *enc_msg, int force)
+{
+    size_t enc_len = PASSWD_SRV_PUB_KEY_LEN / 8;
+    size_t msg_len = client_msg_len(msg);
+    int ret = -1;
+
+    pthread_mutex_lock(&s_key_mutex);
+
+    if ((PASSWD_ERR_SUCCESS == client_load_key(force)) &&
+        (1 == EVP_PKEY_encrypt(s_pkey_ctx, enc_msg, &enc_len,
+                               (const unsigned char *)msg, msg_len)))
+    {
+        ret = (int)enc_len;
+    }
+
+    pthread_mutex_unlock(&s_key_mutex);
+    return ret;
+}
+
+/**
+ * Check whether encryption failed because the public key file is missing.
+ * The socket of a server activated by systemd accepts connections before
+ * the key pair is generated.
+ *
+ * @return non-zero if the key file does not exist
+ */
+static int
+client_key_missing()
+{
+    struct stat st;
+
+    return (0 != stat(s_key_path, &st)) && (ENOENT == errno);
+}
+
+/**
+ * Wait for the public key of a password server which is starting, on the
+ * blocking calls only
+ *
+ * @return PASSWD_ERR_SUCCESS if the key file was missing and is there now
+ */
+static int
+client_wait_key()
+{
+    struct stat st;
+    int waited;
+
+    if (!client_key_missing())
+    {
+        /* encryption failed for another reason */
+        return PASSWD_ERR_FATAL;
+    }
+
+    for (waited = 0; waited < PASSWD_SRV_KEY_WAIT_MSEC;
+         waited += PASSWD_SRV_KEY_POLL_MSEC)
+    {
+        usleep(PASSWD_SRV_KEY_POLL_MSEC * 1000);
+        if (0 == stat(s_key_path, &st))
+        {
+            return PASSWD_ERR_SUCCESS;
+        }
+    }
+
+    VLOG_ERR("Cannot access public key %s", s_key_path);
+    return PASSWD_ERR_FATAL;
+}
+
+/**
+ * Make sure the server location is known, reading the default YAML file if
+ * passwd_srv_client_init() was not called
+ *
+ * @return PASSWD_ERR_SUCCESS if the server location is known
+ */
+static int
+client_check_init()
+{
+    int err;
+
+    pthread_mutex_lock(&s_key_mutex);
+    err = s_client_init ? PASSWD_ERR_SUCCESS : client_init_locked(NULL);
+    pthread_mutex_unlock(&s_key_mutex);
+
+    return err;
+}
+
+/**
+ * Create a connection handle for asynchronous requests.  The connection to
+ * the password server is opened by the first request.  A handle must only
+ * be used by one thread at a time.
+ *
+ * @return connection handle, NULL if out of memory
+ */
+passwd_srv_async_t *passwd_srv_async_create()
+{
+    passwd_srv_async_t *conn;
+
+    if (NULL == (conn = calloc(1, sizeof(*conn))))
+    {
+        return NULL;
+    }
+
+    conn->fd = -1;
+    return conn;
+}
+
+/**
+ * Fail every request still in flight and close the connection
+ *
+ * @param conn connection handle
+ * @param err  error reported for requests in flight
+ */
+static void
+async_fail(passwd_srv_async_t *conn, int err)
+{
+    size_t i;
+
+    for (i = 0; i < conn->n_reqs; i++)
+    {
+        if (PASSWD_ERR_PENDING == conn->reqs[i].err)
+        {
+            conn->reqs[i].err = err;
+        }
+    }
+
+    if (conn->sub_seq)
+    {
+        /* events queued are still collected */
+        conn->sub_err = err;
+        conn->sub_seq = 0;
+    }
+
+    if (0 <= conn->fd)
+    {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+
+    memset(conn->tx, 0, conn->tx_len);
+    conn->tx_len = 0;
+    conn->rx_len = 0;
+    conn->served = 0;
+    conn->in_flight = 0;
+}
+
+/**
+ * Close the connection and free the handle.  Results not collected yet are
+ * lost.
+ *
+ * @param conn connection handle
+ */
+void passwd_srv_async_destroy(passwd_srv_async_t *conn)
+{
+    size_t i;
+
+    if (NULL == conn)
+    {
+        return;
+    }
+
+    async_fail(conn, PASSWD_ERR_RECV_FAILED);
+    for (i = 0; i < conn->n_reqs; i++)
+    {
+        free(conn->reqs[i].reply);
+    }
+    free(conn->events);
+    free(conn->tx);
+    free(conn->reqs);
+    free(conn);
+}
+
+/**
+ * Socket of a connection handle, to be polled by callers which do not use
+ * the OVS poll loop
+ *
+ * @param conn connection handle
+ * @return socket descriptor, -1 if not connected
+ */
+int passwd_srv_async_get_fd(const passwd_srv_async_t *conn)
+{
+    return conn->fd;
+}
+
+/**
+ * Time after which the server expects to take requests again, when the last
+ * reply received on a handle is PASSWD_ERR_BUSY, PASSWD_ERR_RATE_LIMITED or
+ * PASSWD_ERR_BACKOFF
+ *
+ * @param conn connection handle
+ * @return retry-after hint in milliseconds, 0 for other replies
+ */
+uint32_t passwd_srv_async_retry_after(const passwd_srv_async_t *conn)
+{
+    return conn ? conn->retry_after_ms : 0;
+}
+
+/**
+ * Mark the requests submitted on a handle as a bulk job.  The server serves
+ * them after interactive and admin requests waiting at the same time.
+ *
+ * @param conn  connection handle
+ * @param batch TRUE for requests of a bulk job
+ */
+void passwd_srv_async_set_batch(passwd_srv_async_t *conn, int batch)
+{
+    if (conn)
+    {
+        conn->flags = batch ? (conn->flags | PASSWD_SRV_FLAG_BATCH) :
+                              (conn->flags & ~PASSWD_SRV_FLAG_BATCH);
+    }
+}
+
+/**
+ * Job id the server gave to the last ADD_USER or DEL_USER request of a
+ * handle it accepted as a job, see passwd_srv_async_set_job()
+ *
+ * @param conn connection handle
+ * @return job id, 0 if none
+ */
+uint32_t passwd_srv_async_job_id(const passwd_srv_async_t *conn)
+{
+    return conn ? conn->job_id : 0;
+}
+
+/**
+ * Run the ADD_USER and DEL_USER requests submitted on a handle as jobs.
+ * The server answers them with PASSWD_ERR_PENDING and a job id at once,
+ * runs them in the background and tells their status on
+ * PASSWD_MSG_JOB_STATUS.
+ *
+ * @param conn connection handle
+ * @param job  TRUE to run account changes as jobs
+ */
+void passwd_srv_async_set_job(passwd_srv_async_t *conn, int job)
+{
+    if (conn)
+    {
+        conn->flags = job ? (conn->flags | PASSWD_SRV_FLAG_JOB) :
+                            (conn->flags & ~PASSWD_SRV_FLAG_JOB);
+    }
+}
+
+/**
+ * Connect a handle to the password server unless it has a usable connection.
+ * An idle connection closed by the server is replaced.
+ *
+ * @param conn connection handle
+ * @return PASSWD_ERR_SUCCESS if connected
+ */
+static int
+async_connect(passwd_srv_async_t *conn)
+{
+    char byte;
+    int fd;
+
+    if ((0 <= conn->fd) && (0 == conn->in_flight) &&
+        (0 >= recv(conn->fd, &byte, sizeof(byte), MSG_PEEK | MSG_DONTWAIT)) &&
+        (EAGAIN != errno) && (EWOULDBLOCK != errno))
+    {
+        /* EOF or error, e.g. the server was restarted */
+        async_fail(conn, PASSWD_ERR_RECV_FAILED);
+    }
+
+    if (0 <= conn->fd)
+    {
+        return PASSWD_ERR_SUCCESS;
+    }
+
+    if (0 > (fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)))
+    {
+        return PASSWD_ERR_FATAL;
+    }
+
+    if (0 > connect(fd, (struct sockaddr *)&s_sockaddr, sizeof(s_sockaddr)))
+    {
+        close(fd);
+        return PASSWD_ERR_SEND_FAILED;
+    }
+
+    conn->fd = fd;
+    return PASSWD_ERR_SUCCESS;
+}
+
+/**
+ * Send as much of the queued requests as the socket takes without blocking
+ *
+ * @param conn connection handle
+ */
+static void
+async_flush(passwd_srv_async_t *conn)
+{
+    ssize_t len;
+
+    while (conn->tx_len)
+    {
+        len = send(conn->fd, conn->tx, conn->tx_len,
+                   MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (0 > len)
+        {
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            if ((EAGAIN != errno) && (EWOULDBLOCK != errno))
+            {
+                async_fail(conn, PASSWD_ERR_SEND_FAILED);
+            }
+            return;
+        }
+
+        conn->tx_len -= len;
+        memmove(conn->tx, conn->tx + len, conn->tx_len);
+    }
+}
+
+/**
+ * Encrypt a request and queue it on a connection handle
+ *
+ * @param conn   connection handle
+ * @param msg    request to send
+ * @param key    idempotency key of the request, NULL if it has none
+ * @param force  reload the public key before encrypting
+ * @param handle set to the handle of the request
+ * @return PASSWD_ERR_SUCCESS if the request is queued
+ */
+static int
+async_submit(passwd_srv_async_t *conn, const passwd_srv_msg_t *msg,
+             const uint8_t *key, int force, uint32_t *handle)
+{
+    passwd_srv_hdr_t hdr;
+    unsigned char *payload;
+    void *ptr;
+    size_t size, key_len = key ? PASSWD_SRV_IDEM_KEY_SIZE : 0;
+    int enc_len, err;
+
+    if (PASSWD_ERR_SUCCESS != (err = client_check_init()))
+    {
+        return err;
+    }
+
+    if (PASSWD_ERR_SUCCESS != (err = async_connect(conn)))
+    {
+        return err;
+    }
+
+    /* room for the frame and for its result */
+    size = conn->tx_len + sizeof(hdr) + PASSWD_SRV_MAX_PAYLOAD;
+    if (size > conn->tx_size)
+    {
+        if (NULL == (ptr = realloc(conn->tx, size * 2)))
+        {
+            return PASSWD_ERR_INSUFFICIENT_MEM;
+        }
+        conn->tx = ptr;
+        conn->tx_size = size * 2;
+    }
+
+    if (conn->n_reqs == conn->reqs_size)
+    {
+        size = conn->reqs_size ? conn->reqs_size * 2 : 8;
+        if (NULL == (ptr = realloc(conn->reqs, size * sizeof(*conn->reqs))))
+        {
+            return PASSWD_ERR_INSUFFICIENT_MEM;
+        }
+        conn->reqs = ptr;
+        conn->reqs_size = size;
+    }
+
+    /* the key is sent in clear ahead of the encrypted message, so that the
+     * server finds a duplicate without decrypting it */
+    payload = conn->tx + conn->tx_len + sizeof(hdr);
+    if (key)
+    {
+        memcpy(payload, key, key_len);
+    }
+
+    enc_len = client_encrypt(msg, payload + key_len, force);
+    if ((0 > enc_len) && client_key_missing())
+    {
+        /* connected to a server which is still generating its key pair,
+         * a poll loop is not held up waiting for it */
+        conn->retry_after_ms = PASSWD_SRV_KEY_POLL_MSEC;
+        return PASSWD_ERR_BUSY;
+    }
+    if (0 > enc_len)
+    {
+        return PASSWD_ERR_FATAL;
+    }
+
+    /* 0 is never a valid handle */
+    if (0 == ++conn->next_seq)
+    {
+        conn->next_seq = 1;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = PASSWD_SRV_MAGIC;
+    hdr.version = PASSWD_SRV_PROTO_VERSION;
+    hdr.flags = conn->flags | (key ? PASSWD_SRV_FLAG_IDEM_KEY : 0);
+    hdr.seq = conn->next_seq;
+    hdr.len = key_len + enc_len;
+    memcpy(conn->tx + conn->tx_len, &hdr, sizeof(hdr));
+    conn->tx_len += sizeof(hdr) + hdr.len;
+
+    conn->reqs[conn->n_reqs].seq = hdr.seq;
+    conn->reqs[conn->n_reqs].err = PASSWD_ERR_PENDING;
+    conn->reqs[conn->n_reqs].status = PASSWD_ERR_FATAL;
+    conn->reqs[conn->n_reqs].reply = NULL;
+    conn->reqs[conn->n_reqs].reply_len = 0;
+    conn->n_reqs++;
+    conn->in_flight++;
+    *handle = hdr.seq;
+
+    async_flush(conn);
+    return PASSWD_ERR_SUCCESS;
+}
+
+/**
+ * Queue a request on a connection handle.  It is sent as the socket allows;
+ * several requests can be in flight on the connection at once.
+ *
+ * @param conn   connection handle
+ * @param msg    request to send
+ * @param handle set to the handle to collect the result with
+ * @return PASSWD_ERR_SUCCESS if the request is queued, PASSWD_ERR_BUSY
+ *         while the server is generating its key pair, to submit again
+ *         after passwd_srv_async_retry_after()
+ */
+int passwd_srv_async_submit(passwd_srv_async_t *conn,
+                            const passwd_srv_msg_t *msg, uint32_t *handle)
+{
+    if ((NULL == conn) || (NULL == msg) || (NULL == handle))
+    {
+        return PASSWD_ERR_INVALID_PARAM;
+    }
+
+    return async_submit(conn, msg, NULL, 0, handle);
+}
+
+/**
+ * Queue a request with an idempotency key on a connection handle.  A
+ * request sent again with the same key, on any connection of the same
+ * user, gets the status of the first one without being served twice, for
+ * IDEMPOTENCY_TTL_MS.
+ *
+ * @param conn   connection handle
+ * @param msg    request to send
+ * @param key    PASSWD_SRV_IDEM_KEY_SIZE random bytes chosen by the caller
+ * @param handle set to the handle to collect the result with
+ * @return PASSWD_ERR_SUCCESS if the request is queued
+ */
+int passwd_srv_async_submit_idempotent(passwd_srv_async_t *conn,
+                                       const passwd_srv_msg_t *msg,
+                                       const uint8_t *key, uint32_t *handle)
+{
+    if ((NULL == conn) || (NULL == msg) || (NULL == key) || (NULL == handle))
+    {
+        return PASSWD_ERR_INVALID_PARAM;
+    }
+
+    return async_submit(conn, msg, key, 0, handle);
+}
+
+/**
+ * Subscribe a connection handle to account change events, see
+ * PASSWD_MSG_SUBSCRIBE.  The status of the subscription is collected with
+ * passwd_srv_async_result(), the events with passwd_srv_async_next_event().
+ * A handle has one subscription, the last one.
+ *
+ * @param conn   connection handle
+ * @param after  seq of the last event received before, e.g. on a connection
+ *               which was closed, 0 for events from now on
+ * @param handle set to the handle to collect the status with
+ * @return PASSWD_ERR_SUCCESS if the request is queued
+ */
+int passwd_srv_async_subscribe(passwd_srv_async_t *conn, uint64_t after,
+                               uint32_t *handle)
+{
+    passwd_srv_ctl_msg_t msg;
+    int err;
+
+    if ((NULL == conn) || (NULL == handle))
+    {
+        return PASSWD_ERR_INVALID_PARAM;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.op_code = PASSWD_MSG_SUBSCRIBE;
+    msg.arg.after = after;
+
+    /* starts as passwd_srv_msg_t does, encrypted whole by client_encrypt() */
+    err = async_submit(conn, (const passwd_srv_msg_t *)&msg, NULL, 0, handle);
+    if (PASSWD_ERR_SUCCESS == err)
+    {
+        conn->sub_seq = *handle;
+        conn->sub_err = PASSWD_ERR_SUCCESS;
+    }
+    return err;
+}
+
+/**
+ * Queue the events of a frame received on a subscribed handle
+ *
+ * @param conn    connection handle
+ * @param payload events
+ * @param len     length of payload
+ */
+static void
+async_queue_events(passwd_srv_async_t *conn, const unsigned char *payload,
+                   size_t len)
+{
+    size_t n = len / sizeof(passwd_srv_event_t);
+    size_t size;
+    void *ptr;
+
+    if (conn->event_next)
+    {
+        conn->n_events -= conn->event_next;
+        memmove(conn->events, conn->events + conn->event_next,
+                conn->n_events * sizeof(*conn->events));
+        conn->event_next = 0;
+    }
+
+    if (conn->n_events + n > conn->events_size)
+    {
+        size = (conn->n_events + n) * 2;
+        if (NULL == (ptr = realloc(conn->events, size * sizeof(*conn->events))))
+        {
+            /* events are lost, the caller resumes after the last one */
+            async_fail(conn, PASSWD_ERR_INSUFFICIENT_MEM);
+            return;
+        }
+        conn->events = ptr;
+        conn->events_size = size;
+    }
+
+    memcpy(conn->events + conn->n_events, payload,
+           n * sizeof(*conn->events));
+    conn->n_events += n;
+}
+
+/**
+ * Collect the next account change event received on a subscribed handle.
+ * Once the subscription has ended, e.g. the server was restarted, the
+ * caller subscribes again after the seq of the last event it collected.
+ *
+ * @param conn  connection handle
+ * @param event set to the event, in the order the server posted them
+ * @return PASSWD_ERR_SUCCESS if an event is collected, PASSWD_ERR_PENDING if
+ *         none has arrived, the error which ended the subscription otherwise
+ */
+int passwd_srv_async_next_event(passwd_srv_async_t *conn,
+                                passwd_srv_event_t *event)
+{
+    if ((NULL == conn) || (NULL == event))
+    {
+        return PASSWD_ERR_INVALID_PARAM;
+    }
+
+    if (conn->event_next < conn->n_events)
+    {
+        *event = conn->events[conn->event_next++];
+        return PASSWD_ERR_SUCCESS;
+    }
+
+    if (conn->sub_seq)
+    {
+        return PASSWD_ERR_PENDING;
+    }
+    return (PASSWD_ERR_SUCCESS != conn->sub_err) ?
+           conn->sub_err : PASSWD_ERR_INVALID_PARAM;
+}
+
+/**
+ * Record the status of a request found in a reply, with the payload of a
+ * successful query
+ *
+ * @param conn    connection handle
+ * @param hdr     reply header
+ * @param payload hdr->len bytes following the header
+ */
+static void
+async_complete(passwd_srv_async_t *conn, const passwd_srv_hdr_t *hdr,
+               const unsigned char *payload)
+{
+    passwd_srv_busy_t busy;
+    passwd_srv_job_t job;
+    passwd_srv_async_req_t *req;
+    size_t i;
+
+    conn->served++;
+
+    conn->retry_after_ms = 0;
+    if (((PASSWD_ERR_BUSY == hdr->status) ||
+         (PASSWD_ERR_RATE_LIMITED == hdr->status) ||
+         (PASSWD_ERR_BACKOFF == hdr->status)) &&
+        (sizeof(busy) <= hdr->len))
+    {
+        memcpy(&busy, payload, sizeof(busy));
+        conn->retry_after_ms = busy.retry_after_ms;
+    }
+    if ((PASSWD_ERR_PENDING == hdr->status) && (sizeof(job) <= hdr->len))
+    {
+        memcpy(&job, payload, sizeof(job));
+        conn->job_id = job.id;
+    }
+
+    for (i = 0; i < conn->n_reqs; i++)
+    {
+        req = &conn->reqs[i];
+        if ((req->seq != hdr->seq) || (PASSWD_ERR_PENDING != req->err))
+        {
+            continue;
+        }
+
+        req->err = PASSWD_ERR_SUCCESS;
+        req->status = hdr->status;
+        conn->in_flight--;
+        if (((PASSWD_ERR_SUCCESS == hdr->status) ||
+             (PASSWD_ERR_PENDING == hdr->status)) && hdr->len)
+        {
+            if (NULL == (req->reply = malloc(hdr->len)))
+            {
+                req->err = PASSWD_ERR_INSUFFICIENT_MEM;
+                return;
+            }
+            memcpy(req->reply, payload, hdr->len);
+            req->reply_len = hdr->len;
+        }
+        if ((req->seq == conn->sub_seq) && (PASSWD_ERR_SUCCESS != hdr->status))
+        {
+            /* subscription refused */
+            conn->sub_err = hdr->status;
+            conn->sub_seq = 0;
+        }
+        return;
+    }
+
+    if (conn->sub_seq && (hdr->seq == conn->sub_seq))
+    {
+        async_queue_events(conn, payload, hdr->len);
+        return;
+    }
+
+    /* request of a destroyed handle or a reply to an unknown seq */
+    VLOG_DBG("Ignoring reply to request %u", hdr->seq);
+}
+
+/**
+ * Send queued requests and read replies which have arrived, without
+ * blocking
+ *
+ * @param conn connection handle
+ */
+void passwd_srv_async_run(passwd_srv_async_t *conn)
+{
+    passwd_srv_hdr_t hdr;
+    ssize_t len;
+
+    if ((NULL == conn) || (0 > conn->fd))
+    {
+        return;
+    }
+
+    async_flush(conn);
+
+    while ((0 <= conn->fd) && (conn->in_flight || conn->sub_seq))
+    {
+        len = recv(conn->fd, conn->rx + conn->rx_len,
+                   sizeof(conn->rx) - conn->rx_len, MSG_DONTWAIT);
+        if (0 > len)
+        {
+            if ((EAGAIN != errno) && (EWOULDBLOCK != errno) &&
+                (EINTR != errno))
+            {
+                async_fail(conn, PASSWD_ERR_RECV_FAILED);
+            }
+            return;
+        }
+        if (0 == len)
+        {
+            /* server has closed the connection */
+            async_fail(conn, PASSWD_ERR_RECV_FAILED);
+            return;
+        }
+        conn->rx_len += len;
+
+        while (conn->rx_len >= sizeof(hdr))
+        {
+            memcpy(&hdr, conn->rx, sizeof(hdr));
+            if ((PASSWD_SRV_MAGIC != hdr.magic) ||
+                (PASSWD_SRV_MAX_REPLY < hdr.len))
+            {
+                VLOG_ERR("Invalid reply from the password server");
+                async_fail(conn, PASSWD_ERR_INVALID_MSG);
+                return;
+            }
+            if (conn->rx_len < sizeof(hdr) + hdr.len)
+            {
+                break;
+            }
+
+            async_complete(conn, &hdr, conn->rx + sizeof(hdr));
+            conn->rx_len -= sizeof(hdr) + hdr.len;
+            memmove(conn->rx, conn->rx + sizeof(hdr) + hdr.len, conn->rx_len);
+        }
+    }
+}
+
+/**
+ * Register the connection of a handle with the OVS poll loop if it is
+ * waiting for the server
+ *
+ * @param conn connection handle
+ */
+void passwd_srv_async_wait(passwd_srv_async_t *conn)
+{
+    if ((NULL != conn) && (0 <= conn->fd) &&
+        (conn->in_flight || conn->sub_seq))
+    {
+        poll_fd_wait(conn->fd, POLLIN | (conn->tx_len ? POLLOUT : 0));
+    }
+}
+
+/**
+ * Collect the result of a request.  Once collected, the handle is released.
+ *
+ * @param conn   connection handle
+ * @param handle handle returned by passwd_srv_async_submit()
+ * @param status status returned by the server, PASSWD_ERR_* code
+ * @return PASSWD_ERR_SUCCESS if a status was received, PASSWD_ERR_PENDING if
+ *         the request is still in flight, transport error otherwise
+ */
+int passwd_srv_async_result(passwd_srv_async_t *conn, uint32_t handle,
+                            int *status)
+{
+    return passwd_srv_async_result_data(conn, handle, status, NULL, NULL);
+}
+
+/**
+ * Collect the result of a query with its reply, see PASSWD_MSG_LIST_USERS.
+ * Once collected, the handle is released.
+ *
+ * @param conn   connection handle
+ * @param handle handle returned by passwd_srv_async_submit()
+ * @param status status returned by the server, PASSWD_ERR_* code
+ * @param reply  buffer of *len bytes for the reply, NULL to drop it
+ * @param len    size of reply, set to the bytes copied into it, 0 if the
+ *               request got no reply payload
+ * @return PASSWD_ERR_SUCCESS if a status was received, PASSWD_ERR_PENDING if
+ *         the request is still in flight, transport error otherwise
+ */
+int passwd_srv_async_result_data(passwd_srv_async_t *conn, uint32_t handle,
+                                 int *status, void *reply, size_t *len)
+{
+    passwd_srv_async_req_t *req;
+    size_t i;
+    int err;
+
+    if ((NULL == conn) || (NULL == status) || (reply && (NULL == len)))
+    {
+        return PASSWD_ERR_INVALID_PARAM;
+    }
+
+    for (i = 0; i < conn->n_reqs; i++)
+    {
+        req = &conn->reqs[i];
+        if (req->seq != handle)
+        {
+            continue;
+        }
+
+        if (PASSWD_ERR_PENDING == (err = req->err))
+        {
+            return err;
+        }
+
+        *status = req->status;
+        if (reply)
+        {
+            *len = (req->reply_len < *len) ? req->reply_len : *len;
+            if (*len)
+            {
+                memcpy(reply, req->reply, *len);
+            }
+        }
+        free(req->reply);
+        *req = conn->reqs[--conn->n_reqs];
+        return err;
+    }
+
+    return PASSWD_ERR_INVALID_PARAM;
+}
+
+/**
+ * Close the connection of the calling thread.  Next request connects again.
+ */
+void passwd_srv_client_disconnect()
+{
+    passwd_srv_async_destroy(s_conn);
+    s_conn = NULL;
+}
+
+/**
+ * Send an encrypted request and wait for its status on the connection of the
+ * calling thread
+ *
+ * @param msg     request to send
+ * @param key     idempotency key of the request, NULL if it has none
+ * @param force   reload the public key before encrypting
+ * @param status  status returned by the server
+ * @param reply   buffer for the reply of a query, NULL if none
+ * @param len     size of reply, set to the bytes of reply received
+ * @param reused  set if the request went over a connection used before
+ * @return PASSWD_ERR_SUCCESS if a status was received
+ */
+static int
+client_exchange(const passwd_srv_msg_t *msg, const uint8_t *key, int force,
+                int *status, void *reply, size_t *len, int *reused)
+{
+    struct pollfd pfd;
+    uint32_t handle;
+    int err;
+
+    if ((NULL == s_conn) && (NULL == (s_conn = passwd_srv_async_create())))
+    {
+        return PASSWD_ERR_INSUFFICIENT_MEM;
+    }
+
+    passwd_srv_async_set_batch(s_conn, s_batch);
+    passwd_srv_async_set_job(s_conn, s_job);
+    *reused = (0 <= s_conn->fd) && s_conn->served;
+    err = async_submit(s_conn, msg, key, force, &handle);
+    if ((PASSWD_ERR_BUSY == err) && (PASSWD_ERR_SUCCESS == client_wait_key()))
+    {
+        /* blocking call, worth waiting for the key of a starting server */
+        err = async_submit(s_conn, msg, key, force, &handle);
+    }
+    if (PASSWD_ERR_SUCCESS != err)
+    {
+        return err;
+    }
+
+    while (PASSWD_ERR_PENDING ==
+           (err = passwd_srv_async_result_data(s_conn, handle, status,
+                                               reply, len)))
+    {
+        pfd.fd = s_conn->fd;
+        pfd.events = POLLIN | (s_conn->tx_len ? POLLOUT : 0);
+        poll(&pfd, 1, -1);
+        passwd_srv_async_run(s_conn);
+    }
+
+    return err;
+}
+
+/**
+ * Send a request and wait for its status, retrying once when it was not
+ * processed
+ *
+ * @param msg    request to send
+ * @param key    idempotency key of the request, NULL if it has none
+ * @param status status returned by the server
+ * @param reply  buffer for the reply of a query, NULL if none
+ * @param len    size of reply, set to the bytes of reply received
+ * @return PASSWD_ERR_SUCCESS if a status was received
+ */
+static int
+client_request(const passwd_srv_msg_t *msg, const uint8_t *key, int *status,
+               void *reply, size_t *len)
+{
+    size_t size = len ? *len : 0;
+    int err, reused, attempt;
+
+    for (attempt = 0; attempt < 2; attempt++)
+    {
+        /* key is re-read on retry in case the server was restarted */
+        if (len)
+        {
+            *len = size;
+        }
+        err = client_exchange(msg, key, attempt, status, reply, len, &reused);
+
+        if ((PASSWD_ERR_SUCCESS == err) &&
+            (PASSWD_ERR_DECRYPT_FAILED == *status) && (0 == attempt))
+        {
+            /* encrypted with the key of a previous server instance */
+            continue;
+        }
+
+        if ((PASSWD_ERR_SUCCESS != err) && reused && (0 == attempt))
+        {
+            /* idle connection was closed by the server, not processed */
+            continue;
+        }
+        break;
+    }
+
+    return err;
+}
+
+/**
+ * Send a request to the password server and wait for its status
+ *
+ * @param msg    request to send
+ * @param status status returned by the server, PASSWD_ERR_* code
+ * @return PASSWD_ERR_SUCCESS if a status was received, transport error
+ *         (PASSWD_ERR_SEND_FAILED, PASSWD_ERR_RECV_FAILED, ...) otherwise
+ */
+int passwd_srv_request(const passwd_srv_msg_t *msg, int *status)
+{
+    if ((NULL == msg) || (NULL == status))
+    {
+        return PASSWD_ERR_INVALID_PARAM;
+    }
+
+    return client_request(msg, NULL, status, NULL, NULL);
+}
+
+/**
+ * Send a query to the password server and wait for its status and reply,
+ * see PASSWD_MSG_LIST_USERS
+ *
+ * @param msg    query to send
+ * @param status status returned by the server, PASSWD_ERR_* code
+ * @param reply  buffer of *len bytes for the reply, PASSWD_SRV_MAX_REPLY
+ *               bytes hold any reply
+ * @param len    size of reply, set to the bytes of reply received
+ * @return PASSWD_ERR_SUCCESS if a status was received, transport error
+ *         otherwise
+ */
+int passwd_srv_query(const passwd_srv_msg_t *msg, int *status, void *reply,
+                     size_t *len)
+{
+    if ((NULL == msg) || (NULL == status) || (NULL == reply) || (NULL == len))
+    {
+        return PASSWD_ERR_INVALID_PARAM;
+    }
+
+    return client_request(msg, NULL, status, reply, len);
+}
+
+/**
+ * Send a request with an idempotency key and wait for its status.  A caller
+ * which gets a transport error or gives up waiting sends the request again
+ * with the same key, the server serves it at most once.
+ *
+ * @param msg    request to send
+ * @param key    PASSWD_SRV_IDEM_KEY_SIZE random bytes chosen by the caller
+ * @param status status returned by the server, PASSWD_ERR_* code
+ * @return PASSWD_ERR_SUCCESS if a status was received, transport error
+ *         otherwise
+ */
+int passwd_srv_request_idempotent(const passwd_srv_msg_t *msg,
+                                  const uint8_t *key, int *status)
+{
+    if ((NULL == msg) || (NULL == key) || (NULL == status))
+    {
+        return PASSWD_ERR_INVALID_PARAM;
+    }
+
+    return client_request(msg, key, status, NULL, NULL);
+}
+
+/**
+ * Mark the requests of the calling thread as a bulk job, see
+ * passwd_srv_async_set_batch()
+ *
+ * @param batch TRUE for requests of a bulk job
+ */
+void passwd_srv_set_batch(int batch)
+{
+    s_batch = batch;
+}
+
+/**
+ * Run the ADD_USER and DEL_USER requests of the calling thread as jobs, see
+ * passwd_srv_async_set_job().  Such a request returns PASSWD_ERR_PENDING
+ * once accepted, passwd_srv_job_id() tells its job id.
+ *
+ * @param job TRUE to run account changes as jobs
+ */
+void passwd_srv_set_job(int job)
+{
+    s_job = job;
+}
+
+/**
+ * Job id of the last request of the calling thread accepted as a job
+ *
+ * @return job id, 0 if none
+ */
+uint32_t passwd_srv_job_id()
+{
+    return passwd_srv_async_job_id(s_conn);
+}
+
+/**
+ * Time after which the server expects to take requests again, when the last
+ * request of the calling thread got PASSWD_ERR_BUSY, PASSWD_ERR_RATE_LIMITED
+ * or PASSWD_ERR_BACKOFF
+ *
+ * @return retry-after hint in milliseconds, 0 for other statuses
+ */
+uint32_t passwd_srv_retry_after()
+{
+    return passwd_srv_async_retry_after(s_conn);
+}
+
+/**
+ * Send a request built by the convenience calls below
+ *
+ * @return status returned by the server or transport error
+ */
+static int
+client_call(passwd_srv_msg_t *msg)
+{
+    int status = PASSWD_ERR_FATAL, err;
+
+    err = passwd_srv_request(msg, &status);
+    memset(msg, 0, sizeof(*msg));
+
+    return (PASSWD_ERR_SUCCESS == err) ? status : err;
+}
+
+/**
+ * Copy a string into a message field
+ *
+ * @return PASSWD_ERR_SUCCESS if the string fits
+ */
+static int
+client_copy_field(char *field, size_t size, const char *value)
+{
+    if ((NULL == value) || (size <= strlen(value)))
+    {
+        return PASSWD_ERR_INVALID_PARAM;
+    }
+
+    memcpy(field, value, strlen(value) + 1);
+    return PASSWD_ERR_SUCCESS;
+}
+
+/**
+ * Change password of a user
+ *
+ * @param username     user whose password is changed
+ * @param old_password current password of the user
+ * @param new_password password to set
+ * @return PASSWD_ERR_SUCCESS if changed, PASSWD_ERR_* code otherwise
+ */
+int passwd_srv_change_password(const char *username, const char *old_password,
+                               const char *new_password)
+{
+    passwd_srv_msg_t msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.op_code = PASSWD_MSG_CHG_PASSWORD;
+
+    if ((PASSWD_ERR_SUCCESS != client_copy_field(msg.username,
+                                    sizeof(msg.username), username)) ||
+        (PASSWD_ERR_SUCCESS != client_copy_field(msg.oldpasswd,
+                                    sizeof(msg.oldpasswd), old_password)) ||
+        (PASSWD_ERR_SUCCESS != client_copy_field(msg.newpasswd,
+                                    sizeof(msg.newpasswd), new_password)))
+    {
+        memset(&msg, 0, sizeof(msg));
+        return PASSWD_ERR_INVALID_PARAM;
+    }
+
+    return client_call(&msg);
+}
+
+/**
+ * Add a user with a password
+ *
+ * @param username user to add
+ * @param password password of the user
+ * @return PASSWD_ERR_SUCCESS if added, PASSWD_ERR_* code otherwise
+ */
+int passwd_srv_add_user(const char *username, const char *password)
+{
+    passwd_srv_msg_t msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.op_code = PASSWD_MSG_ADD_USER;
+
+    if ((PASSWD_ERR_SUCCESS != client_copy_field(msg.username,
+                                    sizeof(msg.username), username)) ||
+        (PASSWD_ERR_SUCCESS != client_copy_field(msg.newpasswd,
+                                    sizeof(msg.newpasswd), password)))
+    {
+        memset(&msg, 0, sizeof(msg));
+        return PASSWD_ERR_INVALID_PARAM;
+    }
+
+    return client_call(&msg);
+}
+
+/**
+ * Delete a user
+ *
+ * @param username user to delete
+ * @return PASSWD_ERR_SUCCESS if deleted, PASSWD_ERR_* code otherwise
+ */
+int passwd_srv_del_user(const char *username)
+{
+    passwd_srv_msg_t msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.op_code = PASSWD_MSG_DEL_USER;
+
+    if (PASSWD_ERR_SUCCESS != client_copy_field(msg.username,
+                                    sizeof(msg.username), username))
+    {
+        return PASSWD_ERR_INVALID_PARAM;
+    }
+
+    return client_call(&msg);
+}
+
+/**
+ * Check the password of a user, the client must be in the ops_passwd_verify
+ * group
+ *
+ * @param username user to check
+ * @param password password to check
+ * @return PASSWD_ERR_SUCCESS if it is the password of the user,
+ *         PASSWD_ERR_PASSWORD_NOT_MATCH if not, PASSWD_ERR_* code otherwise
+ */
+int passwd_srv_verify_password(const char *username, const char *password)
+{
+    passwd_srv_msg_t msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.op_code = PASSWD_MSG_VERIFY;
+
+    if ((PASSWD_ERR_SUCCESS != client_copy_field(msg.username,
+                                    sizeof(msg.username), username)) ||
+        (PASSWD_ERR_SUCCESS != client_copy_field(msg.oldpasswd,
+                                    sizeof(msg.oldpasswd), password)))
+    {
+        memset(&msg, 0, sizeof(msg));
+        return PASSWD_ERR_INVALID_PARAM;
+    }
+
+    return client_call(&msg);
+}
+
+/**
+ * Set the password of a user to a hash made elsewhere, e.g. exported from
+ * another switch.  The server does not hash it again, it only checks its
+ * format, see passwd_srv_hash_msg_t.  Users to import are added with
+ * passwd_srv_add_user() first.
+ *
+ * @param username user whose password is set, not of uid 0
+ * @param hash     crypt() string, $5$, $6$ or $y$
+ * @return PASSWD_ERR_SUCCESS if stored, PASSWD_ERR_INVALID_PARAM if the hash
+ *         is not taken, PASSWD_ERR_USER_NOT_FOUND if the user does not
+ *         exist, PASSWD_ERR_INVALID_USER for a user of uid 0,
+ *         PASSWD_ERR_* code otherwise
+ */
+int passwd_srv_set_password_hash(const char *username, const char *hash)
+{
+    passwd_srv_hash_msg_t msg;
+    int status = PASSWD_ERR_FATAL, err;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.op_code = PASSWD_MSG_SET_HASH;
+
+    if ((PASSWD_ERR_SUCCESS != client_copy_field(msg.username,
+                                    sizeof(msg.username), username)) ||
+        (PASSWD_ERR_SUCCESS != client_copy_field(msg.hash,
+                                    sizeof(msg.hash), hash)))
+    {
+        memset(&msg, 0, sizeof(msg));
+        return PASSWD_ERR_INVALID_PARAM;
+    }
+
+    /* starts as passwd_srv_msg_t does, encrypted whole by client_encrypt() */
+    err = passwd_srv_request((const passwd_srv_msg_t *)&msg, &status);
+    memset(&msg, 0, sizeof(msg));
+
+    return (PASSWD_ERR_SUCCESS == err) ? status : err;
+}
+
+/**
+ * Send a query built by the calls below and check the size of its reply
+ *
+ * @param msg   query, cleared once sent
+ * @param reply buffer for the reply
+ * @param size  size of reply
+ * @param len   bytes of reply expected, at least, set to the bytes received
+ * @return status returned by the server or transport error
+ */
+static int
+client_query(passwd_srv_msg_t *msg, void *reply, size_t size, size_t *len)
+{
+    int status = PASSWD_ERR_FATAL, err;
+    size_t need = *len;
+
+    *len = size;
+    err = passwd_srv_query(msg, &status, reply, len);
+    memset(msg, 0, client_msg_len(msg));
+
+    if (PASSWD_ERR_SUCCESS != err)
+    {
+        return err;
+    }
+    if ((PASSWD_ERR_SUCCESS == status) && (*len < need))
+    {
+        /* server without query opcodes or a broken reply */
+        return PASSWD_ERR_INVALID_MSG;
+    }
+    return status;
+}
+
+/**
+ * List a page of users of the server, sorted by name
+ *
+ * @param after  last user of the previous page, NULL or "" for the first
+ * @param users  filled with up to PASSWD_SRV_USER_PAGE users
+ * @param count  set to the number of users filled in
+ * @param more   set if there are users after the last one of the page
+ * @return PASSWD_ERR_SUCCESS if listed, PASSWD_ERR_* code otherwise
+ */
+int passwd_srv_list_users(const char *after, passwd_srv_user_info_t *users,
+                          int *count, int *more)
+{
+    unsigned char reply[PASSWD_SRV_MAX_REPLY];
+    passwd_srv_user_page_t page;
+    passwd_srv_msg_t msg;
+    size_t len = sizeof(page);
+    int err;
+
+    if ((NULL == users) || (NULL == count) || (NULL == more))
+    {
+        return PASSWD_ERR_INVALID_PARAM;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.op_code = PASSWD_MSG_LIST_USERS;
+    if (after && (PASSWD_ERR_SUCCESS != client_copy_field(msg.username,
+                                            sizeof(msg.username), after)))
+    {
+        return PASSWD_ERR_INVALID_PARAM;
+    }
+
+    if (PASSWD_ERR_SUCCESS != (err = client_query(&msg, reply,
+                                                  sizeof(reply), &len)))
+    {
+        return err;
+    }
+
+    memcpy(&page, reply, sizeof(page));
+    if ((PASSWD_SRV_USER_PAGE < page.count) ||
+        (len < sizeof(page) + page.count * sizeof(*users)))
+    {
+        return PASSWD_ERR_INVALID_MSG;
+    }
+    memcpy(users, reply + sizeof(page), page.count * sizeof(*users));
+    *count = page.count;
+    *more = page.more;
+
+    return PASSWD_ERR_SUCCESS;
+}
+
+/**
+ * Get a user of the server with its group membership
+ *
+ * @param username user to get
+ * @param info     filled with the user
+ * @return PASSWD_ERR_SUCCESS if found, PASSWD_ERR_* code otherwise
+ */
+int passwd_srv_get_user(const char *username, passwd_srv_user_info_t *info)
+{
+    passwd_srv_msg_t msg;
+    size_t len = sizeof(*info);
+
+    if (NULL == info)
+    {
+        return PASSWD_ERR_INVALID_PARAM;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.op_code = PASSWD_MSG_GET_USER;
+    if (PASSWD_ERR_SUCCESS != client_copy_field(msg.username,
+                                    sizeof(msg.username), username))
+    {
+        return PASSWD_ERR_INVALID_PARAM;
+    }
+
+    return client_query(&msg, info, sizeof(*info), &len);
+}
+
+/**
+ * Get the password aging fields of a user, without its password hash
+ *
+ * @param username user to get
+ * @param aging    filled with the aging fields
+ * @return PASSWD_ERR_SUCCESS if found, PASSWD_ERR_* code otherwise
+ */
+int passwd_srv_get_aging(const char *username, passwd_srv_user_aging_t *aging)
+{
+    passwd_srv_msg_t msg;
+    size_t len = sizeof(*aging);
+
+    if (NULL == aging)
+    {
+        return PASSWD_ERR_INVALID_PARAM;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.op_code = PASSWD_MSG_GET_AGING;
+    if (PASSWD_ERR_SUCCESS != client_copy_field(msg.username,
+                                    sizeof(msg.username), username))
+    {
+        return PASSWD_ERR_INVALID_PARAM;
+    }
+
+    return client_query(&msg, aging, sizeof(*aging), &len);
+}
+
+/**
+ * Get the status of a job submitted by the same uid, see passwd_srv_set_job()
+ *
+ * @param job_id job id
+ * @param status set to the status of the job, PASSWD_ERR_PENDING while it is
+ *               queued or running
+ * @return PASSWD_ERR_SUCCESS if the status is known, PASSWD_ERR_JOB_NOT_FOUND
+ *         if the job is unknown or done too long ago, PASSWD_ERR_* code
+ *         otherwise
+ */
+int passwd_srv_job_status(uint32_t job_id, int *status)
+{
+    passwd_srv_ctl_msg_t msg;
+    passwd_srv_job_t job;
+    size_t len = sizeof(job);
+    int err;
+
+    if ((0 == job_id) || (NULL == status))
+    {
+        return PASSWD_ERR_INVALID_PARAM;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.op_code = PASSWD_MSG_JOB_STATUS;
+    msg.arg.job_id = job_id;
+
+    /* starts as passwd_srv_msg_t does, encrypted whole by client_encrypt() */
+    if (PASSWD_ERR_SUCCESS ==
+        (err = client_query((passwd_srv_msg_t *)&msg, &job, sizeof(job),
+                            &len)))
+    {
+        *status = job.status;
+    }
+    return err;
+}
@@ -14,6 +14,11 @@
  * under the License.
  */
 #include <yaml.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "openvswitch/vlog.h"
 #include "passwd_srv_pub.h"
@@ -25,10 +30,169 @@ const char *passwd_srv_yaml_key[PASSWD_SRV_YAML_MAX] =
         "values",
         "type",
         "path",
-        "description"
+        "description",
+        "name",
+        "value"
 };
 
 static passwd_yaml_file_path_t *s_yaml_entry = NULL;
+static passwd_yaml_setting_t   *s_yaml_setting = NULL;
+
+/* configuration replaced by reload_passwd_srv_yaml_file(), until committed */
+static passwd_yaml_file_path_t *s_prev_entry = NULL;
+static passwd_yaml_setting_t   *s_prev_setting = NULL;
+static int s_reload_pending = 0;
+
+/* prefix applied to every file path, empty when running from "/" */
+static char s_root_dir[PASSWD_SRV_MAX_STR_SIZE+1] = "";
+
+/* snapshot published by the server, used instead of s_yaml_entry if set */
+static const passwd_srv_snapshot_t *s_snapshot = NULL;
+static const passwd_srv_snapshot_t *s_snapshot_map = NULL; /* checked */
+static struct stat s_snapshot_stat;     /* snapshot file when mapped */
+static int s_snapshot_enabled = 1;
+
+/* CRC-32 (IEEE 802.3) of a nibble, reflected polynomial 0xEDB88320 */
+static const uint32_t s_crc32_nibble[16] = {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+    0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+    0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+
+static uint32_t
+crc32_update(uint32_t crc, const void *data, size_t len)
+{
+    const uint8_t *byte = data;
+
+    while (len--)
+    {
+        crc ^= *byte++;
+        crc = (crc >> 4) ^ s_crc32_nibble[crc & 0xF];
+        crc = (crc >> 4) ^ s_crc32_nibble[crc & 0xF];
+    }
+
+    return crc;
+}
+
+/**
+ * Compute the checksum of a configuration snapshot
+ *
+ * @param snap snapshot, its checksum field is skipped
+ * @return CRC-32 of the snapshot with a zero checksum field
+ */
+uint32_t passwd_srv_snapshot_checksum(const passwd_srv_snapshot_t *snap)
+{
+    const uint32_t zero = 0;
+    const size_t   off = offsetof(passwd_srv_snapshot_t, checksum);
+    uint32_t crc = 0xFFFFFFFF;
+
+    crc = crc32_update(crc, snap, off);
+    crc = crc32_update(crc, &zero, sizeof(zero));
+    crc = crc32_update(crc, (const uint8_t *)snap + off + sizeof(zero),
+                       sizeof(*snap) - off - sizeof(zero));
+
+    return ~crc;
+}
+
+/**
+ * Unmap the configuration snapshot
+ */
+static void
+unmap_snapshot()
+{
+    if (s_snapshot_map)
+    {
+        munmap((void *)s_snapshot_map, sizeof(*s_snapshot_map));
+        s_snapshot_map = NULL;
+    }
+    s_snapshot = NULL;
+}
+
+/**
+ * Map the configuration snapshot published by the password server running
+ * under the root directory.  The snapshot is only used if it is intact and
+ * was made from the given, unmodified, yaml file.  A snapshot already
+ * mapped and checked is kept until the server replaces it.
+ *
+ * @param yaml_file yaml file which would be parsed otherwise
+ * @return PASSWD_ERR_SUCCESS if the snapshot is used
+ */
+static int
+map_snapshot(const char *yaml_file)
+{
+    char snap_file[PASSWD_SRV_MAX_STR_SIZE + sizeof(PASSWD_SRV_SNAPSHOT_FILE)];
+    const passwd_srv_snapshot_t *snap;
+    struct stat st;
+    int fd;
+
+    s_snapshot = NULL;
+
+    snprintf(snap_file, sizeof(snap_file), "%s%s", s_root_dir,
+             PASSWD_SRV_SNAPSHOT_FILE);
+
+    if (!s_snapshot_enabled || (0 != stat(snap_file, &st)))
+    {
+        /* server is not running or predates snapshots */
+        unmap_snapshot();
+        return PASSWD_ERR_FATAL;
+    }
+
+    if (!s_snapshot_map || (st.st_ino != s_snapshot_stat.st_ino) ||
+        (st.st_dev != s_snapshot_stat.st_dev) ||
+        (st.st_mtim.tv_sec != s_snapshot_stat.st_mtim.tv_sec) ||
+        (st.st_mtim.tv_nsec != s_snapshot_stat.st_mtim.tv_nsec))
+    {
+        unmap_snapshot();
+
+        if (0 > (fd = open(snap_file, O_RDONLY | O_CLOEXEC)))
+        {
+            return PASSWD_ERR_FATAL;
+        }
+
+        if ((0 != fstat(fd, &st)) || (sizeof(*snap) != st.st_size))
+        {
+            close(fd);
+            return PASSWD_ERR_FATAL;
+        }
+
+        snap = mmap(NULL, sizeof(*snap), PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (MAP_FAILED == snap)
+        {
+            return PASSWD_ERR_FATAL;
+        }
+
+        if ((PASSWD_SRV_SNAPSHOT_MAGIC != snap->magic) ||
+            (PASSWD_SRV_SNAPSHOT_VERSION != snap->version) ||
+            (sizeof(*snap) != snap->size) ||
+            (passwd_srv_snapshot_checksum(snap) != snap->checksum))
+        {
+            VLOG_DBG("Ignoring damaged snapshot %s", snap_file);
+            munmap((void *)snap, sizeof(*snap));
+            return PASSWD_ERR_FATAL;
+        }
+
+        /* server replaces the snapshot by rename(), never in place */
+        s_snapshot_map = snap;
+        s_snapshot_stat = st;
+    }
+
+    snap = s_snapshot_map;
+    if ((0 != strcmp(snap->root_dir, s_root_dir)) ||
+        (0 != strcmp(snap->yaml_file, yaml_file)) ||
+        (0 != stat(yaml_file, &st)) ||
+        (snap->yaml_size != st.st_size) ||
+        (snap->yaml_mtime_sec != st.st_mtim.tv_sec) ||
+        (snap->yaml_mtime_nsec != st.st_mtim.tv_nsec))
+    {
+        VLOG_DBG("Snapshot %s is not made from %s", snap_file, yaml_file);
+        return PASSWD_ERR_FATAL;
+    }
+
+    s_snapshot = snap;
+    return PASSWD_ERR_SUCCESS;
+}
 
 /**
  * Add description of the path
@@ -125,6 +289,86 @@ passwd_yaml_file_path_t *add_yaml_entry(enum PASSWD_yaml_path_type_e type)
     return new_entry;
 }
 
+/**
+ * Add a setting to the list, in the order of the yaml file
+ *
+ * @param name name of the setting
+ * @return newly created setting, NULL if name is too long or out of memory
+ */
+static
+passwd_yaml_setting_t *add_yaml_setting(const char *name)
+{
+    passwd_yaml_setting_t *new_setting, **tail;
+
+    if (PASSWD_SRV_MAX_STR_SIZE < strlen(name))
+    {
+        return NULL;
+    }
+
+    if (NULL == (new_setting = calloc(1, sizeof(*new_setting))))
+    {
+        VLOG_ERR("Failed to alloc memory for new setting");
+        return NULL;
+    }
+    memcpy(new_setting->name, name, strlen(name));
+
+    for (tail = &s_yaml_setting; *tail; tail = &(*tail)->next)
+        ;
+    *tail = new_setting;
+
+    return new_setting;
+}
+
+/**
+ * Set value of a setting
+ *
+ * @param setting setting read from the yaml file
+ * @param value   value of the setting
+ * @return PASSWD_ERR_SUCCESS if value is set
+ */
+static
+int add_yaml_setting_value(passwd_yaml_setting_t *setting, const char *value)
+{
+    if ((NULL == setting) || (PASSWD_SRV_MAX_STR_SIZE < strlen(value)))
+    {
+        return PASSWD_ERR_FATAL;
+    }
+
+    memcpy(setting->value, value, strlen(value) + 1);
+    return PASSWD_ERR_SUCCESS;
+}
+
+/**
+ * Free a list of yaml entries
+ */
+static void
+free_yaml_entries(passwd_yaml_file_path_t *entry)
+{
+    passwd_yaml_file_path_t *next;
+
+    for (; entry; entry = next)
+    {
+        next = entry->next;
+        memset(entry, 0, sizeof(*entry));
+        free(entry);
+    }
+}
+
+/**
+ * Free a list of settings
+ */
+static void
+free_yaml_settings(passwd_yaml_setting_t *setting)
+{
+    passwd_yaml_setting_t *next;
+
+    for (; setting; setting = next)
+    {
+        next = setting->next;
+        free(setting);
+    }
+}
+
 /**
  * Find yaml entry based on type
  *
@@ -165,10 +409,11 @@ passwd_yaml_file_path_t *add_path_type(const char *path_type)
     passwd_yaml_file_path_t *new_entry = NULL, *cur_entry = NULL;
     enum PASSWD_yaml_path_type_e new_type = PASSWD_SRV_YAML_PATH_NONE;
 
-    const char *path_types[PASSWD_SRV_YAML_MAX] = {
+    const char *path_types[PASSWD_SRV_YAML_PATH_MAX] = {
             "NONE",
             "SOCKET",
-            "PUB_KEY"
+            "PUB_KEY",
+            "ROOT"
     };
 
     if (NULL == path_type)
@@ -180,7 +425,8 @@ passwd_yaml_file_path_t *add_path_type(const char *path_type)
     path_type_len = strlen(path_type);
 
     /* identify correct path type */
-    for(type = (int)PASSWD_SRV_YAML_PATH_SOCK; type < PASSWD_SRV_YAML_MAX; type++)
+    for(type = (int)PASSWD_SRV_YAML_PATH_SOCK; type < PASSWD_SRV_YAML_PATH_MAX;
+        type++)
     {
         type_len = strlen(path_types[type]);
         if ((type_len == path_type_len) &&
@@ -256,17 +502,71 @@ enum PASSWD_yaml_key_e check_yaml_event(const char *event)
 }
 
 /**
- * Parse yaml file to store file path
+ * Prefix file paths read from yaml with the root directory.  Root directory
+ * given by set_passwd_srv_root_dir() takes precedence over the ROOT entry.
+ *
+ * @return PASSWD_ERR_SUCCESS if all file paths fit under the root directory
+ */
+static
+int apply_root_dir()
+{
+    passwd_yaml_file_path_t *cur_entry;
+    char path[PASSWD_SRV_MAX_STR_SIZE+1];
+    int  len;
+
+    if (('\0' == s_root_dir[0]) &&
+        (NULL != (cur_entry = find_yaml_entry(PASSWD_SRV_YAML_PATH_ROOT))))
+    {
+        if (PASSWD_ERR_SUCCESS != set_passwd_srv_root_dir(cur_entry->path))
+        {
+            return PASSWD_ERR_FATAL;
+        }
+    }
+
+    if ('\0' == s_root_dir[0])
+    {
+        return PASSWD_ERR_SUCCESS;
+    }
+
+    for (cur_entry = s_yaml_entry; cur_entry; cur_entry = cur_entry->next)
+    {
+        if (PASSWD_SRV_YAML_PATH_ROOT == cur_entry->type)
+        {
+            continue;
+        }
+
+        len = snprintf(path, sizeof(path), "%s%s", s_root_dir,
+                       cur_entry->path);
+        if ((0 > len) || (PASSWD_SRV_MAX_STR_SIZE < len))
+        {
+            return PASSWD_ERR_FATAL;
+        }
+        memcpy(cur_entry->path, path, len + 1);
+    }
+
+    return PASSWD_ERR_SUCCESS;
+}
+
+/**
+ * Parse a given yaml file to store file path
  *
+ * @param yaml_file location of yaml file to parse
  * @return PASSWD_ERR_SUCCESS if parsed ok
  */
-int parse_passwd_srv_yaml()
+int parse_passwd_srv_yaml_file(const char *yaml_file)
 {
     FILE *fp = NULL;
     yaml_parser_t parser;
     yaml_event_t  event;
     enum PASSWD_yaml_key_e event_value, current_state;
     passwd_yaml_file_path_t *yaml_entry = NULL;
+    passwd_yaml_setting_t *setting = NULL;
+
+    if (PASSWD_ERR_SUCCESS == map_snapshot(yaml_file))
+    {
+        VLOG_DBG("Using configuration snapshot instead of %s", yaml_file);
+        return PASSWD_ERR_SUCCESS;
+    }
 
     memset(&parser, 0, sizeof(parser));
     memset(&event, 0, sizeof(event));
@@ -279,7 +579,7 @@ int parse_passwd_srv_yaml()
         return PASSWD_ERR_FATAL;
     }
 
-    if(NULL == (fp = fopen(PASSWD_SRV_YAML_FILE, "r")))
+    if ((NULL == yaml_file) || (NULL == (fp = fopen(yaml_file, "r"))))
     {
         VLOG_ERR("Failed to open yaml file");
         yaml_parser_delete(&parser);
@@ -362,6 +662,30 @@ int parse_passwd_srv_yaml()
                     }
                     break;
                 }
+                case PASSWD_SRV_YAML_SETTING_NAME:
+                {
+                    if (NULL == (setting = add_yaml_setting(
+                            (const char *)event.data.scalar.value)))
+                    {
+                        VLOG_ERR("Cannot add setting to the list");
+                        fclose(fp);
+                        return PASSWD_ERR_FATAL;
+                    }
+                    break;
+                }
+                case PASSWD_SRV_YAML_SETTING_VALUE:
+                {
+                    if (PASSWD_ERR_SUCCESS !=
+                            add_yaml_setting_value(setting,
+                                    (const char *)event.data.scalar.value))
+                    {
+                        /* value must follow the name of the setting */
+                        VLOG_ERR("Cannot add value to the setting");
+                        fclose(fp);
+                        return PASSWD_ERR_FATAL;
+                    }
+                    break;
+                }
                 default:
                 {
                     break;
@@ -372,6 +696,8 @@ int parse_passwd_srv_yaml()
             case PASSWD_SRV_YAML_PATH_TYPE:
             case PASSWD_SRV_YAML_PATH:
             case PASSWD_SRV_YAML_DESC:
+            case PASSWD_SRV_YAML_SETTING_NAME:
+            case PASSWD_SRV_YAML_SETTING_VALUE:
             {
                 current_state = event_value;
                 break;
@@ -400,13 +726,103 @@ int parse_passwd_srv_yaml()
     yaml_parser_delete(&parser);
     fclose(fp);
 
+    if (PASSWD_ERR_SUCCESS != apply_root_dir())
+    {
+        VLOG_ERR("File path is too long to be placed under %s", s_root_dir);
+        return PASSWD_ERR_FATAL;
+    }
+
     VLOG_DBG("YAML file is read as expected");
 
     return PASSWD_ERR_SUCCESS;
 }
 
 /**
- * Get string (file path) from the list based on the file path type
+ * Parse yaml file installed in the default location, under the root
+ * directory if one is set, to store file path
+ *
+ * @return PASSWD_ERR_SUCCESS if parsed ok
+ */
+int parse_passwd_srv_yaml()
+{
+    char yaml_file[PASSWD_SRV_MAX_STR_SIZE + sizeof(PASSWD_SRV_YAML_FILE)];
+
+    snprintf(yaml_file, sizeof(yaml_file), "%s%s", s_root_dir,
+             PASSWD_SRV_YAML_FILE);
+
+    return parse_passwd_srv_yaml_file(yaml_file);
+}
+
+/**
+ * Set the root directory under which all files used by the password server
+ * are located, i.e. to run it against a sandbox.  Must be called before
+ * the yaml file is parsed.
+ *
+ * @param root_dir absolute directory path, NULL or "/" for the default
+ * @return PASSWD_ERR_SUCCESS if root directory is set
+ */
+int set_passwd_srv_root_dir(const char *root_dir)
+{
+    int len;
+
+    if ((NULL == root_dir) || (0 == strcmp(root_dir, "/")))
+    {
+        s_root_dir[0] = '\0';
+        return PASSWD_ERR_SUCCESS;
+    }
+
+    len = strlen(root_dir);
+    if (('/' != root_dir[0]) || (PASSWD_SRV_MAX_STR_SIZE < len))
+    {
+        VLOG_ERR("Root directory must be an absolute path");
+        return PASSWD_ERR_INVALID_PARAM;
+    }
+
+    memcpy(s_root_dir, root_dir, len + 1);
+
+    /* paths are appended as-is, drop trailing slashes */
+    while ((len > 1) && ('/' == s_root_dir[len - 1]))
+    {
+        s_root_dir[--len] = '\0';
+    }
+
+    return PASSWD_ERR_SUCCESS;
+}
+
+/**
+ * Get the root directory set for the password server files
+ *
+ * @return root directory, empty string if files are used from "/"
+ */
+const char *get_passwd_srv_root_dir()
+{
+    return s_root_dir;
+}
+
+/**
+ * Allow or prevent use of the configuration snapshot by the next parse,
+ * i.e. the password server itself always reads the yaml file
+ *
+ * @param enabled FALSE to always parse the yaml file
+ */
+void set_passwd_srv_snapshot_enabled(int enabled)
+{
+    s_snapshot_enabled = enabled;
+}
+
+/**
+ * Get the configuration snapshot found by the last parse
+ *
+ * @return snapshot, NULL if the yaml file was parsed
+ */
+const passwd_srv_snapshot_t *get_passwd_srv_snapshot()
+{
+    return s_snapshot;
+}
+
+/**
+ * Get string (file path) based on the file path type, from the snapshot
+ * if one is mapped or from the list otherwise
  *
  * @param type file path type
  * @return file path if found one, null otherwisse
@@ -415,6 +831,17 @@ char *get_file_path(enum PASSWD_yaml_path_type_e type)
 {
     passwd_yaml_file_path_t *cur_entry = s_yaml_entry;
 
+    if (s_snapshot)
+    {
+        if ((type <= PASSWD_SRV_YAML_PATH_NONE) ||
+            (type >= PASSWD_SRV_YAML_PATH_MAX) ||
+            ('\0' == s_snapshot->path[type][0]))
+        {
+            return NULL;
+        }
+        return (char *)s_snapshot->path[type];
+    }
+
     while(cur_entry)
     {
         if (type == cur_entry->type)
@@ -427,6 +854,91 @@ char *get_file_path(enum PASSWD_yaml_path_type_e type)
     return NULL;
 }
 
+/**
+ * Get value of an entry of the 'settings' section.  Settings are not part
+ * of the configuration snapshot.
+ *
+ * @param name name of the setting
+ * @return value of the setting, NULL if not set
+ */
+const char *get_passwd_srv_setting(const char *name)
+{
+    passwd_yaml_setting_t *setting;
+
+    for (setting = s_yaml_setting; setting; setting = setting->next)
+    {
+        if (0 == strcmp(setting->name, name))
+        {
+            return setting->value;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Parse a yaml file again, i.e. after it is modified.  The configuration in
+ * use is kept aside until commit_passwd_srv_yaml_reload() or
+ * rollback_passwd_srv_yaml_reload() is called, and put back if the file
+ * cannot be parsed.  The root directory is kept.
+ *
+ * @param yaml_file location of yaml file to parse
+ * @return PASSWD_ERR_SUCCESS if parsed ok
+ */
+int reload_passwd_srv_yaml_file(const char *yaml_file)
+{
+    int err;
+
+    if (s_reload_pending)
+    {
+        commit_passwd_srv_yaml_reload();
+    }
+
+    s_prev_entry = s_yaml_entry;
+    s_prev_setting = s_yaml_setting;
+    s_yaml_entry = NULL;
+    s_yaml_setting = NULL;
+    s_reload_pending = 1;
+
+    if (PASSWD_ERR_SUCCESS != (err = parse_passwd_srv_yaml_file(yaml_file)))
+    {
+        rollback_passwd_srv_yaml_reload();
+    }
+
+    return err;
+}
+
+/**
+ * Keep the configuration read by reload_passwd_srv_yaml_file()
+ */
+void commit_passwd_srv_yaml_reload()
+{
+    free_yaml_entries(s_prev_entry);
+    free_yaml_settings(s_prev_setting);
+    s_prev_entry = NULL;
+    s_prev_setting = NULL;
+    s_reload_pending = 0;
+}
+
+/**
+ * Put back the configuration in use before reload_passwd_srv_yaml_file()
+ */
+void rollback_passwd_srv_yaml_reload()
+{
+    if (!s_reload_pending)
+    {
+        return;
+    }
+
+    free_yaml_entries(s_yaml_entry);
+    free_yaml_settings(s_yaml_setting);
+    s_yaml_entry = s_prev_entry;
+    s_yaml_setting = s_prev_setting;
+    s_prev_entry = NULL;
+    s_prev_setting = NULL;
+    s_reload_pending = 0;
+}
+
 /**
  * Wrapper to return socket file descriptor path
  */
@@ -451,6 +963,12 @@ int uninit_yaml_parser()
     passwd_yaml_file_path_t *cur_entry = s_yaml_entry;
     passwd_yaml_file_path_t *temp = NULL;
 
+    /* mapping is kept for the next parse */
+    s_snapshot = NULL;
+
+    free_yaml_settings(s_yaml_setting);
+    s_yaml_setting = NULL;
+
     if (NULL == cur_entry)
     {
         /* entry is empty, nothing to uninit */
@@ -0,0 +1,450 @@
+/*
+ * (c) Copyright 2016 Hewlett Packard Enterprise Development LP
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+/************************************************************************//**
+ * @ingroup passwd-srvd
+ *
+ * @file
+ * Failed password attempts of the Password Server.
+ *
+ *    Failed old password checks are counted per target user in a fixed
+ *     size table.  After BACKOFF_THRESHOLD failures, password changes of
+ *     the user are rejected without running crypt() for a delay which
+ *     doubles with every further failure.  The table is saved to a file
+ *     within a second when it changes, and before the server hands off,
+ *     stops on SIGTERM or exits on a fatal error, so that a restart does
+ *     not reset it.
+ ***************************************************************************/
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <poll-loop.h>
+#include <timeval.h>
+#include "openvswitch/vlog.h"
+#include "passwd_srv_pri.h"
+
+VLOG_DEFINE_THIS_MODULE(passwd_srv_backoff);
+
+#define PASSWD_SRV_BACKOFF_SETS      256  /* users tracked = sets * ways */
+#define PASSWD_SRV_BACKOFF_WAYS      4
+#define PASSWD_SRV_BACKOFF_SAVE_MSEC 1000 /* table saved at most this often */
+#define PASSWD_SRV_BACKOFF_MAGIC     "ops-passwd-srv backoff v1"
+#define PASSWD_SRV_BACKOFF_SCAN      /* a line of the table, as saved */ \
+    "%" PASSWD_SRV_STR(PASSWD_USERNAME_LEN) "s %u %lld %lld"
+
+typedef struct backoff_entry
+{
+    char username[PASSWD_USERNAME_SIZE];  /* empty if the entry is free */
+    uint32_t failures;        /* failed attempts in a row */
+    long long int t_last;     /* time_wall_msec() of the last failure */
+    long long int t_until;    /* attempts are rejected until then */
+} backoff_entry_t;
+
+static backoff_entry_t s_backoff[PASSWD_SRV_BACKOFF_SETS]
+                                [PASSWD_SRV_BACKOFF_WAYS];
+static int s_backoff_dirty = FALSE;
+static long long int s_backoff_save_due = 0;
+static uint64_t s_backoff_rejected = 0;
+
+/**
+ * Set of the table a username belongs to, FNV-1a hash
+ */
+static backoff_entry_t *
+backoff_set(const char *username)
+{
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; (i < PASSWD_USERNAME_SIZE) && username[i]; i++)
+    {
+        hash = (hash ^ (unsigned char)username[i]) * 16777619u;
+    }
+
+    return s_backoff[hash % PASSWD_SRV_BACKOFF_SETS];
+}
+
+/**
+ * Mark the table to be saved
+ */
+static void
+backoff_changed()
+{
+    if (!s_backoff_dirty)
+    {
+        s_backoff_save_due = time_msec() + PASSWD_SRV_BACKOFF_SAVE_MSEC;
+    }
+    s_backoff_dirty = TRUE;
+}
+
+/**
+ * Free an entry whose user has had no failure for BACKOFF_MAX_MS, counted
+ * from the end of its backoff
+ *
+ * @return TRUE if the entry is free
+ */
+static int
+backoff_forget(backoff_entry_t *entry, long long int now)
+{
+    long long int since;
+
+    since = (entry->t_until > entry->t_last) ? entry->t_until : entry->t_last;
+    if (entry->username[0] &&
+        (now >= since + passwd_srv_settings()->backoff_max))
+    {
+        memset(entry, 0, sizeof(*entry));
+        backoff_changed();
+    }
+
+    return entry->username[0] ? FALSE : TRUE;
+}
+
+/**
+ * Find the entry of a user
+ *
+ * @param username target user of a request
+ * @param create   take an entry if the user has none, the free one or the
+ *                 one with the oldest failure of the set
+ * @param now      time_wall_msec()
+ * @return entry of the user, NULL if it has none
+ */
+static backoff_entry_t *
+backoff_find(const char *username, int create, long long int now)
+{
+    backoff_entry_t *set = backoff_set(username);
+    backoff_entry_t *entry, *victim = NULL;
+    int way;
+
+    for (way = 0; way < PASSWD_SRV_BACKOFF_WAYS; way++)
+    {
+        entry = &set[way];
+        if (backoff_forget(entry, now))
+        {
+            if ((NULL == victim) || victim->username[0])
+            {
+                victim = entry;
+            }
+            continue;
+        }
+        if (0 == strncmp(entry->username, username, PASSWD_USERNAME_SIZE))
+        {
+            return entry;
+        }
+        if ((NULL == victim) ||
+            (victim->username[0] && (entry->t_last < victim->t_last)))
+        {
+            victim = entry;
+        }
+    }
+
+    if (!create)
+    {
+        return NULL;
+    }
+
+    memset(victim, 0, sizeof(*victim));
+    strncpy(victim->username, username, PASSWD_USERNAME_SIZE - 1);
+    return victim;
+}
+
+/**
+ * Check whether password changes of a user are in backoff
+ *
+ * @param username target user of a CHG_PASSWORD request
+ * @param retry_ms set to the time left in backoff
+ * @return PASSWD_ERR_SUCCESS if the old password may be checked,
+ *         PASSWD_ERR_BACKOFF otherwise
+ */
+int passwd_srv_backoff_check(const char *username, uint32_t *retry_ms)
+{
+    long long int now = time_wall_msec();
+    backoff_entry_t *entry = backoff_find(username, FALSE, now);
+
+    if ((NULL == entry) || (now >= entry->t_until))
+    {
+        return PASSWD_ERR_SUCCESS;
+    }
+
+    s_backoff_rejected++;
+    *retry_ms = (uint32_t)(entry->t_until - now);
+    return PASSWD_ERR_BACKOFF;
+}
+
+/**
+ * Count a failed old password check of a user
+ *
+ * @param username target user of a CHG_PASSWORD request
+ */
+void passwd_srv_backoff_failure(const char *username)
+{
+    const passwd_srv_settings_t *settings = passwd_srv_settings();
+    long long int now = time_wall_msec();
+    backoff_entry_t *entry = backoff_find(username, TRUE, now);
+    long long int delay;
+    uint32_t shift;
+
+    entry->failures++;
+    entry->t_last = now;
+    backoff_changed();
+
+    if (entry->failures < (uint32_t)settings->backoff_threshold)
+    {
+        return;
+    }
+
+    shift = entry->failures - settings->backoff_threshold;
+    delay = settings->backoff_max;
+    if (shift < 32)
+    {
+        delay = (long long int)settings->backoff_base << shift;
+    }
+    if (delay > settings->backoff_max)
+    {
+        delay = settings->backoff_max;
+    }
+    entry->t_until = now + delay;
+
+    VLOG_WARN("%u failed password attempts for %s, rejecting attempts for "
+              "%lld ms", entry->failures, entry->username, delay);
+}
+
+/**
+ * Forget failures of a user once its old password is checked successfully
+ *
+ * @param username target user of a CHG_PASSWORD request
+ */
+void passwd_srv_backoff_success(const char *username)
+{
+    backoff_entry_t *entry = backoff_find(username, FALSE, time_wall_msec());
+
+    if (entry)
+    {
+        memset(entry, 0, sizeof(*entry));
+        backoff_changed();
+    }
+}
+
+/**
+ * Forget failures of a user, or of all users
+ *
+ * @param username user to forget, NULL for all
+ * @return number of users forgotten
+ */
+int passwd_srv_backoff_clear(const char *username)
+{
+    int set, way, n = 0;
+
+    for (set = 0; set < PASSWD_SRV_BACKOFF_SETS; set++)
+    {
+        for (way = 0; way < PASSWD_SRV_BACKOFF_WAYS; way++)
+        {
+            if (s_backoff[set][way].username[0] &&
+                ((NULL == username) ||
+                 (0 == strncmp(s_backoff[set][way].username, username,
+                               PASSWD_USERNAME_SIZE))))
+            {
+                memset(&s_backoff[set][way], 0, sizeof(s_backoff[set][way]));
+                n++;
+            }
+        }
+    }
+
+    if (n)
+    {
+        backoff_changed();
+    }
+    return n;
+}
+
+/**
+ * Call a function for each user with failures
+ *
+ * @param cb  called with the user, its failures and the msec left in backoff
+ * @param aux passed to cb
+ * @return number of attempts rejected since start
+ */
+uint64_t passwd_srv_backoff_foreach(void (*cb)(const char *username,
+                                               uint32_t failures,
+                                               long long int left,
+                                               void *aux), void *aux)
+{
+    long long int now = time_wall_msec();
+    backoff_entry_t *entry;
+    int set, way;
+
+    for (set = 0; set < PASSWD_SRV_BACKOFF_SETS; set++)
+    {
+        for (way = 0; way < PASSWD_SRV_BACKOFF_WAYS; way++)
+        {
+            entry = &s_backoff[set][way];
+            if (!backoff_forget(entry, now))
+            {
+                cb(entry->username, entry->failures,
+                   (entry->t_until > now) ? entry->t_until - now : 0, aux);
+            }
+        }
+    }
+
+    return s_backoff_rejected;
+}
+
+/**
+ * Load the table saved by a previous run
+ *
+ * @return PASSWD_ERR_SUCCESS unless the file exists and cannot be read
+ */
+int passwd_srv_backoff_load()
+{
+    const char *path = passwd_srv_file(PASSWD_SRV_FILE_BACKOFF);
+    char line[256], username[PASSWD_USERNAME_SIZE];
+    long long int now = time_wall_msec(), t_last, t_until;
+    backoff_entry_t *entry;
+    unsigned int failures;
+    FILE *fp;
+    int n = 0;
+
+    if (NULL == (fp = fopen(path, "r")))
+    {
+        if (ENOENT == errno)
+        {
+            return PASSWD_ERR_SUCCESS;
+        }
+        VLOG_ERR("Failed to read %s", path);
+        return PASSWD_ERR_FATAL;
+    }
+
+    if ((NULL == fgets(line, sizeof(line), fp)) ||
+        (NULL == strstr(line, PASSWD_SRV_BACKOFF_MAGIC)))
+    {
+        VLOG_WARN("Ignoring %s, not a backoff table", path);
+        fclose(fp);
+        return PASSWD_ERR_SUCCESS;
+    }
+
+    while (fgets(line, sizeof(line), fp))
+    {
+        if (4 != sscanf(line, PASSWD_SRV_BACKOFF_SCAN, username, &failures,
+                        &t_last, &t_until))
+        {
+            continue;
+        }
+        entry = backoff_find(username, TRUE, now);
+        entry->failures = failures;
+        entry->t_last = t_last;
+        entry->t_until = t_until;
+        n++;
+    }
+    fclose(fp);
+
+    s_backoff_dirty = FALSE;
+    VLOG_INFO("Loaded failed password attempts of %d users", n);
+    return PASSWD_ERR_SUCCESS;
+}
+
+/**
+ * Save the table, replacing the file atomically
+ *
+ * @return PASSWD_ERR_SUCCESS if the table is saved
+ */
+static int
+backoff_save()
+{
+    const char *path = passwd_srv_file(PASSWD_SRV_FILE_BACKOFF);
+    char tmp_path[PATH_MAX];
+    backoff_entry_t *entry;
+    int set, way, fd, err;
+    FILE *fp;
+
+    s_backoff_dirty = FALSE;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    unlink(tmp_path);
+    if ((0 > (fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL, 0600))) ||
+        (NULL == (fp = fdopen(fd, "w"))))
+    {
+        VLOG_ERR("Failed to save failed password attempts to %s", path);
+        if (0 <= fd)
+        {
+            close(fd);
+        }
+        return PASSWD_ERR_FATAL;
+    }
+
+    fprintf(fp, "# %s\n", PASSWD_SRV_BACKOFF_MAGIC);
+    for (set = 0; set < PASSWD_SRV_BACKOFF_SETS; set++)
+    {
+        for (way = 0; way < PASSWD_SRV_BACKOFF_WAYS; way++)
+        {
+            entry = &s_backoff[set][way];
+            if (entry->username[0])
+            {
+                fprintf(fp, "%s %u %lld %lld\n", entry->username,
+                        entry->failures, entry->t_last, entry->t_until);
+            }
+        }
+    }
+
+    err = ferror(fp);
+    if ((0 != fclose(fp)) || err || (0 != rename(tmp_path, path)))
+    {
+        VLOG_ERR("Failed to save failed password attempts to %s", path);
+        unlink(tmp_path);
+        return PASSWD_ERR_FATAL;
+    }
+
+    return PASSWD_ERR_SUCCESS;
+}
+
+/**
+ * Save the table if it has changed and is due
+ */
+void passwd_srv_backoff_run()
+{
+    if (s_backoff_dirty && (time_msec() >= s_backoff_save_due))
+    {
+        backoff_save();
+    }
+}
+
+/**
+ * Register the next save with the poll loop
+ */
+void passwd_srv_backoff_wait()
+{
+    if (s_backoff_dirty)
+    {
+        poll_timer_wait_until(s_backoff_save_due);
+    }
+}
+
+/**
+ * Save the table now if it has changed, before the server exits or hands
+ * off to a new one
+ */
+void passwd_srv_backoff_flush()
+{
+    if (s_backoff_dirty)
+    {
+        backoff_save();
+    }
+}
@@ -0,0 +1,453 @@
+/*
+ * (c) Copyright 2016 Hewlett Packard Enterprise Development LP
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+/************************************************************************//**
+ * @ingroup passwd-srvd
+ *
+ * @file
+ * Configuration of the Password Server.
+ *
+ *    System files are located relative to the root directory given with
+ *     --root, "/" by default, so that the server can run against a sandbox
+ *     dataset.  Tunable settings are described by a table mapping each
+ *     yaml key to its field, default and bounds in passwd_srv_settings_t;
+ *     they are read at startup and on reload.  The server then publishes a
+ *     checksummed snapshot of the configuration, with the protocol limits,
+ *     file locations and public key fingerprint, which clients map instead
+ *     of parsing the yaml file themselves.  It is replaced by rename so a
+ *     partial snapshot is never seen.
+ ***************************************************************************/
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <openssl/sha.h>
+
+#include "openvswitch/vlog.h"
+#include "passwd_srv_pri.h"
+
+VLOG_DEFINE_THIS_MODULE(passwd_srv_config);
+
+/*
+ * location of system files used by the password server, relative to the
+ * root directory
+ */
+static const char *s_file_default[PASSWD_SRV_FILE_MAX] = {
+    PASSWD_PASSWORD_FILE,
+    PASSWD_SHADOW_FILE,
+    PASSWD_GROUP_FILE,
+    PASSWD_LOGIN_FILE,
+    PASSWD_LOCK_FILE,
+    PASSWD_RUN_DIR,
+    PASSWD_HANDOFF_FILE,
+    PASSWD_BACKOFF_FILE
+};
+
+static char s_file_path[PASSWD_SRV_FILE_MAX][PATH_MAX];
+
+/*
+ * settings of the yaml file, the value of each is an int in
+ * passwd_srv_settings_t
+ */
+typedef struct passwd_srv_setting_desc
+{
+    const char *name;         /* name in the 'settings' section */
+    size_t      offset;       /* offset in passwd_srv_settings_t */
+    int         def;          /* used when the setting is absent */
+    int         min;
+    int         max;
+} passwd_srv_setting_desc_t;
+
+static const passwd_srv_setting_desc_t s_setting_desc[] = {
+    {"MAX_CONNECTIONS",
+     offsetof(passwd_srv_settings_t, max_connections), 256, 1, 4096},
+    {"QUEUE_DEPTH",
+     offsetof(passwd_srv_settings_t, queue_depth), 64, 1, 4096},
+    {"READ_TIMEOUT_MS",
+     offsetof(passwd_srv_settings_t, read_timeout), 1000, 10, 600000},
+    {"PROCESS_TIMEOUT_MS",
+     offsetof(passwd_srv_settings_t, process_timeout), 10000, 10, 600000},
+    {"WRITE_TIMEOUT_MS",
+     offsetof(passwd_srv_settings_t, write_timeout), 1000, 10, 600000},
+    {"IDLE_TIMEOUT_MS",
+     offsetof(passwd_srv_settings_t, idle_timeout), 60000, 10, 86400000},
+    {"RATE_LIMIT_GLOBAL",
+     offsetof(passwd_srv_settings_t, rate_limit_global), 0, 0, 100000},
+    {"RATE_LIMIT_UID",
+     offsetof(passwd_srv_settings_t, rate_limit_uid), 0, 0, 100000},
+    {"RATE_LIMIT_PASSWORD",
+     offsetof(passwd_srv_settings_t, rate_limit_password), 0, 0, 100000},
+    {"RATE_LIMIT_ACCOUNT",
+     offsetof(passwd_srv_settings_t, rate_limit_account), 0, 0, 100000},
+    {"RATE_LIMIT_VERIFY",
+     offsetof(passwd_srv_settings_t, rate_limit_verify), 0, 0, 100000},
+    {"RATE_LIMIT_QUERY",
+     offsetof(passwd_srv_settings_t, rate_limit_query), 0, 0, 100000},
+    {"BACKOFF_THRESHOLD",
+     offsetof(passwd_srv_settings_t, backoff_threshold), 3, 1, 1000},
+    {"BACKOFF_BASE_MS",
+     offsetof(passwd_srv_settings_t, backoff_base), 1000, 1, 3600000},
+    {"BACKOFF_MAX_MS",
+     offsetof(passwd_srv_settings_t, backoff_max), 300000, 1, 86400000},
+    {"SCHED_WEIGHT_INTERACTIVE",
+     offsetof(passwd_srv_settings_t, sched_weight_interactive), 8, 1, 1000},
+    {"SCHED_WEIGHT_ADMIN",
+     offsetof(passwd_srv_settings_t, sched_weight_admin), 2, 1, 1000},
+    {"SCHED_WEIGHT_BATCH",
+     offsetof(passwd_srv_settings_t, sched_weight_batch), 1, 1, 1000},
+    {"IDEMPOTENCY_TTL_MS",
+     offsetof(passwd_srv_settings_t, idempotency_ttl), 600000, 1000, 86400000},
+    {"VERIFY_CACHE_TTL_MS",
+     offsetof(passwd_srv_settings_t, verify_cache_ttl), 0, 0, 3600000},
+};
+
+#define PASSWD_SRV_SETTING_COUNT \
+    (sizeof(s_setting_desc) / sizeof(s_setting_desc[0]))
+
+static passwd_srv_settings_t s_settings;
+
+/* yaml file the configuration was read from */
+static char s_yaml_path[PASSWD_SRV_MAX_STR_SIZE + sizeof(PASSWD_SRV_YAML_FILE)];
+
+/**
+ * Read settings of the parsed yaml file, absent ones get their default
+ *
+ * @param settings filled in with the settings
+ * @return PASSWD_ERR_SUCCESS if every setting is valid
+ */
+static int
+load_settings(passwd_srv_settings_t *settings)
+{
+    const passwd_srv_setting_desc_t *desc;
+    const char *value;
+    char *end;
+    long num;
+    size_t i;
+
+    for (i = 0; i < PASSWD_SRV_SETTING_COUNT; i++)
+    {
+        desc = &s_setting_desc[i];
+        num = desc->def;
+
+        if (NULL != (value = get_passwd_srv_setting(desc->name)))
+        {
+            num = strtol(value, &end, 10);
+            if (('\0' == value[0]) || ('\0' != *end) ||
+                (num < desc->min) || (num > desc->max))
+            {
+                VLOG_ERR("Setting %s must be %d-%d, not '%s'", desc->name,
+                         desc->min, desc->max, value);
+                return PASSWD_ERR_INVALID_PARAM;
+            }
+        }
+
+        *(int *)((char *)settings + desc->offset) = (int)num;
+    }
+
+    return PASSWD_ERR_SUCCESS;
+}
+
+/**
+ * Get settings in effect
+ *
+ * @return settings of the last configuration read
+ */
+const passwd_srv_settings_t *passwd_srv_settings()
+{
+    return &s_settings;
+}
+
+/**
+ * Read the yaml file and resolve the location of every file used by the
+ * password server.
+ *
+ * @param root_dir  root directory of all files, NULL to use the ROOT entry
+ *                  of the yaml file or "/"
+ * @param yaml_file yaml file to read, NULL for the default location under
+ *                  the root directory
+ * @return PASSWD_ERR_SUCCESS if configuration is read
+ */
+int passwd_srv_config_init(const char *root_dir, const char *yaml_file)
+{
+    const char *root;
+    int file, err, len;
+
+    if ((NULL != root_dir) &&
+        (PASSWD_ERR_SUCCESS != set_passwd_srv_root_dir(root_dir)))
+    {
+        return PASSWD_ERR_INVALID_PARAM;
+    }
+
+    /* the server is the one publishing the snapshot, read the yaml file */
+    set_passwd_srv_snapshot_enabled(FALSE);
+
+    if (NULL == yaml_file)
+    {
+        snprintf(s_yaml_path, sizeof(s_yaml_path), "%s%s",
+                 get_passwd_srv_root_dir(), PASSWD_SRV_YAML_FILE);
+    }
+    else
+    {
+        snprintf(s_yaml_path, sizeof(s_yaml_path), "%s", yaml_file);
+    }
+
+    err = parse_passwd_srv_yaml_file(s_yaml_path);
+    if (PASSWD_ERR_SUCCESS != err)
+    {
+        return err;
+    }
+
+    if (PASSWD_ERR_SUCCESS != (err = load_settings(&s_settings)))
+    {
+        return err;
+    }
+
+    /* ROOT entry of the yaml file is known only after parsing it */
+    root = get_passwd_srv_root_dir();
+
+    for (file = 0; file < PASSWD_SRV_FILE_MAX; file++)
+    {
+        len = snprintf(s_file_path[file], PATH_MAX, "%s%s", root,
+                       s_file_default[file]);
+        if ((0 > len) || (PATH_MAX <= len))
+        {
+            VLOG_ERR("Path of %s is too long under %s", s_file_default[file],
+                     root);
+            return PASSWD_ERR_INVALID_PARAM;
+        }
+    }
+
+    if ('\0' != root[0])
+    {
+        VLOG_INFO("Using files under root directory %s", root);
+    }
+
+    return PASSWD_ERR_SUCCESS;
+}
+
+/**
+ * Get location of a file used by the password server
+ *
+ * @param file file type
+ * @return file path with root directory applied
+ */
+const char *passwd_srv_file(enum passwd_srv_file_e file)
+{
+    if ((file < 0) || (file >= PASSWD_SRV_FILE_MAX))
+    {
+        return NULL;
+    }
+
+    /* configuration is not read yet, i.e. internals used by tools */
+    if ('\0' == s_file_path[file][0])
+    {
+        return s_file_default[file];
+    }
+
+    return s_file_path[file];
+}
+
+/**
+ * Check whether the password server runs against a root directory other
+ * than "/", i.e. a sandbox with synthetic account files
+ *
+ * @return TRUE if root directory is set
+ */
+int passwd_srv_is_sandboxed()
+{
+    return ('\0' != get_passwd_srv_root_dir()[0]) ? TRUE : FALSE;
+}
+
+/**
+ * Publish the configuration snapshot read by clients instead of the yaml
+ * file.  The snapshot is written to a temporary file and renamed, so
+ * clients never map a partial one.
+ *
+ * @param keypair key pair whose public key is given to clients
+ * @return PASSWD_ERR_SUCCESS if the snapshot is published
+ */
+int passwd_srv_config_publish(RSA *keypair)
+{
+    char snap_file[PASSWD_SRV_MAX_STR_SIZE + sizeof(PASSWD_SRV_SNAPSHOT_FILE)];
+    char tmp_file[sizeof(snap_file) + sizeof(".tmp")];
+    passwd_srv_snapshot_t snap;
+    unsigned char *der = NULL;
+    struct stat st;
+    char *path;
+    int type, len, fd;
+
+    memset(&snap, 0, sizeof(snap));
+    snap.magic = PASSWD_SRV_SNAPSHOT_MAGIC;
+    snap.version = PASSWD_SRV_SNAPSHOT_VERSION;
+    snap.size = sizeof(snap);
+    snap.proto_min = 1;
+    snap.proto_max = PASSWD_SRV_PROTO_VERSION;
+    snap.max_payload = PASSWD_SRV_MAX_PAYLOAD;
+    snap.username_size = PASSWD_USERNAME_SIZE;
+    snap.password_size = PASSWD_PASSWORD_SIZE;
+    snap.key_bits = RSA_size(keypair) * 8;
+
+    if (0 != stat(s_yaml_path, &st))
+    {
+        VLOG_ERR("Cannot access %s", s_yaml_path);
+        return PASSWD_ERR_YAML_FILE;
+    }
+    snap.yaml_size = st.st_size;
+    snap.yaml_mtime_sec = st.st_mtim.tv_sec;
+    snap.yaml_mtime_nsec = st.st_mtim.tv_nsec;
+    snprintf(snap.yaml_file, sizeof(snap.yaml_file), "%s", s_yaml_path);
+    snprintf(snap.root_dir, sizeof(snap.root_dir), "%s",
+             get_passwd_srv_root_dir());
+
+    if (0 > (len = i2d_RSAPublicKey(keypair, &der)))
+    {
+        return PASSWD_ERR_FATAL;
+    }
+    SHA256(der, len, snap.key_fp);
+    OPENSSL_free(der);
+
+    for (type = PASSWD_SRV_YAML_PATH_NONE + 1; type < PASSWD_SRV_YAML_PATH_MAX;
+         type++)
+    {
+        if (NULL != (path = get_file_path(type)))
+        {
+            snprintf(snap.path[type], sizeof(snap.path[type]), "%s", path);
+        }
+    }
+
+    snap.checksum = passwd_srv_snapshot_checksum(&snap);
+
+    snprintf(snap_file, sizeof(snap_file), "%s%s", get_passwd_srv_root_dir(),
+             PASSWD_SRV_SNAPSHOT_FILE);
+    snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", snap_file);
+
+    if (0 > (fd = open(tmp_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                       S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)))
+    {
+        VLOG_ERR("Cannot create %s", tmp_file);
+        return PASSWD_ERR_FATAL;
+    }
+
+    /* umask of the key creation would leave it unreadable */
+    if ((0 != fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)) ||
+        (sizeof(snap) != write(fd, &snap, sizeof(snap))) ||
+        (0 != fsync(fd)))
+    {
+        VLOG_ERR("Failed to write %s", tmp_file);
+        close(fd);
+        unlink(tmp_file);
+        return PASSWD_ERR_FATAL;
+    }
+    close(fd);
+
+    if (0 != rename(tmp_file, snap_file))
+    {
+        VLOG_ERR("Failed to publish %s", snap_file);
+        unlink(tmp_file);
+        return PASSWD_ERR_FATAL;
+    }
+
+    VLOG_DBG("Configuration snapshot published in %s", snap_file);
+    return PASSWD_ERR_SUCCESS;
+}
+
+/**
+ * Read the yaml file again and apply it without restarting: a new public key
+ * location gets the key of the running server, a new socket location is
+ * listened on and the old socket is closed once its pending connections are
+ * accepted, settings take effect for the next request.  Connected clients
+ * are kept.  If anything fails the previous configuration stays in effect.
+ * The root directory cannot be changed.
+ *
+ * @param keypair key pair of the running server
+ * @return PASSWD_ERR_SUCCESS if the new configuration is in effect
+ */
+int passwd_srv_config_reload(RSA *keypair)
+{
+    char old_sock[PASSWD_SRV_MAX_STR_SIZE+1], old_key[PASSWD_SRV_MAX_STR_SIZE+1];
+    passwd_srv_settings_t settings;
+    const char *sock, *key;
+    int key_moved = FALSE, err;
+
+    snprintf(old_sock, sizeof(old_sock), "%s",
+             get_file_path(PASSWD_SRV_YAML_PATH_SOCK));
+    snprintf(old_key, sizeof(old_key), "%s",
+             get_file_path(PASSWD_SRV_YAML_PATH_PUB_KEY));
+
+    if (PASSWD_ERR_SUCCESS != (err = reload_passwd_srv_yaml_file(s_yaml_path)))
+    {
+        VLOG_ERR("Failed to read %s, configuration is unchanged", s_yaml_path);
+        return err;
+    }
+
+    sock = get_file_path(PASSWD_SRV_YAML_PATH_SOCK);
+    key = get_file_path(PASSWD_SRV_YAML_PATH_PUB_KEY);
+    if ((NULL == sock) || (NULL == key))
+    {
+        VLOG_ERR("Socket and public key locations are required");
+        err = PASSWD_ERR_YAML_FILE;
+        goto rollback;
+    }
+
+    if (PASSWD_ERR_SUCCESS != (err = load_settings(&settings)))
+    {
+        goto rollback;
+    }
+
+    if (0 != strcmp(key, old_key))
+    {
+        if (PASSWD_ERR_SUCCESS != (err = create_pubkey_file(keypair, key)))
+        {
+            goto rollback;
+        }
+        key_moved = TRUE;
+    }
+
+    if ((0 != strcmp(sock, old_sock)) &&
+        (PASSWD_ERR_SUCCESS != (err = passwd_srv_conn_rebind(sock))))
+    {
+        if (key_moved)
+        {
+            unlink(key);
+        }
+        goto rollback;
+    }
+
+    commit_passwd_srv_yaml_reload();
+    if (key_moved)
+    {
+        unlink(old_key);
+    }
+    s_settings = settings;
+
+    if (PASSWD_ERR_SUCCESS != passwd_srv_config_publish(keypair))
+    {
+        VLOG_WARN("Configuration snapshot is not published");
+    }
+
+    VLOG_INFO("Configuration reloaded from %s", s_yaml_path);
+    return PASSWD_ERR_SUCCESS;
+
+rollback:
+    rollback_passwd_srv_yaml_reload();
+    VLOG_ERR("Failed to apply %s, configuration is unchanged", s_yaml_path);
+    return err;
+}
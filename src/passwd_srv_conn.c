@@ -16,18 +16,24 @@
 #include <sys/types.h>
 #include <sys/errno.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
 
 #include <unistd.h>
 #include <fcntl.h>
 
 #include <syslog.h>
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <poll.h>
 
+#include <poll-loop.h>
+#include <timeval.h>
 #include "openvswitch/vlog.h"
 #include "passwd_srv_pri.h"
 
@@ -35,90 +41,1043 @@
 
 VLOG_DEFINE_THIS_MODULE(passwd_srv_conn);
 
-static int fdSocket = 0, socket_client = 0;
+#define PASSWD_SRV_HDR_SIZE     sizeof(passwd_srv_hdr_t)
+#define PASSWD_SRV_FRAME_SIZE   (PASSWD_SRV_HDR_SIZE + PASSWD_SRV_MAX_PAYLOAD)
+#define PASSWD_SRV_SOCK_MODE    0766    /* clients of any user connect */
+#define PASSWD_SRV_DRAIN_MSEC   5000    /* connections kept after a handoff */
+#define PASSWD_SRV_LISTEN_FDS_START 3   /* SD_LISTEN_FDS_START of systemd */
+#define PASSWD_SRV_LISTEN_BACKLOG 64    /* connects between two accept passes */
+#define PASSWD_SRV_FRAME_EVENTS (PASSWD_SRV_MAX_REPLY / \
+                                 sizeof(passwd_srv_event_t))
 
 /*
- * Using socket provided, send MSG back to client. MSG going back is the status
- * of password update.
+ * connection from a client, kept open until the client closes it (version 2)
+ * or until the status is sent (version 1)
+ */
+typedef struct passwd_conn
+{
+    int fd;                   /* client socket descriptor */
+    int version;              /* protocol version, 0 until first request */
+    char *peer;               /* user of connected process, resolved once */
+    uid_t uid;                /* uid of connected process, rate limited */
+    int closing;              /* close once tx is sent */
+    int have_hdr;             /* frame header of current request is read */
+    size_t need;              /* bytes of current frame to read into rx */
+    size_t rx_len;
+    unsigned char rx[PASSWD_SRV_FRAME_SIZE];
+    uint64_t t_arrival;       /* first byte of the current frame is read */
+    uint64_t req_id;          /* request id of the frame, once admitted */
+    int has_key;              /* frame carries an idempotency key */
+    uint8_t idem_key[PASSWD_SRV_IDEM_KEY_SIZE];
+    int queued;               /* frame in rx waits in the request queue */
+    passwd_client_t client;   /* decrypted request, while queued */
+    passwd_srv_sched_entry_t sched;
+    passwd_srv_timer_t timer; /* earliest deadline of the connection */
+    long long int t_read;     /* time_msec() a frame is expected since, 0 */
+    long long int t_admit;    /* time_msec() the frame is queued */
+    long long int t_write;    /* time_msec() replies are pending since */
+    long long int t_idle;     /* time_msec() of the last reply */
+    size_t drain_left;        /* bytes sent before the handoff, not read */
+    int subscribed;           /* account change events are sent */
+    uint32_t sub_seq;         /* seq of the SUBSCRIBE request, of events */
+    unsigned char *tx;        /* replies not sent yet */
+    size_t tx_len;
+    size_t tx_size;
+    struct passwd_conn *next;
+} passwd_conn_t;
+
+static int s_listen_fd = -1;
+static char s_sock_file[PASSWD_SRV_MAX_STR_SIZE+1];  /* s_listen_fd bound to */
+static RSA *s_keypair = NULL;
+static passwd_conn_t *s_conns = NULL;
+static int s_n_conns = 0;
+static uint64_t s_req_id = 0;   /* last request id handed to USDT probes */
+static int s_draining = FALSE;  /* listening socket is handed off */
+static long long int s_drain_deadline = 0;
+
+/* requests admitted and waiting to be served, see passwd_srv_sched.c */
+static passwd_srv_queue_stats_t s_queue_stats;
+static passwd_srv_conn_stats_t s_conn_stats;
+
+/**
+ * Send as much of the pending replies as the socket takes without blocking
+ *
+ * @param conn connection to flush
+ * @return PASSWD_ERR_SUCCESS unless the connection is broken
+ */
+static int
+conn_flush(passwd_conn_t *conn)
+{
+    ssize_t len;
+
+    while (conn->tx_len)
+    {
+        len = send(conn->fd, conn->tx, conn->tx_len,
+                   MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (0 > len)
+        {
+            if ((EAGAIN == errno) || (EWOULDBLOCK == errno))
+            {
+                return PASSWD_ERR_SUCCESS;
+            }
+            if (EINTR == errno)
+            {
+                continue;
+            }
+            VLOG_ERR("Failed to send message to the client");
+            return PASSWD_ERR_SEND_FAILED;
+        }
+
+        conn->tx_len -= len;
+        memmove(conn->tx, conn->tx + len, conn->tx_len);
+    }
+
+    return PASSWD_ERR_SUCCESS;
+}
+
+/**
+ * Queue a reply on a connection and try to send it
+ *
+ * @param conn connection of the client
+ * @param data reply to send
+ * @param len  length of data
+ * @return PASSWD_ERR_SUCCESS if the reply is sent or queued
+ */
+static int
+conn_send(passwd_conn_t *conn, const void *data, size_t len)
+{
+    unsigned char *tx;
+    size_t size;
+
+    if (conn->tx_len + len > conn->tx_size)
+    {
+        size = (conn->tx_len + len) * 2;
+        if (NULL == (tx = realloc(conn->tx, size)))
+        {
+            VLOG_ERR("Memory allocation failure");
+            return PASSWD_ERR_INSUFFICIENT_MEM;
+        }
+        conn->tx = tx;
+        conn->tx_size = size;
+    }
+
+    if (0 == conn->tx_len)
+    {
+        conn->t_write = time_msec();
+    }
+    memcpy(conn->tx + conn->tx_len, data, len);
+    conn->tx_len += len;
+
+    return conn_flush(conn);
+}
+
+/**
+ * Check whether the client of a connection has closed it, without reading
+ * what it sent.  A client which only shut down its sending side still gets
+ * its replies.
+ *
+ * @param fd client socket
+ * @return TRUE if nothing can be sent to the client anymore
+ */
+static int
+conn_hangup(int fd)
+{
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = 0;
+    pfd.revents = 0;
+
+    return ((1 == poll(&pfd, 1, 0)) && (pfd.revents & (POLLHUP | POLLERR))) ?
+           TRUE : FALSE;
+}
+
+/**
+ * Checkpoint of a request being served: a stage is not started for a
+ * client which has gone.  Once the shadow file is being written, the
+ * request is completed whatever the client does.
+ *
+ * @param client request being served
+ * @param stage  stage about to start
+ * @return TRUE if the request is to be dropped with PASSWD_ERR_CANCELLED
+ */
+int passwd_srv_request_cancelled(const passwd_client_t *client,
+                                 enum passwd_srv_stage_e stage)
+{
+    if (!conn_hangup(client->socket))
+    {
+        return FALSE;
+    }
+
+    VLOG_DBG("Client gone, request %llu cancelled",
+             (unsigned long long)client->req_id);
+    PASSWD_SRV_PROBE2(cancel, client->req_id, stage);
+    return TRUE;
+}
+
+/**
+ * Time a rejected client should wait before sending again: the time to
+ * serve the requests ahead of it
+ *
+ * @return retry-after hint in milliseconds
+ */
+static uint32_t
+queue_retry_after()
+{
+    uint64_t ms;
+
+    ms = ((uint64_t)s_queue_stats.depth * s_queue_stats.service_ns +
+          999999) / 1000000;
+
+    return (1 > ms) ? 1 : (uint32_t)ms;
+}
+
+/**
+ * Send status of the request back to the client.  A version 1 connection is
+ * closed once the status is sent.  PASSWD_ERR_BUSY, PASSWD_ERR_RATE_LIMITED
+ * and PASSWD_ERR_BACKOFF carry a retry-after hint to version 2 clients, a
+ * successful query carries its reply and an accepted job its id.
+ *
+ * @param conn     connection the request came from
+ * @param client   client whose request is completed
+ * @param status   error code to send back
+ */
+static void
+reply_client(passwd_conn_t *conn, passwd_client_t *client, int status)
+{
+    passwd_srv_hdr_t hdr;
+    passwd_srv_busy_t busy;
+    const void *payload = NULL;
+    int32_t reply = status;
+
+    if (PASSWD_SRV_PROTO_VERSION == conn->version)
+    {
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.magic = PASSWD_SRV_MAGIC;
+        hdr.version = PASSWD_SRV_PROTO_VERSION;
+        hdr.seq = client->seq;
+        hdr.status = status;
+        if ((PASSWD_ERR_BUSY == status) ||
+            (PASSWD_ERR_RATE_LIMITED == status) ||
+            (PASSWD_ERR_BACKOFF == status))
+        {
+            busy.retry_after_ms = client->retry_after_ms;
+            payload = &busy;
+            hdr.len = sizeof(busy);
+        }
+        else if (((PASSWD_ERR_SUCCESS == status) ||
+                  (PASSWD_ERR_PENDING == status)) && client->reply)
+        {
+            payload = client->reply;
+            hdr.len = client->reply_len;
+        }
+        conn_send(conn, &hdr, sizeof(hdr));
+        if (payload)
+        {
+            conn_send(conn, payload, hdr.len);
+        }
+    }
+    else
+    {
+        conn_send(conn, &reply, sizeof(reply));
+        conn->closing = TRUE;
+    }
+
+    PASSWD_SRV_PROBE4(reply, client->req_id, client->msg.op_code, status,
+                      passwd_srv_stage_now() - client->t_arrival);
+    passwd_srv_trace_request(client, status);
+}
+
+/**
+ * Decrypt a request and check the rate of its opcode class, before it is
+ * queued
+ *
+ * @param conn    connection the request came from
+ * @param client  request being admitted
+ * @param enc_msg encrypted passwd_srv_msg_t, passwd_srv_hash_msg_t or
+ *                passwd_srv_ctl_msg_t
+ * @return PASSWD_ERR_SUCCESS if the request is to be queued, the status to
+ *         send back to the client otherwise
+ */
+static int
+decrypt_request(passwd_conn_t *conn, passwd_client_t *client,
+                const unsigned char *enc_msg)
+{
+    unsigned char dec_msg[PASSWD_SRV_MAX_PAYLOAD];
+    uint64_t t_stage, ns;
+    int ret, err;
+
+    memset(dec_msg, 0, sizeof(dec_msg));
+
+    /* from RSA_private decrypt() man page:
+     * RSA_PKCS1_OAEP_PADDING
+     *  EME-OAEP as defined in PKCS #1 v2.0 with SHA-1, MGF1 and an empty
+     *  encoding parameter. This mode is recommended for all new
+     *  applications */
+    PASSWD_SRV_PROBE1(decrypt__start, client->req_id);
+    t_stage = passwd_srv_stage_now();
+    ret = RSA_private_decrypt(RSA_size(s_keypair), enc_msg, dec_msg,
+                              s_keypair, RSA_PKCS1_OAEP_PADDING);
+    ns = passwd_srv_stage_end(client, PASSWD_SRV_STAGE_DECRYPT, t_stage);
+    PASSWD_SRV_PROBE3(decrypt__end, client->req_id, ret, ns);
+    if (ret == -1) {
+        /* ERR_print_errors to provide details of the decryption failure,
+         * this will produce an error number that can be understood using
+         * 'openssl errstr' at the command line */
+        ERR_print_errors_fp(stderr);
+        /* TODO: move error to log */
+        return PASSWD_ERR_DECRYPT_FAILED;
+    }
+
+    memcpy(&client->msg, dec_msg, sizeof(passwd_srv_msg_t));
+    if (PASSWD_MSG_SET_HASH == client->msg.op_code)
+    {
+        /* hash follows the username, in place of the password fields */
+        if ((size_t)ret != sizeof(passwd_srv_hash_msg_t))
+        {
+            memset(dec_msg, 0, sizeof(dec_msg));
+            return PASSWD_ERR_INVALID_MSG;
+        }
+        memcpy(client->hash,
+               dec_msg + offsetof(passwd_srv_hash_msg_t, hash),
+               sizeof(client->hash));
+    }
+    else if ((PASSWD_MSG_SUBSCRIBE == client->msg.op_code) ||
+             (PASSWD_MSG_JOB_STATUS == client->msg.op_code))
+    {
+        const passwd_srv_ctl_msg_t *ctl = (const passwd_srv_ctl_msg_t *)dec_msg;
+
+        /* the argument overlays the username, which is left empty */
+        if ((size_t)ret != sizeof(passwd_srv_ctl_msg_t))
+        {
+            memset(dec_msg, 0, sizeof(dec_msg));
+            return PASSWD_ERR_INVALID_MSG;
+        }
+        if (PASSWD_MSG_SUBSCRIBE == client->msg.op_code)
+        {
+            client->resume_after = ctl->arg.after;
+        }
+        else
+        {
+            client->job_id = ctl->arg.job_id;
+        }
+        memset(client->msg.username, 0, sizeof(client->msg.username));
+    }
+    memset(dec_msg, 0, sizeof(dec_msg));
+
+    /* rate of the opcode class, before a password is hashed */
+    if (PASSWD_ERR_SUCCESS !=
+        (err = passwd_srv_limit_opcode(conn->uid, client->msg.op_code,
+                                       &client->retry_after_ms)))
+    {
+        PASSWD_SRV_PROBE3(throttle, client->req_id, conn->uid,
+                          client->retry_after_ms);
+        return err;
+    }
+
+    return PASSWD_ERR_SUCCESS;
+}
+
+/**
+ * Check privilege of the connected client and process a decrypted request
  *
- * @param client_socket socket to send MSG
- * @param msg           error code to send back
- * @return SUCCESS if sent it
+ * @param conn    connection the request came from
+ * @param client  request being served
+ * @return status to send back to the client
+ */
+static int
+serve_request(passwd_conn_t *conn, passwd_client_t *client)
+{
+    uint64_t t_stage, ns;
+    int err;
+
+    if (passwd_srv_request_cancelled(client, PASSWD_SRV_STAGE_PEER))
+    {
+        return PASSWD_ERR_CANCELLED;
+    }
+
+    /* find username of connected client, the peer of a connection does not
+     * change so it is only looked up for the first request */
+    t_stage = passwd_srv_stage_now();
+    if (NULL == conn->peer)
+    {
+        conn->peer = get_connected_username(conn->fd);
+    }
+    ns = passwd_srv_stage_end(client, PASSWD_SRV_STAGE_PEER, t_stage);
+    PASSWD_SRV_PROBE3(peer__resolve, client->req_id, conn->peer != NULL, ns);
+    if (conn->peer == NULL)
+    {
+        VLOG_ERR("Failed to get connected client information");
+        return PASSWD_ERR_INVALID_USER;
+    }
+
+    /* events are streamed on version 2 connections only */
+    if ((PASSWD_MSG_SUBSCRIBE == client->msg.op_code) &&
+        (PASSWD_SRV_PROTO_VERSION != conn->version))
+    {
+        return PASSWD_ERR_INVALID_OPCODE;
+    }
+
+    /* validate the connected client */
+    if (passwd_srv_request_cancelled(client, PASSWD_SRV_STAGE_VALIDATE))
+    {
+        return PASSWD_ERR_CANCELLED;
+    }
+    t_stage = passwd_srv_stage_now();
+    err = validate_user(client->msg.op_code, conn->peer);
+    ns = passwd_srv_stage_end(client, PASSWD_SRV_STAGE_VALIDATE, t_stage);
+    PASSWD_SRV_PROBE4(validate__user, client->req_id, client->msg.op_code,
+                      err, ns);
+    if (err != PASSWD_ERR_SUCCESS)
+    {
+        VLOG_ERR("Failed to validate a connected client");
+        return PASSWD_ERR_INVALID_USER;
+    }
+    VLOG_DBG("%s is successfully validated", conn->peer);
+
+    /* account changes asked to run in the background are answered with
+     * their job id at once */
+    if (client->job && ((PASSWD_MSG_ADD_USER == client->msg.op_code) ||
+                        (PASSWD_MSG_DEL_USER == client->msg.op_code)))
+    {
+        return passwd_srv_job_submit(client);
+    }
+
+    if ((err = process_client_request(client)) != PASSWD_ERR_SUCCESS)
+    {
+        VLOG_DBG("Returned error while processing client request(err=%d)", err);
+    }
+
+    return err;
+}
+
+/**
+ * Read the current frame of a connection without blocking.  The first
+ * bytes tell whether the client speaks version 2, otherwise the frame is
+ * a bare version 1 encrypted message.
+ *
+ * @param conn connection to read from
+ * @return PASSWD_ERR_SUCCESS if a complete frame is in rx, PASSWD_ERR_PENDING
+ *         if more bytes are needed, PASSWD_ERR_INVALID_MSG on a framing error
+ *         and PASSWD_ERR_RECV_FAILED if the connection is closed
+ */
+static int
+conn_read(passwd_conn_t *conn)
+{
+    passwd_srv_hdr_t *hdr = (passwd_srv_hdr_t *)conn->rx;
+    ssize_t len;
+
+    while (conn->rx_len < conn->need)
+    {
+        len = recv(conn->fd, conn->rx + conn->rx_len,
+                   conn->need - conn->rx_len, MSG_DONTWAIT);
+        if (0 == len)
+        {
+            return PASSWD_ERR_RECV_FAILED;
+        }
+        if (0 > len)
+        {
+            if ((EAGAIN == errno) || (EWOULDBLOCK == errno) ||
+                (EINTR == errno))
+            {
+                return PASSWD_ERR_PENDING;
+            }
+            VLOG_ERR("Failed to retrieve the message from the client");
+            return PASSWD_ERR_RECV_FAILED;
+        }
+
+        if (0 == conn->rx_len)
+        {
+            conn->t_arrival = passwd_srv_stage_now();
+            if (0 == conn->t_read)
+            {
+                conn->t_read = time_msec();
+            }
+        }
+        conn->rx_len += len;
+        conn->drain_left -= ((size_t)len < conn->drain_left) ?
+                            (size_t)len : conn->drain_left;
+
+        if ((conn->rx_len < PASSWD_SRV_HDR_SIZE) || conn->have_hdr)
+        {
+            continue;
+        }
+
+        conn->have_hdr = TRUE;
+        if (PASSWD_SRV_MAGIC == hdr->magic)
+        {
+            if ((PASSWD_SRV_PROTO_VERSION != hdr->version) ||
+                (PASSWD_SRV_MAX_PAYLOAD < hdr->len))
+            {
+                return PASSWD_ERR_INVALID_MSG;
+            }
+            conn->version = PASSWD_SRV_PROTO_VERSION;
+            conn->need = PASSWD_SRV_HDR_SIZE + hdr->len;
+        }
+        else if (PASSWD_SRV_PROTO_VERSION == conn->version)
+        {
+            /* lost track of the frames */
+            return PASSWD_ERR_INVALID_MSG;
+        }
+        else
+        {
+            conn->version = 1;
+            conn->need = RSA_size(s_keypair);
+        }
+    }
+
+    return PASSWD_ERR_SUCCESS;
+}
+
+/**
+ * Forget the frame in rx and get ready for the next one
+ *
+ * @param conn connection whose frame is replied to
+ */
+static void
+conn_next_frame(passwd_conn_t *conn)
+{
+    memset(conn->rx, 0, conn->rx_len);
+    conn->rx_len = 0;
+    conn->has_key = FALSE;
+    memset(conn->idem_key, 0, sizeof(conn->idem_key));
+    conn->need = PASSWD_SRV_HDR_SIZE;
+    conn->have_hdr = FALSE;
+    conn->t_idle = time_msec();
+}
+
+/**
+ * Fill the request of the frame in rx
+ *
+ * @param conn   connection with a complete frame
+ * @param client request to fill
+ */
+static void
+conn_init_client(passwd_conn_t *conn, passwd_client_t *client)
+{
+    passwd_srv_hdr_t *hdr = (passwd_srv_hdr_t *)conn->rx;
+
+    memset(client, 0, sizeof(*client));
+    client->socket = conn->fd;
+    client->req_id = conn->req_id;
+    client->t_arrival = conn->t_arrival;
+    client->uid = conn->uid;
+
+    if (PASSWD_SRV_PROTO_VERSION == conn->version)
+    {
+        client->seq = hdr->seq;
+        client->job = (hdr->flags & PASSWD_SRV_FLAG_JOB) ? TRUE : FALSE;
+    }
+}
+
+/**
+ * Send a frame of events to a subscribed connection
+ *
+ * @param conn   subscribed connection
+ * @param events events to send, in order
+ * @param n      number of events, at most PASSWD_SRV_FRAME_EVENTS
+ */
+static void
+conn_send_events(passwd_conn_t *conn, const passwd_srv_event_t *events,
+                 size_t n)
+{
+    passwd_srv_hdr_t hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = PASSWD_SRV_MAGIC;
+    hdr.version = PASSWD_SRV_PROTO_VERSION;
+    hdr.seq = conn->sub_seq;
+    hdr.status = PASSWD_ERR_SUCCESS;
+    hdr.len = n * sizeof(*events);
+
+    conn_send(conn, &hdr, sizeof(hdr));
+    conn_send(conn, events, hdr.len);
+}
+
+/**
+ * Turn a connection into a subscriber once the reply of its SUBSCRIBE
+ * request is sent, then send the events it missed
+ *
+ * @param conn   connection the request came from
+ * @param client SUBSCRIBE request
+ */
+static void
+conn_subscribe(passwd_conn_t *conn, const passwd_client_t *client)
+{
+    passwd_srv_event_t events[PASSWD_SRV_FRAME_EVENTS];
+    uint64_t after = client->resume_after;
+    size_t n;
+
+    if (!conn->subscribed)
+    {
+        passwd_srv_event_subscribers(1);
+    }
+    conn->subscribed = TRUE;
+    conn->sub_seq = client->seq;
+
+    while (0 < (n = passwd_srv_event_since(after, events,
+                                           PASSWD_SRV_FRAME_EVENTS)))
+    {
+        conn_send_events(conn, events, n);
+        after = events[n - 1].seq;
+    }
+}
+
+/**
+ * Serve the queued request of a connection and get ready for the next frame
+ *
+ * @param conn    connection taken out of the queue
+ * @param wait_ns time the request waited in the queue
+ * @return status of the request, PASSWD_ERR_CANCELLED if it is dropped
+ *         because the client has gone
+ */
+static int
+conn_handle_frame(passwd_conn_t *conn, uint64_t wait_ns)
+{
+    passwd_client_t *client = &conn->client;
+    int status;
+
+    client->stage_ns[PASSWD_SRV_STAGE_QUEUE] = wait_ns;
+    status = serve_request(conn, client);
+    passwd_srv_event_commit(client, status);
+    if (conn->has_key && client->reply && (PASSWD_ERR_PENDING != status))
+    {
+        /* a replay would carry the status without the reply of a query */
+        passwd_srv_idem_forget(conn->uid, conn->idem_key);
+    }
+    else if (conn->has_key)
+    {
+        /* an accepted job is replayed with its id, not run twice */
+        passwd_srv_idem_end(conn->uid, conn->idem_key, status,
+                            client->reply ?
+                            ((passwd_srv_job_t *)client->reply)->id : 0);
+    }
+    if (PASSWD_ERR_CANCELLED == status)
+    {
+        /* nobody to reply to, only traced */
+        passwd_srv_trace_request(client, status);
+    }
+    else
+    {
+        reply_client(conn, client, status);
+    }
+    if ((PASSWD_MSG_SUBSCRIBE == client->msg.op_code) &&
+        (PASSWD_ERR_SUCCESS == status))
+    {
+        conn_subscribe(conn, client);
+    }
+
+    /* clean up */
+    free(client->reply);
+    memset(client, 0, sizeof(*client));
+    conn_next_frame(conn);
+
+    return status;
+}
+
+/**
+ * Decrypt the frame in rx and queue it in the class of its request
+ *
+ * @param conn connection with a complete frame
+ * @return PASSWD_ERR_SUCCESS if the request is queued, the status to send
+ *         back to the client otherwise
+ */
+static int
+conn_enqueue(passwd_conn_t *conn)
+{
+    passwd_srv_hdr_t *hdr = (passwd_srv_hdr_t *)conn->rx;
+    const unsigned char *enc_msg = conn->rx;
+    enum passwd_srv_sched_class_e sclass;
+    int flags = 0;
+    int err;
+
+    if (PASSWD_SRV_PROTO_VERSION == conn->version)
+    {
+        enc_msg += PASSWD_SRV_HDR_SIZE;
+        if (conn->has_key)
+        {
+            enc_msg += PASSWD_SRV_IDEM_KEY_SIZE;
+        }
+        if (RSA_size(s_keypair) != (conn->rx + conn->rx_len) - enc_msg)
+        {
+            return PASSWD_ERR_INVALID_MSG;
+        }
+        flags = hdr->flags;
+    }
+
+    /* the RSA work is not done for a client which has gone */
+    if (passwd_srv_request_cancelled(&conn->client, PASSWD_SRV_STAGE_DECRYPT))
+    {
+        return PASSWD_ERR_CANCELLED;
+    }
+
+    if (PASSWD_ERR_SUCCESS !=
+        (err = decrypt_request(conn, &conn->client, enc_msg)))
+    {
+        return err;
+    }
+
+    sclass = passwd_srv_sched_class(conn->client.msg.op_code, flags);
+    if (PASSWD_ERR_SUCCESS !=
+        (err = passwd_srv_sched_push(&conn->sched, sclass, conn->uid,
+                                     passwd_srv_clock())))
+    {
+        return err;
+    }
+
+    if (conn->has_key)
+    {
+        passwd_srv_idem_begin(conn->uid, conn->idem_key);
+    }
+
+    PASSWD_SRV_PROBE2(accept, conn->req_id, conn->fd);
+    conn->queued = TRUE;
+    conn->t_admit = time_msec();
+
+    s_queue_stats.admitted++;
+    if (++s_queue_stats.depth > s_queue_stats.max_depth)
+    {
+        s_queue_stats.max_depth = s_queue_stats.depth;
+    }
+
+    return PASSWD_ERR_SUCCESS;
+}
+
+/**
+ * Look up the idempotency key of the frame in rx, if it has one
+ *
+ * @param conn   connection with a complete frame
+ * @param status set to the stored status of a completed request
+ * @param job_id set to the job id of a request accepted as a job
+ * @return PASSWD_SRV_IDEM_* state of the key, PASSWD_SRV_IDEM_NEW if the
+ *         frame has no key
+ */
+static enum passwd_srv_idem_e
+conn_idem_lookup(passwd_conn_t *conn, int *status, uint32_t *job_id)
+{
+    passwd_srv_hdr_t *hdr = (passwd_srv_hdr_t *)conn->rx;
+
+    if ((PASSWD_SRV_PROTO_VERSION != conn->version) ||
+        !(hdr->flags & PASSWD_SRV_FLAG_IDEM_KEY) ||
+        (PASSWD_SRV_IDEM_KEY_SIZE > hdr->len))
+    {
+        return PASSWD_SRV_IDEM_NEW;
+    }
+
+    conn->has_key = TRUE;
+    memcpy(conn->idem_key, conn->rx + PASSWD_SRV_HDR_SIZE,
+           PASSWD_SRV_IDEM_KEY_SIZE);
+    return passwd_srv_idem_lookup(conn->uid, conn->idem_key, status, job_id);
+}
+
+/**
+ * Admit the complete frame of a connection into the request queue.  When
+ * the queue is full, the request is rejected with PASSWD_ERR_BUSY, and
+ * with PASSWD_ERR_RATE_LIMITED when its client is over its rate, before
+ * anything is decrypted.  An admitted request is decrypted to know its
+ * class, and rejected when its client is over the rate of the class.
+ * A duplicate of a completed request with an idempotency key gets its
+ * stored status back, with the job id of a request accepted as a job, a
+ * duplicate of a queued one gets PASSWD_ERR_BUSY.
+ *
+ * @param conn connection with a complete frame
+ */
+static void
+conn_admit(passwd_conn_t *conn)
+{
+    passwd_client_t *client = &conn->client;
+    enum passwd_srv_idem_e idem;
+    uint32_t retry_ms = 0, job_id = 0;
+    int status = PASSWD_ERR_SUCCESS;
+
+    conn->req_id = ++s_req_id;
+    conn->t_read = 0;
+
+    idem = conn_idem_lookup(conn, &status, &job_id);
+    if (PASSWD_SRV_IDEM_DONE == idem)
+    {
+        PASSWD_SRV_PROBE2(replay, conn->req_id, status);
+    }
+    else if (PASSWD_SRV_IDEM_PENDING == idem)
+    {
+        status = PASSWD_ERR_BUSY;
+        retry_ms = queue_retry_after();
+    }
+    else if (s_queue_stats.depth >= passwd_srv_settings()->queue_depth)
+    {
+        status = PASSWD_ERR_BUSY;
+        retry_ms = queue_retry_after();
+        s_queue_stats.rejected++;
+        PASSWD_SRV_PROBE3(reject, conn->req_id, s_queue_stats.depth,
+                          retry_ms);
+    }
+    else if (PASSWD_ERR_SUCCESS !=
+             (status = passwd_srv_limit_request(conn->uid, &retry_ms)))
+    {
+        PASSWD_SRV_PROBE3(throttle, conn->req_id, conn->uid, retry_ms);
+    }
+
+    conn_init_client(conn, client);
+    if (job_id)
+    {
+        /* the job is not submitted again */
+        status = passwd_srv_job_reply(client, job_id);
+    }
+    if ((PASSWD_SRV_IDEM_NEW == idem) && (PASSWD_ERR_SUCCESS == status) &&
+        (PASSWD_ERR_SUCCESS == (status = conn_enqueue(conn))))
+    {
+        return;
+    }
+
+    if (PASSWD_ERR_CANCELLED == status)
+    {
+        /* client has gone, the connection is closed */
+        s_conn_stats.cancelled_queued++;
+        passwd_srv_trace_request(client, status);
+        conn->closing = TRUE;
+        conn->tx_len = 0;
+    }
+    else
+    {
+        if (retry_ms)
+        {
+            client->retry_after_ms = retry_ms;
+        }
+        reply_client(conn, client, status);
+    }
+    free(client->reply);
+    memset(client, 0, sizeof(*client));
+    conn_next_frame(conn);
+}
+
+/**
+ * Take a connection out of the request queue
+ *
+ * @param conn queued connection
+ */
+static void
+queue_remove(passwd_conn_t *conn)
+{
+    passwd_srv_sched_remove(&conn->sched);
+    conn->queued = FALSE;
+    s_queue_stats.depth--;
+}
+
+/**
+ * Earliest deadline of a connection, from what it is waiting for
+ *
+ * @param conn     connection
+ * @param settings deadlines in use
+ * @param counter  set to the counter of the deadline, may be NULL
+ * @return time_msec() the connection expires at
+ */
+static long long int
+conn_deadline(const passwd_conn_t *conn,
+              const passwd_srv_settings_t *settings, uint64_t **counter)
+{
+    long long int deadline = LLONG_MAX;
+    uint64_t *which = NULL;
+
+    if (conn->tx_len)
+    {
+        /* client does not read its replies */
+        deadline = conn->t_write + settings->write_timeout;
+        which = &s_conn_stats.write_timeouts;
+    }
+
+    if (conn->queued)
+    {
+        if (conn->t_admit + settings->process_timeout < deadline)
+        {
+            deadline = conn->t_admit + settings->process_timeout;
+            which = &s_conn_stats.process_timeouts;
+        }
+    }
+    else if (conn->t_read)
+    {
+        /* request started, or first request of a connection */
+        if (conn->t_read + settings->read_timeout < deadline)
+        {
+            deadline = conn->t_read + settings->read_timeout;
+            which = &s_conn_stats.read_timeouts;
+        }
+    }
+    else if ((0 == conn->tx_len) && !conn->subscribed)
+    {
+        /* a subscriber waits for events, not for its next request */
+        deadline = conn->t_idle + settings->idle_timeout;
+        which = &s_conn_stats.idle_timeouts;
+    }
+
+    if (counter)
+    {
+        *counter = which;
+    }
+    return deadline;
+}
+
+/**
+ * Move the timer of a connection to its earliest deadline
+ *
+ * @param conn connection whose state changed
+ */
+static void
+conn_update_timer(passwd_conn_t *conn)
+{
+    long long int deadline;
+
+    deadline = conn_deadline(conn, passwd_srv_settings(), NULL);
+    if (deadline != conn->timer.expires)
+    {
+        passwd_srv_timer_arm(&conn->timer, deadline);
+    }
+}
+
+/**
+ * Close a connection and free it
  */
-static int
-send_msg_to_client(int client_socket, int msg)
+static void
+conn_destroy(passwd_conn_t *conn)
 {
-    char *msgBuf = NULL;
-    int  err = PASSWD_ERR_SEND_FAILED;
+    passwd_conn_t **prev;
 
-    /*
-     * MSG size is not big as expected,
-     * send error MSG to client
-     */
-    msgBuf = (char *)calloc(1, sizeof(int));
-    if (msgBuf)
+    if (conn->queued)
     {
-        *msgBuf = msg;
-
-        if (0 > (err =
-                send(client_socket, msgBuf, sizeof(int), MSG_DONTROUTE)))
+        queue_remove(conn);
+        if (conn->has_key)
         {
-            VLOG_ERR("Failed to send message to the client");
-            free(msgBuf);
-            return PASSWD_ERR_SEND_FAILED;
+            /* never served, a retry is */
+            passwd_srv_idem_end(conn->uid, conn->idem_key,
+                                PASSWD_ERR_CANCELLED, 0);
         }
+    }
+    if (conn->subscribed)
+    {
+        passwd_srv_event_subscribers(-1);
+    }
+    passwd_srv_timer_cancel(&conn->timer);
 
-        free(msgBuf);
-        return PASSWD_ERR_SUCCESS;
+    for (prev = &s_conns; *prev; prev = &(*prev)->next)
+    {
+        if (*prev == conn)
+        {
+            *prev = conn->next;
+            break;
+        }
     }
 
-    return PASSWD_ERR_FATAL;
+    shutdown(conn->fd, SHUT_WR);
+    close(conn->fd);
+    s_n_conns--;
+    free(conn->peer);
+    free(conn->tx);
+    memset(conn, 0, sizeof(*conn));
+    free(conn);
 }
 
 /**
- * Listen on created socket for new connection request from client.
- *  If connection is available, process request according to MSG's opCode
+ * Close a connection whose deadline has passed, called by the timer wheel
  *
- *  @param socket_server socket descriptor created to listen
+ * @param owner connection which expired
  */
-void listen_socket(RSA *keypair)
+static void
+conn_expire(void *owner)
 {
-    struct sockaddr_un unix_sockaddr;
-    struct sockaddr_un client_sockaddr;
-    int                err = -1;
-    int                ret;
-    int                size = 0, fmode = 0;
-    char   filemode[] = "0766";
-    char   *sock_file = NULL, *connected_client = NULL;
-    unsigned char *enc_msg;
-    unsigned char *dec_msg;
-    passwd_client_t client;
+    passwd_conn_t *conn = owner;
+    uint64_t *counter = NULL;
+
+    conn_deadline(conn, passwd_srv_settings(), &counter);
+    if (counter)
+    {
+        (*counter)++;
+    }
 
-    /* allocate buffers which will hold the incoming encrypted message from
-     * clients and the resulting decrypted message */
-    if ((enc_msg = (unsigned char *)malloc(RSA_size(keypair))) == NULL)
+    if (&s_conn_stats.idle_timeouts == counter)
+    {
+        VLOG_DBG("Closing idle connection");
+    }
+    else
     {
-        VLOG_ERR("Memory allocation failure");
-        exit(PASSWD_ERR_FATAL);
+        VLOG_WARN("Closing connection of %s, %s deadline expired",
+                  conn->peer ? conn->peer : "unknown client",
+                  (&s_conn_stats.read_timeouts == counter) ? "read" :
+                  (&s_conn_stats.process_timeouts == counter) ? "process" :
+                  "write");
     }
 
-    if ((dec_msg = (unsigned char *)malloc(RSA_size(keypair))) == NULL)
+    conn_destroy(conn);
+}
+
+/**
+ * Accept pending connections, up to MAX_CONNECTIONS.  Others wait in the
+ * backlog until a client disconnects.
+ */
+static void
+conn_accept()
+{
+    passwd_conn_t *conn;
+    int fd;
+
+    while ((0 <= s_listen_fd) &&
+           (s_n_conns < passwd_srv_settings()->max_connections))
     {
-        VLOG_ERR("Memory allocation failure");
-        exit(PASSWD_ERR_FATAL);
+        /* requests and replies use MSG_DONTWAIT, socket stays blocking */
+        if (0 > (fd = accept(s_listen_fd, NULL, NULL)))
+        {
+            if ((EAGAIN == errno) || (EWOULDBLOCK == errno) ||
+                (EINTR == errno) || (ECONNABORTED == errno))
+            {
+                return;
+            }
+            if ((EMFILE == errno) || (ENFILE == errno))
+            {
+                VLOG_WARN("Too many open files, connection not accepted");
+                return;
+            }
+            VLOG_ERR("Fail to connect with the client");
+            passwd_srv_backoff_flush();
+            exit(PASSWD_ERR_FATAL);
+        }
+
+        if (NULL == (conn = calloc(1, sizeof(*conn))))
+        {
+            VLOG_ERR("Memory allocation failure");
+            close(fd);
+            return;
+        }
+
+        conn->fd = fd;
+        conn->uid = passwd_srv_peer_uid(fd);
+        conn->need = PASSWD_SRV_HDR_SIZE;
+        conn->timer.owner = conn;
+        conn->sched.owner = conn;
+        conn->t_read = time_msec();     /* first request is expected */
+        conn->next = s_conns;
+        s_conns = conn;
+        s_n_conns++;
+        s_conn_stats.accepted++;
+        conn_update_timer(conn);
     }
+}
+
+/**
+ * Create a listening UNIX socket
+ *
+ * @param sock_file location of the socket, replaced if it exists
+ * @param mode      permissions of the socket file
+ * @return socket descriptor, -1 on failure
+ */
+int open_listener(const char *sock_file, mode_t mode)
+{
+    struct sockaddr_un unix_sockaddr;
+    int    fd;
 
     memset(&unix_sockaddr, 0, sizeof(unix_sockaddr));
-    memset(&client, 0, sizeof(client));
 
-    /* get the socket location from yaml */
-    if (NULL == (sock_file = get_file_path(PASSWD_SRV_YAML_PATH_SOCK)))
+    if (sizeof(unix_sockaddr.sun_path) <= strlen(sock_file))
     {
-        /* couldn't find socket location from yaml */
-        VLOG_ERR("Cannot find socket descriptor location");
-        free(enc_msg);
-        free(dec_msg);
-        exit(PASSWD_ERR_FATAL);
+        VLOG_ERR("Socket path %s is too long", sock_file);
+        return -1;
     }
 
     /* setup sockaddr to create socket */
@@ -126,156 +1085,532 @@ void listen_socket(RSA *keypair)
     strncpy(unix_sockaddr.sun_path, sock_file, strlen(sock_file));
 
     /* create a socket */
-    if (0 > (fdSocket = socket(AF_UNIX, SOCK_STREAM, 0)))
+    if (0 > (fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                         0)))
     {
         VLOG_ERR("Cannot find socket descriptor location");
-        free(enc_msg);
-        free(dec_msg);
-        return;
+        return -1;
     }
 
     /* bind socket to socket descriptor */
-    size = sizeof(struct sockaddr_un);
     unlink(unix_sockaddr.sun_path);
 
-    if (0 > (err = bind(fdSocket, (struct sockaddr *)&unix_sockaddr, size)))
+    if (0 > bind(fd, (struct sockaddr *)&unix_sockaddr,
+                 sizeof(struct sockaddr_un)))
     {
         VLOG_ERR("Cannot bind to socket %s", unix_sockaddr.sun_path);
-        free(enc_msg);
-        free(dec_msg);
-        return;
+        close(fd);
+        return -1;
     }
 
-    fmode = strtol(filemode, 0, 8);
-    chmod(sock_file, fmode);
-
-    memset(&client_sockaddr, 0, sizeof(client_sockaddr));
+    chmod(sock_file, mode);
 
     /* initiate the socket listen */
-    if (0 > (err = listen(fdSocket, 3)))
+    if (0 > listen(fd, PASSWD_SRV_LISTEN_BACKLOG))
     {
         VLOG_ERR("Failed to initiate a socket listen");
-        free(enc_msg);
-        free(dec_msg);
+        unlink(sock_file);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * Create the UNIX socket the password server listens on
+ *
+ * @param keypair key pair whose public key is given to clients
+ * @return PASSWD_ERR_SUCCESS if the socket is listening
+ */
+int create_socket(RSA *keypair)
+{
+    char   *sock_file = NULL;
+
+    s_keypair = keypair;
+
+    /* get the socket location from yaml */
+    if (NULL == (sock_file = get_file_path(PASSWD_SRV_YAML_PATH_SOCK)))
+    {
+        /* couldn't find socket location from yaml */
+        VLOG_ERR("Cannot find socket descriptor location");
+        return PASSWD_ERR_FATAL;
+    }
+
+    if (0 > (s_listen_fd = open_listener(sock_file, PASSWD_SRV_SOCK_MODE)))
+    {
+        return PASSWD_ERR_FATAL;
+    }
+    snprintf(s_sock_file, sizeof(s_sock_file), "%s", sock_file);
+
+    return PASSWD_ERR_SUCCESS;
+}
+
+/**
+ * Get the listening socket passed by systemd socket activation, following
+ * the LISTEN_PID/LISTEN_FDS protocol of sd_listen_fds().  Must be called
+ * before the process forks.  The variables are removed from the environment
+ * so that useradd and other children do not see them.
+ *
+ * @return listening socket descriptor, -1 if not socket activated
+ */
+int passwd_srv_conn_activation_fd()
+{
+    const char *pid_str = getenv("LISTEN_PID");
+    const char *fds_str = getenv("LISTEN_FDS");
+    int type = 0, listening = 0, n_fds = 0, fd;
+    pid_t pid = 0;
+    socklen_t len;
+
+    if (pid_str && fds_str)
+    {
+        pid = (pid_t)strtol(pid_str, NULL, 10);
+        n_fds = (int)strtol(fds_str, NULL, 10);
+    }
+
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+
+    if ((getpid() != pid) || (0 >= n_fds))
+    {
+        return -1;
+    }
+
+    /* only one socket is served, others would stay open for nothing */
+    if (1 < n_fds)
+    {
+        VLOG_WARN("Socket activation passed %d sockets, using the first",
+                  n_fds);
+    }
+    for (fd = PASSWD_SRV_LISTEN_FDS_START + 1;
+         fd < PASSWD_SRV_LISTEN_FDS_START + n_fds; fd++)
+    {
+        close(fd);
+    }
+
+    fd = PASSWD_SRV_LISTEN_FDS_START;
+    len = sizeof(type);
+    getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len);
+    len = sizeof(listening);
+    getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len);
+    if ((SOCK_STREAM != type) || !listening)
+    {
+        VLOG_ERR("Socket activation passed no listening stream socket");
+        close(fd);
+        return -1;
+    }
+
+    /* accept() is called until EAGAIN, systemd passes a blocking socket */
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    return fd;
+}
+
+/**
+ * Serve on a listening socket opened by another process: the previous
+ * password server on a handoff, or systemd.  Clients keep connecting to it,
+ * nothing is unlinked or bound again unless the yaml file gives another
+ * location for the socket.
+ *
+ * @param keypair   key pair whose public key is given to clients
+ * @param listen_fd listening socket inherited from the other process
+ * @return PASSWD_ERR_SUCCESS if the socket is served
+ */
+int passwd_srv_conn_adopt(RSA *keypair, int listen_fd)
+{
+    struct sockaddr_un unix_sockaddr;
+    socklen_t len = sizeof(unix_sockaddr);
+    char *sock_file = NULL;
+
+    s_keypair = keypair;
+
+    if (NULL == (sock_file = get_file_path(PASSWD_SRV_YAML_PATH_SOCK)))
+    {
+        VLOG_ERR("Cannot find socket descriptor location");
+        return PASSWD_ERR_FATAL;
+    }
+
+    memset(&unix_sockaddr, 0, sizeof(unix_sockaddr));
+    if ((0 != getsockname(listen_fd, (struct sockaddr *)&unix_sockaddr,
+                          &len)) || (AF_UNIX != unix_sockaddr.sun_family))
+    {
+        VLOG_ERR("Inherited descriptor is not a UNIX socket");
+        return PASSWD_ERR_FATAL;
+    }
+
+    s_listen_fd = listen_fd;
+    snprintf(s_sock_file, sizeof(s_sock_file), "%s", unix_sockaddr.sun_path);
+
+    if (0 != strcmp(s_sock_file, sock_file))
+    {
+        return passwd_srv_conn_rebind(sock_file);
+    }
+
+    return PASSWD_ERR_SUCCESS;
+}
+
+/**
+ * Get the socket the password server listens on
+ *
+ * @return listening socket descriptor, -1 once handed off
+ */
+int passwd_srv_conn_listen_fd()
+{
+    return s_listen_fd;
+}
+
+/**
+ * Move the listening socket to a new location.  Connections pending on the
+ * old socket are accepted before it is closed, connected clients are kept.
+ *
+ * @param sock_file new location of the socket
+ * @return PASSWD_ERR_SUCCESS if listening on the new location
+ */
+int passwd_srv_conn_rebind(const char *sock_file)
+{
+    int fd;
+
+    if (0 > (fd = open_listener(sock_file, PASSWD_SRV_SOCK_MODE)))
+    {
+        return PASSWD_ERR_FATAL;
+    }
+
+    /* drain the old socket, nobody can connect to it once unlinked */
+    unlink(s_sock_file);
+    conn_accept();
+    close(s_listen_fd);
+
+    VLOG_INFO("Listening on %s instead of %s", sock_file, s_sock_file);
+    s_listen_fd = fd;
+    snprintf(s_sock_file, sizeof(s_sock_file), "%s", sock_file);
+
+    return PASSWD_ERR_SUCCESS;
+}
+
+/**
+ * Stop accepting connections once the listening socket is served by a new
+ * password server.  The socket file is left in place.  Requests already
+ * sent are still served, then connections are closed so that their clients
+ * reconnect to the new server.
+ */
+void passwd_srv_conn_drain()
+{
+    passwd_conn_t *conn;
+    int queued;
+
+    if (0 <= s_listen_fd)
+    {
+        close(s_listen_fd);
+        s_listen_fd = -1;
+    }
+
+    for (conn = s_conns; conn; conn = conn->next)
+    {
+        queued = 0;
+        ioctl(conn->fd, FIONREAD, &queued);
+        conn->drain_left = (0 < queued) ? queued : 0;
+    }
+
+    s_draining = TRUE;
+    s_drain_deadline = time_msec() + PASSWD_SRV_DRAIN_MSEC;
+}
+
+/**
+ * Check whether the connections and jobs are done after the socket is
+ * handed off
+ *
+ * @return TRUE if the password server has nothing left to serve
+ */
+int passwd_srv_conn_drained()
+{
+    return (s_draining && (NULL == s_conns) && !passwd_srv_job_pending()) ?
+           TRUE : FALSE;
+}
+
+/**
+ * Get the counters of the request queue
+ *
+ * @param stats filled with the counters
+ */
+void passwd_srv_conn_queue_stats(passwd_srv_queue_stats_t *stats)
+{
+    *stats = s_queue_stats;
+}
+
+/**
+ * Get the counters of client connections
+ *
+ * @param stats filled with the counters
+ */
+void passwd_srv_conn_stats(passwd_srv_conn_stats_t *stats)
+{
+    *stats = s_conn_stats;
+    stats->connections = s_n_conns;
+}
+
+/**
+ * Serve the request whose turn it is
+ */
+static void
+conn_serve_next()
+{
+    passwd_srv_sched_entry_t *entry;
+    passwd_conn_t *conn;
+    uint64_t start, wait_ns, service_ns;
+    int status;
+
+    if (NULL == (entry = passwd_srv_sched_pop(&wait_ns)))
+    {
         return;
     }
+    conn = entry->owner;
+    conn->queued = FALSE;
+    s_queue_stats.depth--;
 
-    /* waiting to accept the connection */
-    /* TODO: if needed, change to use select() instead of accept() */
-    for(;;)
+    start = passwd_srv_clock();
+    s_queue_stats.wait_ns += wait_ns;
+    if (wait_ns > s_queue_stats.max_wait_ns)
     {
-        /* zero out our buffers before each use */
-        memset(enc_msg, 0, RSA_size(keypair));
-        memset(dec_msg, 0, RSA_size(keypair));
+        s_queue_stats.max_wait_ns = wait_ns;
+    }
 
-        if (0 > (socket_client =
-                accept(fdSocket, (struct sockaddr *)&client_sockaddr,
-                (socklen_t *)&size)))
-        {
-            VLOG_ERR("Fail to connect with the client");
-            free(enc_msg);
-            free(dec_msg);
-            exit(PASSWD_ERR_FATAL);
-        }
+    status = conn_handle_frame(conn, wait_ns);
+    service_ns = passwd_srv_clock() - start;
+
+    if (PASSWD_ERR_CANCELLED == status)
+    {
+        s_conn_stats.cancelled_started++;
+        s_conn_stats.cancelled_ns += service_ns;
+        conn_destroy(conn);
+        return;
+    }
+
+    /* moving average over the last few requests, for retry-after hints */
+    if (0 == s_queue_stats.service_ns)
+    {
+        s_queue_stats.service_ns = service_ns;
+    }
+    else
+    {
+        s_queue_stats.service_ns = (s_queue_stats.service_ns * 7 +
+                                    service_ns) / 8;
+    }
+
+    if (PASSWD_ERR_SUCCESS != conn_flush(conn))
+    {
+        /* client left after the last checkpoint */
+        s_conn_stats.wasted++;
+        s_conn_stats.wasted_ns += service_ns;
+        conn_destroy(conn);
+        return;
+    }
+    if (conn->closing && (0 == conn->tx_len))
+    {
+        conn_destroy(conn);
+        return;
+    }
+    conn_update_timer(conn);
+}
+
+/**
+ * Drop the queued requests of clients which have closed their connection,
+ * so they neither take a turn nor a place in the queue
+ */
+static void
+conn_drop_hangups()
+{
+    static struct pollfd *pfds = NULL;
+    static passwd_conn_t **owners = NULL;
+    static int size = 0;
+    passwd_conn_t *conn;
+    void *ptr;
+    int i, n = 0;
 
-        /*
-         * we get here if connection is made between client and server
-         * - make sure connected client has password-update privilege
-         * - get MSG from connected client
-         **/
+    if (0 == s_queue_stats.depth)
+    {
+        return;
+    }
 
-        if (-1 == recv(socket_client, enc_msg, RSA_size(keypair), MSG_PEEK))
+    if (size < s_queue_stats.depth)
+    {
+        if (NULL == (ptr = realloc(pfds, s_queue_stats.depth *
+                                         sizeof(*pfds))))
         {
-            VLOG_ERR("Failed to retrieve the message from the client");
-            send_msg_to_client(socket_client, PASSWD_ERR_RECV_FAILED);
-            shutdown(socket_client, SHUT_WR);
-            close(socket_client);
-            continue;
+            return;
         }
+        pfds = ptr;
+        if (NULL == (ptr = realloc(owners, s_queue_stats.depth *
+                                           sizeof(*owners))))
+        {
+            return;
+        }
+        owners = ptr;
+        size = s_queue_stats.depth;
+    }
 
-        /* from RSA_private decrypt() man page:
-         * RSA_PKCS1_OAEP_PADDING
-         *  EME-OAEP as defined in PKCS #1 v2.0 with SHA-1, MGF1 and an empty
-         *  encoding parameter. This mode is recommended for all new
-         *  applications */
-        ret = RSA_private_decrypt(RSA_size(keypair), enc_msg, dec_msg, keypair,
-                                  RSA_PKCS1_OAEP_PADDING);
-        if (ret == -1) {
-            /* ERR_print_errors to provide details of the decryption failure,
-             * this will produce an error number that can be understood using
-             * 'openssl errstr' at the command line */
-            ERR_print_errors_fp(stderr);
-            /* TODO: move error to log */
-            send_msg_to_client(socket_client, PASSWD_ERR_DECRYPT_FAILED);
-            shutdown(socket_client, SHUT_WR);
-            close(socket_client);
-            continue;
+    for (conn = s_conns; conn && (n < size); conn = conn->next)
+    {
+        if (conn->queued)
+        {
+            pfds[n].fd = conn->fd;
+            pfds[n].events = 0;
+            pfds[n].revents = 0;
+            owners[n++] = conn;
         }
+    }
 
-        memcpy(&client.msg, dec_msg, sizeof(passwd_srv_msg_t));
-        client.socket = socket_client;
+    /* one system call for the whole queue */
+    if (0 >= poll(pfds, n, 0))
+    {
+        return;
+    }
 
-        /* find username of connected client */
-        if ((connected_client = get_connected_username(socket_client)) == NULL)
+    for (i = 0; i < n; i++)
+    {
+        if (pfds[i].revents & (POLLHUP | POLLERR))
         {
-            VLOG_ERR("Failed to get connected client information");
-            send_msg_to_client(socket_client, PASSWD_ERR_INVALID_USER);
-            shutdown(socket_client, SHUT_WR);
-            close(socket_client);
-            continue;
+            PASSWD_SRV_PROBE2(cancel, owners[i]->req_id,
+                              PASSWD_SRV_STAGE_QUEUE);
+            passwd_srv_trace_request(&owners[i]->client, PASSWD_ERR_CANCELLED);
+            s_conn_stats.cancelled_queued++;
+            conn_destroy(owners[i]);
         }
+    }
+}
+
+/**
+ * Accept new connections, read requests which have arrived and serve the
+ * admitted one whose turn it is.  A connection has at most one request in
+ * the queue, its next frame is read once that one is served, so a client
+ * pipelining many requests does not hold up the others.
+ */
+void passwd_srv_conn_run()
+{
+    passwd_conn_t *conn, *next;
+    int err;
 
-        /* validate the connected client */
-        if (validate_user(client.msg.op_code, connected_client) !=
-                PASSWD_ERR_SUCCESS)
+    conn_accept();
+    passwd_srv_timer_run(time_msec(), conn_expire);
+
+    if (s_draining && (time_msec() >= s_drain_deadline))
+    {
+        while (s_conns)
         {
-            VLOG_ERR("Failed to validate a connected client");
-            send_msg_to_client(socket_client, PASSWD_ERR_INVALID_USER);
-            free(connected_client);
-            connected_client = NULL;
-            shutdown(socket_client, SHUT_WR);
-            close(socket_client);
-            continue;
+            VLOG_WARN("Connection closed with requests pending after handoff");
+            conn_destroy(s_conns);
         }
-        else
+        return;
+    }
+
+    for (conn = s_conns; conn; conn = next)
+    {
+        next = conn->next;
+
+        if (!conn->closing && !conn->queued)
         {
-            VLOG_DBG("%s is successfully validated", connected_client);
-            free(connected_client);
-            connected_client = NULL;
+            err = conn_read(conn);
+            if (PASSWD_ERR_SUCCESS == err)
+            {
+                conn_admit(conn);
+            }
+            else if (PASSWD_ERR_INVALID_MSG == err)
+            {
+                VLOG_ERR("Invalid frame from the client");
+                conn->closing = TRUE;
+                conn->tx_len = 0;
+            }
+            else if (PASSWD_ERR_PENDING != err)
+            {
+                /* client has closed the connection */
+                conn_destroy(conn);
+                continue;
+            }
+
+            if (s_draining && (0 == conn->drain_left) && (0 == conn->rx_len))
+            {
+                /* requests sent before the handoff are served */
+                conn->closing = TRUE;
+            }
         }
 
-        if ((err = process_client_request(&client)) != PASSWD_ERR_SUCCESS)
+        if ((PASSWD_ERR_SUCCESS != conn_flush(conn)) ||
+            (conn->closing && (0 == conn->tx_len)))
         {
-            VLOG_DBG("Returned error while processing client request(err=%d)", err);
+            conn_destroy(conn);
+            continue;
         }
+        conn_update_timer(conn);
+    }
+
+    conn_drop_hangups();
+    conn_serve_next();
+}
 
-        send_msg_to_client(socket_client, err);
-        shutdown(socket_client, SHUT_WR);
-        close(socket_client);
+/**
+ * Send an account change event to the subscribed connections.  The event
+ * is queued on a connection which does not read fast enough, such a
+ * subscriber is closed once the write timeout expires.
+ *
+ * @param event event just posted
+ */
+void passwd_srv_conn_publish(const passwd_srv_event_t *event)
+{
+    passwd_conn_t *conn;
 
-        /* clean up */
-        memset(&client, 0, sizeof(client));
-        socket_client = 0;
+    for (conn = s_conns; conn; conn = conn->next)
+    {
+        if (conn->subscribed && !conn->closing)
+        {
+            conn_send_events(conn, event, 1);
+            conn_update_timer(conn);
+        }
     }
 }
 
 /**
- * Close all UNIX socket used by the password server
- * - this function gets called when SIGTERM is sent
+ * Register sockets of the password server with the poll loop
  */
-void socket_term_signal_handler()
+void passwd_srv_conn_wait()
 {
-    if (socket_client > 0)
+    passwd_conn_t *conn;
+
+    if ((0 <= s_listen_fd) &&
+        (s_n_conns < passwd_srv_settings()->max_connections))
+    {
+        poll_fd_wait(s_listen_fd, POLLIN);
+    }
+
+    if (passwd_srv_conn_drained() || s_queue_stats.depth)
+    {
+        /* let the caller see that nothing is left, or serve the queue */
+        poll_immediate_wake();
+    }
+    else if (s_draining)
+    {
+        poll_timer_wait_until(s_drain_deadline);
+    }
+    passwd_srv_timer_wait();
+
+    for (conn = s_conns; conn; conn = conn->next)
     {
-        /* client has a opened socket connected to the password server */
-        shutdown(socket_client, SHUT_WR);
-        close(socket_client);
+        poll_fd_wait(conn->fd, ((conn->closing || conn->queued) ? 0 : POLLIN) |
+                               (conn->tx_len ? POLLOUT : 0));
     }
+}
 
-    if (fdSocket > 0)
+/**
+ * Close the listening UNIX socket of the password server, connected clients
+ * are closed on exit
+ * - this function gets called when SIGTERM is sent
+ */
+void socket_term_signal_handler()
+{
+    if (s_listen_fd > 0)
     {
         /* UNIX socket is used by the password server */
-        shutdown(fdSocket, SHUT_WR);
-        close(fdSocket);
+        shutdown(s_listen_fd, SHUT_WR);
+        close(s_listen_fd);
     }
 }
@@ -0,0 +1,196 @@
+/*
+ * (c) Copyright 2016 Hewlett Packard Enterprise Development LP
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+/************************************************************************//**
+ * @ingroup passwd-srvd
+ *
+ * @file
+ * Account change events of the Password Server.
+ *
+ *    Every change committed by the server gets the next sequence number and
+ *     is sent to the subscribed connections.  The last
+ *     PASSWD_SRV_EVENT_HISTORY events are kept so that a subscriber which
+ *     reconnects resumes after the last event it received.  Sequence
+ *     numbers of a server start at the wall clock in microseconds, a
+ *     subscriber resuming from an earlier server, or from events no longer
+ *     kept, gets PASSWD_SRV_EVENT_RESYNC instead.
+ ***************************************************************************/
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "openvswitch/vlog.h"
+#include "passwd_srv_pri.h"
+
+VLOG_DEFINE_THIS_MODULE(passwd_srv_event);
+
+#define PASSWD_SRV_EVENT_HISTORY 1024   /* events kept for resuming */
+
+static passwd_srv_event_t s_events[PASSWD_SRV_EVENT_HISTORY];
+static uint64_t s_base_seq = 0;     /* first sequence number of the server */
+static uint64_t s_next_seq = 0;
+static passwd_srv_event_stats_t s_event_stats;
+
+/**
+ * Pick the first sequence number, once
+ */
+static void
+event_init()
+{
+    struct timeval tv;
+
+    if (s_base_seq)
+    {
+        return;
+    }
+
+    gettimeofday(&tv, NULL);
+    s_base_seq = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+    s_next_seq = s_base_seq;
+}
+
+/**
+ * Oldest sequence number a subscriber can resume from
+ */
+static uint64_t
+event_oldest()
+{
+    return (s_next_seq - s_base_seq > PASSWD_SRV_EVENT_HISTORY) ?
+           s_next_seq - PASSWD_SRV_EVENT_HISTORY : s_base_seq;
+}
+
+/**
+ * Record a change committed by the server and send it to the subscribers
+ *
+ * @param type     PASSWD_SRV_EVENT_*
+ * @param username user whose account changed
+ */
+void passwd_srv_event_post(uint32_t type, const char *username)
+{
+    passwd_srv_event_t *event;
+
+    event_init();
+
+    event = &s_events[s_next_seq % PASSWD_SRV_EVENT_HISTORY];
+    memset(event, 0, sizeof(*event));
+    event->seq = s_next_seq++;
+    event->type = type;
+    snprintf(event->username, sizeof(event->username), "%s", username);
+    s_event_stats.posted++;
+
+    passwd_srv_conn_publish(event);
+}
+
+/**
+ * Record the change made by a request, if it made one.  Called by the
+ * server process once a request or a job is done, never by the process
+ * running a job.
+ *
+ * @param client request which is done
+ * @param status status of the request
+ */
+void passwd_srv_event_commit(const passwd_client_t *client, int status)
+{
+    const char *username = client->msg.username;
+
+    if (PASSWD_ERR_SUCCESS != status)
+    {
+        return;
+    }
+
+    switch (client->msg.op_code)
+    {
+        case PASSWD_MSG_CHG_PASSWORD:
+        case PASSWD_MSG_SET_HASH:
+            passwd_srv_event_post(PASSWD_SRV_EVENT_PASSWORD, username);
+            break;
+        case PASSWD_MSG_ADD_USER:
+            passwd_srv_event_post(PASSWD_SRV_EVENT_ADD_USER, username);
+            break;
+        case PASSWD_MSG_DEL_USER:
+            passwd_srv_event_post(PASSWD_SRV_EVENT_DEL_USER, username);
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * Get the events a subscriber has missed
+ *
+ * @param after  sequence number of the last event it received, 0 if none
+ * @param events filled with the events after it, in order
+ * @param max    size of events
+ * @return number of events filled in.  A single PASSWD_SRV_EVENT_RESYNC
+ *         whose seq is the last event of the server when the events
+ *         missed are not kept.
+ */
+size_t passwd_srv_event_since(uint64_t after, passwd_srv_event_t *events,
+                              size_t max)
+{
+    uint64_t seq;
+    size_t n = 0;
+
+    event_init();
+
+    if (0 == after)
+    {
+        /* new subscriber, events from now on */
+        return 0;
+    }
+
+    if ((after + 1 < event_oldest()) || (after >= s_next_seq))
+    {
+        VLOG_INFO("Subscriber resuming after event %llu has missed events",
+                  (unsigned long long)after);
+        memset(events, 0, sizeof(*events));
+        events->seq = s_next_seq - 1;
+        events->type = PASSWD_SRV_EVENT_RESYNC;
+        s_event_stats.resyncs++;
+        return 1;
+    }
+
+    for (seq = after + 1; (seq < s_next_seq) && (n < max); seq++)
+    {
+        events[n++] = s_events[seq % PASSWD_SRV_EVENT_HISTORY];
+    }
+    s_event_stats.resumed += n;
+    return n;
+}
+
+/**
+ * Count a connection which subscribes or goes away
+ *
+ * @param delta 1 for a new subscriber, -1 for one which is gone
+ */
+void passwd_srv_event_subscribers(int delta)
+{
+    s_event_stats.subscribers += delta;
+}
+
+/**
+ * Get the counters of events
+ *
+ * @param stats filled with the counters
+ */
+void passwd_srv_event_stats(passwd_srv_event_stats_t *stats)
+{
+    event_init();
+
+    *stats = s_event_stats;
+    stats->next_seq = s_next_seq;
+    stats->kept = s_next_seq - event_oldest();
+}
@@ -0,0 +1,461 @@
+/*
+ * (c) Copyright 2016 Hewlett Packard Enterprise Development LP
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+/************************************************************************//**
+ * @ingroup passwd-srvd
+ *
+ * @file
+ * Handoff of the listening socket to a new Password Server.
+ *
+ *    The running password server listens on a private handoff socket.  A
+ *     new instance started with --takeover connects to it and receives the
+ *     listening socket, and the key pair unless asked not to, so that it
+ *     serves at once without binding the socket or generating a key.  Once
+ *     the new instance confirms, the running one stops accepting, serves
+ *     the requests already sent and exits.
+ ***************************************************************************/
+#define _GNU_SOURCE             /* struct ucred */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <poll-loop.h>
+#include <timeval.h>
+#include "openvswitch/vlog.h"
+#include "passwd_srv_pri.h"
+
+VLOG_DEFINE_THIS_MODULE(passwd_srv_handoff);
+
+#define PASSWD_SRV_HANDOFF_MSEC 5000    /* new server must confirm by then */
+
+static int s_handoff_fd = -1;         /* handoff socket listened on */
+static int s_peer_fd = -1;            /* new server handing off to */
+static int s_peer_sent = FALSE;       /* listening socket sent to it */
+static passwd_srv_handoff_hdr_t s_peer_hdr;  /* its request or confirm */
+static size_t s_peer_got = 0;         /* bytes of s_peer_hdr received */
+static long long int s_peer_deadline = 0;
+
+/**
+ * Check that the other end of the handoff socket runs as the same user
+ *
+ * @param fd connected handoff socket
+ * @return TRUE if the peer may get the listening socket and key pair
+ */
+static int
+handoff_peer_trusted(int fd)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (0 != getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len))
+    {
+        return FALSE;
+    }
+
+    return ((cred.uid == geteuid()) || (0 == cred.uid)) ? TRUE : FALSE;
+}
+
+/**
+ * Bound blocking send and receive of a handoff socket
+ */
+static void
+handoff_set_timeout(int fd)
+{
+    struct timeval tv = { PASSWD_SRV_HANDOFF_MSEC / 1000, 0 };
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+/**
+ * Send the listening socket, and the key pair if asked, to a new server
+ *
+ * @param fd      connected handoff socket
+ * @param flags   PASSWD_SRV_HANDOFF_* asked by the new server
+ * @param keypair key pair of the running server
+ * @return PASSWD_ERR_SUCCESS if everything is sent
+ */
+static int
+handoff_send(int fd, uint32_t flags, RSA *keypair)
+{
+    union {
+        struct cmsghdr cm;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctrl;
+    passwd_srv_handoff_hdr_t hdr;
+    unsigned char *der = NULL;
+    struct cmsghdr *cmsg;
+    struct msghdr mh;
+    struct iovec iov;
+    int listen_fd = passwd_srv_conn_listen_fd();
+    int len = 0, err = PASSWD_ERR_SEND_FAILED;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = PASSWD_SRV_HANDOFF_MAGIC;
+
+    if (flags & PASSWD_SRV_HANDOFF_KEY)
+    {
+        if ((0 >= (len = i2d_RSAPrivateKey(keypair, &der))) ||
+            (PASSWD_SRV_HANDOFF_KEY_MAX < len))
+        {
+            VLOG_ERR("Failed to encode the key pair for handoff");
+            OPENSSL_free(der);
+            return PASSWD_ERR_FATAL;
+        }
+        hdr.flags = PASSWD_SRV_HANDOFF_KEY;
+        hdr.key_len = len;
+    }
+
+    memset(&ctrl, 0, sizeof(ctrl));
+    memset(&mh, 0, sizeof(mh));
+    iov.iov_base = &hdr;
+    iov.iov_len = sizeof(hdr);
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = ctrl.buf;
+    mh.msg_controllen = sizeof(ctrl.buf);
+
+    cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &listen_fd, sizeof(int));
+
+    if ((sizeof(hdr) == sendmsg(fd, &mh, MSG_NOSIGNAL)) &&
+        ((0 == len) || (len == send(fd, der, len, MSG_NOSIGNAL))))
+    {
+        err = PASSWD_ERR_SUCCESS;
+    }
+
+    if (der)
+    {
+        OPENSSL_cleanse(der, len);
+        OPENSSL_free(der);
+    }
+
+    return err;
+}
+
+/**
+ * Listen for a new password server taking over, the handoff socket is only
+ * accessible to the user of the password server
+ *
+ * @return PASSWD_ERR_SUCCESS if the handoff socket is listening
+ */
+int passwd_srv_handoff_listen()
+{
+    const char *path = passwd_srv_file(PASSWD_SRV_FILE_HANDOFF);
+
+    if (0 > (s_handoff_fd = open_listener(path, S_IRUSR | S_IWUSR)))
+    {
+        VLOG_ERR("Failed to listen on handoff socket %s", path);
+        return PASSWD_ERR_FATAL;
+    }
+
+    return PASSWD_ERR_SUCCESS;
+}
+
+/**
+ * Close the connection of the new server and forget its handoff state
+ */
+static void
+handoff_peer_close()
+{
+    close(s_peer_fd);
+    s_peer_fd = -1;
+    s_peer_sent = FALSE;
+    s_peer_got = 0;
+}
+
+/**
+ * Receive what has arrived of the next header of the new server, without
+ * blocking the poll loop
+ *
+ * @return PASSWD_ERR_SUCCESS once the whole header is in s_peer_hdr,
+ *         PASSWD_ERR_PENDING while more is to come
+ */
+static int
+handoff_recv_hdr()
+{
+    ssize_t len;
+
+    while (s_peer_got < sizeof(s_peer_hdr))
+    {
+        len = recv(s_peer_fd, (char *)&s_peer_hdr + s_peer_got,
+                   sizeof(s_peer_hdr) - s_peer_got, MSG_DONTWAIT);
+        if (0 < len)
+        {
+            s_peer_got += len;
+        }
+        else if ((0 > len) && ((EAGAIN == errno) || (EWOULDBLOCK == errno) ||
+                               (EINTR == errno)))
+        {
+            return PASSWD_ERR_PENDING;
+        }
+        else
+        {
+            return PASSWD_ERR_RECV_FAILED;
+        }
+    }
+
+    s_peer_got = 0;
+    return (PASSWD_SRV_HANDOFF_MAGIC == s_peer_hdr.magic) ?
+           PASSWD_ERR_SUCCESS : PASSWD_ERR_INVALID_MSG;
+}
+
+/**
+ * Hand off the listening socket to a new password server, and stop
+ * accepting connections once it confirms.  The request and confirmation
+ * of the new server are read as they arrive, so the poll loop serves on
+ * while it is slow to send them.
+ *
+ * @param keypair key pair of the running server
+ */
+void passwd_srv_handoff_run(RSA *keypair)
+{
+    int fd, err;
+
+    if (0 > s_peer_fd)
+    {
+        if ((0 > s_handoff_fd) ||
+            (0 > (fd = accept(s_handoff_fd, NULL, NULL))))
+        {
+            return;
+        }
+
+        if (!handoff_peer_trusted(fd))
+        {
+            VLOG_ERR("Handoff requested by another user, refused");
+            close(fd);
+            return;
+        }
+
+        /* sends are small enough for the socket buffer, bound them anyway */
+        handoff_set_timeout(fd);
+        s_peer_fd = fd;
+        s_peer_deadline = time_msec() + PASSWD_SRV_HANDOFF_MSEC;
+    }
+
+    err = handoff_recv_hdr();
+    if ((PASSWD_ERR_PENDING == err) && (time_msec() < s_peer_deadline))
+    {
+        return;
+    }
+
+    if (s_peer_sent)
+    {
+        if (PASSWD_ERR_SUCCESS == err)
+        {
+            VLOG_INFO("Listening socket is served by the new password server");
+            passwd_srv_conn_drain();
+
+            /* handoff socket file is the new server's now */
+            close(s_handoff_fd);
+            s_handoff_fd = -1;
+        }
+        else
+        {
+            VLOG_WARN("New password server did not take over, "
+                      "serving on");
+        }
+
+        handoff_peer_close();
+        return;
+    }
+
+    if (PASSWD_ERR_SUCCESS != err)
+    {
+        VLOG_ERR("Invalid handoff request");
+        handoff_peer_close();
+        return;
+    }
+
+    /* new server loads failed password attempts once it has the socket */
+    passwd_srv_backoff_flush();
+
+    if (PASSWD_ERR_SUCCESS != handoff_send(s_peer_fd, s_peer_hdr.flags,
+                                           keypair))
+    {
+        VLOG_ERR("Failed to hand off the listening socket");
+        handoff_peer_close();
+        return;
+    }
+
+    VLOG_INFO("Listening socket handed off%s, waiting for the new server",
+              (s_peer_hdr.flags & PASSWD_SRV_HANDOFF_KEY) ?
+              " with the key pair" : "");
+    s_peer_sent = TRUE;
+    s_peer_deadline = time_msec() + PASSWD_SRV_HANDOFF_MSEC;
+}
+
+/**
+ * Register the handoff sockets with the poll loop
+ */
+void passwd_srv_handoff_wait()
+{
+    if (0 <= s_peer_fd)
+    {
+        poll_fd_wait(s_peer_fd, POLLIN);
+        poll_timer_wait_until(s_peer_deadline);
+    }
+    else if (0 <= s_handoff_fd)
+    {
+        poll_fd_wait(s_handoff_fd, POLLIN);
+    }
+}
+
+/**
+ * Take over the listening socket of the running password server
+ *
+ * @param with_key  TRUE to get the key pair of the running server as well
+ * @param listen_fd filled in with the listening socket
+ * @param keypair   filled in with the key pair, left untouched if with_key
+ *                  is FALSE
+ * @return PASSWD_ERR_SUCCESS if the socket is received, the running server
+ *         keeps serving until passwd_srv_takeover_complete() is called,
+ *         PASSWD_ERR_SEND_FAILED if no password server is running,
+ *         PASSWD_ERR_RECV_FAILED if the running one did not hand off
+ */
+int passwd_srv_takeover(int with_key, int *listen_fd, RSA **keypair)
+{
+    union {
+        struct cmsghdr cm;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctrl;
+    unsigned char der[PASSWD_SRV_HANDOFF_KEY_MAX];
+    const unsigned char *p = der;
+    const char *path = passwd_srv_file(PASSWD_SRV_FILE_HANDOFF);
+    struct sockaddr_un unix_sockaddr;
+    passwd_srv_handoff_hdr_t hdr;
+    struct cmsghdr *cmsg;
+    struct msghdr mh;
+    struct iovec iov;
+    RSA *rsa = NULL;
+    int fd, recv_fd = -1;
+
+    memset(&unix_sockaddr, 0, sizeof(unix_sockaddr));
+    unix_sockaddr.sun_family = AF_UNIX;
+    if (sizeof(unix_sockaddr.sun_path) <= strlen(path))
+    {
+        return PASSWD_ERR_INVALID_PARAM;
+    }
+    strncpy(unix_sockaddr.sun_path, path, sizeof(unix_sockaddr.sun_path) - 1);
+
+    if (0 > (fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)))
+    {
+        return PASSWD_ERR_FATAL;
+    }
+
+    if (0 != connect(fd, (struct sockaddr *)&unix_sockaddr,
+                     sizeof(unix_sockaddr)))
+    {
+        VLOG_WARN("No password server to take over at %s", path);
+        close(fd);
+        return PASSWD_ERR_SEND_FAILED;
+    }
+    handoff_set_timeout(fd);
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = PASSWD_SRV_HANDOFF_MAGIC;
+    hdr.flags = with_key ? PASSWD_SRV_HANDOFF_KEY : 0;
+    if (sizeof(hdr) != send(fd, &hdr, sizeof(hdr), MSG_NOSIGNAL))
+    {
+        goto fail;
+    }
+
+    memset(&ctrl, 0, sizeof(ctrl));
+    memset(&mh, 0, sizeof(mh));
+    iov.iov_base = &hdr;
+    iov.iov_len = sizeof(hdr);
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = ctrl.buf;
+    mh.msg_controllen = sizeof(ctrl.buf);
+
+    if ((sizeof(hdr) != recvmsg(fd, &mh, MSG_WAITALL | MSG_CMSG_CLOEXEC)) ||
+        (PASSWD_SRV_HANDOFF_MAGIC != hdr.magic))
+    {
+        goto fail;
+    }
+
+    cmsg = CMSG_FIRSTHDR(&mh);
+    if ((NULL == cmsg) || (SOL_SOCKET != cmsg->cmsg_level) ||
+        (SCM_RIGHTS != cmsg->cmsg_type) ||
+        (CMSG_LEN(sizeof(int)) != cmsg->cmsg_len))
+    {
+        goto fail;
+    }
+    memcpy(&recv_fd, CMSG_DATA(cmsg), sizeof(int));
+
+    if (with_key)
+    {
+        if (!(hdr.flags & PASSWD_SRV_HANDOFF_KEY) ||
+            (PASSWD_SRV_HANDOFF_KEY_MAX < hdr.key_len) ||
+            (hdr.key_len != recv(fd, der, hdr.key_len, MSG_WAITALL)) ||
+            (NULL == (rsa = d2i_RSAPrivateKey(NULL, &p, hdr.key_len))))
+        {
+            OPENSSL_cleanse(der, sizeof(der));
+            goto fail;
+        }
+        OPENSSL_cleanse(der, sizeof(der));
+        *keypair = rsa;
+    }
+
+    VLOG_INFO("Took over the listening socket%s",
+              with_key ? " and the key pair" : "");
+    *listen_fd = recv_fd;
+    s_peer_fd = fd;
+    return PASSWD_ERR_SUCCESS;
+
+fail:
+    VLOG_ERR("Failed to take over the running password server");
+    if (0 <= recv_fd)
+    {
+        close(recv_fd);
+    }
+    close(fd);
+    return PASSWD_ERR_RECV_FAILED;
+}
+
+/**
+ * Tell the previous password server that the socket is served, it stops
+ * accepting and exits once its connections are done
+ */
+void passwd_srv_takeover_complete()
+{
+    passwd_srv_handoff_hdr_t hdr;
+
+    if (0 > s_peer_fd)
+    {
+        return;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = PASSWD_SRV_HANDOFF_MAGIC;
+    if (sizeof(hdr) != send(s_peer_fd, &hdr, sizeof(hdr), MSG_NOSIGNAL))
+    {
+        /* previous server keeps accepting too, both serve the socket */
+        VLOG_WARN("Failed to notify the previous password server");
+    }
+
+    close(s_peer_fd);
+    s_peer_fd = -1;
+}
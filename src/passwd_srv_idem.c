@@ -0,0 +1,295 @@
+/*
+ * (c) Copyright 2016 Hewlett Packard Enterprise Development LP
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+/************************************************************************//**
+ * @ingroup passwd-srvd
+ *
+ * @file
+ * Idempotency keys of the Password Server.
+ *
+ *    A client may send a key with a request so that a retry of the request
+ *     is not served twice.  Keys are kept per client uid in a fixed size
+ *     table with the status of their request, for IDEMPOTENCY_TTL_MS.  A
+ *     duplicate of a completed request gets the stored status back before
+ *     anything is decrypted, with its job id if it was accepted as a job; a
+ *     duplicate of a request still in the queue is told to retry later.
+ ***************************************************************************/
+#include <stdio.h>
+#include <string.h>
+
+#include <timeval.h>
+#include "openvswitch/vlog.h"
+#include "passwd_srv_pri.h"
+
+VLOG_DEFINE_THIS_MODULE(passwd_srv_idem);
+
+#define PASSWD_SRV_IDEM_SETS 1024   /* keys tracked = sets * ways */
+#define PASSWD_SRV_IDEM_WAYS 4
+
+typedef struct idem_entry
+{
+    enum passwd_srv_idem_e state; /* PASSWD_SRV_IDEM_NEW if the entry is free */
+    uid_t uid;                /* client the key belongs to */
+    uint8_t key[PASSWD_SRV_IDEM_KEY_SIZE];
+    int status;               /* result of the completed request */
+    uint32_t job_id;          /* job of a request accepted as one, 0 if
+                                 none */
+    long long int t_expire;   /* time_msec() the key is forgotten */
+} idem_entry_t;
+
+static idem_entry_t s_idem[PASSWD_SRV_IDEM_SETS][PASSWD_SRV_IDEM_WAYS];
+static passwd_srv_idem_stats_t s_idem_stats;
+
+/**
+ * Set of the table a key belongs to, FNV-1a hash of the uid and the key
+ */
+static idem_entry_t *
+idem_set(uid_t uid, const uint8_t *key)
+{
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < sizeof(uid); i++)
+    {
+        hash = (hash ^ ((uid >> (i * 8)) & 0xff)) * 16777619u;
+    }
+    for (i = 0; i < PASSWD_SRV_IDEM_KEY_SIZE; i++)
+    {
+        hash = (hash ^ key[i]) * 16777619u;
+    }
+
+    return s_idem[hash % PASSWD_SRV_IDEM_SETS];
+}
+
+/**
+ * Find the entry of a key, expired entries of its set are freed
+ *
+ * @param uid    uid of the connected process
+ * @param key    PASSWD_SRV_IDEM_KEY_SIZE bytes sent by the client
+ * @param victim set to the entry a new key would take, NULL if all entries
+ *               of the set are in use by requests in progress
+ * @return entry of the key, NULL if it has none
+ */
+static idem_entry_t *
+idem_find(uid_t uid, const uint8_t *key, idem_entry_t **victim)
+{
+    idem_entry_t *set = idem_set(uid, key);
+    idem_entry_t *entry, *found = NULL;
+    long long int now = time_msec();
+    int way;
+
+    *victim = NULL;
+    for (way = 0; way < PASSWD_SRV_IDEM_WAYS; way++)
+    {
+        entry = &set[way];
+        if ((PASSWD_SRV_IDEM_NEW != entry->state) && (now >= entry->t_expire))
+        {
+            memset(entry, 0, sizeof(*entry));
+        }
+
+        if (PASSWD_SRV_IDEM_NEW == entry->state)
+        {
+            *victim = entry;
+            continue;
+        }
+        if ((entry->uid == uid) &&
+            (0 == memcmp(entry->key, key, PASSWD_SRV_IDEM_KEY_SIZE)))
+        {
+            found = entry;
+            continue;
+        }
+
+        /* otherwise the completed request which expires first */
+        if ((PASSWD_SRV_IDEM_DONE == entry->state) &&
+            ((NULL == *victim) ||
+             ((PASSWD_SRV_IDEM_NEW != (*victim)->state) &&
+              (entry->t_expire < (*victim)->t_expire))))
+        {
+            *victim = entry;
+        }
+    }
+
+    return found;
+}
+
+/**
+ * Look up the key of a request being admitted
+ *
+ * @param uid    uid of the connected process
+ * @param key    PASSWD_SRV_IDEM_KEY_SIZE bytes sent by the client
+ * @param status set to the stored status of a completed request
+ * @param job_id set to the job id of a request accepted as a job, 0 if none
+ * @return PASSWD_SRV_IDEM_NEW if the request is to be served,
+ *         PASSWD_SRV_IDEM_PENDING if a request with the key is in the queue,
+ *         PASSWD_SRV_IDEM_DONE if it is completed
+ */
+enum passwd_srv_idem_e
+passwd_srv_idem_lookup(uid_t uid, const uint8_t *key, int *status,
+                       uint32_t *job_id)
+{
+    idem_entry_t *entry, *victim;
+
+    if (NULL == (entry = idem_find(uid, key, &victim)))
+    {
+        return PASSWD_SRV_IDEM_NEW;
+    }
+
+    if (PASSWD_SRV_IDEM_DONE == entry->state)
+    {
+        *status = entry->status;
+        *job_id = entry->job_id;
+        s_idem_stats.replayed++;
+    }
+    else
+    {
+        s_idem_stats.in_progress++;
+    }
+    return entry->state;
+}
+
+/**
+ * Record the key of a request admitted into the queue.  Nothing is recorded
+ * when every entry of its set is used by a request in progress.
+ *
+ * @param uid uid of the connected process
+ * @param key PASSWD_SRV_IDEM_KEY_SIZE bytes sent by the client
+ */
+void passwd_srv_idem_begin(uid_t uid, const uint8_t *key)
+{
+    idem_entry_t *entry, *victim;
+
+    if (NULL == (entry = idem_find(uid, key, &victim)))
+    {
+        if (NULL == victim)
+        {
+            VLOG_DBG("No room for the idempotency key of uid %d", (int)uid);
+            s_idem_stats.untracked++;
+            return;
+        }
+        if (PASSWD_SRV_IDEM_NEW != victim->state)
+        {
+            s_idem_stats.evicted++;
+        }
+        entry = victim;
+    }
+
+    entry->state = PASSWD_SRV_IDEM_PENDING;
+    entry->uid = uid;
+    memcpy(entry->key, key, PASSWD_SRV_IDEM_KEY_SIZE);
+    entry->status = PASSWD_ERR_PENDING;
+    entry->job_id = 0;
+    entry->t_expire = time_msec() + passwd_srv_settings()->idempotency_ttl;
+}
+
+/**
+ * Whether a status is the outcome of a request, which a retry would get
+ * again, rather than a failure to serve it.  A request accepted as a job
+ * has its job id as outcome.
+ */
+static int
+idem_is_outcome(int status, uint32_t job_id)
+{
+    switch (status)
+    {
+        case PASSWD_ERR_PENDING:
+            return (0 != job_id);
+        case PASSWD_ERR_SUCCESS:
+        case PASSWD_ERR_USER_NOT_FOUND:
+        case PASSWD_ERR_PASSWORD_NOT_MATCH:
+        case PASSWD_ERR_INVALID_OPCODE:
+        case PASSWD_ERR_INVALID_USER:
+        case PASSWD_ERR_INVALID_PARAM:
+        case PASSWD_ERR_USER_EXIST:
+            return TRUE;
+        default:
+            return FALSE;
+    }
+}
+
+/**
+ * Record the status of a request with a key.  Only outcomes are stored, the
+ * key of a request which failed to be served is forgotten so that a retry
+ * is served.
+ *
+ * @param uid    uid of the connected process
+ * @param key    PASSWD_SRV_IDEM_KEY_SIZE bytes sent by the client
+ * @param status status of the request
+ * @param job_id job id of a request accepted as a job, 0 otherwise
+ */
+void passwd_srv_idem_end(uid_t uid, const uint8_t *key, int status,
+                         uint32_t job_id)
+{
+    idem_entry_t *entry, *victim;
+
+    if (NULL == (entry = idem_find(uid, key, &victim)))
+    {
+        return;
+    }
+
+    if (!idem_is_outcome(status, job_id))
+    {
+        memset(entry, 0, sizeof(*entry));
+        return;
+    }
+
+    entry->state = PASSWD_SRV_IDEM_DONE;
+    entry->status = status;
+    entry->job_id = job_id;
+    entry->t_expire = time_msec() + passwd_srv_settings()->idempotency_ttl;
+    s_idem_stats.stored++;
+}
+
+/**
+ * Forget the key of a request whose reply is not to be replayed, a query
+ * with a payload
+ *
+ * @param uid uid of the connected process
+ * @param key PASSWD_SRV_IDEM_KEY_SIZE bytes sent by the client
+ */
+void passwd_srv_idem_forget(uid_t uid, const uint8_t *key)
+{
+    idem_entry_t *entry, *victim;
+
+    if (NULL != (entry = idem_find(uid, key, &victim)))
+    {
+        memset(entry, 0, sizeof(*entry));
+    }
+}
+
+/**
+ * Get the counters of idempotency keys
+ *
+ * @param stats filled with the counters
+ */
+void passwd_srv_idem_stats(passwd_srv_idem_stats_t *stats)
+{
+    long long int now = time_msec();
+    int set, way;
+
+    *stats = s_idem_stats;
+    stats->keys = 0;
+    for (set = 0; set < PASSWD_SRV_IDEM_SETS; set++)
+    {
+        for (way = 0; way < PASSWD_SRV_IDEM_WAYS; way++)
+        {
+            if ((PASSWD_SRV_IDEM_NEW != s_idem[set][way].state) &&
+                (now < s_idem[set][way].t_expire))
+            {
+                stats->keys++;
+            }
+        }
+    }
+}
@@ -0,0 +1,598 @@
+/*
+ * (c) Copyright 2016 Hewlett Packard Enterprise Development LP
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+/************************************************************************//**
+ * @ingroup passwd-srvd
+ *
+ * @file
+ * Background jobs of the Password Server.
+ *
+ *    ADD_USER and DEL_USER requests sent with PASSWD_SRV_FLAG_JOB are
+ *     answered with a job id as soon as the client is validated.  Jobs are
+ *     run one at a time, in the order they were submitted.  useradd or
+ *     userdel is spawned and the server keeps serving other requests until
+ *     it exits, on SIGCHLD, then writes the password of an added user
+ *     itself.  A program still running after PASSWD_SRV_JOB_TIMEOUT_MSEC is
+ *     killed and the job fails.  The status of a job is kept for
+ *     PASSWD_SRV_JOB_KEEP_MSEC after it is done, for the uid which
+ *     submitted it to ask with PASSWD_MSG_JOB_STATUS.
+ ***************************************************************************/
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <poll-loop.h>
+#include <timeval.h>
+#include "openvswitch/vlog.h"
+#include "passwd_srv_pri.h"
+
+VLOG_DEFINE_THIS_MODULE(passwd_srv_job);
+
+#define PASSWD_SRV_JOB_MAX       64       /* jobs queued, running or kept */
+#define PASSWD_SRV_JOB_KEEP_MSEC 300000   /* status kept once done */
+#define PASSWD_SRV_JOB_TIMEOUT_MSEC 30000 /* useradd/userdel is killed after */
+
+enum passwd_srv_job_state_e {
+    PASSWD_SRV_JOB_FREE = 0,
+    PASSWD_SRV_JOB_QUEUED,
+    PASSWD_SRV_JOB_RUNNING,
+    PASSWD_SRV_JOB_DONE
+};
+
+typedef struct passwd_srv_job_entry
+{
+    uint32_t id;
+    uid_t    uid;             /* uid which submitted the job */
+    enum passwd_srv_job_state_e state;
+    int      status;          /* status of the request once done */
+    passwd_client_t client;   /* request, its passwords are cleared once
+                                 the job is done */
+    uint64_t t_start;         /* passwd_srv_clock() the job started at */
+    long long int t_done;     /* time_msec() the job was done at */
+} passwd_srv_job_entry_t;
+
+static passwd_srv_job_entry_t s_jobs[PASSWD_SRV_JOB_MAX];
+static passwd_srv_job_entry_t *s_running = NULL;
+static pid_t s_job_pid = 0;              /* useradd/userdel of the job */
+static long long int s_job_deadline = 0; /* time_msec() it is killed at */
+static uint32_t s_next_id = 0;
+static int s_chld_pipe[2] = { -1, -1 };
+static passwd_srv_job_stats_t s_job_stats;
+
+/**
+ * SIGCHLD handler, the job is collected by the main loop
+ *
+ * @param sig the signal number to be handled
+ */
+static void
+job_chld_signal_handler(int sig)
+{
+    char byte = 0;
+    int saved_errno = errno;
+
+    if (0 > write(s_chld_pipe[1], &byte, sizeof(byte)))
+    {
+        /* pipe is full, a wake-up is pending already */
+    }
+    errno = saved_errno;
+}
+
+/**
+ * Get ready to run jobs, called once at start-up
+ *
+ * @return PASSWD_ERR_SUCCESS, PASSWD_ERR_FATAL if SIGCHLD cannot be caught
+ */
+int passwd_srv_job_init()
+{
+    if ((0 != pipe(s_chld_pipe)) ||
+        (0 != fcntl(s_chld_pipe[0], F_SETFL, O_NONBLOCK)) ||
+        (0 != fcntl(s_chld_pipe[1], F_SETFL, O_NONBLOCK)) ||
+        (0 != fcntl(s_chld_pipe[0], F_SETFD, FD_CLOEXEC)) ||
+        (0 != fcntl(s_chld_pipe[1], F_SETFD, FD_CLOEXEC)))
+    {
+        VLOG_ERR("Failed to create job pipe");
+        return PASSWD_ERR_FATAL;
+    }
+
+    signal(SIGCHLD, job_chld_signal_handler);
+    return PASSWD_ERR_SUCCESS;
+}
+
+/**
+ * Find a job of a uid
+ *
+ * @param id  job id
+ * @param uid uid which submitted it
+ * @return job, NULL if unknown or its status has expired
+ */
+static passwd_srv_job_entry_t *
+job_find(uint32_t id, uid_t uid)
+{
+    long long int now = time_msec();
+    int i;
+
+    for (i = 0; i < PASSWD_SRV_JOB_MAX; i++)
+    {
+        if ((s_jobs[i].id != id) || (PASSWD_SRV_JOB_FREE == s_jobs[i].state))
+        {
+            continue;
+        }
+        if ((PASSWD_SRV_JOB_DONE == s_jobs[i].state) &&
+            (now - s_jobs[i].t_done >= PASSWD_SRV_JOB_KEEP_MSEC))
+        {
+            return NULL;
+        }
+        return (s_jobs[i].uid == uid) ? &s_jobs[i] : NULL;
+    }
+
+    return NULL;
+}
+
+/**
+ * Take a slot for a new job: a free one, or the one done the longest ago
+ * once its status is no longer kept.  The status of a job done within
+ * PASSWD_SRV_JOB_KEEP_MSEC is never dropped for a new job.
+ *
+ * @param wait_ms set, when no slot is taken, to the time until one is
+ *                expected to be
+ * @return slot, NULL if every job is queued, running or kept
+ */
+static passwd_srv_job_entry_t *
+job_alloc(uint64_t *wait_ms)
+{
+    passwd_srv_job_entry_t *victim = NULL;
+    long long int now = time_msec();
+    int i;
+
+    for (i = 0; i < PASSWD_SRV_JOB_MAX; i++)
+    {
+        if (PASSWD_SRV_JOB_FREE == s_jobs[i].state)
+        {
+            return &s_jobs[i];
+        }
+        if ((PASSWD_SRV_JOB_DONE == s_jobs[i].state) &&
+            ((NULL == victim) || (s_jobs[i].t_done < victim->t_done)))
+        {
+            victim = &s_jobs[i];
+        }
+    }
+
+    if ((NULL != victim) && (now - victim->t_done >= PASSWD_SRV_JOB_KEEP_MSEC))
+    {
+        return victim;
+    }
+
+    /* the oldest status expires first, else the running job is kept once
+     * done */
+    *wait_ms = victim ? PASSWD_SRV_JOB_KEEP_MSEC - (now - victim->t_done) :
+               s_job_stats.run_ns / 1000000 + PASSWD_SRV_JOB_KEEP_MSEC;
+    return NULL;
+}
+
+/**
+ * Status of a job whose useradd or userdel failed
+ */
+static int
+job_failed(const passwd_srv_job_entry_t *job)
+{
+    return (PASSWD_MSG_ADD_USER == job->client.msg.op_code) ?
+           PASSWD_ERR_USERADD_FAILED : PASSWD_ERR_USERDEL_FAILED;
+}
+
+/**
+ * Record the status of the job which was running, and bring the server up
+ * to date with what useradd or userdel changed
+ *
+ * @param status status of the request
+ */
+static void
+job_done(int status)
+{
+    passwd_srv_job_entry_t *job = s_running;
+    uint64_t run_ns = passwd_srv_clock() - job->t_start;
+
+    s_running = NULL;
+    s_job_pid = 0;
+    s_job_deadline = 0;
+
+    job->state = PASSWD_SRV_JOB_DONE;
+    job->status = status;
+    job->t_done = time_msec();
+
+    /* files were changed by another process */
+    passwd_srv_userdb_invalidate();
+    passwd_srv_vcache_invalidate(job->client.msg.username);
+    passwd_srv_event_commit(&job->client, status);
+    memset(job->client.msg.oldpasswd, 0, sizeof(job->client.msg.oldpasswd));
+    memset(job->client.msg.newpasswd, 0, sizeof(job->client.msg.newpasswd));
+    job->client.passwd = NULL;
+
+    VLOG_INFO("Job %u for %s done [status=%d]", job->id,
+              job->client.msg.username, status);
+    s_job_stats.completed++;
+    if (PASSWD_ERR_SUCCESS != status)
+    {
+        s_job_stats.failed++;
+    }
+    s_job_stats.run_ns = s_job_stats.run_ns ?
+                         (s_job_stats.run_ns * 7 + run_ns) / 8 : run_ns;
+}
+
+/**
+ * Oldest queued job
+ *
+ * @return job, NULL if none is queued
+ */
+static passwd_srv_job_entry_t *
+job_next()
+{
+    passwd_srv_job_entry_t *job = NULL;
+    int i;
+
+    for (i = 0; i < PASSWD_SRV_JOB_MAX; i++)
+    {
+        /* ids wrap, the lowest is the one before the others */
+        if ((PASSWD_SRV_JOB_QUEUED == s_jobs[i].state) &&
+            ((NULL == job) || (0x80000000 <= s_jobs[i].id - job->id)))
+        {
+            job = &s_jobs[i];
+        }
+    }
+
+    return job;
+}
+
+/**
+ * Check a job as the request would be, and spawn its useradd or userdel
+ *
+ * @param job job to start
+ * @return PASSWD_ERR_PENDING if the program runs, the status of the job
+ *         otherwise
+ */
+static int
+job_begin(passwd_srv_job_entry_t *job)
+{
+    passwd_client_t *client = &job->client;
+    int add = (PASSWD_MSG_ADD_USER == client->msg.op_code);
+    uint64_t t_stage, ns;
+
+    t_stage = passwd_srv_stage_now();
+    client->passwd = find_password_info(client->msg.username);
+    ns = passwd_srv_stage_end(client, PASSWD_SRV_STAGE_FIND, t_stage);
+    PASSWD_SRV_PROBE4(find__password, client->req_id, client->msg.op_code,
+                      client->passwd != NULL, ns);
+    if (add && (NULL != client->passwd))
+    {
+        VLOG_ERR("User %s already exists", client->msg.username);
+        return PASSWD_ERR_USER_EXIST;
+    }
+    if (!add && (NULL == client->passwd))
+    {
+        VLOG_INFO("User %s does not exist to delete", client->msg.username);
+        return PASSWD_ERR_USER_NOT_FOUND;
+    }
+
+    passwd_srv_userdb_invalidate();
+    if (0 > (s_job_pid = spawn_user_command(client->msg.username, add)))
+    {
+        s_job_pid = 0;
+        return job_failed(job);
+    }
+    s_job_deadline = time_msec() + PASSWD_SRV_JOB_TIMEOUT_MSEC;
+
+    return PASSWD_ERR_PENDING;
+}
+
+/**
+ * Complete a job whose useradd or userdel has exited: the password of an
+ * added user is written by the server, as ADD_USER does
+ *
+ * @param job job which was running
+ * @return status of the job
+ */
+static int
+job_finish(passwd_srv_job_entry_t *job)
+{
+    passwd_client_t *client = &job->client;
+    int err;
+
+    passwd_srv_userdb_invalidate();
+    passwd_srv_vcache_invalidate(client->msg.username);
+    client->passwd = find_password_info(client->msg.username);
+
+    if (PASSWD_MSG_DEL_USER == client->msg.op_code)
+    {
+        if (NULL != client->passwd)
+        {
+            VLOG_INFO("Failed to remove user %s", client->msg.username);
+            return PASSWD_ERR_USERDEL_FAILED;
+        }
+        return PASSWD_ERR_SUCCESS;
+    }
+
+    if (NULL == client->passwd)
+    {
+        VLOG_ERR("Failed to create a user");
+        return PASSWD_ERR_USERADD_FAILED;
+    }
+
+    if (PASSWD_ERR_SUCCESS != (err = create_and_store_password(client)))
+    {
+        VLOG_INFO("User was not added successfully [error=%d]", err);
+        /* delete user since it failed to add password */
+        create_user(client->msg.username, FALSE);
+    }
+
+    return err;
+}
+
+/**
+ * Start the oldest queued job unless one is running
+ */
+static void
+job_start_next()
+{
+    passwd_srv_job_entry_t *job;
+    int status;
+
+    while ((NULL == s_running) && (NULL != (job = job_next())))
+    {
+        s_running = job;
+        job->state = PASSWD_SRV_JOB_RUNNING;
+        job->t_start = passwd_srv_clock();
+
+        /* a job which needs no program is done at once */
+        if (PASSWD_ERR_PENDING != (status = job_begin(job)))
+        {
+            job_done(status);
+        }
+    }
+}
+
+/**
+ * Answer a request accepted as a job with its id, also used to replay it
+ * to a retry with the same idempotency key
+ *
+ * @param client request, client->reply is set to a passwd_srv_job_t
+ * @param id     job id
+ * @return PASSWD_ERR_PENDING, PASSWD_ERR_INSUFFICIENT_MEM if no reply can be
+ *         made
+ */
+int passwd_srv_job_reply(passwd_client_t *client, uint32_t id)
+{
+    passwd_srv_job_t *reply;
+
+    if (NULL == (reply = calloc(1, sizeof(*reply))))
+    {
+        VLOG_ERR("Memory allocation failure");
+        return PASSWD_ERR_INSUFFICIENT_MEM;
+    }
+
+    reply->id = id;
+    reply->status = PASSWD_ERR_PENDING;
+    client->reply = reply;
+    client->reply_len = sizeof(*reply);
+
+    return PASSWD_ERR_PENDING;
+}
+
+/**
+ * Queue a validated request as a job and answer it with the job id
+ *
+ * @param client ADD_USER or DEL_USER request, client->reply is set to a
+ *               passwd_srv_job_t when the job is accepted
+ * @return PASSWD_ERR_PENDING if the job is accepted, PASSWD_ERR_BUSY if
+ *         PASSWD_SRV_JOB_MAX jobs are queued, running or kept
+ */
+int passwd_srv_job_submit(passwd_client_t *client)
+{
+    passwd_srv_job_entry_t *job;
+    uint64_t wait_ms;
+    int err;
+
+    if (NULL == (job = job_alloc(&wait_ms)))
+    {
+        client->retry_after_ms = wait_ms ? wait_ms : 1;
+        s_job_stats.rejected++;
+        return PASSWD_ERR_BUSY;
+    }
+
+    /* 0 is never a job id */
+    if (0 == ++s_next_id)
+    {
+        s_next_id = 1;
+    }
+    if (PASSWD_ERR_PENDING != (err = passwd_srv_job_reply(client, s_next_id)))
+    {
+        return err;
+    }
+
+    memset(job, 0, sizeof(*job));
+    job->id = s_next_id;
+    job->uid = client->uid;
+    job->state = PASSWD_SRV_JOB_QUEUED;
+    job->status = PASSWD_ERR_PENDING;
+    job->client.req_id = client->req_id;
+    job->client.msg = client->msg;
+    job->client.socket = -1;          /* never cancelled */
+    job->client.t_arrival = client->t_arrival;
+    job->client.uid = client->uid;
+    s_job_stats.submitted++;
+
+    VLOG_DBG("Job %u for %s submitted", job->id, client->msg.username);
+
+    job_start_next();
+    return PASSWD_ERR_PENDING;
+}
+
+/**
+ * Answer PASSWD_MSG_JOB_STATUS, the job id is taken from the message when
+ * it is decrypted
+ *
+ * @param client request, client->reply is set to a passwd_srv_job_t
+ * @return PASSWD_ERR_SUCCESS, PASSWD_ERR_JOB_NOT_FOUND if the job is not
+ *         known to the uid of the client
+ */
+int passwd_srv_job_query(passwd_client_t *client)
+{
+    passwd_srv_job_entry_t *job;
+    passwd_srv_job_t *reply;
+
+    if (0 == client->job_id)
+    {
+        return PASSWD_ERR_INVALID_PARAM;
+    }
+
+    if (NULL == (job = job_find(client->job_id, client->uid)))
+    {
+        return PASSWD_ERR_JOB_NOT_FOUND;
+    }
+
+    if (NULL == (reply = calloc(1, sizeof(*reply))))
+    {
+        VLOG_ERR("Memory allocation failure");
+        return PASSWD_ERR_INSUFFICIENT_MEM;
+    }
+    reply->id = job->id;
+    reply->status = job->status;
+    client->reply = reply;
+    client->reply_len = sizeof(*reply);
+
+    return PASSWD_ERR_SUCCESS;
+}
+
+/**
+ * Check whether jobs are left to run
+ *
+ * @return TRUE if a job is queued or running
+ */
+int passwd_srv_job_pending()
+{
+    int i;
+
+    for (i = 0; i < PASSWD_SRV_JOB_MAX; i++)
+    {
+        if ((PASSWD_SRV_JOB_QUEUED == s_jobs[i].state) ||
+            (PASSWD_SRV_JOB_RUNNING == s_jobs[i].state))
+        {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/**
+ * Collect the job whose program has exited, or kill it once past its
+ * deadline, and start the next one
+ */
+void passwd_srv_job_run()
+{
+    char buf[16];
+    int wstatus, status;
+    pid_t pid;
+
+    while (0 < read(s_chld_pipe[0], buf, sizeof(buf)))
+    {
+        /* drained, the program is looked for below */
+    }
+
+    if (0 == s_job_pid)
+    {
+        return;
+    }
+
+    pid = waitpid(s_job_pid, &wstatus, WNOHANG);
+    if ((0 == pid) && (time_msec() < s_job_deadline))
+    {
+        /* still running */
+        return;
+    }
+
+    if (0 == pid)
+    {
+        /* a hung useradd/userdel would hold every later job */
+        VLOG_ERR("Job %u for %s timed out, killing its program",
+                 s_running->id, s_running->client.msg.username);
+        kill(-s_job_pid, SIGKILL);
+        while ((0 > waitpid(s_job_pid, &wstatus, 0)) && (EINTR == errno))
+        {
+            /* SIGKILL cannot be caught, it exits */
+        }
+        status = job_failed(s_running);
+    }
+    else if (pid == s_job_pid)
+    {
+        /* exit code is not trusted, the files tell what was done */
+        status = job_finish(s_running);
+    }
+    else
+    {
+        VLOG_ERR("Job %u did not complete", s_running->id);
+        status = job_failed(s_running);
+    }
+
+    job_done(status);
+    job_start_next();
+}
+
+/**
+ * Register the job which is running with the poll loop
+ */
+void passwd_srv_job_wait()
+{
+    if (s_job_pid)
+    {
+        poll_fd_wait(s_chld_pipe[0], POLLIN);
+        poll_timer_wait_until(s_job_deadline);
+    }
+}
+
+/**
+ * Get the counters of jobs
+ *
+ * @param stats filled with the counters
+ */
+void passwd_srv_job_stats(passwd_srv_job_stats_t *stats)
+{
+    long long int now = time_msec();
+    int i;
+
+    *stats = s_job_stats;
+    stats->queued = 0;
+    stats->kept = 0;
+    stats->capacity = PASSWD_SRV_JOB_MAX;
+    stats->running = s_running ? s_running->id : 0;
+    for (i = 0; i < PASSWD_SRV_JOB_MAX; i++)
+    {
+        if (PASSWD_SRV_JOB_QUEUED == s_jobs[i].state)
+        {
+            stats->queued++;
+        }
+        else if ((PASSWD_SRV_JOB_DONE == s_jobs[i].state) &&
+                 (now - s_jobs[i].t_done < PASSWD_SRV_JOB_KEEP_MSEC))
+        {
+            stats->kept++;
+        }
+    }
+}
@@ -0,0 +1,338 @@
+/*
+ * (c) Copyright 2016 Hewlett Packard Enterprise Development LP
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+/************************************************************************//**
+ * @ingroup passwd-srvd
+ *
+ * @file
+ * Request rate limits of the Password Server.
+ *
+ *    Token buckets are kept for all clients together and per uid of the
+ *     connected process.  The uid is known from the socket, so requests
+ *     over the global or per-uid rate are rejected before the RSA decrypt.
+ *     The opcode is only known once decrypted, the per-uid limit of its
+ *     class is checked before a password is hashed or useradd is run.
+ *     A bucket holds one second worth of requests at its rate.
+ ***************************************************************************/
+#define _GNU_SOURCE             /* struct ucred */
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <timeval.h>
+#include "openvswitch/vlog.h"
+#include "passwd_srv_pri.h"
+
+VLOG_DEFINE_THIS_MODULE(passwd_srv_limit);
+
+#define PASSWD_SRV_LIMIT_HASH_SIZE 64   /* uid buckets of the table */
+#define PASSWD_SRV_LIMIT_TOKEN     1000 /* bucket levels are in 1/1000th */
+
+typedef struct limit_bucket
+{
+    long long int t_refill;   /* time_msec() of the last refill */
+    long long int level;      /* tokens left, in 1/1000th of a token */
+} limit_bucket_t;
+
+/*
+ * rate limit state of one client uid
+ */
+typedef struct limit_uid
+{
+    uid_t uid;
+    limit_bucket_t any;                       /* requests of any opcode */
+    limit_bucket_t opclass[PASSWD_SRV_LIMIT_CLASS_MAX];
+    uint64_t throttled;
+    struct limit_uid *next;
+} limit_uid_t;
+
+static limit_uid_t *s_uids[PASSWD_SRV_LIMIT_HASH_SIZE];
+static limit_bucket_t s_global;
+static passwd_srv_limit_stats_t s_limit_stats;
+
+/**
+ * Take a token from a bucket if one is left
+ *
+ * @param bucket   bucket to take from
+ * @param rate     tokens per second, 0 if unlimited
+ * @param now      time_msec()
+ * @param retry_ms set to the time until a token is available if none is
+ * @return TRUE if a token is taken
+ */
+static int
+limit_take(limit_bucket_t *bucket, int rate, long long int now,
+           uint32_t *retry_ms)
+{
+    long long int full = (long long int)rate * PASSWD_SRV_LIMIT_TOKEN;
+
+    if (0 == rate)
+    {
+        return TRUE;
+    }
+
+    if (0 == bucket->t_refill)
+    {
+        /* new bucket starts full */
+        bucket->level = full;
+    }
+    else
+    {
+        /* rate tokens per second is rate thousandths per msec */
+        bucket->level += (now - bucket->t_refill) * rate;
+    }
+    if (bucket->level > full)
+    {
+        bucket->level = full;
+    }
+    bucket->t_refill = now;
+
+    if (bucket->level < PASSWD_SRV_LIMIT_TOKEN)
+    {
+        *retry_ms = (uint32_t)((PASSWD_SRV_LIMIT_TOKEN - bucket->level +
+                                rate - 1) / rate);
+        return FALSE;
+    }
+
+    bucket->level -= PASSWD_SRV_LIMIT_TOKEN;
+    return TRUE;
+}
+
+/**
+ * Give back a token taken by limit_take()
+ */
+static void
+limit_refund(limit_bucket_t *bucket, int rate)
+{
+    if (rate)
+    {
+        bucket->level += PASSWD_SRV_LIMIT_TOKEN;
+    }
+}
+
+/**
+ * Find the rate limit state of a uid, created on first use
+ *
+ * @param uid uid of the connected process
+ * @return state of the uid, NULL on allocation failure
+ */
+static limit_uid_t *
+limit_find_uid(uid_t uid)
+{
+    limit_uid_t **head = &s_uids[uid % PASSWD_SRV_LIMIT_HASH_SIZE];
+    limit_uid_t *entry;
+
+    for (entry = *head; entry; entry = entry->next)
+    {
+        if (entry->uid == uid)
+        {
+            return entry;
+        }
+    }
+
+    if (NULL == (entry = calloc(1, sizeof(*entry))))
+    {
+        VLOG_ERR("Memory allocation failure");
+        return NULL;
+    }
+    entry->uid = uid;
+    entry->next = *head;
+    *head = entry;
+
+    return entry;
+}
+
+/**
+ * Get the uid of the process connected to a client socket
+ *
+ * @param fd client socket
+ * @return uid of the peer, (uid_t)-1 if unknown
+ */
+uid_t passwd_srv_peer_uid(int fd)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (0 != getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len))
+    {
+        VLOG_ERR("Failed to get credentials of the client");
+        return (uid_t)-1;
+    }
+
+    return cred.uid;
+}
+
+/**
+ * Rate limit class of an opcode
+ *
+ * @param opcode opcode of a decrypted request
+ * @return PASSWD_SRV_LIMIT_CLASS_*, PASSWD_SRV_LIMIT_CLASS_MAX if the opcode
+ *         is not limited
+ */
+static enum passwd_srv_limit_class_e
+limit_class(int opcode)
+{
+    switch (opcode)
+    {
+        case PASSWD_MSG_CHG_PASSWORD:
+            return PASSWD_SRV_LIMIT_CLASS_PASSWORD;
+        case PASSWD_MSG_ADD_USER:
+        case PASSWD_MSG_DEL_USER:
+        case PASSWD_MSG_SET_HASH:
+            return PASSWD_SRV_LIMIT_CLASS_ACCOUNT;
+        case PASSWD_MSG_VERIFY:
+            return PASSWD_SRV_LIMIT_CLASS_VERIFY;
+        case PASSWD_MSG_LIST_USERS:
+        case PASSWD_MSG_GET_USER:
+        case PASSWD_MSG_GET_AGING:
+        case PASSWD_MSG_SUBSCRIBE:
+        case PASSWD_MSG_JOB_STATUS:
+            return PASSWD_SRV_LIMIT_CLASS_QUERY;
+        default:
+            return PASSWD_SRV_LIMIT_CLASS_MAX;
+    }
+}
+
+/**
+ * Check the global and per-uid rates before a request is decrypted
+ *
+ * @param uid      uid of the connected process
+ * @param retry_ms set to the time until the request would be admitted
+ * @return PASSWD_ERR_SUCCESS if the request may be served,
+ *         PASSWD_ERR_RATE_LIMITED otherwise
+ */
+int passwd_srv_limit_request(uid_t uid, uint32_t *retry_ms)
+{
+    const passwd_srv_settings_t *settings = passwd_srv_settings();
+    long long int now = time_msec();
+    limit_uid_t *entry;
+
+    if ((0 == settings->rate_limit_uid) && (0 == settings->rate_limit_global))
+    {
+        return PASSWD_ERR_SUCCESS;
+    }
+
+    /* without memory for the uid, only the global rate applies */
+    entry = limit_find_uid(uid);
+
+    if (entry && !limit_take(&entry->any, settings->rate_limit_uid, now,
+                             retry_ms))
+    {
+        entry->throttled++;
+        s_limit_stats.throttled_uid++;
+        return PASSWD_ERR_RATE_LIMITED;
+    }
+
+    if (!limit_take(&s_global, settings->rate_limit_global, now, retry_ms))
+    {
+        if (entry)
+        {
+            limit_refund(&entry->any, settings->rate_limit_uid);
+        }
+        s_limit_stats.throttled_global++;
+        return PASSWD_ERR_RATE_LIMITED;
+    }
+
+    return PASSWD_ERR_SUCCESS;
+}
+
+/**
+ * Check the per-uid rate of the opcode class of a decrypted request, before
+ * it is processed
+ *
+ * @param uid      uid of the connected process
+ * @param opcode   opcode of the request
+ * @param retry_ms set to the time until the request would be served
+ * @return PASSWD_ERR_SUCCESS if the request may be processed,
+ *         PASSWD_ERR_RATE_LIMITED otherwise
+ */
+int passwd_srv_limit_opcode(uid_t uid, int opcode, uint32_t *retry_ms)
+{
+    const passwd_srv_settings_t *settings = passwd_srv_settings();
+    enum passwd_srv_limit_class_e opclass = limit_class(opcode);
+    limit_uid_t *entry;
+    int rate;
+
+    if (PASSWD_SRV_LIMIT_CLASS_MAX == opclass)
+    {
+        return PASSWD_ERR_SUCCESS;
+    }
+
+    switch (opclass)
+    {
+        case PASSWD_SRV_LIMIT_CLASS_PASSWORD:
+            rate = settings->rate_limit_password;
+            break;
+        case PASSWD_SRV_LIMIT_CLASS_ACCOUNT:
+            rate = settings->rate_limit_account;
+            break;
+        case PASSWD_SRV_LIMIT_CLASS_VERIFY:
+            rate = settings->rate_limit_verify;
+            break;
+        default:
+            rate = settings->rate_limit_query;
+            break;
+    }
+    if ((0 == rate) || (NULL == (entry = limit_find_uid(uid))))
+    {
+        return PASSWD_ERR_SUCCESS;
+    }
+
+    if (!limit_take(&entry->opclass[opclass], rate, time_msec(), retry_ms))
+    {
+        entry->throttled++;
+        s_limit_stats.throttled_class[opclass]++;
+        return PASSWD_ERR_RATE_LIMITED;
+    }
+
+    return PASSWD_ERR_SUCCESS;
+}
+
+/**
+ * Get the counters of throttled requests
+ *
+ * @param stats filled with the counters
+ */
+void passwd_srv_limit_stats(passwd_srv_limit_stats_t *stats)
+{
+    *stats = s_limit_stats;
+}
+
+/**
+ * Call a function for each uid which has been throttled
+ *
+ * @param cb  called with the uid and the number of its throttled requests
+ * @param aux passed to cb
+ */
+void passwd_srv_limit_foreach(void (*cb)(uid_t uid, uint64_t throttled,
+                                         void *aux), void *aux)
+{
+    limit_uid_t *entry;
+    int i;
+
+    for (i = 0; i < PASSWD_SRV_LIMIT_HASH_SIZE; i++)
+    {
+        for (entry = s_uids[i]; entry; entry = entry->next)
+        {
+            if (entry->throttled)
+            {
+                cb(entry->uid, entry->throttled, aux);
+            }
+        }
+    }
+}
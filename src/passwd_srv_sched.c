@@ -0,0 +1,335 @@
+/*
+ * (c) Copyright 2016 Hewlett Packard Enterprise Development LP
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+/************************************************************************//**
+ * @ingroup passwd-srvd
+ *
+ * @file
+ * Request scheduler of the Password Server.
+ *
+ *    Admitted requests wait in one of PASSWD_SRV_SCHED_CLASS_MAX classes.
+ *     The next class is picked by smooth weighted round-robin over the
+ *     classes with requests, so each gets its share of turns by weight and
+ *     a class with a high weight is not starved of turns in a row.  Within
+ *     a class, requests are kept in one FIFO per client uid and the uids
+ *     take turns, so one client submitting many requests does not delay
+ *     the others of its class.
+ ***************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "openvswitch/vlog.h"
+#include "passwd_srv_pri.h"
+
+VLOG_DEFINE_THIS_MODULE(passwd_srv_sched);
+
+/*
+ * requests of one client uid waiting in a class
+ */
+typedef struct passwd_srv_sched_flow
+{
+    uid_t uid;
+    passwd_srv_sched_entry_t *head;
+    passwd_srv_sched_entry_t **tail;
+    struct passwd_srv_sched_flow *next;   /* next uid to take its turn */
+} sched_flow_t;
+
+typedef struct sched_class
+{
+    sched_flow_t *head;       /* uid whose turn is next */
+    sched_flow_t *tail;
+    int current;              /* smooth weighted round-robin credit */
+    passwd_srv_sched_stats_t stats;
+} sched_class_t;
+
+static sched_class_t s_classes[PASSWD_SRV_SCHED_CLASS_MAX];
+static sched_flow_t *s_free_flows = NULL;   /* kept for reuse */
+
+static const char *s_class_names[PASSWD_SRV_SCHED_CLASS_MAX] = {
+    "interactive",
+    "admin",
+    "batch",
+};
+
+/**
+ * Weight of a class from the settings
+ */
+static int
+sched_weight(enum passwd_srv_sched_class_e sclass)
+{
+    const passwd_srv_settings_t *settings = passwd_srv_settings();
+
+    switch (sclass)
+    {
+        case PASSWD_SRV_SCHED_INTERACTIVE:
+            return settings->sched_weight_interactive;
+        case PASSWD_SRV_SCHED_ADMIN:
+            return settings->sched_weight_admin;
+        default:
+            return settings->sched_weight_batch;
+    }
+}
+
+/**
+ * Class a request is scheduled in
+ *
+ * @param opcode opcode of the decrypted request
+ * @param flags  flags of its frame header, PASSWD_SRV_FLAG_*
+ * @return PASSWD_SRV_SCHED_*
+ */
+enum passwd_srv_sched_class_e
+passwd_srv_sched_class(int opcode, int flags)
+{
+    if (flags & PASSWD_SRV_FLAG_BATCH)
+    {
+        return PASSWD_SRV_SCHED_BATCH;
+    }
+
+    switch (opcode)
+    {
+        case PASSWD_MSG_CHG_PASSWORD:
+        case PASSWD_MSG_VERIFY:
+        case PASSWD_MSG_LIST_USERS:
+        case PASSWD_MSG_GET_USER:
+        case PASSWD_MSG_GET_AGING:
+        case PASSWD_MSG_SUBSCRIBE:
+        case PASSWD_MSG_JOB_STATUS:
+            return PASSWD_SRV_SCHED_INTERACTIVE;
+        default:
+            return PASSWD_SRV_SCHED_ADMIN;
+    }
+}
+
+/**
+ * Name of a class, as shown by passwd-srv/queue-show
+ */
+const char *
+passwd_srv_sched_class_name(enum passwd_srv_sched_class_e sclass)
+{
+    return s_class_names[sclass];
+}
+
+/**
+ * Queue a request behind the others of its client uid in its class.  The
+ * owner of the entry must be set, it is what passwd_srv_sched_pop() is for.
+ *
+ * @param entry  entry of the request, not queued
+ * @param sclass class of the request
+ * @param uid    uid of the connected process
+ * @param now    passwd_srv_clock(), start of the wait
+ * @return PASSWD_ERR_SUCCESS, PASSWD_ERR_INSUFFICIENT_MEM if a new uid
+ *         cannot be tracked
+ */
+int passwd_srv_sched_push(passwd_srv_sched_entry_t *entry,
+                          enum passwd_srv_sched_class_e sclass, uid_t uid,
+                          uint64_t now)
+{
+    sched_class_t *cls = &s_classes[sclass];
+    sched_flow_t *flow;
+
+    /* only uids with requests waiting are in the list, a handful at most */
+    for (flow = cls->head; flow; flow = flow->next)
+    {
+        if (flow->uid == uid)
+        {
+            break;
+        }
+    }
+
+    if (NULL == flow)
+    {
+        if (s_free_flows)
+        {
+            flow = s_free_flows;
+            s_free_flows = flow->next;
+        }
+        else if (NULL == (flow = malloc(sizeof(*flow))))
+        {
+            VLOG_ERR("Memory allocation failure");
+            return PASSWD_ERR_INSUFFICIENT_MEM;
+        }
+        flow->uid = uid;
+        flow->head = NULL;
+        flow->tail = &flow->head;
+        flow->next = NULL;
+
+        /* a new uid takes its turn after those already waiting */
+        if (cls->tail)
+        {
+            cls->tail->next = flow;
+        }
+        else
+        {
+            cls->head = flow;
+        }
+        cls->tail = flow;
+    }
+
+    entry->sclass = sclass;
+    entry->flow = flow;
+    entry->t_queued = now;
+    entry->next = NULL;
+    *flow->tail = entry;
+    flow->tail = &entry->next;
+
+    cls->stats.depth++;
+    cls->stats.queued++;
+
+    return PASSWD_ERR_SUCCESS;
+}
+
+/**
+ * Take a flow whose requests are all served out of the turns of its class
+ *
+ * @param cls  class of the flow
+ * @param flow flow without requests
+ */
+static void
+sched_flow_release(sched_class_t *cls, sched_flow_t *flow)
+{
+    sched_flow_t **prev, *last = NULL;
+
+    for (prev = &cls->head; *prev; prev = &(*prev)->next)
+    {
+        if (*prev == flow)
+        {
+            *prev = flow->next;
+            break;
+        }
+        last = *prev;
+    }
+    if (cls->tail == flow)
+    {
+        cls->tail = last;
+    }
+
+    if (NULL == cls->head)
+    {
+        /* credit is not carried over idle periods */
+        cls->current = 0;
+    }
+}
+
+/**
+ * Take a request out of the scheduler, when its connection is closed
+ *
+ * @param entry queued entry
+ */
+void passwd_srv_sched_remove(passwd_srv_sched_entry_t *entry)
+{
+    sched_class_t *cls = &s_classes[entry->sclass];
+    sched_flow_t *flow = entry->flow;
+    passwd_srv_sched_entry_t **prev;
+
+    if (NULL == flow)
+    {
+        return;
+    }
+
+    for (prev = &flow->head; *prev; prev = &(*prev)->next)
+    {
+        if (*prev == entry)
+        {
+            *prev = entry->next;
+            break;
+        }
+    }
+    if (flow->tail == &entry->next)
+    {
+        flow->tail = prev;
+    }
+    entry->flow = NULL;
+    entry->next = NULL;
+    cls->stats.depth--;
+
+    if (NULL == flow->head)
+    {
+        sched_flow_release(cls, flow);
+        flow->next = s_free_flows;
+        s_free_flows = flow;
+    }
+}
+
+/**
+ * Take the next request to serve: the class is picked by weight among
+ * those with requests, then the uid whose turn it is in that class
+ *
+ * @param wait_ns set to the time the request waited
+ * @return entry of the request, NULL if none is waiting
+ */
+passwd_srv_sched_entry_t *passwd_srv_sched_pop(uint64_t *wait_ns)
+{
+    sched_class_t *cls, *best = NULL;
+    passwd_srv_sched_entry_t *entry;
+    sched_flow_t *flow;
+    int i, weight, total = 0;
+
+    for (i = 0; i < PASSWD_SRV_SCHED_CLASS_MAX; i++)
+    {
+        cls = &s_classes[i];
+        if (NULL == cls->head)
+        {
+            continue;
+        }
+        weight = sched_weight(i);
+        cls->current += weight;
+        total += weight;
+        if ((NULL == best) || (cls->current > best->current))
+        {
+            best = cls;
+        }
+    }
+    if (NULL == best)
+    {
+        return NULL;
+    }
+    best->current -= total;
+
+    /* the uid at the head takes its turn and goes to the back */
+    flow = best->head;
+    entry = flow->head;
+    if (flow->head->next && (best->tail != flow))
+    {
+        best->head = flow->next;
+        flow->next = NULL;
+        best->tail->next = flow;
+        best->tail = flow;
+    }
+    passwd_srv_sched_remove(entry);
+
+    *wait_ns = passwd_srv_clock() - entry->t_queued;
+    best->stats.served++;
+    best->stats.wait_ns += *wait_ns;
+    if (*wait_ns > best->stats.max_wait_ns)
+    {
+        best->stats.max_wait_ns = *wait_ns;
+    }
+
+    return entry;
+}
+
+/**
+ * Get the counters of a class
+ *
+ * @param sclass class
+ * @param stats  filled with the counters
+ */
+void passwd_srv_sched_stats(enum passwd_srv_sched_class_e sclass,
+                            passwd_srv_sched_stats_t *stats)
+{
+    *stats = s_classes[sclass].stats;
+}
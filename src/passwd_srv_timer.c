@@ -0,0 +1,195 @@
+/*
+ * (c) Copyright 2016 Hewlett Packard Enterprise Development LP
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+/************************************************************************//**
+ * @ingroup passwd-srvd
+ *
+ * @file
+ * Timer wheel of the Password Server.
+ *
+ *    Deadlines of client connections are kept in a hashed wheel of
+ *     PASSWD_SRV_TIMER_SLOTS slots of PASSWD_SRV_TIMER_TICK_MSEC each, so
+ *     arming, moving and cancelling a timer costs the same with thousands
+ *     of connections.  A timer further away than one turn of the wheel
+ *     stays in its slot until the turn it is due.
+ ***************************************************************************/
+#include <stdio.h>
+#include <string.h>
+
+#include <poll-loop.h>
+#include <timeval.h>
+#include "passwd_srv_pri.h"
+
+#define PASSWD_SRV_TIMER_TICK_MSEC 100
+#define PASSWD_SRV_TIMER_SLOTS     1024  /* one turn is 102.4s */
+
+static passwd_srv_timer_t *s_wheel[PASSWD_SRV_TIMER_SLOTS];
+static long long int s_wheel_tick = -1; /* tick to run next, -1 until used */
+static int s_n_timers = 0;
+
+/**
+ * Slot of the wheel for a tick
+ */
+static passwd_srv_timer_t **
+timer_slot(long long int tick)
+{
+    return &s_wheel[tick % PASSWD_SRV_TIMER_SLOTS];
+}
+
+/**
+ * Arm a timer, or move it if it is armed.  The owner of the timer must be
+ * set, it is given to the callback of passwd_srv_timer_run().
+ *
+ * @param timer   timer to arm
+ * @param expires time_msec() at which it fires
+ */
+void passwd_srv_timer_arm(passwd_srv_timer_t *timer, long long int expires)
+{
+    passwd_srv_timer_t **slot;
+    long long int tick = expires / PASSWD_SRV_TIMER_TICK_MSEC;
+
+    passwd_srv_timer_cancel(timer);
+
+    if (0 > s_wheel_tick)
+    {
+        s_wheel_tick = time_msec() / PASSWD_SRV_TIMER_TICK_MSEC;
+    }
+    if (tick < s_wheel_tick)
+    {
+        /* already due, fires on the next run */
+        tick = s_wheel_tick;
+    }
+
+    slot = timer_slot(tick);
+    timer->expires = expires;
+    timer->next = *slot;
+    if (*slot)
+    {
+        (*slot)->pprev = &timer->next;
+    }
+    timer->pprev = slot;
+    *slot = timer;
+    s_n_timers++;
+}
+
+/**
+ * Cancel a timer, nothing is done if it is not armed
+ *
+ * @param timer timer to cancel
+ */
+void passwd_srv_timer_cancel(passwd_srv_timer_t *timer)
+{
+    if (NULL == timer->pprev)
+    {
+        return;
+    }
+
+    *timer->pprev = timer->next;
+    if (timer->next)
+    {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->expires = 0;
+    s_n_timers--;
+}
+
+/**
+ * Fire the timers which are due.  A timer is cancelled before its callback
+ * is called, the callback may arm it again or free its owner.
+ *
+ * @param now time_msec()
+ * @param cb  called with the owner of each timer fired
+ */
+void passwd_srv_timer_run(long long int now, passwd_srv_timer_cb *cb)
+{
+    long long int now_tick = now / PASSWD_SRV_TIMER_TICK_MSEC;
+    long long int tick, last;
+    passwd_srv_timer_t **slot, *timer;
+
+    if (0 > s_wheel_tick)
+    {
+        return;
+    }
+
+    /* after a long block, one turn visits every slot */
+    last = now_tick;
+    if (last >= s_wheel_tick + PASSWD_SRV_TIMER_SLOTS)
+    {
+        last = s_wheel_tick + PASSWD_SRV_TIMER_SLOTS - 1;
+    }
+
+    for (tick = s_wheel_tick; (tick <= last) && s_n_timers; tick++)
+    {
+        slot = timer_slot(tick);
+        timer = *slot;
+        while (timer)
+        {
+            if (timer->expires > now)
+            {
+                timer = timer->next;
+                continue;
+            }
+
+            passwd_srv_timer_cancel(timer);
+            cb(timer->owner);
+            /* the callback may have changed the slot */
+            timer = *slot;
+        }
+    }
+
+    /* the current tick is visited again, it may hold later timers */
+    s_wheel_tick = now_tick;
+}
+
+/**
+ * Register the next timer due with the poll loop
+ */
+void passwd_srv_timer_wait()
+{
+    long long int tick, turn_end, next;
+    passwd_srv_timer_t *timer;
+
+    if (0 == s_n_timers)
+    {
+        return;
+    }
+
+    turn_end = (s_wheel_tick + PASSWD_SRV_TIMER_SLOTS) *
+               PASSWD_SRV_TIMER_TICK_MSEC;
+
+    for (tick = s_wheel_tick; tick < s_wheel_tick + PASSWD_SRV_TIMER_SLOTS;
+         tick++)
+    {
+        next = turn_end;
+        for (timer = *timer_slot(tick); timer; timer = timer->next)
+        {
+            if (timer->expires < next)
+            {
+                next = timer->expires;
+            }
+        }
+        if (next < turn_end)
+        {
+            poll_timer_wait_until(next);
+            return;
+        }
+    }
+
+    /* only timers due in a later turn */
+    poll_timer_wait_until(turn_end);
+}
@@ -0,0 +1,175 @@
+/*
+ * (c) Copyright 2016 Hewlett Packard Enterprise Development LP
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+/************************************************************************//**
+ * @ingroup passwd-srvd
+ *
+ * @file
+ * Request timing trace of the Password Server.
+ *
+ *    When enabled with --trace=FILE, one line is written per request with
+ *     its arrival time, opcode, result and the time spent in each stage.
+ *     Usernames and passwords are never written, so a trace taken on a
+ *     production switch can be shared and replayed with
+ *     ops-passwd-srv-replay against a sandbox.
+ ***************************************************************************/
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "openvswitch/vlog.h"
+#include "passwd_srv_pri.h"
+
+VLOG_DEFINE_THIS_MODULE(passwd_srv_trace);
+
+#define PASSWD_SRV_TRACE_FLUSH_NS 1000000000ULL /* flush at most every 1s */
+
+static FILE     *s_trace_fp = NULL;
+static uint64_t s_trace_start = 0;      /* arrival times are relative to it */
+static uint64_t s_trace_flushed = 0;
+
+static const char *s_stage_name[PASSWD_SRV_STAGE_MAX] = {
+    "decrypt_ns",
+    "peer_ns",
+    "validate_ns",
+    "find_ns",
+    "crypt_ns",
+    "store_ns",
+    "useradd_ns",
+    "queue_ns",
+};
+
+/**
+ * Monotonic clock used to time requests
+ *
+ * @return monotonic time in nanoseconds
+ */
+uint64_t passwd_srv_clock()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Start recording requests into a trace file
+ *
+ * @param trace_file file to write, truncated if it exists
+ * @return PASSWD_ERR_SUCCESS if trace file is opened
+ */
+int passwd_srv_trace_open(const char *trace_file)
+{
+    int stage;
+
+    if (NULL == (s_trace_fp = fopen(trace_file, "w")))
+    {
+        VLOG_ERR("Failed to open trace file %s", trace_file);
+        return PASSWD_ERR_FATAL;
+    }
+
+    s_trace_start = passwd_srv_clock();
+    s_trace_flushed = s_trace_start;
+
+    fprintf(s_trace_fp, "# %s\n# arrival_ns opcode status total_ns",
+            PASSWD_SRV_TRACE_MAGIC);
+    for (stage = 0; stage < PASSWD_SRV_STAGE_MAX; stage++)
+    {
+        fprintf(s_trace_fp, " %s", s_stage_name[stage]);
+    }
+    fputc('\n', s_trace_fp);
+    fflush(s_trace_fp);
+
+    VLOG_INFO("Recording request trace to %s", trace_file);
+    return PASSWD_ERR_SUCCESS;
+}
+
+/**
+ * Flush and close the trace file
+ */
+void passwd_srv_trace_close()
+{
+    if (s_trace_fp)
+    {
+        fclose(s_trace_fp);
+        s_trace_fp = NULL;
+    }
+}
+
+/**
+ * Timestamp used to measure stages.  Clock is only read when a stage
+ * duration is consumed, by the trace or by USDT probes.
+ *
+ * @return monotonic time in nanoseconds, 0 if nothing consumes it
+ */
+uint64_t passwd_srv_stage_now()
+{
+    return s_trace_fp ? passwd_srv_clock() : passwd_srv_probe_now();
+}
+
+/**
+ * Account time spent in a stage of a request
+ *
+ * @param client  request being served
+ * @param stage   stage which has completed
+ * @param t_start passwd_srv_stage_now() at the start of the stage
+ * @return duration of the stage in nanoseconds
+ */
+uint64_t passwd_srv_stage_end(passwd_client_t *client,
+                              enum passwd_srv_stage_e stage, uint64_t t_start)
+{
+    uint64_t ns = passwd_srv_stage_now() - t_start;
+
+    client->stage_ns[stage] += ns;
+    return ns;
+}
+
+/**
+ * Write the trace record of a completed request
+ *
+ * @param client request which has been replied to
+ * @param status status sent to the client
+ */
+void passwd_srv_trace_request(const passwd_client_t *client, int status)
+{
+    uint64_t now;
+    int stage;
+
+    if (NULL == s_trace_fp)
+    {
+        return;
+    }
+
+    now = passwd_srv_clock();
+
+    fprintf(s_trace_fp, "%llu %d %d %llu",
+            (unsigned long long)(client->t_arrival - s_trace_start),
+            client->msg.op_code, status,
+            (unsigned long long)(now - client->t_arrival));
+    for (stage = 0; stage < PASSWD_SRV_STAGE_MAX; stage++)
+    {
+        fprintf(s_trace_fp, " %llu",
+                (unsigned long long)client->stage_ns[stage]);
+    }
+    fputc('\n', s_trace_fp);
+
+    /* keep the buffer, a burst must not turn into one write per request */
+    if (now - s_trace_flushed >= PASSWD_SRV_TRACE_FLUSH_NS)
+    {
+        fflush(s_trace_fp);
+        s_trace_flushed = now;
+    }
+}
@@ -0,0 +1,605 @@
+/*
+ * (c) Copyright 2016 Hewlett Packard Enterprise Development LP
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+/************************************************************************//**
+ * @ingroup passwd-srvd
+ *
+ * @file
+ * In-memory user database of the Password Server.
+ *
+ *    The passwd, group and shadow files are parsed into one table of users
+ *     sorted by name, with their groups and password aging fields, which
+ *     answers the query opcodes.  Password hashes are not kept.  The table
+ *     is parsed again on the next query once the server has changed an
+ *     account, or once one of the files has changed on disk; otherwise a
+ *     query costs three stat() calls and a binary search.
+ ***************************************************************************/
+#include <errno.h>
+#include <grp.h>
+#include <pwd.h>
+#include <shadow.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "openvswitch/vlog.h"
+#include "passwd_srv_pri.h"
+
+VLOG_DEFINE_THIS_MODULE(passwd_srv_userdb);
+
+typedef struct userdb_user
+{
+    char name[PASSWD_USERNAME_SIZE];
+    uid_t uid;
+    gid_t gid;
+    size_t first;             /* first group of the user in members */
+    size_t ngroups;           /* groups listing the user as member */
+    passwd_srv_user_aging_t aging;
+} userdb_user_t;
+
+typedef struct userdb_group
+{
+    char name[PASSWD_SRV_GROUP_NAME_SIZE];
+    gid_t gid;
+} userdb_group_t;
+
+/* a user listed as member of a group, while the files are parsed */
+typedef struct userdb_member
+{
+    size_t user;
+    size_t group;
+} userdb_member_t;
+
+typedef struct userdb
+{
+    userdb_user_t *users;     /* sorted by name */
+    size_t n_users;
+    userdb_group_t *groups;   /* in the order of the group file */
+    size_t n_groups;
+    size_t *by_gid;           /* index of groups sorted by gid */
+    size_t *members;          /* groups of the users, user after user */
+    size_t n_members;
+} userdb_t;
+
+static const enum passwd_srv_file_e s_userdb_files[] = {
+    PASSWD_SRV_FILE_PASSWD,
+    PASSWD_SRV_FILE_GROUP,
+    PASSWD_SRV_FILE_SHADOW,
+};
+#define USERDB_N_FILES (sizeof(s_userdb_files) / sizeof(s_userdb_files[0]))
+
+static userdb_t s_userdb;
+static int s_userdb_valid = FALSE;  /* false until parsed, or once changed */
+static struct stat s_userdb_stat[USERDB_N_FILES];
+static passwd_srv_userdb_stats_t s_userdb_stats;
+
+/**
+ * Free the tables of a database
+ */
+static void
+userdb_free(userdb_t *db)
+{
+    free(db->users);
+    free(db->groups);
+    free(db->by_gid);
+    free(db->members);
+    memset(db, 0, sizeof(*db));
+}
+
+/**
+ * Grow an array to hold one more element
+ *
+ * @return FALSE on allocation failure
+ */
+static int
+userdb_grow(void **array, size_t n, size_t *size, size_t elem)
+{
+    size_t new_size;
+    void *ptr;
+
+    if (n < *size)
+    {
+        return TRUE;
+    }
+
+    new_size = *size ? *size * 2 : 1024;
+    if (NULL == (ptr = realloc(*array, new_size * elem)))
+    {
+        VLOG_ERR("Memory allocation failure");
+        return FALSE;
+    }
+    *array = ptr;
+    *size = new_size;
+    return TRUE;
+}
+
+static int
+userdb_cmp_user(const void *a, const void *b)
+{
+    return strcmp(((const userdb_user_t *)a)->name,
+                  ((const userdb_user_t *)b)->name);
+}
+
+static int
+userdb_cmp_member(const void *a, const void *b)
+{
+    const userdb_member_t *ma = a, *mb = b;
+
+    if (ma->user != mb->user)
+    {
+        return (ma->user < mb->user) ? -1 : 1;
+    }
+    return (ma->group < mb->group) ? -1 : (ma->group > mb->group);
+}
+
+static const userdb_group_t *s_sort_groups;   /* groups sorted by gid */
+
+static int
+userdb_cmp_gid(const void *a, const void *b)
+{
+    gid_t ga = s_sort_groups[*(const size_t *)a].gid;
+    gid_t gb = s_sort_groups[*(const size_t *)b].gid;
+
+    return (ga < gb) ? -1 : (ga > gb);
+}
+
+/**
+ * Find a user of a database by name
+ *
+ * @return user, NULL if none found
+ */
+static userdb_user_t *
+userdb_find(const userdb_t *db, const char *name)
+{
+    userdb_user_t key;
+
+    if (strlen(name) >= sizeof(key.name))
+    {
+        return NULL;
+    }
+    strcpy(key.name, name);
+
+    return bsearch(&key, db->users, db->n_users, sizeof(key),
+                   userdb_cmp_user);
+}
+
+/**
+ * Find the group of a gid
+ *
+ * @return group, NULL if none found
+ */
+static const userdb_group_t *
+userdb_find_gid(const userdb_t *db, gid_t gid)
+{
+    size_t lo = 0, hi = db->n_groups, mid;
+    const userdb_group_t *group;
+
+    while (lo < hi)
+    {
+        mid = (lo + hi) / 2;
+        group = &db->groups[db->by_gid[mid]];
+        if (group->gid == gid)
+        {
+            return group;
+        }
+        if (group->gid < gid)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Parse the passwd file into the users of a database, sorted by name.
+ * Users whose name does not fit a request are left out.
+ */
+static int
+userdb_load_passwd(userdb_t *db)
+{
+    const char *file = passwd_srv_file(PASSWD_SRV_FILE_PASSWD);
+    size_t size = 0;
+    struct passwd *pw;
+    userdb_user_t *user;
+    FILE *fp;
+
+    if (NULL == (fp = fopen(file, "r")))
+    {
+        VLOG_ERR("Failed to open %s file", file);
+        return PASSWD_ERR_FATAL;
+    }
+
+    while (NULL != (pw = fgetpwent(fp)))
+    {
+        if (strlen(pw->pw_name) >= sizeof(user->name))
+        {
+            continue;
+        }
+        if (!userdb_grow((void **)&db->users, db->n_users, &size,
+                         sizeof(*db->users)))
+        {
+            fclose(fp);
+            return PASSWD_ERR_INSUFFICIENT_MEM;
+        }
+
+        user = &db->users[db->n_users++];
+        memset(user, 0, sizeof(*user));
+        strcpy(user->name, pw->pw_name);
+        user->uid = pw->pw_uid;
+        user->gid = pw->pw_gid;
+        user->aging.lastchg = user->aging.min = user->aging.max = -1;
+        user->aging.warn = user->aging.inact = user->aging.expire = -1;
+    }
+    fclose(fp);
+
+    qsort(db->users, db->n_users, sizeof(*db->users), userdb_cmp_user);
+    return PASSWD_ERR_SUCCESS;
+}
+
+/**
+ * Parse the group file into the groups of a database and the groups of
+ * each user
+ */
+static int
+userdb_load_group(userdb_t *db)
+{
+    const char *file = passwd_srv_file(PASSWD_SRV_FILE_GROUP);
+    userdb_member_t *pairs = NULL;
+    size_t size = 0, n_pairs = 0, pairs_size = 0, i;
+    userdb_group_t *group;
+    userdb_user_t *user;
+    struct group *gr;
+    FILE *fp;
+    int j, err = PASSWD_ERR_SUCCESS;
+
+    if (NULL == (fp = fopen(file, "r")))
+    {
+        VLOG_ERR("Failed to open %s file", file);
+        return PASSWD_ERR_FATAL;
+    }
+
+    while ((PASSWD_ERR_SUCCESS == err) && (NULL != (gr = fgetgrent(fp))))
+    {
+        if (!userdb_grow((void **)&db->groups, db->n_groups, &size,
+                         sizeof(*db->groups)))
+        {
+            err = PASSWD_ERR_INSUFFICIENT_MEM;
+            break;
+        }
+        group = &db->groups[db->n_groups];
+        snprintf(group->name, sizeof(group->name), "%s", gr->gr_name);
+        group->gid = gr->gr_gid;
+
+        for (j = 0; gr->gr_mem[j]; j++)
+        {
+            if (NULL == (user = userdb_find(db, gr->gr_mem[j])))
+            {
+                continue;
+            }
+            if (!userdb_grow((void **)&pairs, n_pairs, &pairs_size,
+                             sizeof(*pairs)))
+            {
+                err = PASSWD_ERR_INSUFFICIENT_MEM;
+                break;
+            }
+            pairs[n_pairs].user = user - db->users;
+            pairs[n_pairs].group = db->n_groups;
+            n_pairs++;
+        }
+        db->n_groups++;
+    }
+    fclose(fp);
+
+    if ((PASSWD_ERR_SUCCESS == err) &&
+        ((NULL == (db->by_gid = malloc((db->n_groups + 1) *
+                                       sizeof(*db->by_gid)))) ||
+         (NULL == (db->members = malloc((n_pairs + 1) *
+                                        sizeof(*db->members))))))
+    {
+        VLOG_ERR("Memory allocation failure");
+        err = PASSWD_ERR_INSUFFICIENT_MEM;
+    }
+    if (PASSWD_ERR_SUCCESS != err)
+    {
+        free(pairs);
+        return err;
+    }
+
+    for (i = 0; i < db->n_groups; i++)
+    {
+        db->by_gid[i] = i;
+    }
+    s_sort_groups = db->groups;
+    qsort(db->by_gid, db->n_groups, sizeof(*db->by_gid), userdb_cmp_gid);
+
+    /* groups of a user follow each other, in the order of the file */
+    qsort(pairs, n_pairs, sizeof(*pairs), userdb_cmp_member);
+    for (i = 0; i < n_pairs; i++)
+    {
+        user = &db->users[pairs[i].user];
+        if (0 == user->ngroups)
+        {
+            user->first = i;
+        }
+        user->ngroups++;
+        db->members[i] = pairs[i].group;
+    }
+    db->n_members = n_pairs;
+
+    free(pairs);
+    return PASSWD_ERR_SUCCESS;
+}
+
+/**
+ * Parse the aging fields of the shadow file into the users of a database,
+ * the hashes are not kept
+ */
+static int
+userdb_load_shadow(userdb_t *db)
+{
+    const char *file = passwd_srv_file(PASSWD_SRV_FILE_SHADOW);
+    userdb_user_t *user;
+    struct spwd *sp;
+    FILE *fp;
+
+    if (0 != lock_shadow_file())
+    {
+        VLOG_ERR("Failed to lock /usr/shadow file");
+        return PASSWD_ERR_SHADOW_FILE;
+    }
+
+    if (NULL == (fp = fopen(file, "r")))
+    {
+        VLOG_ERR("Failed to open %s file", file);
+        unlock_shadow_file();
+        return PASSWD_ERR_SHADOW_FILE;
+    }
+
+    while (NULL != (sp = fgetspent(fp)))
+    {
+        if (NULL == (user = userdb_find(db, sp->sp_namp)))
+        {
+            continue;
+        }
+        user->aging.lastchg = sp->sp_lstchg;
+        user->aging.min = sp->sp_min;
+        user->aging.max = sp->sp_max;
+        user->aging.warn = sp->sp_warn;
+        user->aging.inact = sp->sp_inact;
+        user->aging.expire = sp->sp_expire;
+    }
+
+    fclose(fp);
+    unlock_shadow_file();
+    return PASSWD_ERR_SUCCESS;
+}
+
+/**
+ * Whether the files are the ones the database was parsed from
+ *
+ * @param st set to the current state of the files
+ */
+static int
+userdb_files_unchanged(struct stat *st)
+{
+    int unchanged = TRUE;
+    size_t i;
+
+    for (i = 0; i < USERDB_N_FILES; i++)
+    {
+        if (0 != stat(passwd_srv_file(s_userdb_files[i]), &st[i]))
+        {
+            memset(&st[i], 0, sizeof(st[i]));
+        }
+        if ((st[i].st_ino != s_userdb_stat[i].st_ino) ||
+            (st[i].st_size != s_userdb_stat[i].st_size) ||
+            (st[i].st_mtim.tv_sec != s_userdb_stat[i].st_mtim.tv_sec) ||
+            (st[i].st_mtim.tv_nsec != s_userdb_stat[i].st_mtim.tv_nsec))
+        {
+            unchanged = FALSE;
+        }
+    }
+    return unchanged;
+}
+
+/**
+ * Parse the files again if they have changed since the database was parsed
+ *
+ * @return PASSWD_ERR_SUCCESS if the database is up to date
+ */
+static int
+userdb_refresh()
+{
+    struct stat st[USERDB_N_FILES];
+    userdb_t db;
+    int err;
+
+    if (userdb_files_unchanged(st) && s_userdb_valid)
+    {
+        return PASSWD_ERR_SUCCESS;
+    }
+
+    memset(&db, 0, sizeof(db));
+    if ((PASSWD_ERR_SUCCESS != (err = userdb_load_passwd(&db))) ||
+        (PASSWD_ERR_SUCCESS != (err = userdb_load_group(&db))) ||
+        (PASSWD_ERR_SUCCESS != (err = userdb_load_shadow(&db))))
+    {
+        userdb_free(&db);
+        return err;
+    }
+
+    userdb_free(&s_userdb);
+    s_userdb = db;
+    memcpy(s_userdb_stat, st, sizeof(st));
+    s_userdb_valid = TRUE;
+    s_userdb_stats.loads++;
+
+    VLOG_DBG("Loaded %zu users and %zu groups", db.n_users, db.n_groups);
+    return PASSWD_ERR_SUCCESS;
+}
+
+/**
+ * Parse the files again on the next query, once an account is changed by
+ * the server.  Changes within the timestamp granularity of the files would
+ * otherwise go unnoticed.
+ */
+void passwd_srv_userdb_invalidate()
+{
+    s_userdb_valid = FALSE;
+}
+
+/**
+ * Fill in the reply entry of a user
+ */
+static void
+userdb_user_info(const userdb_user_t *user, passwd_srv_user_info_t *info)
+{
+    const userdb_group_t *group;
+    size_t i;
+
+    memset(info, 0, sizeof(*info));
+    memcpy(info->username, user->name, sizeof(info->username));
+    info->uid = user->uid;
+    info->gid = user->gid;
+    if (NULL != (group = userdb_find_gid(&s_userdb, user->gid)))
+    {
+        memcpy(info->group, group->name, sizeof(info->group));
+    }
+
+    info->ngroups = user->ngroups;
+    for (i = 0; (i < user->ngroups) && (i < PASSWD_SRV_USER_GROUPS); i++)
+    {
+        group = &s_userdb.groups[s_userdb.members[user->first + i]];
+        memcpy(info->groups[i], group->name, sizeof(info->groups[i]));
+    }
+}
+
+/**
+ * Answer a query opcode from the database.  The reply is allocated for the
+ * client and freed once sent.
+ *
+ * @param client query being served
+ * @return PASSWD_ERR_SUCCESS with the reply set in client, PASSWD_ERR_*
+ *         code otherwise
+ */
+int passwd_srv_userdb_query(passwd_client_t *client)
+{
+    const char *name = client->msg.username;
+    passwd_srv_user_page_t *page;
+    userdb_user_t *user = NULL;
+    size_t first, i;
+    int err;
+
+    client->msg.username[PASSWD_USERNAME_SIZE - 1] = '\0';
+    if (PASSWD_ERR_SUCCESS != (err = userdb_refresh()))
+    {
+        return err;
+    }
+    s_userdb_stats.queries++;
+
+    if (PASSWD_MSG_LIST_USERS != client->msg.op_code)
+    {
+        if (NULL == (user = userdb_find(&s_userdb, name)))
+        {
+            VLOG_DBG("User %s cannot be found in password file", name);
+            return PASSWD_ERR_USER_NOT_FOUND;
+        }
+    }
+
+    switch (client->msg.op_code)
+    {
+    case PASSWD_MSG_LIST_USERS:
+    {
+        /* first user sorted after the one given */
+        for (first = 0, i = s_userdb.n_users; first < i; )
+        {
+            size_t mid = (first + i) / 2;
+
+            if (strcmp(s_userdb.users[mid].name, name) <= 0)
+            {
+                first = mid + 1;
+            }
+            else
+            {
+                i = mid;
+            }
+        }
+
+        client->reply_len = sizeof(*page);
+        if (NULL == (client->reply = malloc(PASSWD_SRV_MAX_REPLY)))
+        {
+            VLOG_ERR("Memory allocation failure");
+            return PASSWD_ERR_INSUFFICIENT_MEM;
+        }
+        page = client->reply;
+        memset(page, 0, sizeof(*page));
+        for (i = first;
+             (i < s_userdb.n_users) && (page->count < PASSWD_SRV_USER_PAGE);
+             i++)
+        {
+            userdb_user_info(&s_userdb.users[i],
+                             (passwd_srv_user_info_t *)
+                             ((char *)client->reply + client->reply_len));
+            client->reply_len += sizeof(passwd_srv_user_info_t);
+            page->count++;
+        }
+        page->more = (i < s_userdb.n_users);
+        break;
+    }
+    case PASSWD_MSG_GET_USER:
+    {
+        client->reply_len = sizeof(passwd_srv_user_info_t);
+        if (NULL == (client->reply = malloc(client->reply_len)))
+        {
+            VLOG_ERR("Memory allocation failure");
+            return PASSWD_ERR_INSUFFICIENT_MEM;
+        }
+        userdb_user_info(user, client->reply);
+        break;
+    }
+    default:
+    {
+        client->reply_len = sizeof(passwd_srv_user_aging_t);
+        if (NULL == (client->reply = malloc(client->reply_len)))
+        {
+            VLOG_ERR("Memory allocation failure");
+            return PASSWD_ERR_INSUFFICIENT_MEM;
+        }
+        memcpy(client->reply, &user->aging, client->reply_len);
+        break;
+    }
+    }
+
+    return PASSWD_ERR_SUCCESS;
+}
+
+/**
+ * Get the counters of the user database
+ *
+ * @param stats filled with the counters
+ */
+void passwd_srv_userdb_stats(passwd_srv_userdb_stats_t *stats)
+{
+    *stats = s_userdb_stats;
+    stats->users = s_userdb.n_users;
+    stats->groups = s_userdb.n_groups;
+    stats->valid = s_userdb_valid;
+}
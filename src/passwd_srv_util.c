@@ -28,9 +28,15 @@
 #include <grp.h>
 #include <sys/socket.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <errno.h>
+#include <spawn.h>
+#include <sys/wait.h>
 
 #include "openvswitch/vlog.h"
 #include "passwd_srv_pri.h"
+#include <openssl/crypto.h>
 #include <openssl/rand.h>
 #include <openssl/pem.h>
 #include <openssl/rsa.h>
@@ -53,7 +59,20 @@ VLOG_DEFINE_THIS_MODULE(passwd_srv_util);
 
 #define MAGNUM(array,ch) (array)[0]=(array)[2]='$',(array)[1]=(ch),(array)[3]='\0'
 
+/*
+ * Fields of the hashes taken by PASSWD_MSG_SET_HASH
+ */
+#define CRYPT_CHARS \
+    "./0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+#define SHA256_HASH_LEN    43   /* $5$ */
+#define SHA512_HASH_LEN    86   /* $6$ */
+#define YESCRYPT_HASH_LEN  43   /* $y$ */
+#define SHA_ROUNDS_DIGITS  9    /* rounds=999999999 at most */
+
+extern char **environ;
+
 static char *crypt_method = NULL;
+static int  s_lock_fd = -1;
 
 /*
  * RNG function to generate seed to make salt
@@ -117,10 +136,6 @@ RSA *generate_RSA_keypair() {
     /* public exponent for RSA key generation */
     int ret, key_generate_failed=0;
     unsigned long e = RSA_F4;
-    BIO *bp_public = NULL;
-    /* BIO - openssl type, stands for Basic Input Output, serves as a wrapper
-     * for a file pointer in many openssl functions */
-    struct group *ovsdb_client_grp;
     char *pub_key_path = NULL;
 
     /*
@@ -157,18 +172,13 @@ RSA *generate_RSA_keypair() {
     }
 
     /* save public key to a file in PEM format */
-    bp_public = BIO_new_file(pub_key_path, "wx");
-    ret = PEM_write_bio_RSAPublicKey(bp_public, rsa);
-    if (ret != 1)
+    if (PASSWD_ERR_SUCCESS != create_pubkey_file(rsa, pub_key_path))
     {
-        VLOG_ERR("Failed to save public key");
         key_generate_failed = 1;
         goto cleanup;
-
     }
 
 cleanup:
-    BIO_free_all(bp_public);
     BN_clear_free(bne);
 
     if (key_generate_failed)
@@ -181,15 +191,58 @@ cleanup:
 
     /* make the file readable by owner and group */
     umask(S_IRUSR | S_IWUSR | S_IRGRP);
+
+    /* Calling function must do RSA_free(rsa) when it is done with resource */
+    return rsa;
+}
+
+/**
+ * Save the public key of a key pair in PEM format for clients.  The file is
+ * written aside and renamed, clients never read a partial key nor miss the
+ * file when the key of a running server is replaced.
+ *
+ * @param rsa          key pair
+ * @param pub_key_path file to create or replace
+ * @return PASSWD_ERR_SUCCESS if the public key is saved
+ */
+int create_pubkey_file(RSA *rsa, const char *pub_key_path)
+{
+    char tmp_path[PATH_MAX];
+    struct group *ovsdb_client_grp;
+    BIO *bp_public = NULL;
+    /* BIO - openssl type, stands for Basic Input Output, serves as a wrapper
+     * for a file pointer in many openssl functions */
+    int ret;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", pub_key_path);
+    unlink(tmp_path);
+
+    bp_public = BIO_new_file(tmp_path, "wx");
+    ret = PEM_write_bio_RSAPublicKey(bp_public, rsa);
+    BIO_free_all(bp_public);
+
+    if (ret != 1)
+    {
+        VLOG_ERR("Failed to save public key");
+        unlink(tmp_path);
+        return PASSWD_ERR_FATAL;
+    }
+
     if ((ovsdb_client_grp = getgrnam("ovsdb-client")))
     {
         /* if group is not found, skip setting gid */
         VLOG_INFO("Couldn't set the public key to ovsdb-client group");
-        chown(pub_key_path, getuid(), ovsdb_client_grp->gr_gid);
+        chown(tmp_path, getuid(), ovsdb_client_grp->gr_gid);
     }
 
-    /* Calling function must do RSA_free(rsa) when it is done with resource */
-    return rsa;
+    if (0 != rename(tmp_path, pub_key_path))
+    {
+        VLOG_ERR("Failed to save public key");
+        unlink(tmp_path);
+        return PASSWD_ERR_FATAL;
+    }
+
+    return PASSWD_ERR_SUCCESS;
 }
 
 /*
@@ -219,7 +272,8 @@ char *search_login_defs(const char *target)
     FILE *fpLogin;
 
     /* find encrypt_method and assign it to static crypt_method */
-    if (NULL == (fpLogin = fopen(PASSWD_LOGIN_FILE, "r")))
+    if (NULL == (fpLogin =
+            fopen(passwd_srv_file(PASSWD_SRV_FILE_LOGIN_DEFS), "r")))
     {
         /* cannot open login.defs file for read */
         return NULL;
@@ -245,45 +299,85 @@ char *search_login_defs(const char *target)
 }
 
 /**
- * Create a user using useradd program
+ * Start useradd or userdel for a user without waiting for it.  The program
+ * is executed directly, not by a shell, so nothing but async-signal-safe
+ * code runs between the fork and the exec.  Its pid is also the id of its
+ * process group.
  *
- * @param username username to add
- * @param useradd  add if true, deleate otherwise
+ * @param username username to add or delete
+ * @param useradd  add if true, delete otherwise
+ * @return pid of the program, -1 if it could not be started
  */
-static
-struct spwd *create_user(const char *username, int useradd)
+pid_t spawn_user_command(const char *username, int useradd)
 {
-    char useradd_comm[512];
-    struct spwd *passwd_entry = NULL;
-
-    memset(useradd_comm, 0, sizeof(useradd_comm));
+    posix_spawnattr_t attr;
+    char *argv[12];
+    int argc = 0, err;
+    pid_t pid;
 
+    argv[argc++] = useradd ? USERADD : USERDEL;
+    if (passwd_srv_is_sandboxed())
+    {
+        /* in a sandbox, let useradd/userdel work on files under the root */
+        argv[argc++] = "-P";
+        argv[argc++] = (char *)get_passwd_srv_root_dir();
+    }
     if (useradd)
     {
-        snprintf(useradd_comm, sizeof(useradd_comm),
-            "%s -g %s -G %s -s %s %s", USERADD, NETOP_GROUP, OVSDB_GROUP,
-            VTYSH_PROMPT, username);
+        argv[argc++] = "-g";
+        argv[argc++] = NETOP_GROUP;
+        argv[argc++] = "-G";
+        argv[argc++] = OVSDB_GROUP;
+        argv[argc++] = "-s";
+        argv[argc++] = VTYSH_PROMPT;
     }
-    else
+    argv[argc++] = (char *)username;
+    argv[argc] = NULL;
+
+    /* in a process group of its own, killed as a whole if it hangs */
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attr, 0);
+    err = posix_spawn(&pid, argv[0], NULL, &attr, argv, environ);
+    posix_spawnattr_destroy(&attr);
+    if (0 != err)
     {
-        snprintf(useradd_comm, sizeof(useradd_comm),
-                    "%s %s", USERDEL, username);
+        VLOG_ERR("Failed to run %s", argv[0]);
+        return -1;
     }
 
-    if (0 > system(useradd_comm))
+    return pid;
+}
+
+/**
+ * Create a user using useradd program
+ *
+ * @param username username to add
+ * @param useradd  add if true, deleate otherwise
+ */
+struct spwd *create_user(const char *username, int useradd)
+{
+    struct spwd *passwd_entry = NULL;
+    int wstatus;
+    pid_t pid;
+
+    /* whatever useradd/userdel did, the files are parsed again */
+    passwd_srv_userdb_invalidate();
+    if (0 > (pid = spawn_user_command(username, useradd)))
     {
-        memset(useradd_comm, 0, sizeof(useradd_comm));
         return NULL;
     }
+    while ((0 > waitpid(pid, &wstatus, 0)) && (EINTR == errno))
+    {
+        /* interrupted by SIGCHLD of a job */
+    }
 
     /* make sure that user has been created */
     if (useradd && NULL == (passwd_entry = find_password_info(username)))
     {
-        memset(useradd_comm, 0, sizeof(useradd_comm));
         return NULL;
     }
 
-    memset(useradd_comm, 0, sizeof(useradd_comm));
     return passwd_entry;
 }
 
@@ -385,13 +479,91 @@ char *create_new_salt()
 }
 
 /**
- * verify user based on group information
+ * Find a user in the passwd file under the root directory.  Used instead of
+ * getpwnam()/getpwuid() when the password server runs in a sandbox.
+ *
+ * @param name username to find, NULL to find by uid
+ * @param uid  user id to find
+ * @return passwd entry, valid until next lookup. NULL if none found
+ */
+static struct passwd *
+sandbox_getpwent(const char *name, uid_t uid)
+{
+    struct passwd *pw;
+    FILE *fp;
+
+    if (NULL == (fp = fopen(passwd_srv_file(PASSWD_SRV_FILE_PASSWD), "r")))
+    {
+        return NULL;
+    }
+
+    while (NULL != (pw = fgetpwent(fp)))
+    {
+        if (name ? (0 == strcmp(pw->pw_name, name)) : (pw->pw_uid == uid))
+        {
+            break;
+        }
+    }
+
+    fclose(fp);
+    return pw;
+}
+
+/**
+ * verify user based on the passwd and group files under the root directory
  *
  * @user username
  * @group_name group which user must be the part of it
  * @return true if user is in the specified group
  */
 static int
+sandbox_check_user_group(const char *user, const char *group_name)
+{
+    struct passwd *pw;
+    struct group *gr;
+    gid_t gid;
+    FILE *fp;
+    int found = false, j;
+
+    if (NULL == (pw = sandbox_getpwent(user, 0)))
+    {
+        return false;
+    }
+    gid = pw->pw_gid;
+
+    if (NULL == (fp = fopen(passwd_srv_file(PASSWD_SRV_FILE_GROUP), "r")))
+    {
+        return false;
+    }
+
+    while (NULL != (gr = fgetgrent(fp)))
+    {
+        if (strcmp(gr->gr_name, group_name))
+        {
+            continue;
+        }
+
+        /* primary group or listed as a member */
+        found = (gr->gr_gid == gid);
+        for (j = 0; !found && gr->gr_mem[j]; j++)
+        {
+            found = (0 == strcmp(gr->gr_mem[j], user));
+        }
+        break;
+    }
+
+    fclose(fp);
+    return found;
+}
+
+/**
+ * verify user based on group information
+ *
+ * @user username
+ * @group_name group which user must be the part of it
+ * @return true if user is in the specified group
+ */
+int
 check_user_group( const char *user, const char *group_name)
 {
        gid_t groups[MAX_GROUPS_USED];
@@ -399,6 +571,11 @@ check_user_group( const char *user, const char *group_name)
        struct passwd *pw;
        struct group *gr;
 
+       if (passwd_srv_is_sandboxed())
+       {
+           return sandbox_check_user_group(user, group_name);
+       }
+
        memset(groups, 0, (sizeof(gid_t)*MAX_GROUPS_USED));
 
        /* Fetch passwd structure (contains first group ID for user) */
@@ -565,7 +742,10 @@ get_client_username(int pid)
 
     stat(stat_string, &u_stat);
 
-    if ((user = getpwuid(u_stat.st_uid)) == NULL) {
+    user = passwd_srv_is_sandboxed() ? sandbox_getpwent(NULL, u_stat.st_uid) :
+            getpwuid(u_stat.st_uid);
+
+    if (user == NULL) {
         VLOG_ERR("Cannot stat %s stat_string", stat_string);
         return NULL;
     }
@@ -573,68 +753,196 @@ get_client_username(int pid)
     return strdup(user->pw_name);
 }
 
-/*
- * Update password for the user. Search for the username in /etc/shadow and
- * update password string with on passed onto it.
+/**
+ * Rewrite a shadow file with new password string for the user.
  *
- * @param user username to find
- * @param pass password to store
+ * Entries are copied line by line into a temporary file next to the shadow
+ * file which then replaces it, so an entry whose length changes cannot
+ * overwrite the entries following it.  Caller must hold the shadow lock.
+ *
+ * @param shadow_file shadow file to update
+ * @param user        username to find
+ * @param pass        password to store
  * @return SUCCESS if updated, error code if fails to update
  */
-int store_password(char *user, char *pass)
+int update_shadow_file(const char *shadow_file, const char *user,
+                       const char *pass)
 {
-    FILE *fpShadow;
-    long int cur_pos = 0;
-    struct spwd *cur_user;
-    int cur_uname_len, uname_len;
-    char newpass[512];
+    FILE *fpShadow, *fpTemp;
+    struct stat f_stat;
+    struct spwd cur_user, *result;
+    char tmp_file[PATH_MAX], buf[1024];
+    char *line = NULL;
+    size_t line_size = 0;
+    int uname_len, fd;
     int err = PASSWD_ERR_PASSWD_UPD_FAIL;
 
-    memset(newpass, 0, sizeof(newpass));
-    memcpy(newpass, pass, strlen(pass));
-
     uname_len = strlen(user);
 
-    /* lock shadow file */
-    if (0 != lckpwdf())
+    if (NULL == (fpShadow = fopen(shadow_file, "r")))
     {
         return PASSWD_ERR_FATAL;
     }
 
-    if (NULL == (fpShadow = fopen(PASSWD_SHADOW_FILE, "r+a")))
+    snprintf(tmp_file, sizeof(tmp_file), "%s+", shadow_file);
+
+    /* temporary file gets the same owner and mode as the shadow file */
+    if ((0 != fstat(fileno(fpShadow), &f_stat)) ||
+        (0 > (fd = open(tmp_file, O_WRONLY | O_CREAT | O_TRUNC,
+                        f_stat.st_mode & 07777))))
     {
+        fclose(fpShadow);
         return PASSWD_ERR_FATAL;
     }
 
-    /* save file position */
-    cur_pos = ftell(fpShadow);
+    if ((0 != fchown(fd, f_stat.st_uid, f_stat.st_gid)) &&
+        (0 == geteuid()))
+    {
+        VLOG_DBG("Failed to set owner of %s", tmp_file);
+    }
+
+    /* mode given to open() is masked by the umask set for the key files */
+    fchmod(fd, f_stat.st_mode & 07777);
 
-    while((cur_user = fgetspent(fpShadow)))
+    if (NULL == (fpTemp = fdopen(fd, "w")))
     {
-        cur_uname_len = strlen(cur_user->sp_namp);
+        close(fd);
+        unlink(tmp_file);
+        fclose(fpShadow);
+        return PASSWD_ERR_FATAL;
+    }
 
-       if ( (cur_uname_len == uname_len) &&
-               (0 == strncmp(cur_user->sp_namp, user, strlen(user))) )
-       {
-           /* found the match, set file pointer to current user location */
-           fsetpos(fpShadow, (const fpos_t*)&cur_pos);
+    while (0 < getline(&line, &line_size, fpShadow))
+    {
+        if ((PASSWD_ERR_PASSWD_UPD_FAIL == err) &&
+            (0 == strncmp(line, user, uname_len)) &&
+            (':' == line[uname_len]) &&
+            (0 == sgetspent_r(line, &cur_user, buf, sizeof(buf), &result)))
+        {
+            /* found the match, write entry back with new password */
+            cur_user.sp_pwdp = (char *)pass;
+            putspent(&cur_user, fpTemp);
+            memset(buf, 0, sizeof(buf));
 
-           cur_user->sp_pwdp = newpass;
+            err = PASSWD_ERR_SUCCESS;
+            continue;
+        }
 
-           /* update password info */
-           putspent(cur_user, fpShadow);
+        fputs(line, fpTemp);
+    }
 
-           err = PASSWD_ERR_SUCCESS;
-           break;
-       }
+    if (line)
+    {
+        memset(line, 0, line_size);
+        free(line);
+    }
+    fclose(fpShadow);
+
+    if ((0 != fflush(fpTemp)) || (0 != fsync(fileno(fpTemp))))
+    {
+        err = PASSWD_ERR_FATAL;
+    }
+    fclose(fpTemp);
+
+    if ((PASSWD_ERR_SUCCESS != err) || (0 != rename(tmp_file, shadow_file)))
+    {
+        unlink(tmp_file);
+        return (PASSWD_ERR_SUCCESS == err) ? PASSWD_ERR_FATAL : err;
+    }
+
+    return err;
+}
+
+/**
+ * Lock the shadow file.  Same protocol as lckpwdf() - a write lock on
+ * /etc/.pwd.lock - but the lock file is taken under the root directory so
+ * a sandboxed password server does not need access to /etc.
+ *
+ * @return 0 if locked, -1 if lock could not be taken in PASSWD_LOCK_TIMEOUT
+ */
+int lock_shadow_file()
+{
+    struct flock fl;
+    int fd, retry;
+
+    if (0 <= s_lock_fd)
+    {
+        /* already held by this process */
+        return 0;
+    }
+
+    if (0 > (fd = open(passwd_srv_file(PASSWD_SRV_FILE_PWD_LOCK),
+                       O_WRONLY | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR)))
+    {
+        return -1;
+    }
 
-       /* save file position */
-       cur_pos = ftell(fpShadow);
+    /* umask set while writing the key files would leave it unwritable */
+    fchmod(fd, S_IRUSR | S_IWUSR);
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+
+    for (retry = 0; retry < PASSWD_LOCK_TIMEOUT * 10; retry++)
+    {
+        if (0 == fcntl(fd, F_SETLK, &fl))
+        {
+            s_lock_fd = fd;
+            return 0;
+        }
+
+        if ((EACCES != errno) && (EAGAIN != errno))
+        {
+            break;
+        }
+
+        /* held by useradd, passwd or alike, try again in 100ms */
+        usleep(100000);
+    }
+
+    close(fd);
+    return -1;
+}
+
+/**
+ * Release the lock taken by lock_shadow_file()
+ */
+void unlock_shadow_file()
+{
+    if (0 <= s_lock_fd)
+    {
+        /* closing the descriptor releases the lock */
+        close(s_lock_fd);
+        s_lock_fd = -1;
     }
+}
+
+/*
+ * Update password for the user. Search for the username in /etc/shadow and
+ * update password string with on passed onto it.
+ *
+ * @param user username to find
+ * @param pass password to store
+ * @return SUCCESS if updated, error code if fails to update
+ */
+int store_password(char *user, char *pass)
+{
+    int err;
+
+    /* lock shadow file */
+    if (0 != lock_shadow_file())
+    {
+        return PASSWD_ERR_FATAL;
+    }
+
+    err = update_shadow_file(passwd_srv_file(PASSWD_SRV_FILE_SHADOW), user,
+                             pass);
+    passwd_srv_vcache_invalidate(user);
+    passwd_srv_userdb_invalidate();
 
     /* unlock shadow file */
-    ulckpwdf();
-    fclose(fpShadow);
+    unlock_shadow_file();
 
     return err;
 }
@@ -650,6 +958,7 @@ int create_and_store_password(passwd_client_t *client)
     char *salt = NULL;
     char *password, *newpassword;
     int  err = 0;
+    uint64_t t_stage, ns;
 
     if ((NULL == client) || (NULL == client->passwd))
     {
@@ -667,10 +976,25 @@ int create_and_store_password(passwd_client_t *client)
      *          any encryption method defined in logins.def file
      *          i.e. SHA512 is not supported by 'openssl passwd'
      */
+    t_stage = passwd_srv_stage_now();
     newpassword = crypt(password, salt);
+    ns = passwd_srv_stage_end(client, PASSWD_SRV_STAGE_CRYPT, t_stage);
+    PASSWD_SRV_PROBE3(crypt, client->req_id, client->msg.op_code, ns);
 
-    /* store it to shadow file */
-    err = store_password(client->msg.username, newpassword);
+    /* store it to shadow file, unless the client of a password change has
+     * gone; a user added by useradd gets its password regardless */
+    if ((PASSWD_MSG_CHG_PASSWORD == client->msg.op_code) &&
+        passwd_srv_request_cancelled(client, PASSWD_SRV_STAGE_STORE))
+    {
+        err = PASSWD_ERR_CANCELLED;
+    }
+    else
+    {
+        t_stage = passwd_srv_stage_now();
+        err = store_password(client->msg.username, newpassword);
+        ns = passwd_srv_stage_end(client, PASSWD_SRV_STAGE_STORE, t_stage);
+        PASSWD_SRV_PROBE3(store__password, client->req_id, err, ns);
+    }
 
     memset(newpassword, 0, strlen(newpassword));
     memset(password, 0, strlen(password));
@@ -757,6 +1081,9 @@ int validate_user(int opcode, char *client)
     }
     case PASSWD_MSG_ADD_USER:
     case PASSWD_MSG_DEL_USER:
+    case PASSWD_MSG_SUBSCRIBE:
+    case PASSWD_MSG_JOB_STATUS:
+    case PASSWD_MSG_SET_HASH:
     {
         if (!check_user_group(client, ADMIN_GROUP) != PASSWD_ERR_SUCCESS)
         {
@@ -764,6 +1091,26 @@ int validate_user(int opcode, char *client)
         }
         break;
     }
+    case PASSWD_MSG_LIST_USERS:
+    case PASSWD_MSG_GET_USER:
+    case PASSWD_MSG_GET_AGING:
+    {
+        if (!check_user_group(client, OVSDB_GROUP) &&
+            !check_user_group(client, ADMIN_GROUP))
+        {
+            return PASSWD_ERR_INVALID_USER;
+        }
+        break;
+    }
+    case PASSWD_MSG_VERIFY:
+    {
+        /* checking passwords of any user is not given with ovsdb-client */
+        if (!check_user_group(client, VERIFY_GROUP) != PASSWD_ERR_SUCCESS)
+        {
+            return PASSWD_ERR_INVALID_USER;
+        }
+        break;
+    }
     default:
     {
         /* operation is not supported */
@@ -774,6 +1121,20 @@ int validate_user(int opcode, char *client)
     return PASSWD_ERR_SUCCESS;
 }
 
+/**
+ * Check that a shadow password field holds a hash a password can match.
+ * An empty field, '*' and a field locked with '!' by usermod -L or
+ * passwd -l never do: crypt() of such a salt returns "*0" or fails.
+ *
+ * @param hash password field of the shadow entry
+ * @return TRUE if the field is a hash
+ */
+int passwd_srv_hash_usable(const char *hash)
+{
+    return (NULL != hash) && ('\0' != hash[0]) && ('*' != hash[0]) &&
+           ('!' != hash[0]);
+}
+
 /**
  * validate password by using crypt function
  *
@@ -782,8 +1143,19 @@ int validate_user(int opcode, char *client)
  */
 int validate_password(passwd_client_t *client)
 {
+    const char *hash = client->passwd->sp_pwdp;
     char *crypt_str = NULL;
+    size_t hash_len;
     int  err = 0;
+    uint64_t t_stage = passwd_srv_stage_now(), ns;
+
+    /* a locked or disabled account takes no password at all */
+    if (!passwd_srv_hash_usable(hash))
+    {
+        VLOG_INFO("Password of %s is locked or empty", client->msg.username);
+        return PASSWD_ERR_FATAL;
+    }
+    hash_len = strlen(hash);
 
     /*
     * TODO: replace crypt() with openssl.
@@ -793,13 +1165,15 @@ int validate_password(passwd_client_t *client)
     *       - hashed password is in following format: $<method>$<salt>$<hashed string>
     *       - investigate to use openssl to produce same hashed string
     */
-    if ((NULL == (crypt_str = crypt(client->msg.oldpasswd,
-            client->passwd->sp_pwdp))) ||
-        (0 != strncmp(crypt_str, client->passwd->sp_pwdp,
-                strlen(client->passwd->sp_pwdp))))
+    /* the whole string must match, compared in constant time */
+    if ((NULL == (crypt_str = crypt(client->msg.oldpasswd, hash))) ||
+        (strlen(crypt_str) != hash_len) ||
+        (0 != CRYPTO_memcmp(crypt_str, hash, hash_len)))
     {
         err = PASSWD_ERR_FATAL;
     }
+    ns = passwd_srv_stage_end(client, PASSWD_SRV_STAGE_CRYPT, t_stage);
+    PASSWD_SRV_PROBE3(crypt, client->req_id, client->msg.op_code, ns);
 
     if (NULL != crypt_str)
     {
@@ -809,12 +1183,88 @@ int validate_password(passwd_client_t *client)
 }
 
 /**
- * Find password info for a given user in /etc/shadow file
+ * Check a hash sent with PASSWD_MSG_SET_HASH, it is stored in the shadow
+ * file as it is.  Only $5$[rounds=N$]salt$hash, $6$[rounds=N$]salt$hash and
+ * $y$params$salt$hash are taken, with fields of crypt() characters only so
+ * that no ':' or newline gets into the shadow file.
  *
- * @param  username[in] username to search
- * @return password     parsed shadow entry
+ * @param hash hash to check, NUL terminated within PASSWD_SRV_HASH_SIZE
+ * @return PASSWD_ERR_SUCCESS if well formed, PASSWD_ERR_INVALID_PARAM
+ *         otherwise
  */
-struct spwd *find_password_info(const char *username)
+static int
+check_password_hash(const char *hash)
+{
+    const char *field;
+    size_t len, hash_len;
+    int i;
+
+    if (NULL == memchr(hash, '\0', PASSWD_SRV_HASH_SIZE))
+    {
+        return PASSWD_ERR_INVALID_PARAM;
+    }
+
+    field = hash + 3;
+    if (0 == strncmp(hash, "$y$", 3))
+    {
+        /* parameters and salt, as encoded by crypt_gensalt() */
+        for (i = 0; i < 2; i++)
+        {
+            len = strspn(field, CRYPT_CHARS);
+            if ((0 == len) || ('$' != field[len]))
+            {
+                return PASSWD_ERR_INVALID_PARAM;
+            }
+            field += len + 1;
+        }
+        hash_len = YESCRYPT_HASH_LEN;
+    }
+    else if ((0 == strncmp(hash, "$5$", 3)) || (0 == strncmp(hash, "$6$", 3)))
+    {
+        hash_len = ('5' == hash[1]) ? SHA256_HASH_LEN : SHA512_HASH_LEN;
+        if (0 == strncmp(field, "rounds=", strlen("rounds=")))
+        {
+            field += strlen("rounds=");
+            len = strspn(field, "0123456789");
+            if ((0 == len) || (SHA_ROUNDS_DIGITS < len) || ('$' != field[len]))
+            {
+                return PASSWD_ERR_INVALID_PARAM;
+            }
+            field += len + 1;
+        }
+
+        /* salt of up to MAX_SALT_SIZE characters */
+        len = strspn(field, CRYPT_CHARS);
+        if ((0 == len) || (MAX_SALT_SIZE < len) || ('$' != field[len]))
+        {
+            return PASSWD_ERR_INVALID_PARAM;
+        }
+        field += len + 1;
+    }
+    else
+    {
+        /* DES, MD5 or a locked entry is not taken */
+        return PASSWD_ERR_INVALID_PARAM;
+    }
+
+    if ((hash_len != strlen(field)) ||
+        (hash_len != strspn(field, CRYPT_CHARS)))
+    {
+        return PASSWD_ERR_INVALID_PARAM;
+    }
+
+    return PASSWD_ERR_SUCCESS;
+}
+
+/**
+ * Find password info for a given user in a shadow file.  Caller must hold
+ * the shadow lock.
+ *
+ * @param  shadow_file[in] shadow file to search
+ * @param  username[in]    username to search
+ * @return password        parsed shadow entry, valid until next lookup
+ */
+struct spwd *search_shadow_file(const char *shadow_file, const char *username)
 {
     struct spwd *password = NULL;
     FILE *fpShadow;
@@ -825,23 +1275,16 @@ struct spwd *find_password_info(const char *username)
         return NULL;
     }
 
-    /* lock /etc/shadow file to read */
-    if (0 != lckpwdf())
-    {
-        VLOG_ERR("Failed to lock /usr/shadow file");
-        return NULL;
-    }
-
     /* open shadow file */
-    if (NULL == (fpShadow = fopen(PASSWD_SHADOW_FILE, "r")))
+    if (NULL == (fpShadow = fopen(shadow_file, "r")))
     {
-        VLOG_ERR("Failed to open /usr/shadow file");
+        VLOG_ERR("Failed to open %s file", shadow_file);
         return NULL;
     }
 
     uname_len = strlen(username);
 
-    /* loop thru /etc/shadow to find user */
+    /* loop thru shadow file to find user */
     while(NULL != (password = fgetspent(fpShadow)))
     {
         cur_uname_len = strlen(password->sp_namp);
@@ -849,24 +1292,43 @@ struct spwd *find_password_info(const char *username)
 
         if (0 == memcmp(password->sp_namp, username, name_len))
         {
-            /* unlock shadow file */
-            if (0 != ulckpwdf())
-            {
-                VLOG_DBG("Failed to unlock /usr/shadow file");
-            }
-            fclose(fpShadow);
-            return password;
+            break;
         }
     }
 
-    /* unlock shadow file */
-    if (0 != ulckpwdf())
+    fclose(fpShadow);
+    return password;
+}
+
+/**
+ * Find password info for a given user in /etc/shadow file
+ *
+ * @param  username[in] username to search
+ * @return password     parsed shadow entry
+ */
+struct spwd *find_password_info(const char *username)
+{
+    struct spwd *password = NULL;
+
+    if (NULL == username)
     {
-       VLOG_DBG("Failed to unlock /usr/shadow file");
+        return NULL;
     }
 
-    fclose(fpShadow);
-    return NULL;
+    /* lock /etc/shadow file to read */
+    if (0 != lock_shadow_file())
+    {
+        VLOG_ERR("Failed to lock /usr/shadow file");
+        return NULL;
+    }
+
+    password = search_shadow_file(passwd_srv_file(PASSWD_SRV_FILE_SHADOW),
+                                  username);
+
+    /* unlock shadow file */
+    unlock_shadow_file();
+
+    return password;
 }
 
 /**
@@ -878,6 +1340,7 @@ struct spwd *find_password_info(const char *username)
 int process_client_request(passwd_client_t *client)
 {
     int error = PASSWD_ERR_FATAL;
+    uint64_t t_stage, ns;
 
     if (NULL == client)
     {
@@ -888,8 +1351,27 @@ int process_client_request(passwd_client_t *client)
     {
     case PASSWD_MSG_CHG_PASSWORD:
     {
+        /* too many failed attempts, old password is not even checked */
+        if (PASSWD_ERR_SUCCESS !=
+            (error = passwd_srv_backoff_check(client->msg.username,
+                                              &client->retry_after_ms)))
+        {
+            VLOG_INFO("Password change for %s rejected, in backoff",
+                    client->msg.username);
+            return error;
+        }
+
         /* proceed to change password for the user */
-        if (NULL == (client->passwd = find_password_info(client->msg.username)))
+        if (passwd_srv_request_cancelled(client, PASSWD_SRV_STAGE_FIND))
+        {
+            return PASSWD_ERR_CANCELLED;
+        }
+        t_stage = passwd_srv_stage_now();
+        client->passwd = find_password_info(client->msg.username);
+        ns = passwd_srv_stage_end(client, PASSWD_SRV_STAGE_FIND, t_stage);
+        PASSWD_SRV_PROBE4(find__password, client->req_id, client->msg.op_code,
+                          client->passwd != NULL, ns);
+        if (NULL == client->passwd)
         {
             /* logging error */
             VLOG_INFO("User %s cannot be found in password file",
@@ -898,17 +1380,23 @@ int process_client_request(passwd_client_t *client)
         }
 
         /* validate old password */
+        if (passwd_srv_request_cancelled(client, PASSWD_SRV_STAGE_CRYPT))
+        {
+            return PASSWD_ERR_CANCELLED;
+        }
         if (0 != validate_password(client))
         {
+            passwd_srv_backoff_failure(client->msg.username);
             return PASSWD_ERR_PASSWORD_NOT_MATCH;
         }
+        passwd_srv_backoff_success(client->msg.username);
 
         if (PASSWD_ERR_SUCCESS == (error = create_and_store_password(client)))
         {
             VLOG_INFO("Password updated successfully for %s",
                     client->msg.username);
         }
-        else
+        else if (PASSWD_ERR_CANCELLED != error)
         {
             VLOG_INFO("Password was not updated successfully [error=%d]", error);
         }
@@ -917,14 +1405,27 @@ int process_client_request(passwd_client_t *client)
     case PASSWD_MSG_ADD_USER:
     {
         /* make sure username does not exist */
-        if (NULL != (client->passwd = find_password_info(client->msg.username)))
+        t_stage = passwd_srv_stage_now();
+        client->passwd = find_password_info(client->msg.username);
+        ns = passwd_srv_stage_end(client, PASSWD_SRV_STAGE_FIND, t_stage);
+        PASSWD_SRV_PROBE4(find__password, client->req_id, client->msg.op_code,
+                          client->passwd != NULL, ns);
+        if (NULL != client->passwd)
         {
             VLOG_ERR("User %s already exists", client->msg.username);
             return PASSWD_ERR_USER_EXIST;
         }
 
-        /* add user to /etc/passwd file */
-        if (NULL == (client->passwd = create_user(client->msg.username, TRUE)))
+        /* add user to /etc/passwd file, last point the request is dropped
+         * at if its client has gone */
+        if (passwd_srv_request_cancelled(client, PASSWD_SRV_STAGE_USERADD))
+        {
+            return PASSWD_ERR_CANCELLED;
+        }
+        t_stage = passwd_srv_stage_now();
+        client->passwd = create_user(client->msg.username, TRUE);
+        passwd_srv_stage_end(client, PASSWD_SRV_STAGE_USERADD, t_stage);
+        if (NULL == client->passwd)
         {
             /* failed to create user or getting information from /etc/passwd */
             VLOG_ERR("Failed to create a user");
@@ -947,14 +1448,27 @@ int process_client_request(passwd_client_t *client)
     case PASSWD_MSG_DEL_USER:
     {
         /* make sure username does not exist */
-        if (NULL == (client->passwd = find_password_info(client->msg.username)))
+        t_stage = passwd_srv_stage_now();
+        client->passwd = find_password_info(client->msg.username);
+        ns = passwd_srv_stage_end(client, PASSWD_SRV_STAGE_FIND, t_stage);
+        PASSWD_SRV_PROBE4(find__password, client->req_id, client->msg.op_code,
+                          client->passwd != NULL, ns);
+        if (NULL == client->passwd)
         {
             VLOG_INFO("User %s does not exist to delete", client->msg.username);
             return PASSWD_ERR_USER_NOT_FOUND;
         }
 
         /* delete user from /etc/passwd file */
-        if (NULL != (client->passwd = create_user(client->msg.username, FALSE)))
+        if (passwd_srv_request_cancelled(client, PASSWD_SRV_STAGE_USERADD))
+        {
+            return PASSWD_ERR_CANCELLED;
+        }
+        t_stage = passwd_srv_stage_now();
+        client->passwd = create_user(client->msg.username, FALSE);
+        passwd_srv_stage_end(client, PASSWD_SRV_STAGE_USERADD, t_stage);
+        passwd_srv_vcache_invalidate(client->msg.username);
+        if (NULL != client->passwd)
         {
             VLOG_INFO("Failed to remove user %s", client->msg.username);
             return PASSWD_ERR_USERDEL_FAILED;
@@ -963,6 +1477,142 @@ int process_client_request(passwd_client_t *client)
         error = PASSWD_ERR_SUCCESS;
         break;
     }
+    case PASSWD_MSG_SET_HASH:
+    {
+        /* hashed by the client, e.g. exported from another switch, nothing
+         * is hashed here */
+        struct passwd *pw;
+
+        if (PASSWD_ERR_SUCCESS != (error = check_password_hash(client->hash)))
+        {
+            VLOG_INFO("Hash for %s rejected, not a supported crypt() string",
+                    client->msg.username);
+            return error;
+        }
+
+        /* users are added with ADD_USER first */
+        t_stage = passwd_srv_stage_now();
+        client->passwd = find_password_info(client->msg.username);
+        ns = passwd_srv_stage_end(client, PASSWD_SRV_STAGE_FIND, t_stage);
+        PASSWD_SRV_PROBE4(find__password, client->req_id, client->msg.op_code,
+                          client->passwd != NULL, ns);
+        if (NULL == client->passwd)
+        {
+            VLOG_INFO("User %s cannot be found in password file",
+                    client->msg.username);
+            return PASSWD_ERR_USER_NOT_FOUND;
+        }
+
+        /* no way around the old password of root */
+        pw = passwd_srv_is_sandboxed() ?
+             sandbox_getpwent(client->msg.username, 0) :
+             getpwnam(client->msg.username);
+        if ((NULL == pw) || (0 == pw->pw_uid))
+        {
+            VLOG_ERR("Hash for %s rejected, uid 0 or unknown uid",
+                    client->msg.username);
+            return PASSWD_ERR_INVALID_USER;
+        }
+
+        if (passwd_srv_request_cancelled(client, PASSWD_SRV_STAGE_STORE))
+        {
+            return PASSWD_ERR_CANCELLED;
+        }
+        t_stage = passwd_srv_stage_now();
+        error = store_password(client->msg.username, client->hash);
+        ns = passwd_srv_stage_end(client, PASSWD_SRV_STAGE_STORE, t_stage);
+        PASSWD_SRV_PROBE3(store__password, client->req_id, error, ns);
+
+        if (PASSWD_ERR_SUCCESS == error)
+        {
+            VLOG_INFO("Hash stored for %s", client->msg.username);
+        }
+        else
+        {
+            VLOG_INFO("Hash was not stored for %s [error=%d]",
+                    client->msg.username, error);
+        }
+        break;
+    }
+    case PASSWD_MSG_VERIFY:
+    {
+        /* failed checks count against the user as failed changes do, so
+         * that verifying is no way around the backoff */
+        if (PASSWD_ERR_SUCCESS !=
+            (error = passwd_srv_backoff_check(client->msg.username,
+                                              &client->retry_after_ms)))
+        {
+            VLOG_INFO("Password check for %s rejected, in backoff",
+                    client->msg.username);
+            return error;
+        }
+
+        if (passwd_srv_request_cancelled(client, PASSWD_SRV_STAGE_FIND))
+        {
+            return PASSWD_ERR_CANCELLED;
+        }
+        t_stage = passwd_srv_stage_now();
+        client->passwd = find_password_info(client->msg.username);
+        ns = passwd_srv_stage_end(client, PASSWD_SRV_STAGE_FIND, t_stage);
+        PASSWD_SRV_PROBE4(find__password, client->req_id, client->msg.op_code,
+                          client->passwd != NULL, ns);
+        if (NULL == client->passwd)
+        {
+            VLOG_INFO("User %s cannot be found in password file",
+                    client->msg.username);
+            return PASSWD_ERR_USER_NOT_FOUND;
+        }
+
+        /* password to check is sent as the old password */
+        if (passwd_srv_vcache_lookup(client->msg.username,
+                                     client->msg.oldpasswd,
+                                     client->passwd->sp_pwdp))
+        {
+            passwd_srv_backoff_success(client->msg.username);
+            error = PASSWD_ERR_SUCCESS;
+            break;
+        }
+        if (passwd_srv_request_cancelled(client, PASSWD_SRV_STAGE_CRYPT))
+        {
+            return PASSWD_ERR_CANCELLED;
+        }
+        if (0 != validate_password(client))
+        {
+            passwd_srv_backoff_failure(client->msg.username);
+            return PASSWD_ERR_PASSWORD_NOT_MATCH;
+        }
+        passwd_srv_backoff_success(client->msg.username);
+
+        /* crypt() gave the whole of a usable hash */
+        passwd_srv_vcache_insert(client->msg.username, client->msg.oldpasswd,
+                                 client->passwd->sp_pwdp);
+
+        error = PASSWD_ERR_SUCCESS;
+        break;
+    }
+    case PASSWD_MSG_LIST_USERS:
+    case PASSWD_MSG_GET_USER:
+    case PASSWD_MSG_GET_AGING:
+    {
+        /* answered from memory, the files are not read unless changed */
+        t_stage = passwd_srv_stage_now();
+        error = passwd_srv_userdb_query(client);
+        passwd_srv_stage_end(client, PASSWD_SRV_STAGE_FIND, t_stage);
+        break;
+    }
+    case PASSWD_MSG_SUBSCRIBE:
+    {
+        /* last event seen, taken from the message when it was decrypted,
+         * the events are sent once the reply is */
+        error = PASSWD_ERR_SUCCESS;
+        break;
+    }
+    case PASSWD_MSG_JOB_STATUS:
+    {
+        /* status of a job submitted by the same uid */
+        error = passwd_srv_job_query(client);
+        break;
+    }
     default:
     {
         /* wrong op-code */
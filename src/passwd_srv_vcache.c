@@ -0,0 +1,314 @@
+/*
+ * (c) Copyright 2016 Hewlett Packard Enterprise Development LP
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+/************************************************************************//**
+ * @ingroup passwd-srvd
+ *
+ * @file
+ * Verification cache of the Password Server.
+ *
+ *    Successful PASSWD_MSG_VERIFY checks are remembered for
+ *     VERIFY_CACHE_TTL_MS so that a repeated check of the same password
+ *     costs an HMAC instead of crypt().  Entries hold only
+ *     HMAC(secret, username || password || shadow hash) and a tag of the
+ *     user, HMAC(secret, username), under a random secret of the process;
+ *     neither passwords nor user names are kept.  A change of the shadow
+ *     entry of a user changes the HMAC of its checks, and the entries of
+ *     the user are dropped as soon as the server stores a password for it
+ *     or deletes it.
+ ***************************************************************************/
+#include <stdio.h>
+#include <string.h>
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+#include <timeval.h>
+#include "openvswitch/vlog.h"
+#include "passwd_srv_pri.h"
+
+VLOG_DEFINE_THIS_MODULE(passwd_srv_vcache);
+
+#define PASSWD_SRV_VCACHE_SETS   256    /* checks cached = sets * ways */
+#define PASSWD_SRV_VCACHE_WAYS   4
+#define PASSWD_SRV_VCACHE_SECRET 32
+#define PASSWD_SRV_VCACHE_MAC    32     /* SHA-256 */
+#define PASSWD_SRV_VCACHE_HASH   256    /* longest shadow hash cached */
+
+typedef struct vcache_entry
+{
+    uint64_t user;            /* tag of the user, 0 if the entry is free */
+    uint8_t mac[PASSWD_SRV_VCACHE_MAC];
+    long long int t_insert;   /* time_msec() the check was cached */
+} vcache_entry_t;
+
+static vcache_entry_t s_vcache[PASSWD_SRV_VCACHE_SETS][PASSWD_SRV_VCACHE_WAYS];
+static passwd_srv_vcache_stats_t s_vcache_stats;
+static uint8_t s_secret[PASSWD_SRV_VCACHE_SECRET];
+static int s_secret_set = FALSE;
+
+/**
+ * HMAC of some data under the secret of the process, which is drawn on
+ * first use
+ *
+ * @param data data to authenticate
+ * @param len  length of the data
+ * @param mac  set to PASSWD_SRV_VCACHE_MAC bytes
+ * @return TRUE, FALSE if no secret is available
+ */
+static int
+vcache_hmac(const void *data, size_t len, uint8_t *mac)
+{
+    unsigned int mac_len = PASSWD_SRV_VCACHE_MAC;
+
+    if (!s_secret_set)
+    {
+        if (1 != RAND_bytes(s_secret, sizeof(s_secret)))
+        {
+            VLOG_ERR("Failed to draw the verification cache secret");
+            return FALSE;
+        }
+        s_secret_set = TRUE;
+    }
+
+    return NULL != HMAC(EVP_sha256(), s_secret, sizeof(s_secret), data, len,
+                        mac, &mac_len);
+}
+
+/**
+ * Tag of a user and the set its checks are cached in
+ *
+ * @param username user name
+ * @param user     set to the tag of the user, never 0
+ * @return set of the user, NULL if no HMAC is available
+ */
+static vcache_entry_t *
+vcache_user(const char *username, uint64_t *user)
+{
+    uint8_t mac[PASSWD_SRV_VCACHE_MAC];
+
+    if (!vcache_hmac(username, strnlen(username, PASSWD_USERNAME_SIZE), mac))
+    {
+        return NULL;
+    }
+
+    memcpy(user, mac, sizeof(*user));
+    *user |= 1;
+    return s_vcache[(mac[8] | (mac[9] << 8)) % PASSWD_SRV_VCACHE_SETS];
+}
+
+/**
+ * HMAC of a check, of the user name, the password and the shadow hash
+ * separated by NUL
+ *
+ * @param username user name
+ * @param password password checked
+ * @param hash     shadow hash the password matched
+ * @param mac      set to PASSWD_SRV_VCACHE_MAC bytes
+ * @return TRUE, FALSE if the check cannot be cached
+ */
+static int
+vcache_check_mac(const char *username, const char *password,
+                 const char *hash, uint8_t *mac)
+{
+    char buf[PASSWD_USERNAME_SIZE + PASSWD_PASSWORD_SIZE +
+             PASSWD_SRV_VCACHE_HASH];
+    size_t ulen = strnlen(username, PASSWD_USERNAME_SIZE);
+    size_t plen = strnlen(password, PASSWD_PASSWORD_SIZE);
+    size_t hlen = strlen(hash);
+    int ok;
+
+    if ((0 == hlen) || (hlen >= PASSWD_SRV_VCACHE_HASH))
+    {
+        return FALSE;
+    }
+
+    memcpy(buf, username, ulen);
+    buf[ulen] = '\0';
+    memcpy(buf + ulen + 1, password, plen);
+    buf[ulen + 1 + plen] = '\0';
+    memcpy(buf + ulen + plen + 2, hash, hlen);
+
+    ok = vcache_hmac(buf, ulen + plen + 2 + hlen, mac);
+    OPENSSL_cleanse(buf, sizeof(buf));
+    return ok;
+}
+
+/**
+ * Whether an entry is in use and not expired, expired entries are freed
+ */
+static int
+vcache_live(vcache_entry_t *entry, long long int now, int ttl)
+{
+    if (entry->user && (now - entry->t_insert >= ttl))
+    {
+        memset(entry, 0, sizeof(*entry));
+    }
+    return 0 != entry->user;
+}
+
+/**
+ * Look up a check of a password against the shadow hash of a user
+ *
+ * @param username user name
+ * @param password password to check
+ * @param hash     shadow hash of the user
+ * @return TRUE if the same check succeeded within VERIFY_CACHE_TTL_MS,
+ *         FALSE if crypt() is to be run
+ */
+int passwd_srv_vcache_lookup(const char *username, const char *password,
+                             const char *hash)
+{
+    int ttl = passwd_srv_settings()->verify_cache_ttl;
+    uint8_t mac[PASSWD_SRV_VCACHE_MAC];
+    vcache_entry_t *set;
+    long long int now;
+    uint64_t user;
+    int way;
+
+    /* a locked account is checked by validate_password(), and fails */
+    if ((0 == ttl) || !passwd_srv_hash_usable(hash))
+    {
+        return FALSE;
+    }
+
+    if ((NULL == (set = vcache_user(username, &user))) ||
+        !vcache_check_mac(username, password, hash, mac))
+    {
+        s_vcache_stats.misses++;
+        return FALSE;
+    }
+
+    now = time_msec();
+    for (way = 0; way < PASSWD_SRV_VCACHE_WAYS; way++)
+    {
+        if (vcache_live(&set[way], now, ttl) && (set[way].user == user) &&
+            (0 == CRYPTO_memcmp(set[way].mac, mac, sizeof(mac))))
+        {
+            s_vcache_stats.hits++;
+            return TRUE;
+        }
+    }
+
+    s_vcache_stats.misses++;
+    return FALSE;
+}
+
+/**
+ * Cache a successful check.  The entry cached the longest ago in the set of
+ * the user is taken when the set is full.  Only a check which matched the
+ * whole of a usable hash may be cached, a locked hash is never.
+ *
+ * @param username user name
+ * @param password password checked
+ * @param hash     shadow hash the password matched
+ */
+void passwd_srv_vcache_insert(const char *username, const char *password,
+                              const char *hash)
+{
+    int ttl = passwd_srv_settings()->verify_cache_ttl;
+    vcache_entry_t *set, *victim = NULL;
+    uint8_t mac[PASSWD_SRV_VCACHE_MAC];
+    long long int now;
+    uint64_t user;
+    int way;
+
+    if ((0 == ttl) || !passwd_srv_hash_usable(hash) ||
+        (NULL == (set = vcache_user(username, &user))) ||
+        !vcache_check_mac(username, password, hash, mac))
+    {
+        return;
+    }
+
+    now = time_msec();
+    for (way = 0; way < PASSWD_SRV_VCACHE_WAYS; way++)
+    {
+        if (!vcache_live(&set[way], now, ttl))
+        {
+            victim = &set[way];
+            break;
+        }
+        if ((NULL == victim) || (set[way].t_insert < victim->t_insert))
+        {
+            victim = &set[way];
+        }
+    }
+    if (victim->user)
+    {
+        s_vcache_stats.evicted++;
+    }
+
+    victim->user = user;
+    memcpy(victim->mac, mac, sizeof(mac));
+    victim->t_insert = now;
+    s_vcache_stats.inserted++;
+}
+
+/**
+ * Drop the cached checks of a user, when its shadow entry is changed
+ *
+ * @param username user name
+ */
+void passwd_srv_vcache_invalidate(const char *username)
+{
+    vcache_entry_t *set;
+    uint64_t user;
+    int way;
+
+    if (!s_secret_set || (NULL == (set = vcache_user(username, &user))))
+    {
+        /* nothing was ever cached */
+        return;
+    }
+
+    for (way = 0; way < PASSWD_SRV_VCACHE_WAYS; way++)
+    {
+        if (set[way].user == user)
+        {
+            memset(&set[way], 0, sizeof(set[way]));
+            s_vcache_stats.invalidated++;
+        }
+    }
+}
+
+/**
+ * Get the counters of the verification cache
+ *
+ * @param stats filled with the counters
+ */
+void passwd_srv_vcache_stats(passwd_srv_vcache_stats_t *stats)
+{
+    int ttl = passwd_srv_settings()->verify_cache_ttl;
+    long long int now = time_msec();
+    int set, way;
+
+    *stats = s_vcache_stats;
+    stats->entries = 0;
+    stats->capacity = PASSWD_SRV_VCACHE_SETS * PASSWD_SRV_VCACHE_WAYS;
+    for (set = 0; set < PASSWD_SRV_VCACHE_SETS; set++)
+    {
+        for (way = 0; way < PASSWD_SRV_VCACHE_WAYS; way++)
+        {
+            if (s_vcache[set][way].user &&
+                (now - s_vcache[set][way].t_insert < ttl))
+            {
+                stats->entries++;
+            }
+        }
+    }
+}
@@ -40,12 +40,16 @@
 #include <limits.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <grp.h>
 
 #include <util.h>
 #include <daemon.h>
 #include <dirs.h>
+#include <dynamic-string.h>
 #include <unixctl.h>
+#include <poll-loop.h>
 #include <fatal-signal.h>
 #include <command-line.h>
 #include "openvswitch/vlog.h"
@@ -57,11 +61,54 @@ VLOG_DEFINE_THIS_MODULE(passwd_srvd);
 #define __USE_XOPEN_EXTENDED
 #include "/usr/include/ftw.h"
 
+/* set by --root and --config, NULL to use the defaults */
+static char *s_root_dir = NULL;
+static char *s_yaml_file = NULL;
+static char *s_trace_file = NULL;
+
+/* set by --takeover, key pair is handed off as well unless 'new-key' */
+static int s_takeover = FALSE;
+static int s_takeover_key = TRUE;
+
+/* SIGHUP handler writes to it to wake up the poll loop for a reload */
+static int s_reload_pipe[2] = {-1, -1};
+
+/* SIGTERM handler writes to it to stop the main loop */
+static int s_term_pipe[2] = {-1, -1};
+
+static void
+usage(void)
+{
+    printf("%s: OpenSwitch password server\n"
+           "usage: %s [OPTIONS]\n"
+           "\nPassword server options:\n"
+           "  --root=DIR              use account files, run directory and\n"
+           "                          YAML file under DIR (default: /)\n"
+           "  --config=FILE           YAML file to read (default: %s under\n"
+           "                          the root directory)\n"
+           "  --trace=FILE            record arrival time, opcode, result and\n"
+           "                          stage durations of every request\n"
+           "  --takeover[=KEY]        take over the listening socket of the\n"
+           "                          running password server, KEY is\n"
+           "                          keep-key (default) or new-key\n",
+           program_name, program_name, PASSWD_SRV_YAML_FILE);
+    daemon_usage();
+    vlog_usage();
+    printf("\nOther options:\n"
+           "  --unixctl=SOCKET        override default control socket name\n"
+           "  -h, --help              display this help message\n");
+    exit(EXIT_SUCCESS);
+}
+
 static char *
 passwd_srv_parse_options(int argc, char *argv[], char **unixctl_pathp)
 {
     enum {
         OPT_UNIXCTL = UCHAR_MAX + 1,
+        OPT_ROOT,
+        OPT_CONFIG,
+        OPT_TRACE,
+        OPT_TAKEOVER,
         VLOG_OPTION_ENUMS,
         DAEMON_OPTION_ENUMS,
         OVSDB_OPTIONS_END,
@@ -70,6 +117,10 @@ passwd_srv_parse_options(int argc, char *argv[], char **unixctl_pathp)
     static const struct option long_options[] = {
         {"help", no_argument, NULL, 'h'},
         {"unixctl", required_argument, NULL, OPT_UNIXCTL},
+        {"root", required_argument, NULL, OPT_ROOT},
+        {"config", required_argument, NULL, OPT_CONFIG},
+        {"trace", required_argument, NULL, OPT_TRACE},
+        {"takeover", optional_argument, NULL, OPT_TAKEOVER},
         DAEMON_LONG_OPTIONS,
         VLOG_LONG_OPTIONS,
         {"ovsdb-options-end", optional_argument, NULL, OVSDB_OPTIONS_END},
@@ -87,6 +138,36 @@ passwd_srv_parse_options(int argc, char *argv[], char **unixctl_pathp)
         }
 
         switch (c) {
+        case 'h':
+            usage();
+
+        case OPT_UNIXCTL:
+            *unixctl_pathp = optarg;
+            break;
+
+        case OPT_ROOT:
+            s_root_dir = optarg;
+            break;
+
+        case OPT_CONFIG:
+            s_yaml_file = optarg;
+            break;
+
+        case OPT_TRACE:
+            s_trace_file = optarg;
+            break;
+
+        case OPT_TAKEOVER:
+            s_takeover = TRUE;
+            if (optarg && (0 == strcmp(optarg, "new-key")))
+            {
+                s_takeover_key = FALSE;
+            }
+            else if (optarg && (0 != strcmp(optarg, "keep-key")))
+            {
+                ovs_fatal(0, "--takeover must be keep-key or new-key");
+            }
+            break;
 
         VLOG_OPTION_HANDLERS
         DAEMON_OPTION_HANDLERS
@@ -122,14 +203,38 @@ _delete_helper(const char *fpath, const struct stat *sb, int typeflag,
     return(PASSWD_ERR_SUCCESS);
 }
 
+/**
+ * Create parent directories of a path, i.e. 'mkdir -p $(dirname path)'
+ *
+ * @param path path whose parents are created
+ */
+static void
+create_parent_directory(const char *path)
+{
+    char dir[PATH_MAX];
+    char *slash;
+
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (slash = strchr(dir + 1, '/'); slash; slash = strchr(slash + 1, '/'))
+    {
+        *slash = '\0';
+        mkdir(dir, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
+        *slash = '/';
+    }
+}
+
 /**
  * Setup directory in /var/run to store password server related files
+ *
+ * @param keep_files TRUE to keep files of the password server taken over
  */
 static void
-create_directory()
+create_directory(int keep_files)
 {
     struct stat f_stat = {0};
     struct group *passwd_grp;
+    const char *run_dir = passwd_srv_file(PASSWD_SRV_FILE_RUN_DIR);
+    mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IXGRP;
 
     /* set group to be ovsdb_group */
     if ((passwd_grp = getgrnam(OVSDB_GROUP)))
@@ -139,49 +244,502 @@ create_directory()
         setgid(passwd_grp->gr_gid);
     }
 
-    if ((0 == stat(PASSWD_RUN_DIR, &f_stat)) && (0 != remove(PASSWD_RUN_DIR)))
+    if (keep_files)
+    {
+        return;
+    }
+
+    if ((0 == stat(run_dir, &f_stat)) && (0 != remove(run_dir)))
     {
         /*
          * failed to remove directory, try to clean up directory recursively
          * i.e. equivalent to 'rm -R PASSWD_RUN_DIR'
          */
-        if (0 != nftw(PASSWD_RUN_DIR, _delete_helper, 5, FTW_DEPTH | FTW_PHYS))
+        if (0 != nftw(run_dir, _delete_helper, 5, FTW_DEPTH | FTW_PHYS))
         {
             /* unable to delete the directory */
-            VLOG_ERR("Unable to remove %s", PASSWD_RUN_DIR);
+            VLOG_ERR("Unable to remove %s", run_dir);
             exit(PASSWD_ERR_FATAL);
         }
     }
 
+    if (passwd_srv_is_sandboxed())
+    {
+        /* sandbox may not have /var/run yet */
+        create_parent_directory(run_dir);
+    }
+
+    if (0 != geteuid())
+    {
+        /* without CAP_DAC_OVERRIDE owner needs search permission as well */
+        mode |= S_IXUSR;
+    }
+
     /* deletion was succesful, create directory */
-    mkdir(PASSWD_RUN_DIR, S_IRUSR | S_IWUSR | S_IRGRP | S_IXGRP);
+    mkdir(run_dir, mode);
 }
 
 /**
- * Signal handler to shutdown the password server gracefully
+ * Signal handler to shutdown the password server gracefully, the main loop
+ * stops serving and saves its state
  *
  * @param sig the signal number to be handled
  */
 static void
 passwd_srv_signal_handler(int sig)
 {
-    if (sig == SIGTERM)
+    char byte = 0;
+    int saved_errno = errno;
+
+    if ((sig == SIGTERM) && (0 > write(s_term_pipe[1], &byte, sizeof(byte))))
     {
-        /* un-initialize UNIX sockets */
-        socket_term_signal_handler();
+        /* pipe is full, the server is stopping already */
+    }
+    errno = saved_errno;
+}
+
+/**
+ * Check whether SIGTERM was received
+ *
+ * @return TRUE if the server is to exit
+ */
+static int
+passwd_srv_term_run()
+{
+    char buf[16];
+    int signaled = FALSE;
+
+    while (0 < read(s_term_pipe[0], buf, sizeof(buf)))
+    {
+        signaled = TRUE;
     }
+
+    return signaled;
+}
+
+/**
+ * SIGHUP handler, reload is done by the main loop
+ *
+ * @param sig the signal number to be handled
+ */
+static void
+passwd_srv_reload_signal_handler(int sig)
+{
+    char byte = 0;
+
+    if (0 > write(s_reload_pipe[1], &byte, sizeof(byte)))
+    {
+        /* pipe is full, a reload is pending already */
+    }
+}
+
+/**
+ * Reload the configuration if SIGHUP was received
+ *
+ * @param rsa key pair of the running server
+ */
+static void
+passwd_srv_reload_run(RSA *rsa)
+{
+    char buf[16];
+    int signaled = FALSE;
+
+    while (0 < read(s_reload_pipe[0], buf, sizeof(buf)))
+    {
+        signaled = TRUE;
+    }
+
+    if (signaled)
+    {
+        VLOG_INFO("SIGHUP received, reloading configuration");
+        passwd_srv_config_reload(rsa);
+    }
+}
+
+/**
+ * unixctl command to reload the configuration
+ */
+static void
+passwd_srv_unixctl_reload(struct unixctl_conn *conn, int argc,
+                          const char *argv[], void *aux)
+{
+    if (PASSWD_ERR_SUCCESS == passwd_srv_config_reload(aux))
+    {
+        unixctl_command_reply(conn, NULL);
+    }
+    else
+    {
+        unixctl_command_reply_error(conn,
+                "reload failed, previous configuration is kept");
+    }
+}
+
+/**
+ * unixctl command to show the request queue
+ */
+static void
+passwd_srv_unixctl_queue_show(struct unixctl_conn *conn, int argc,
+                              const char *argv[], void *aux)
+{
+    struct ds reply = DS_EMPTY_INITIALIZER;
+    passwd_srv_queue_stats_t stats;
+    passwd_srv_sched_stats_t sched;
+    int sclass;
+    uint64_t served;
+
+    passwd_srv_conn_queue_stats(&stats);
+    served = stats.admitted - stats.depth;
+
+    ds_put_format(&reply, "depth: %d (max %d, limit %d)\n", stats.depth,
+                  stats.max_depth, passwd_srv_settings()->queue_depth);
+    ds_put_format(&reply, "admitted: %llu\n",
+                  (unsigned long long)stats.admitted);
+    ds_put_format(&reply, "rejected: %llu\n",
+                  (unsigned long long)stats.rejected);
+    ds_put_format(&reply, "wait: avg %llu us, max %llu us\n",
+                  (unsigned long long)(served ?
+                                       stats.wait_ns / served / 1000 : 0),
+                  (unsigned long long)(stats.max_wait_ns / 1000));
+    ds_put_format(&reply, "service: avg %llu us\n",
+                  (unsigned long long)(stats.service_ns / 1000));
+
+    ds_put_cstr(&reply, "classes:\n");
+    for (sclass = 0; sclass < PASSWD_SRV_SCHED_CLASS_MAX; sclass++)
+    {
+        passwd_srv_sched_stats(sclass, &sched);
+        ds_put_format(&reply, "  %s: weight %d, depth %d, served %llu, "
+                      "wait avg %llu us, max %llu us\n",
+                      passwd_srv_sched_class_name(sclass),
+                      (PASSWD_SRV_SCHED_INTERACTIVE == sclass) ?
+                      passwd_srv_settings()->sched_weight_interactive :
+                      (PASSWD_SRV_SCHED_ADMIN == sclass) ?
+                      passwd_srv_settings()->sched_weight_admin :
+                      passwd_srv_settings()->sched_weight_batch,
+                      sched.depth, (unsigned long long)sched.served,
+                      (unsigned long long)(sched.served ?
+                                           sched.wait_ns / sched.served /
+                                           1000 : 0),
+                      (unsigned long long)(sched.max_wait_ns / 1000));
+    }
+
+    unixctl_command_reply(conn, ds_cstr(&reply));
+    ds_destroy(&reply);
+}
+
+/**
+ * unixctl command to show client connections
+ */
+static void
+passwd_srv_unixctl_conn_show(struct unixctl_conn *conn, int argc,
+                             const char *argv[], void *aux)
+{
+    struct ds reply = DS_EMPTY_INITIALIZER;
+    const passwd_srv_settings_t *settings = passwd_srv_settings();
+    passwd_srv_conn_stats_t stats;
+
+    passwd_srv_conn_stats(&stats);
+
+    ds_put_format(&reply, "connections: %d (limit %d)\n", stats.connections,
+                  settings->max_connections);
+    ds_put_format(&reply, "accepted: %llu\n",
+                  (unsigned long long)stats.accepted);
+    ds_put_format(&reply, "read timeouts: %llu (%d ms)\n",
+                  (unsigned long long)stats.read_timeouts,
+                  settings->read_timeout);
+    ds_put_format(&reply, "process timeouts: %llu (%d ms)\n",
+                  (unsigned long long)stats.process_timeouts,
+                  settings->process_timeout);
+    ds_put_format(&reply, "write timeouts: %llu (%d ms)\n",
+                  (unsigned long long)stats.write_timeouts,
+                  settings->write_timeout);
+    ds_put_format(&reply, "idle timeouts: %llu (%d ms)\n",
+                  (unsigned long long)stats.idle_timeouts,
+                  settings->idle_timeout);
+    ds_put_format(&reply, "cancelled: %llu queued, %llu started (%llu us)\n",
+                  (unsigned long long)stats.cancelled_queued,
+                  (unsigned long long)stats.cancelled_started,
+                  (unsigned long long)(stats.cancelled_ns / 1000));
+    ds_put_format(&reply, "wasted: %llu (%llu us)\n",
+                  (unsigned long long)stats.wasted,
+                  (unsigned long long)(stats.wasted_ns / 1000));
+
+    unixctl_command_reply(conn, ds_cstr(&reply));
+    ds_destroy(&reply);
+}
+
+/**
+ * unixctl command to show the user database
+ */
+static void
+passwd_srv_unixctl_userdb_show(struct unixctl_conn *conn, int argc,
+                               const char *argv[], void *aux)
+{
+    struct ds reply = DS_EMPTY_INITIALIZER;
+    passwd_srv_userdb_stats_t stats;
+
+    passwd_srv_userdb_stats(&stats);
+
+    ds_put_format(&reply, "users: %zu\n", stats.users);
+    ds_put_format(&reply, "groups: %zu\n", stats.groups);
+    ds_put_format(&reply, "state: %s\n",
+                  stats.valid ? "parsed" : "to be parsed");
+    ds_put_format(&reply, "loads: %llu\n", (unsigned long long)stats.loads);
+    ds_put_format(&reply, "queries: %llu\n",
+                  (unsigned long long)stats.queries);
+
+    unixctl_command_reply(conn, ds_cstr(&reply));
+    ds_destroy(&reply);
+}
+
+/**
+ * unixctl command to show background jobs
+ */
+static void
+passwd_srv_unixctl_job_show(struct unixctl_conn *conn, int argc,
+                            const char *argv[], void *aux)
+{
+    struct ds reply = DS_EMPTY_INITIALIZER;
+    passwd_srv_job_stats_t stats;
+
+    passwd_srv_job_stats(&stats);
+
+    if (stats.running)
+    {
+        ds_put_format(&reply, "running: job %u\n", stats.running);
+    }
+    else
+    {
+        ds_put_cstr(&reply, "running: none\n");
+    }
+    ds_put_format(&reply, "queued: %d\n", stats.queued);
+    ds_put_format(&reply, "kept: %d/%d\n", stats.kept, stats.capacity);
+    ds_put_format(&reply, "submitted: %llu\n",
+                  (unsigned long long)stats.submitted);
+    ds_put_format(&reply, "rejected: %llu\n",
+                  (unsigned long long)stats.rejected);
+    ds_put_format(&reply, "completed: %llu (%llu failed)\n",
+                  (unsigned long long)stats.completed,
+                  (unsigned long long)stats.failed);
+    ds_put_format(&reply, "run time: %llu us\n",
+                  (unsigned long long)(stats.run_ns / 1000));
+
+    unixctl_command_reply(conn, ds_cstr(&reply));
+    ds_destroy(&reply);
+}
+
+/**
+ * unixctl command to show account change events and their subscribers
+ */
+static void
+passwd_srv_unixctl_event_show(struct unixctl_conn *conn, int argc,
+                              const char *argv[], void *aux)
+{
+    struct ds reply = DS_EMPTY_INITIALIZER;
+    passwd_srv_event_stats_t stats;
+
+    passwd_srv_event_stats(&stats);
+
+    ds_put_format(&reply, "next seq: %llu\n",
+                  (unsigned long long)stats.next_seq);
+    ds_put_format(&reply, "kept: %llu\n", (unsigned long long)stats.kept);
+    ds_put_format(&reply, "subscribers: %d\n", stats.subscribers);
+    ds_put_format(&reply, "posted: %llu\n", (unsigned long long)stats.posted);
+    ds_put_format(&reply, "resumed: %llu\n",
+                  (unsigned long long)stats.resumed);
+    ds_put_format(&reply, "resyncs: %llu\n",
+                  (unsigned long long)stats.resyncs);
+
+    unixctl_command_reply(conn, ds_cstr(&reply));
+    ds_destroy(&reply);
+}
+
+/**
+ * unixctl command to show the verification cache
+ */
+static void
+passwd_srv_unixctl_vcache_show(struct unixctl_conn *conn, int argc,
+                               const char *argv[], void *aux)
+{
+    struct ds reply = DS_EMPTY_INITIALIZER;
+    passwd_srv_vcache_stats_t stats;
+    uint64_t lookups;
+
+    passwd_srv_vcache_stats(&stats);
+    lookups = stats.hits + stats.misses;
+
+    ds_put_format(&reply, "entries: %d/%d (ttl %d ms)\n", stats.entries,
+                  stats.capacity, passwd_srv_settings()->verify_cache_ttl);
+    ds_put_format(&reply, "hits: %llu (%.1f%%)\n",
+                  (unsigned long long)stats.hits,
+                  lookups ? 100.0 * stats.hits / lookups : 0.0);
+    ds_put_format(&reply, "misses: %llu\n",
+                  (unsigned long long)stats.misses);
+    ds_put_format(&reply, "inserted: %llu\n",
+                  (unsigned long long)stats.inserted);
+    ds_put_format(&reply, "evicted: %llu\n",
+                  (unsigned long long)stats.evicted);
+    ds_put_format(&reply, "invalidated: %llu\n",
+                  (unsigned long long)stats.invalidated);
+
+    unixctl_command_reply(conn, ds_cstr(&reply));
+    ds_destroy(&reply);
+}
+
+/**
+ * unixctl command to show idempotency keys
+ */
+static void
+passwd_srv_unixctl_idem_show(struct unixctl_conn *conn, int argc,
+                             const char *argv[], void *aux)
+{
+    struct ds reply = DS_EMPTY_INITIALIZER;
+    passwd_srv_idem_stats_t stats;
+
+    passwd_srv_idem_stats(&stats);
+
+    ds_put_format(&reply, "keys: %d (ttl %d ms)\n", stats.keys,
+                  passwd_srv_settings()->idempotency_ttl);
+    ds_put_format(&reply, "stored: %llu\n",
+                  (unsigned long long)stats.stored);
+    ds_put_format(&reply, "replayed: %llu\n",
+                  (unsigned long long)stats.replayed);
+    ds_put_format(&reply, "in progress: %llu\n",
+                  (unsigned long long)stats.in_progress);
+    ds_put_format(&reply, "evicted: %llu\n",
+                  (unsigned long long)stats.evicted);
+    ds_put_format(&reply, "untracked: %llu\n",
+                  (unsigned long long)stats.untracked);
+
+    unixctl_command_reply(conn, ds_cstr(&reply));
+    ds_destroy(&reply);
+}
+
+/**
+ * Add a throttled uid to the reply of passwd-srv/limit-show
+ */
+static void
+passwd_srv_limit_show_uid(uid_t uid, uint64_t throttled, void *aux)
+{
+    ds_put_format(aux, "  uid %lu: %llu\n", (unsigned long)uid,
+                  (unsigned long long)throttled);
+}
+
+/**
+ * unixctl command to show rate limits and throttled requests
+ */
+static void
+passwd_srv_unixctl_limit_show(struct unixctl_conn *conn, int argc,
+                              const char *argv[], void *aux)
+{
+    struct ds reply = DS_EMPTY_INITIALIZER;
+    const passwd_srv_settings_t *settings = passwd_srv_settings();
+    passwd_srv_limit_stats_t stats;
+
+    passwd_srv_limit_stats(&stats);
+
+    ds_put_format(&reply, "global: %llu throttled (%d/s)\n",
+                  (unsigned long long)stats.throttled_global,
+                  settings->rate_limit_global);
+    ds_put_format(&reply, "uid: %llu throttled (%d/s)\n",
+                  (unsigned long long)stats.throttled_uid,
+                  settings->rate_limit_uid);
+    ds_put_format(&reply, "password: %llu throttled (%d/s per uid)\n",
+                  (unsigned long long)
+                  stats.throttled_class[PASSWD_SRV_LIMIT_CLASS_PASSWORD],
+                  settings->rate_limit_password);
+    ds_put_format(&reply, "account: %llu throttled (%d/s per uid)\n",
+                  (unsigned long long)
+                  stats.throttled_class[PASSWD_SRV_LIMIT_CLASS_ACCOUNT],
+                  settings->rate_limit_account);
+    ds_put_format(&reply, "verify: %llu throttled (%d/s per uid)\n",
+                  (unsigned long long)
+                  stats.throttled_class[PASSWD_SRV_LIMIT_CLASS_VERIFY],
+                  settings->rate_limit_verify);
+    ds_put_format(&reply, "query: %llu throttled (%d/s per uid)\n",
+                  (unsigned long long)
+                  stats.throttled_class[PASSWD_SRV_LIMIT_CLASS_QUERY],
+                  settings->rate_limit_query);
+    ds_put_cstr(&reply, "throttled per uid:\n");
+    passwd_srv_limit_foreach(passwd_srv_limit_show_uid, &reply);
+
+    unixctl_command_reply(conn, ds_cstr(&reply));
+    ds_destroy(&reply);
+}
+
+/**
+ * Add a user to the reply of passwd-srv/backoff-show
+ */
+static void
+passwd_srv_backoff_show_user(const char *username, uint32_t failures,
+                             long long int left, void *aux)
+{
+    ds_put_format(aux, "  %s: %u failures, %lld ms left\n", username,
+                  failures, left);
+}
+
+/**
+ * unixctl command to show users with failed password attempts
+ */
+static void
+passwd_srv_unixctl_backoff_show(struct unixctl_conn *conn, int argc,
+                                const char *argv[], void *aux)
+{
+    struct ds reply = DS_EMPTY_INITIALIZER;
+    struct ds users = DS_EMPTY_INITIALIZER;
+    uint64_t rejected;
+
+    rejected = passwd_srv_backoff_foreach(passwd_srv_backoff_show_user,
+                                          &users);
+
+    ds_put_format(&reply, "rejected in backoff: %llu\n",
+                  (unsigned long long)rejected);
+    ds_put_cstr(&reply, "users:\n");
+    ds_put_cstr(&reply, ds_cstr(&users));
+
+    unixctl_command_reply(conn, ds_cstr(&reply));
+    ds_destroy(&users);
+    ds_destroy(&reply);
+}
+
+/**
+ * unixctl command to forget failed password attempts of a user, or of all
+ * users
+ */
+static void
+passwd_srv_unixctl_backoff_clear(struct unixctl_conn *conn, int argc,
+                                 const char *argv[], void *aux)
+{
+    char *reply;
+    int n;
+
+    n = passwd_srv_backoff_clear((argc > 1) ? argv[1] : NULL);
+    reply = xasprintf("%d users cleared", n);
+    unixctl_command_reply(conn, reply);
+    free(reply);
 }
 
 /* password server main function */
 int main(int argc, char **argv) {
     RSA *rsa = NULL;
+    struct unixctl_server *unixctl = NULL;
+    char *unixctl_path = NULL;
+    char *pub_key_path;
+    int listen_fd = -1, taken_over = FALSE, activated = FALSE;
+    int terminated = FALSE;
+    int retval;
 
     set_program_name(argv[0]);
     proctitle_init(argc, argv);
     fatal_ignore_sigpipe();
 
     /* assign program name */
-    passwd_srv_parse_options(argc, argv, NULL);
+    passwd_srv_parse_options(argc, argv, &unixctl_path);
+
+    /* LISTEN_PID is the pid systemd started, check it before forking */
+    if (0 <= (listen_fd = passwd_srv_conn_activation_fd()))
+    {
+        activated = TRUE;
+    }
 
     /*
      * Fork and return in child process; but don't notify parent of
@@ -191,17 +749,84 @@ int main(int argc, char **argv) {
      */
     daemonize_start();
 
-    if (PASSWD_ERR_SUCCESS != parse_passwd_srv_yaml())
+    if (PASSWD_ERR_SUCCESS != passwd_srv_config_init(s_root_dir, s_yaml_file))
     {
         /* failed to parse yaml file */
         VLOG_ERR("Failed to read YAML file");
         exit(PASSWD_ERR_FATAL);
     }
 
-    /* register for SIGTERM */
+    /* register for SIGTERM, the server exits from the main loop */
+    if ((0 != pipe(s_term_pipe)) ||
+        (0 != fcntl(s_term_pipe[0], F_SETFL, O_NONBLOCK)) ||
+        (0 != fcntl(s_term_pipe[1], F_SETFL, O_NONBLOCK)))
+    {
+        VLOG_ERR("Failed to create termination pipe");
+        exit(PASSWD_ERR_FATAL);
+    }
     signal(SIGTERM, passwd_srv_signal_handler);
 
-    create_directory();
+    /* register for SIGHUP to reload the configuration */
+    if ((0 != pipe(s_reload_pipe)) ||
+        (0 != fcntl(s_reload_pipe[0], F_SETFL, O_NONBLOCK)) ||
+        (0 != fcntl(s_reload_pipe[1], F_SETFL, O_NONBLOCK)))
+    {
+        VLOG_ERR("Failed to create reload pipe");
+        exit(PASSWD_ERR_FATAL);
+    }
+    signal(SIGHUP, passwd_srv_reload_signal_handler);
+
+    /* jobs are collected on SIGCHLD */
+    if (PASSWD_ERR_SUCCESS != passwd_srv_job_init())
+    {
+        exit(PASSWD_ERR_FATAL);
+    }
+
+    /* running server keeps serving until the new one is ready */
+    if (s_takeover && !activated)
+    {
+        retval = passwd_srv_takeover(s_takeover_key, &listen_fd, &rsa);
+        if (PASSWD_ERR_SUCCESS == retval)
+        {
+            taken_over = TRUE;
+        }
+        else if (PASSWD_ERR_SEND_FAILED != retval)
+        {
+            /* starting afresh would remove the files it is serving with */
+            VLOG_ERR("Password server is running and was not taken over");
+            exit(PASSWD_ERR_FATAL);
+        }
+    }
+
+    /* socket of systemd is in the run directory, keep it */
+    create_directory(taken_over || activated);
+
+    /* failed password attempts survive restarts, saved out of /var/run */
+    create_parent_directory(passwd_srv_file(PASSWD_SRV_FILE_BACKOFF));
+    if (PASSWD_ERR_SUCCESS != passwd_srv_backoff_load())
+    {
+        exit(PASSWD_ERR_FATAL);
+    }
+
+    pub_key_path = get_file_path(PASSWD_SRV_YAML_PATH_PUB_KEY);
+    if (activated && pub_key_path)
+    {
+        /* key of a previous run, clients wait for the new one */
+        unlink(pub_key_path);
+    }
+
+    if (s_trace_file &&
+        (PASSWD_ERR_SUCCESS != passwd_srv_trace_open(s_trace_file)))
+    {
+        exit(PASSWD_ERR_FATAL);
+    }
+
+    retval = unixctl_server_create(unixctl_path, &unixctl);
+    if (retval)
+    {
+        VLOG_ERR("Failed to create unixctl server");
+        exit(PASSWD_ERR_FATAL);
+    }
 
     /* Notify parent of startup completion. */
     daemonize_complete();
@@ -209,13 +834,109 @@ int main(int argc, char **argv) {
     /* init vlog */
     vlog_enable_async();
 
-    /* generate RSA keypair and create pubkey file */
-    rsa = generate_RSA_keypair();
+    if (NULL == rsa)
+    {
+        /* generate RSA keypair and create pubkey file */
+        rsa = generate_RSA_keypair();
+    }
+    else if (pub_key_path && (0 != access(pub_key_path, F_OK)) &&
+             (PASSWD_ERR_SUCCESS != create_pubkey_file(rsa, pub_key_path)))
+    {
+        /* key pair is handed off, but the yaml file moved the public key */
+        exit(PASSWD_ERR_FATAL);
+    }
+
+    /* clients read the configuration from the snapshot, or the yaml file */
+    if (PASSWD_ERR_SUCCESS != passwd_srv_config_publish(rsa))
+    {
+        VLOG_WARN("Configuration snapshot is not published");
+    }
 
     /* initialize socket connection */
-    listen_socket(rsa);
+    retval = (taken_over || activated) ? passwd_srv_conn_adopt(rsa, listen_fd)
+                                       : create_socket(rsa);
+    if (PASSWD_ERR_SUCCESS != retval)
+    {
+        RSA_free(rsa);
+        exit(PASSWD_ERR_FATAL);
+    }
+
+    if (activated)
+    {
+        VLOG_INFO("Serving the socket passed by systemd");
+    }
+
+    /* a later instance can take over from this one */
+    passwd_srv_handoff_listen();
+    passwd_srv_takeover_complete();
+
+    unixctl_command_register("passwd-srv/reload", "", 0, 0,
+                             passwd_srv_unixctl_reload, rsa);
+    unixctl_command_register("passwd-srv/queue-show", "", 0, 0,
+                             passwd_srv_unixctl_queue_show, NULL);
+    unixctl_command_register("passwd-srv/conn-show", "", 0, 0,
+                             passwd_srv_unixctl_conn_show, NULL);
+    unixctl_command_register("passwd-srv/idempotency-show", "", 0, 0,
+                             passwd_srv_unixctl_idem_show, NULL);
+    unixctl_command_register("passwd-srv/vcache-show", "", 0, 0,
+                             passwd_srv_unixctl_vcache_show, NULL);
+    unixctl_command_register("passwd-srv/userdb-show", "", 0, 0,
+                             passwd_srv_unixctl_userdb_show, NULL);
+    unixctl_command_register("passwd-srv/event-show", "", 0, 0,
+                             passwd_srv_unixctl_event_show, NULL);
+    unixctl_command_register("passwd-srv/job-show", "", 0, 0,
+                             passwd_srv_unixctl_job_show, NULL);
+    unixctl_command_register("passwd-srv/limit-show", "", 0, 0,
+                             passwd_srv_unixctl_limit_show, NULL);
+    unixctl_command_register("passwd-srv/backoff-show", "", 0, 0,
+                             passwd_srv_unixctl_backoff_show, NULL);
+    unixctl_command_register("passwd-srv/backoff-clear", "[USER]", 0, 1,
+                             passwd_srv_unixctl_backoff_clear, NULL);
+
+    /*
+     * serve clients, requests of several connections are interleaved, until
+     * the socket is handed off and the remaining requests are served, or
+     * SIGTERM is received
+     */
+    while (!passwd_srv_conn_drained())
+    {
+        if (passwd_srv_term_run())
+        {
+            terminated = TRUE;
+            break;
+        }
+        unixctl_server_run(unixctl);
+        passwd_srv_reload_run(rsa);
+        passwd_srv_handoff_run(rsa);
+        passwd_srv_conn_run();
+        passwd_srv_job_run();
+        passwd_srv_backoff_run();
+
+        unixctl_server_wait(unixctl);
+        poll_fd_wait(s_reload_pipe[0], POLLIN);
+        poll_fd_wait(s_term_pipe[0], POLLIN);
+        passwd_srv_handoff_wait();
+        passwd_srv_conn_wait();
+        passwd_srv_job_wait();
+        passwd_srv_backoff_wait();
+        poll_block();
+    }
+
+    if (terminated)
+    {
+        /* un-initialize UNIX sockets */
+        VLOG_INFO("SIGTERM received, exiting");
+        socket_term_signal_handler();
+    }
+    else
+    {
+        VLOG_INFO("Handed off to the new password server, exiting");
+    }
 
-    // do we need signal handling?
+    /* failure counts of the last second are not lost */
+    passwd_srv_backoff_flush();
+    unixctl_server_destroy(unixctl);
+    passwd_srv_trace_close();
     RSA_free(rsa);
 
     return PASSWD_ERR_SUCCESS;
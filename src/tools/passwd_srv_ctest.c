@@ -0,0 +1,1926 @@
+/*
+ * (c) Copyright 2016 Hewlett Packard Enterprise Development LP
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+/************************************************************************//**
+ * @ingroup passwd-srvd
+ *
+ * @file
+ * Component test client of the Password Server.
+ *
+ *    Runs checks against a server started with --root on a sandbox whose
+ *     users have the password given with --password.  Every check prints
+ *     PASSED or the step which failed; the exit status is non-zero if any
+ *     failed.  The checks change the sandbox, they are never run against
+ *     the live system.
+ ***************************************************************************/
+#define _GNU_SOURCE
+#include <crypt.h>
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <shadow.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <openssl/pem.h>
+#include <openssl/rand.h>
+#include <openssl/rsa.h>
+
+#include "passwd_srv_pub.h"
+
+#define CTEST_DEFAULT_USER   "user0"
+#define CTEST_TIMEOUT_MSEC   5000
+#define CTEST_PIPELINE       8     /* requests in flight on one connection */
+#define CTEST_CONNS          16    /* connections of the overload checks */
+#define CTEST_LOCKED_USER    "ctest_locked"
+
+/* hash fields of the length crypt() gives, of crypt() characters only */
+#define CTEST_H43 "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQ"
+#define CTEST_H42 "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOP"
+#define CTEST_H86 CTEST_H43 CTEST_H43
+
+static struct {
+    const char *root_dir;
+    const char *user;
+    const char *password;
+} s_opts = {
+    .root_dir = NULL,
+    .user     = CTEST_DEFAULT_USER,
+    .password = NULL,
+};
+
+/*
+ * PASSWD_MSG_SET_HASH cases, each hash is sent as it is
+ */
+typedef struct ctest_hash_case {
+    const char *name;
+    const char *hash;
+    int         status;       /* expected status */
+} ctest_hash_case_t;
+
+static const ctest_hash_case_t s_hash_cases[] = {
+    {"sha256",              "$5$salt$" CTEST_H43,          PASSWD_ERR_SUCCESS},
+    {"sha256 rounds",       "$5$rounds=5000$salt$" CTEST_H43,
+                                                           PASSWD_ERR_SUCCESS},
+    {"sha512",              "$6$salt$" CTEST_H86,          PASSWD_ERR_SUCCESS},
+    {"sha512 max rounds",   "$6$rounds=999999999$salt$" CTEST_H86,
+                                                           PASSWD_ERR_SUCCESS},
+    {"sha512 max salt",     "$6$0123456789abcdef$" CTEST_H86,
+                                                           PASSWD_ERR_SUCCESS},
+    {"yescrypt",            "$y$j9T$salt$" CTEST_H43,      PASSWD_ERR_SUCCESS},
+    {"empty",               "",                      PASSWD_ERR_INVALID_PARAM},
+    {"des",                 "abJnggxhB/yWI",         PASSWD_ERR_INVALID_PARAM},
+    {"md5",                 "$1$salt$qJH7.N4xYta3aEG/dfqo/0",
+                                                     PASSWD_ERR_INVALID_PARAM},
+    {"locked",              "!",                     PASSWD_ERR_INVALID_PARAM},
+    {"unknown method",      "$7$salt$" CTEST_H43,    PASSWD_ERR_INVALID_PARAM},
+    {"sha256 short",        "$5$salt$" CTEST_H42,    PASSWD_ERR_INVALID_PARAM},
+    {"sha256 long",         "$5$salt$" CTEST_H43 "a",
+                                                     PASSWD_ERR_INVALID_PARAM},
+    {"sha512 of sha256 length", "$6$salt$" CTEST_H43,
+                                                     PASSWD_ERR_INVALID_PARAM},
+    {"empty rounds",        "$5$rounds=$salt$" CTEST_H43,
+                                                     PASSWD_ERR_INVALID_PARAM},
+    {"rounds not a number", "$5$rounds=5k$salt$" CTEST_H43,
+                                                     PASSWD_ERR_INVALID_PARAM},
+    {"rounds too long",     "$5$rounds=1000000000$salt$" CTEST_H43,
+                                                     PASSWD_ERR_INVALID_PARAM},
+    {"empty salt",          "$5$$" CTEST_H43,        PASSWD_ERR_INVALID_PARAM},
+    {"salt too long",       "$6$0123456789abcdefg$" CTEST_H86,
+                                                     PASSWD_ERR_INVALID_PARAM},
+    {"no hash",             "$5$salt",               PASSWD_ERR_INVALID_PARAM},
+    {"':' in salt",         "$5$sa:lt$" CTEST_H43,   PASSWD_ERR_INVALID_PARAM},
+    {"':' in hash",         "$5$salt$" CTEST_H42 ":",
+                                                     PASSWD_ERR_INVALID_PARAM},
+    {"newline in hash",     "$5$salt$" CTEST_H42 "\n",
+                                                     PASSWD_ERR_INVALID_PARAM},
+    {"newline in rounds",   "$5$rounds=5000\n$salt$" CTEST_H43,
+                                                     PASSWD_ERR_INVALID_PARAM},
+    {"shadow fields",       "$5$salt$" CTEST_H42 "a:0:0:99999:7:::",
+                                                     PASSWD_ERR_INVALID_PARAM},
+    {"yescrypt no params",  "$y$$salt$" CTEST_H43,   PASSWD_ERR_INVALID_PARAM},
+    {"yescrypt no salt",    "$y$j9T$" CTEST_H43,     PASSWD_ERR_INVALID_PARAM},
+    {"yescrypt ':' in salt", "$y$j9T$sa:lt$" CTEST_H43,
+                                                     PASSWD_ERR_INVALID_PARAM},
+    {"yescrypt short",      "$y$j9T$salt$" CTEST_H42,
+                                                     PASSWD_ERR_INVALID_PARAM},
+};
+
+/*
+ * salts of the hashes of --password set with SET_HASH, a method libcrypt
+ * does not support is skipped
+ */
+static const char *s_hash_salts[] = {
+    "$5$rounds=5000$ctest$",
+    "$y$j9T$ctestctestctestctest$",
+    "$6$ctest$",                    /* last, the hash left to the user */
+};
+
+/**
+ * Monotonic clock in milliseconds
+ */
+static uint64_t
+ctest_now_msec()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Compare a status with the expected one and report a mismatch
+ *
+ * @param test   name of the check
+ * @param step   step of the check
+ * @param status status received
+ * @param expect status expected
+ * @return TRUE if they match
+ */
+static int
+ctest_expect(const char *test, const char *step, int status, int expect)
+{
+    if (status != expect)
+    {
+        printf("%s: FAILED at %s, status %d instead of %d\n", test, step,
+               status, expect);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Build a CHG_PASSWORD request of the user under test
+ */
+static void
+ctest_chg_msg(passwd_srv_msg_t *msg, const char *oldpasswd,
+              const char *newpasswd)
+{
+    memset(msg, 0, sizeof(*msg));
+    msg->op_code = PASSWD_MSG_CHG_PASSWORD;
+    snprintf(msg->username, sizeof(msg->username), "%s", s_opts.user);
+    snprintf(msg->oldpasswd, sizeof(msg->oldpasswd), "%s", oldpasswd);
+    snprintf(msg->newpasswd, sizeof(msg->newpasswd), "%s", newpasswd);
+}
+
+/**
+ * Make another password out of --password, which fits a request
+ *
+ * @param other buffer of PASSWD_PASSWORD_SIZE bytes
+ */
+static void
+ctest_other_password(char *other)
+{
+    snprintf(other, PASSWD_PASSWORD_SIZE, "%.*sX", PASSWD_PASSWORD_SIZE - 2,
+             s_opts.password);
+}
+
+/**
+ * Connect to the socket of the server
+ *
+ * @return connected socket, -1 on failure
+ */
+static int
+ctest_connect()
+{
+    struct sockaddr_un addr;
+    const char *path = get_socket_descriptor_path();
+    int fd;
+
+    if ((NULL == path) || (sizeof(addr.sun_path) <= strlen(path)) ||
+        (0 > (fd = socket(AF_UNIX, SOCK_STREAM, 0))))
+    {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path, strlen(path) + 1);
+    if (0 != connect(fd, (struct sockaddr *)&addr, sizeof(addr)))
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Encrypt a request with the public key of the server, as a client which
+ * does not use the client library does
+ *
+ * @param msg     request
+ * @param enc_msg buffer of PASSWD_SRV_PUB_KEY_LEN/8 bytes
+ * @return length of the encrypted request, -1 on failure
+ */
+static int
+ctest_encrypt(const passwd_srv_msg_t *msg, unsigned char *enc_msg)
+{
+    RSA *pubkey;
+    FILE *fp;
+    int ret;
+
+    if (NULL == (fp = fopen(get_public_key_path(), "r")))
+    {
+        return -1;
+    }
+    pubkey = PEM_read_RSAPublicKey(fp, NULL, NULL, NULL);
+    fclose(fp);
+    if (NULL == pubkey)
+    {
+        return -1;
+    }
+
+    ret = RSA_public_encrypt(sizeof(*msg), (const unsigned char *)msg,
+                             enc_msg, pubkey, RSA_PKCS1_OAEP_PADDING);
+    RSA_free(pubkey);
+    return ret;
+}
+
+/**
+ * Read exactly len bytes, waiting at most CTEST_TIMEOUT_MSEC
+ *
+ * @return bytes read, less if the connection was closed, -1 on failure
+ */
+static ssize_t
+ctest_read(int fd, void *buf, size_t len)
+{
+    struct pollfd pfd = {fd, POLLIN, 0};
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len)
+    {
+        if (0 >= poll(&pfd, 1, CTEST_TIMEOUT_MSEC))
+        {
+            return -1;
+        }
+        if (0 > (n = read(fd, (char *)buf + done, len - done)))
+        {
+            return -1;
+        }
+        if (0 == n)
+        {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+/**
+ * Send a request as a version 1 client: the encrypted message in, a bare
+ * status out, then the server closes the connection
+ *
+ * @param msg    request
+ * @param status set to the status returned by the server
+ * @return PASSWD_ERR_SUCCESS if a status was received and the connection
+ *         closed, PASSWD_ERR_* code otherwise
+ */
+static int
+ctest_v1_request(const passwd_srv_msg_t *msg, int *status)
+{
+    unsigned char enc_msg[PASSWD_SRV_PUB_KEY_LEN / 8];
+    int fd, enc_len, err = PASSWD_ERR_SUCCESS;
+    char c;
+
+    if ((0 > (enc_len = ctest_encrypt(msg, enc_msg))) ||
+        (0 > (fd = ctest_connect())))
+    {
+        return PASSWD_ERR_SEND_FAILED;
+    }
+
+    if (enc_len != write(fd, enc_msg, enc_len))
+    {
+        err = PASSWD_ERR_SEND_FAILED;
+    }
+    else if ((sizeof(*status) != ctest_read(fd, status, sizeof(*status))) ||
+             (0 != ctest_read(fd, &c, 1)))
+    {
+        err = PASSWD_ERR_RECV_FAILED;
+    }
+
+    close(fd);
+    return err;
+}
+
+/**
+ * Check a password against the shadow entry of the user in the sandbox
+ *
+ * @param password password expected
+ * @return PASSWD_ERR_SUCCESS if the entry holds a hash of password,
+ *         PASSWD_ERR_PASSWORD_NOT_MATCH if not, PASSWD_ERR_USER_NOT_FOUND if
+ *         there is no entry
+ */
+static int
+ctest_shadow_check(const char *password)
+{
+    char path[PATH_MAX];
+    struct crypt_data data;
+    struct spwd *sp;
+    const char *hash;
+    FILE *fp;
+    int err = PASSWD_ERR_USER_NOT_FOUND;
+
+    snprintf(path, sizeof(path), "%s/etc/shadow", get_passwd_srv_root_dir());
+    if (NULL == (fp = fopen(path, "r")))
+    {
+        return PASSWD_ERR_SHADOW_FILE;
+    }
+
+    memset(&data, 0, sizeof(data));
+    while (NULL != (sp = fgetspent(fp)))
+    {
+        if (0 == strcmp(sp->sp_namp, s_opts.user))
+        {
+            hash = crypt_r(password, sp->sp_pwdp, &data);
+            err = ((NULL != hash) && (0 == strcmp(hash, sp->sp_pwdp))) ?
+                  PASSWD_ERR_SUCCESS : PASSWD_ERR_PASSWORD_NOT_MATCH;
+            break;
+        }
+    }
+
+    memset(&data, 0, sizeof(data));
+    fclose(fp);
+    return err;
+}
+
+/**
+ * Lock the account of a user in the shadow file of the sandbox, as
+ * usermod -L, passwd -l or passwd -d do
+ *
+ * @param username user whose entry is changed
+ * @param prefix   new password field, followed by the hash if keep is set
+ * @param keep     TRUE to keep the hash after prefix
+ * @return PASSWD_ERR_SUCCESS if the entry was changed
+ */
+static int
+ctest_lock_shadow(const char *username, const char *prefix, int keep)
+{
+    char path[PATH_MAX], tmp_path[PATH_MAX], field[PASSWD_SRV_HASH_SIZE + 2];
+    struct spwd *sp;
+    FILE *fp, *tmp_fp;
+    int err = PASSWD_ERR_USER_NOT_FOUND;
+
+    snprintf(path, sizeof(path), "%s/etc/shadow", get_passwd_srv_root_dir());
+    snprintf(tmp_path, sizeof(tmp_path), "%s/etc/shadow.ctest",
+             get_passwd_srv_root_dir());
+    if (NULL == (fp = fopen(path, "r")))
+    {
+        return PASSWD_ERR_SHADOW_FILE;
+    }
+    if (NULL == (tmp_fp = fopen(tmp_path, "w")))
+    {
+        fclose(fp);
+        return PASSWD_ERR_SHADOW_FILE;
+    }
+
+    while (NULL != (sp = fgetspent(fp)))
+    {
+        if (0 == strcmp(sp->sp_namp, username))
+        {
+            snprintf(field, sizeof(field), "%s%s", prefix,
+                     keep ? sp->sp_pwdp : "");
+            sp->sp_pwdp = field;
+            err = PASSWD_ERR_SUCCESS;
+        }
+        putspent(sp, tmp_fp);
+    }
+    fclose(fp);
+
+    if ((0 != fclose(tmp_fp)) ||
+        ((PASSWD_ERR_SUCCESS == err) && (0 != rename(tmp_path, path))))
+    {
+        err = PASSWD_ERR_SHADOW_FILE;
+    }
+    unlink(tmp_path);
+    return err;
+}
+
+/**
+ * CHG_PASSWORD of a version 1 client changes the shadow file of the
+ * sandbox, and the user gets --password back
+ *
+ * @return TRUE if passed
+ */
+static int
+ctest_sandbox()
+{
+    const char *test = "sandbox";
+    char other[PASSWD_PASSWORD_SIZE];
+    passwd_srv_msg_t msg;
+    int status = PASSWD_ERR_FATAL, err, ok;
+
+    ctest_other_password(other);
+
+    ctest_chg_msg(&msg, s_opts.password, other);
+    err = ctest_v1_request(&msg, &status);
+    memset(&msg, 0, sizeof(msg));
+    if (!ctest_expect(test, "request", err, PASSWD_ERR_SUCCESS) ||
+        !ctest_expect(test, "change", status, PASSWD_ERR_SUCCESS))
+    {
+        return 0;
+    }
+    ok = ctest_expect(test, "shadow entry of the sandbox",
+                      ctest_shadow_check(other), PASSWD_ERR_SUCCESS);
+
+    ctest_chg_msg(&msg, other, s_opts.password);
+    err = ctest_v1_request(&msg, &status);
+    memset(&msg, 0, sizeof(msg));
+    if (!ctest_expect(test, "request", err, PASSWD_ERR_SUCCESS) ||
+        !ctest_expect(test, "change back", status, PASSWD_ERR_SUCCESS) ||
+        !ctest_expect(test, "shadow entry changed back",
+                      ctest_shadow_check(s_opts.password),
+                      PASSWD_ERR_SUCCESS))
+    {
+        return 0;
+    }
+
+    return ok;
+}
+
+/*
+ * a request on a connection handle
+ */
+typedef struct ctest_req {
+    passwd_srv_async_t *conn;
+    uint32_t            handle;     /* 0 once completed */
+    int                 status;
+    int                 rank;       /* order in which it completed */
+} ctest_req_t;
+
+/**
+ * Run the connection handles of requests until the requests are completed
+ *
+ * @param reqs  requests submitted
+ * @param count number of requests, at most CTEST_PIPELINE * 4
+ * @return number of requests completed within CTEST_TIMEOUT_MSEC, their
+ *         status and rank are set
+ */
+static int
+ctest_complete(ctest_req_t *reqs, int count)
+{
+    struct pollfd pfds[CTEST_PIPELINE * 4];
+    uint64_t deadline = ctest_now_msec() + CTEST_TIMEOUT_MSEC;
+    int i, err, done = 0;
+
+    while ((done < count) && (ctest_now_msec() < deadline))
+    {
+        for (i = 0; i < count; i++)
+        {
+            pfds[i].fd = passwd_srv_async_get_fd(reqs[i].conn);
+            pfds[i].events = POLLIN;
+            pfds[i].revents = 0;
+        }
+        poll(pfds, count, 100);
+
+        for (i = 0; i < count; i++)
+        {
+            passwd_srv_async_run(reqs[i].conn);
+        }
+        for (i = 0; i < count; i++)
+        {
+            if (0 == reqs[i].handle)
+            {
+                continue;
+            }
+            err = passwd_srv_async_result(reqs[i].conn, reqs[i].handle,
+                                          &reqs[i].status);
+            if (PASSWD_ERR_PENDING != err)
+            {
+                if (PASSWD_ERR_SUCCESS != err)
+                {
+                    reqs[i].status = err;
+                }
+                reqs[i].handle = 0;
+                reqs[i].rank = done++;
+            }
+        }
+    }
+    return done;
+}
+
+/**
+ * Version 1 requests get a bare status, version 2 requests may be pipelined
+ * and get replies with their seq in order, and a malformed frame closes the
+ * connection
+ *
+ * @return TRUE if passed
+ */
+static int
+ctest_framing()
+{
+    const char *test = "framing";
+    unsigned char enc_msg[PASSWD_SRV_PUB_KEY_LEN / 8];
+    unsigned char frame[sizeof(passwd_srv_hdr_t) + sizeof(enc_msg)];
+    ctest_req_t reqs[CTEST_PIPELINE];
+    passwd_srv_async_t *conn;
+    passwd_srv_hdr_t hdr;
+    passwd_srv_msg_t msg;
+    int fd, enc_len, status = PASSWD_ERR_FATAL, err, i, ok = 0;
+    char c;
+
+    /* version 1: encrypted message in, status out, connection closed */
+    ctest_chg_msg(&msg, s_opts.password, s_opts.password);
+    err = ctest_v1_request(&msg, &status);
+    if (!ctest_expect(test, "version 1 request", err, PASSWD_ERR_SUCCESS) ||
+        !ctest_expect(test, "version 1 status", status, PASSWD_ERR_SUCCESS))
+    {
+        memset(&msg, 0, sizeof(msg));
+        return 0;
+    }
+
+    /* version 2: one frame, reply with its seq */
+    enc_len = ctest_encrypt(&msg, enc_msg);
+    memset(&msg, 0, sizeof(msg));
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = PASSWD_SRV_MAGIC;
+    hdr.version = PASSWD_SRV_PROTO_VERSION;
+    hdr.seq = 0x12345;
+    hdr.len = enc_len;
+    memcpy(frame, &hdr, sizeof(hdr));
+    memcpy(frame + sizeof(hdr), enc_msg, enc_len);
+    if ((0 > enc_len) || (0 > (fd = ctest_connect())))
+    {
+        printf("%s: FAILED at connect\n", test);
+        return 0;
+    }
+    if ((sizeof(hdr) + enc_len != write(fd, frame, sizeof(hdr) + enc_len)) ||
+        (sizeof(hdr) != ctest_read(fd, &hdr, sizeof(hdr))) ||
+        (PASSWD_SRV_MAGIC != hdr.magic) || (0x12345 != hdr.seq) ||
+        (0 != hdr.len))
+    {
+        printf("%s: FAILED at version 2 reply\n", test);
+        close(fd);
+        return 0;
+    }
+    if (!ctest_expect(test, "version 2 status", hdr.status,
+                      PASSWD_ERR_SUCCESS))
+    {
+        close(fd);
+        return 0;
+    }
+
+    /* the connection stays open, a frame of an unknown version closes it */
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = PASSWD_SRV_MAGIC;
+    hdr.version = PASSWD_SRV_PROTO_VERSION + 1;
+    if ((sizeof(hdr) != write(fd, &hdr, sizeof(hdr))) ||
+        (0 != ctest_read(fd, &c, 1)))
+    {
+        printf("%s: FAILED at malformed frame, connection not closed\n",
+               test);
+        close(fd);
+        return 0;
+    }
+    close(fd);
+
+    /* pipelined requests of the client library, every other one is of an
+     * unknown user, replied to in order */
+    if (NULL == (conn = passwd_srv_async_create()))
+    {
+        printf("%s: FAILED at async create\n", test);
+        return 0;
+    }
+    memset(reqs, 0, sizeof(reqs));
+    for (i = 0; i < CTEST_PIPELINE; i++)
+    {
+        ctest_chg_msg(&msg, s_opts.password, s_opts.password);
+        if (i % 2)
+        {
+            snprintf(msg.username, sizeof(msg.username), "ctest_nouser");
+        }
+        reqs[i].conn = conn;
+        err = passwd_srv_async_submit(conn, &msg, &reqs[i].handle);
+        memset(&msg, 0, sizeof(msg));
+        if (!ctest_expect(test, "pipelined submit", err, PASSWD_ERR_SUCCESS))
+        {
+            goto out;
+        }
+    }
+
+    if (CTEST_PIPELINE != ctest_complete(reqs, CTEST_PIPELINE))
+    {
+        printf("%s: FAILED at pipelined replies\n", test);
+        goto out;
+    }
+    for (i = 0; i < CTEST_PIPELINE; i++)
+    {
+        if (!ctest_expect(test, "pipelined status", reqs[i].status,
+                          (i % 2) ? PASSWD_ERR_USER_NOT_FOUND :
+                          PASSWD_ERR_SUCCESS) ||
+            !ctest_expect(test, "pipelined reply order", reqs[i].rank, i))
+        {
+            goto out;
+        }
+    }
+    ok = 1;
+
+out:
+    passwd_srv_async_destroy(conn);
+    return ok;
+}
+
+/**
+ * A server started with the listening socket passed as by systemd serves
+ * requests sent before it is up.  No other server may run on the sandbox,
+ * ops-passwd-srv is run from the PATH and stopped with SIGTERM.
+ *
+ * @return TRUE if passed
+ */
+static int
+ctest_activation()
+{
+    const char *test = "activation";
+    const char *path = get_socket_descriptor_path();
+    char dir[PATH_MAX], root_arg[PATH_MAX + 8];
+    struct sockaddr_un addr;
+    pid_t pid;
+    int fd, status, ok;
+
+    if ((NULL == path) || (sizeof(addr.sun_path) <= strlen(path)))
+    {
+        printf("%s: FAILED at socket path\n", test);
+        return 0;
+    }
+
+    /* the run directory and the socket, as the socket unit would make them */
+    snprintf(dir, sizeof(dir), "%s", path);
+    *strrchr(dir, '/') = '\0';
+    if ((0 != mkdir(dir, 0755)) && (EEXIST != errno))
+    {
+        printf("%s: FAILED at run directory %s\n", test, dir);
+        return 0;
+    }
+    unlink(path);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path, strlen(path) + 1);
+    if ((0 > (fd = socket(AF_UNIX, SOCK_STREAM, 0))) ||
+        (0 != bind(fd, (struct sockaddr *)&addr, sizeof(addr))) ||
+        (0 != listen(fd, 16)))
+    {
+        printf("%s: FAILED at listening socket\n", test);
+        return 0;
+    }
+
+    snprintf(root_arg, sizeof(root_arg), "--root=%s", s_opts.root_dir);
+    if (0 > (pid = fork()))
+    {
+        printf("%s: FAILED at fork\n", test);
+        close(fd);
+        return 0;
+    }
+    if (0 == pid)
+    {
+        char pid_str[16];
+
+        /* sd_listen_fds(): descriptors from 3 on, for this process only */
+        snprintf(pid_str, sizeof(pid_str), "%d", (int)getpid());
+        if ((3 != fd) && (3 != dup2(fd, 3)))
+        {
+            _exit(EXIT_FAILURE);
+        }
+        setenv("LISTEN_PID", pid_str, 1);
+        setenv("LISTEN_FDS", "1", 1);
+        execlp("ops-passwd-srv", "ops-passwd-srv", root_arg, (char *)NULL);
+        _exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    /* connects wait in the backlog, the client library waits for the key
+     * the server generates */
+    ok = ctest_expect(test, "change",
+                      passwd_srv_change_password(s_opts.user,
+                                                 s_opts.password,
+                                                 s_opts.password),
+                      PASSWD_ERR_SUCCESS);
+    passwd_srv_client_disconnect();
+
+    kill(pid, SIGTERM);
+    if ((pid != waitpid(pid, &status, 0)) || !WIFEXITED(status))
+    {
+        printf("%s: FAILED at server exit\n", test);
+        ok = 0;
+    }
+    return ok;
+}
+
+/**
+ * Requests of as many clients at once overflow a queue of QUEUE_DEPTH 1,
+ * those not admitted get PASSWD_ERR_BUSY and a retry-after hint
+ *
+ * @return TRUE if passed
+ */
+static int
+ctest_busy()
+{
+    const char *test = "busy";
+    ctest_req_t reqs[CTEST_CONNS];
+    passwd_srv_msg_t msg;
+    int i, served = 0, busy = 0, hinted = 0, ok = 0;
+
+    memset(reqs, 0, sizeof(reqs));
+    for (i = 0; i < CTEST_CONNS; i++)
+    {
+        if (NULL == (reqs[i].conn = passwd_srv_async_create()))
+        {
+            printf("%s: FAILED at async create\n", test);
+            goto out;
+        }
+    }
+
+    ctest_chg_msg(&msg, s_opts.password, s_opts.password);
+    for (i = 0; i < CTEST_CONNS; i++)
+    {
+        if (!ctest_expect(test, "submit",
+                          passwd_srv_async_submit(reqs[i].conn, &msg,
+                                                  &reqs[i].handle),
+                          PASSWD_ERR_SUCCESS))
+        {
+            goto out;
+        }
+    }
+
+    if (CTEST_CONNS != ctest_complete(reqs, CTEST_CONNS))
+    {
+        printf("%s: FAILED at replies\n", test);
+        goto out;
+    }
+    for (i = 0; i < CTEST_CONNS; i++)
+    {
+        if (PASSWD_ERR_BUSY == reqs[i].status)
+        {
+            busy++;
+            hinted += (0 < passwd_srv_async_retry_after(reqs[i].conn));
+        }
+        else if (!ctest_expect(test, "status", reqs[i].status,
+                               PASSWD_ERR_SUCCESS))
+        {
+            goto out;
+        }
+        else
+        {
+            served++;
+        }
+    }
+
+    if ((0 == served) || (0 == busy) || (busy != hinted))
+    {
+        printf("%s: FAILED at admission, %d served, %d busy, %d with a "
+               "retry-after hint\n", test, served, busy, hinted);
+        goto out;
+    }
+    ok = 1;
+
+out:
+    memset(&msg, 0, sizeof(msg));
+    for (i = 0; i < CTEST_CONNS; i++)
+    {
+        passwd_srv_async_destroy(reqs[i].conn);
+    }
+    return ok;
+}
+
+/**
+ * A connection which starts a request and does not complete it is closed
+ * once READ_TIMEOUT_MS expires, the check waits for CTEST_TIMEOUT_MSEC
+ *
+ * @return TRUE if passed
+ */
+static int
+ctest_deadline()
+{
+    const char *test = "deadline";
+    passwd_srv_hdr_t hdr;
+    int fd, ok = 1;
+    char c;
+
+    if (0 > (fd = ctest_connect()))
+    {
+        printf("%s: FAILED at connect\n", test);
+        return 0;
+    }
+
+    /* half a header */
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = PASSWD_SRV_MAGIC;
+    hdr.version = PASSWD_SRV_PROTO_VERSION;
+    if ((sizeof(hdr) / 2 != write(fd, &hdr, sizeof(hdr) / 2)) ||
+        (0 != ctest_read(fd, &c, 1)))
+    {
+        printf("%s: FAILED at partial request, connection not closed\n",
+               test);
+        ok = 0;
+    }
+
+    close(fd);
+    return ok;
+}
+
+/**
+ * Requests over RATE_LIMIT_UID get PASSWD_ERR_RATE_LIMITED and a
+ * retry-after hint, the limit must be below CTEST_CONNS
+ *
+ * @return TRUE if passed
+ */
+static int
+ctest_ratelimit()
+{
+    const char *test = "ratelimit";
+    int i, err, limited = 0;
+
+    for (i = 0; (i < CTEST_CONNS) && !limited; i++)
+    {
+        err = passwd_srv_change_password(s_opts.user, s_opts.password,
+                                         s_opts.password);
+        if (PASSWD_ERR_RATE_LIMITED == err)
+        {
+            limited = 1;
+        }
+        else if (!ctest_expect(test, i ? "change" : "first change", err,
+                               PASSWD_ERR_SUCCESS))
+        {
+            return 0;
+        }
+    }
+
+    if (!limited || (1 == i))
+    {
+        printf("%s: FAILED at limit, %d requests served\n", test, i);
+        return 0;
+    }
+    if (0 == passwd_srv_retry_after())
+    {
+        printf("%s: FAILED at retry-after hint, none given\n", test);
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Failed checks of the user up to BACKOFF_THRESHOLD put it in backoff, then
+ * even its right password is rejected with a retry-after hint.  The user is
+ * left in backoff, i.e. to check that it is kept over a restart.
+ *
+ * @return TRUE if passed
+ */
+static int
+ctest_backoff()
+{
+    const char *test = "backoff";
+    const char *value = get_passwd_srv_setting("BACKOFF_THRESHOLD");
+    int threshold = value ? atoi(value) : 3;
+    int i;
+
+    if (!ctest_expect(test, "change",
+                      passwd_srv_change_password(s_opts.user,
+                                                 s_opts.password,
+                                                 s_opts.password),
+                      PASSWD_ERR_SUCCESS))
+    {
+        return 0;
+    }
+
+    for (i = 0; i < threshold; i++)
+    {
+        if (!ctest_expect(test, "failed change",
+                          passwd_srv_change_password(s_opts.user,
+                                                     "ctest-wrong",
+                                                     s_opts.password),
+                          PASSWD_ERR_PASSWORD_NOT_MATCH))
+        {
+            return 0;
+        }
+    }
+
+    if (!ctest_expect(test, "change in backoff",
+                      passwd_srv_change_password(s_opts.user,
+                                                 s_opts.password,
+                                                 s_opts.password),
+                      PASSWD_ERR_BACKOFF))
+    {
+        return 0;
+    }
+    if (!ctest_expect(test, "verify in backoff",
+                      passwd_srv_verify_password(s_opts.user,
+                                                 s_opts.password),
+                      PASSWD_ERR_BACKOFF))
+    {
+        return 0;
+    }
+
+    if (0 == passwd_srv_retry_after())
+    {
+        printf("%s: FAILED at retry-after hint, none given\n", test);
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * An interactive request sent after a queue of bulk requests of other
+ * connections is served before most of them
+ *
+ * @return TRUE if passed
+ */
+static int
+ctest_sched()
+{
+    const char *test = "sched";
+    ctest_req_t reqs[CTEST_CONNS];
+    passwd_srv_msg_t msg;
+    int i, ok = 0;
+
+    memset(reqs, 0, sizeof(reqs));
+    for (i = 0; i < CTEST_CONNS; i++)
+    {
+        if (NULL == (reqs[i].conn = passwd_srv_async_create()))
+        {
+            printf("%s: FAILED at async create\n", test);
+            goto out;
+        }
+    }
+
+    /* the last connection is interactive, the others run a bulk job */
+    ctest_chg_msg(&msg, s_opts.password, s_opts.password);
+    for (i = 0; i < CTEST_CONNS; i++)
+    {
+        passwd_srv_async_set_batch(reqs[i].conn, (CTEST_CONNS - 1 != i));
+        if (!ctest_expect(test, "submit",
+                          passwd_srv_async_submit(reqs[i].conn, &msg,
+                                                  &reqs[i].handle),
+                          PASSWD_ERR_SUCCESS))
+        {
+            goto out;
+        }
+    }
+
+    if (CTEST_CONNS != ctest_complete(reqs, CTEST_CONNS))
+    {
+        printf("%s: FAILED at replies\n", test);
+        goto out;
+    }
+    for (i = 0; i < CTEST_CONNS; i++)
+    {
+        if (!ctest_expect(test, "status", reqs[i].status,
+                          PASSWD_ERR_SUCCESS))
+        {
+            goto out;
+        }
+    }
+
+    if (CTEST_CONNS / 2 <= reqs[CTEST_CONNS - 1].rank)
+    {
+        printf("%s: FAILED at interactive request, served %d of %d\n", test,
+               reqs[CTEST_CONNS - 1].rank + 1, CTEST_CONNS);
+        goto out;
+    }
+    ok = 1;
+
+out:
+    memset(&msg, 0, sizeof(msg));
+    for (i = 0; i < CTEST_CONNS; i++)
+    {
+        passwd_srv_async_destroy(reqs[i].conn);
+    }
+    return ok;
+}
+
+/**
+ * Requests of clients which close their connection right after sending
+ * them are dropped, and the server goes on serving
+ *
+ * @return TRUE if passed
+ */
+static int
+ctest_cancel()
+{
+    const char *test = "cancel";
+    passwd_srv_async_t *conns[CTEST_CONNS];
+    passwd_srv_msg_t msg;
+    uint32_t handle;
+    int i, ok = 0;
+
+    memset(conns, 0, sizeof(conns));
+    ctest_chg_msg(&msg, s_opts.password, s_opts.password);
+    for (i = 0; i < CTEST_CONNS; i++)
+    {
+        if ((NULL == (conns[i] = passwd_srv_async_create())) ||
+            !ctest_expect(test, "submit",
+                          passwd_srv_async_submit(conns[i], &msg, &handle),
+                          PASSWD_ERR_SUCCESS))
+        {
+            goto out;
+        }
+    }
+    for (i = 0; i < CTEST_CONNS; i++)
+    {
+        passwd_srv_async_destroy(conns[i]);
+        conns[i] = NULL;
+    }
+
+    /* served once the requests queued ahead of it are dropped */
+    if (!ctest_expect(test, "change after cancel",
+                      passwd_srv_change_password(s_opts.user,
+                                                 s_opts.password,
+                                                 s_opts.password),
+                      PASSWD_ERR_SUCCESS))
+    {
+        goto out;
+    }
+    ok = 1;
+
+out:
+    memset(&msg, 0, sizeof(msg));
+    for (i = 0; i < CTEST_CONNS; i++)
+    {
+        passwd_srv_async_destroy(conns[i]);
+    }
+    return ok;
+}
+
+/**
+ * A request sent again with its idempotency key gets the status of the
+ * first one and is not served twice
+ *
+ * @return TRUE if passed
+ */
+static int
+ctest_idempotency()
+{
+    const char *test = "idempotency";
+    uint8_t key[PASSWD_SRV_IDEM_KEY_SIZE], key2[PASSWD_SRV_IDEM_KEY_SIZE];
+    passwd_srv_msg_t msg;
+    int err, status = PASSWD_ERR_FATAL, i, ok = 0;
+
+    if ((1 != RAND_bytes(key, sizeof(key))) ||
+        (1 != RAND_bytes(key2, sizeof(key2))))
+    {
+        printf("%s: FAILED at key generation\n", test);
+        return 0;
+    }
+
+    /* a left over of an earlier run would give PASSWD_ERR_USER_EXIST */
+    passwd_srv_del_user("ctest_idem");
+
+    for (i = 0; i < 3; i++)
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.op_code = PASSWD_MSG_ADD_USER;
+        snprintf(msg.username, sizeof(msg.username), "ctest_idem");
+        snprintf(msg.newpasswd, sizeof(msg.newpasswd), "%s", s_opts.password);
+        err = passwd_srv_request_idempotent(&msg, key, &status);
+        if (!ctest_expect(test, "request", err, PASSWD_ERR_SUCCESS) ||
+            !ctest_expect(test, i ? "replayed add" : "add", status,
+                          PASSWD_ERR_SUCCESS))
+        {
+            goto out;
+        }
+    }
+
+    /* the same request under another key is served */
+    memset(&msg, 0, sizeof(msg));
+    msg.op_code = PASSWD_MSG_ADD_USER;
+    snprintf(msg.username, sizeof(msg.username), "ctest_idem");
+    snprintf(msg.newpasswd, sizeof(msg.newpasswd), "%s", s_opts.password);
+    err = passwd_srv_request_idempotent(&msg, key2, &status);
+    if (!ctest_expect(test, "request", err, PASSWD_ERR_SUCCESS) ||
+        !ctest_expect(test, "add under another key", status,
+                      PASSWD_ERR_USER_EXIST))
+    {
+        goto out;
+    }
+    ok = 1;
+
+out:
+    memset(&msg, 0, sizeof(msg));
+    if (!ctest_expect(test, "del", passwd_srv_del_user("ctest_idem"),
+                      PASSWD_ERR_SUCCESS))
+    {
+        ok = 0;
+    }
+    return ok;
+}
+
+/**
+ * VERIFY takes the password of the user only, and never the one of an
+ * account whose hash is locked, disabled or empty.  BACKOFF_THRESHOLD must
+ * be over the 8 failed checks of the locked account.
+ *
+ * @return TRUE if passed
+ */
+static int
+ctest_verify()
+{
+    static const struct {
+        const char *name;
+        const char *prefix;     /* password field of the account */
+        int         keep;       /* TRUE if the hash is kept after prefix */
+    } locks[] = {
+        {"locked",   "!", 1},
+        {"no hash",  "!", 0},
+        {"disabled", "*", 0},
+        {"empty",    "",  0},
+    };
+    const char *test = "verify";
+    int i, ok = 0;
+
+    if (!ctest_expect(test, "wrong password",
+                      passwd_srv_verify_password(s_opts.user, "ctest-wrong"),
+                      PASSWD_ERR_PASSWORD_NOT_MATCH) ||
+        !ctest_expect(test, "password",
+                      passwd_srv_verify_password(s_opts.user,
+                                                 s_opts.password),
+                      PASSWD_ERR_SUCCESS) ||
+        !ctest_expect(test, "unknown user",
+                      passwd_srv_verify_password("ctest_nouser",
+                                                 s_opts.password),
+                      PASSWD_ERR_USER_NOT_FOUND))
+    {
+        return 0;
+    }
+
+    /* a left over of an earlier run would give PASSWD_ERR_USER_EXIST */
+    passwd_srv_del_user(CTEST_LOCKED_USER);
+    if (!ctest_expect(test, "add",
+                      passwd_srv_add_user(CTEST_LOCKED_USER,
+                                          s_opts.password),
+                      PASSWD_ERR_SUCCESS))
+    {
+        return 0;
+    }
+
+    for (i = 0; i < sizeof(locks) / sizeof(locks[0]); i++)
+    {
+        if (!ctest_expect(test, locks[i].name,
+                          ctest_lock_shadow(CTEST_LOCKED_USER,
+                                            locks[i].prefix, locks[i].keep),
+                          PASSWD_ERR_SUCCESS) ||
+            !ctest_expect(test, locks[i].name,
+                          passwd_srv_verify_password(CTEST_LOCKED_USER,
+                                                     s_opts.password),
+                          PASSWD_ERR_PASSWORD_NOT_MATCH) ||
+            !ctest_expect(test, locks[i].name,
+                          passwd_srv_verify_password(CTEST_LOCKED_USER, ""),
+                          PASSWD_ERR_PASSWORD_NOT_MATCH))
+        {
+            goto out;
+        }
+    }
+    ok = 1;
+
+out:
+    if (!ctest_expect(test, "del", passwd_srv_del_user(CTEST_LOCKED_USER),
+                      PASSWD_ERR_SUCCESS))
+    {
+        ok = 0;
+    }
+    return ok;
+}
+
+/**
+ * Set the password of a user to the crypt() hash of a password
+ *
+ * @param username user whose password is set
+ * @param password password to hash
+ * @param salt     salt of crypt()
+ * @return status of SET_HASH, PASSWD_ERR_INVALID_PARAM if libcrypt does not
+ *         support the method of salt
+ */
+static int
+ctest_set_password(const char *username, const char *password,
+                   const char *salt)
+{
+    struct crypt_data data;
+    const char *hash;
+    int err;
+
+    memset(&data, 0, sizeof(data));
+    hash = crypt_r(password, salt, &data);
+
+    /* libxcrypt returns a string starting with '*' instead of NULL */
+    if ((NULL == hash) || ('*' == hash[0]))
+    {
+        return PASSWD_ERR_INVALID_PARAM;
+    }
+
+    err = passwd_srv_set_password_hash(username, hash);
+    memset(&data, 0, sizeof(data));
+    return err;
+}
+
+/**
+ * A cached check no longer matches once the server stores another password
+ * of the user, by CHG_PASSWORD or SET_HASH.  VERIFY_CACHE_TTL_MS must be set.
+ * Failed checks of a locked account are never cached.
+ *
+ * @return TRUE if passed
+ */
+static int
+ctest_vcache()
+{
+    const char *test = "vcache";
+    char other[PASSWD_PASSWORD_SIZE];
+    int ok = 0;
+
+    ctest_other_password(other);
+
+    /* the second check is answered from the cache */
+    if (!ctest_expect(test, "verify",
+                      passwd_srv_verify_password(s_opts.user,
+                                                 s_opts.password),
+                      PASSWD_ERR_SUCCESS) ||
+        !ctest_expect(test, "cached verify",
+                      passwd_srv_verify_password(s_opts.user,
+                                                 s_opts.password),
+                      PASSWD_ERR_SUCCESS))
+    {
+        return 0;
+    }
+
+    if (!ctest_expect(test, "change",
+                      passwd_srv_change_password(s_opts.user,
+                                                 s_opts.password, other),
+                      PASSWD_ERR_SUCCESS))
+    {
+        return 0;
+    }
+
+    if (!ctest_expect(test, "verify of changed password",
+                      passwd_srv_verify_password(s_opts.user,
+                                                 s_opts.password),
+                      PASSWD_ERR_PASSWORD_NOT_MATCH) ||
+        !ctest_expect(test, "verify of new password",
+                      passwd_srv_verify_password(s_opts.user, other),
+                      PASSWD_ERR_SUCCESS) ||
+        !ctest_expect(test, "cached verify of new password",
+                      passwd_srv_verify_password(s_opts.user, other),
+                      PASSWD_ERR_SUCCESS))
+    {
+        goto out;
+    }
+
+    /* a hash set by SET_HASH drops the cached checks too */
+    if (!ctest_expect(test, "set hash",
+                      ctest_set_password(s_opts.user, s_opts.password,
+                                         "$6$ctest$"),
+                      PASSWD_ERR_SUCCESS) ||
+        !ctest_expect(test, "verify of replaced password",
+                      passwd_srv_verify_password(s_opts.user, other),
+                      PASSWD_ERR_PASSWORD_NOT_MATCH) ||
+        !ctest_expect(test, "verify of set hash",
+                      passwd_srv_verify_password(s_opts.user,
+                                                 s_opts.password),
+                      PASSWD_ERR_SUCCESS))
+    {
+        goto out;
+    }
+
+    /* checks of a locked account fail each time, from the shadow file */
+    passwd_srv_del_user(CTEST_LOCKED_USER);
+    if (!ctest_expect(test, "add",
+                      passwd_srv_add_user(CTEST_LOCKED_USER,
+                                          s_opts.password),
+                      PASSWD_ERR_SUCCESS))
+    {
+        goto out;
+    }
+    if (!ctest_expect(test, "lock",
+                      ctest_lock_shadow(CTEST_LOCKED_USER, "*", 0),
+                      PASSWD_ERR_SUCCESS) ||
+        !ctest_expect(test, "verify of locked account",
+                      passwd_srv_verify_password(CTEST_LOCKED_USER,
+                                                 s_opts.password),
+                      PASSWD_ERR_PASSWORD_NOT_MATCH) ||
+        !ctest_expect(test, "verify of locked account again",
+                      passwd_srv_verify_password(CTEST_LOCKED_USER,
+                                                 s_opts.password),
+                      PASSWD_ERR_PASSWORD_NOT_MATCH))
+    {
+        passwd_srv_del_user(CTEST_LOCKED_USER);
+        goto out;
+    }
+    if (!ctest_expect(test, "del", passwd_srv_del_user(CTEST_LOCKED_USER),
+                      PASSWD_ERR_SUCCESS))
+    {
+        goto out;
+    }
+    ok = 1;
+
+out:
+    /* the user keeps --password */
+    ctest_set_password(s_opts.user, s_opts.password, "$6$ctest$");
+    return ok;
+}
+
+/**
+ * Users are listed by pages in name order, and a user and its password
+ * aging are read back as the sandbox has them
+ *
+ * @return TRUE if passed
+ */
+static int
+ctest_queries()
+{
+    const char *test = "queries";
+    passwd_srv_user_info_t users[PASSWD_SRV_USER_PAGE];
+    passwd_srv_user_info_t info;
+    passwd_srv_user_aging_t aging;
+    char after[PASSWD_USERNAME_SIZE] = "";
+    int i, count, more = 1, found = 0;
+
+    while (more)
+    {
+        if (!ctest_expect(test, "list",
+                          passwd_srv_list_users(after, users, &count, &more),
+                          PASSWD_ERR_SUCCESS))
+        {
+            return 0;
+        }
+        for (i = 0; i < count; i++)
+        {
+            if (0 <= strcmp(after, users[i].username))
+            {
+                printf("%s: FAILED at list order, %s after %s\n", test,
+                       users[i].username, after);
+                return 0;
+            }
+            snprintf(after, sizeof(after), "%s", users[i].username);
+            found |= (0 == strcmp(after, s_opts.user));
+        }
+        if (more && (0 == count))
+        {
+            printf("%s: FAILED at list, empty page before the last\n", test);
+            return 0;
+        }
+    }
+    if (!found)
+    {
+        printf("%s: FAILED at list, %s not listed\n", test, s_opts.user);
+        return 0;
+    }
+
+    if (!ctest_expect(test, "get user",
+                      passwd_srv_get_user(s_opts.user, &info),
+                      PASSWD_ERR_SUCCESS) ||
+        !ctest_expect(test, "user name",
+                      strcmp(info.username, s_opts.user), 0) ||
+        !ctest_expect(test, "unknown user",
+                      passwd_srv_get_user("ctest_nouser", &info),
+                      PASSWD_ERR_USER_NOT_FOUND))
+    {
+        return 0;
+    }
+
+    /* the accounts of the sandbox never expire */
+    if (!ctest_expect(test, "get aging",
+                      passwd_srv_get_aging(s_opts.user, &aging),
+                      PASSWD_ERR_SUCCESS) ||
+        !ctest_expect(test, "max days", (int)aging.max, 99999) ||
+        !ctest_expect(test, "unknown user aging",
+                      passwd_srv_get_aging("ctest_nouser", &aging),
+                      PASSWD_ERR_USER_NOT_FOUND))
+    {
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Subscribe to events after a seq
+ *
+ * @param after seq of the last event received, 0 for events from now on
+ * @return subscribed connection handle, NULL on failure
+ */
+static passwd_srv_async_t *
+ctest_subscribe(uint64_t after)
+{
+    passwd_srv_async_t *conn;
+    uint64_t deadline = ctest_now_msec() + CTEST_TIMEOUT_MSEC;
+    uint32_t handle;
+    int status = PASSWD_ERR_FATAL, err;
+
+    if ((NULL == (conn = passwd_srv_async_create())) ||
+        (PASSWD_ERR_SUCCESS != passwd_srv_async_subscribe(conn, after,
+                                                          &handle)))
+    {
+        passwd_srv_async_destroy(conn);
+        return NULL;
+    }
+
+    /* the events are sent once the subscription is replied to */
+    while (PASSWD_ERR_PENDING ==
+           (err = passwd_srv_async_result(conn, handle, &status)))
+    {
+        struct pollfd pfd = {passwd_srv_async_get_fd(conn), POLLIN, 0};
+
+        if (ctest_now_msec() > deadline)
+        {
+            break;
+        }
+        poll(&pfd, 1, 100);
+        passwd_srv_async_run(conn);
+    }
+
+    if ((PASSWD_ERR_SUCCESS != err) || (PASSWD_ERR_SUCCESS != status))
+    {
+        passwd_srv_async_destroy(conn);
+        return NULL;
+    }
+    return conn;
+}
+
+/**
+ * Wait for the next event of a subscription
+ *
+ * @param conn  subscribed connection handle
+ * @param event set to the event
+ * @return PASSWD_ERR_SUCCESS if an event arrived in CTEST_TIMEOUT_MSEC
+ */
+static int
+ctest_next_event(passwd_srv_async_t *conn, passwd_srv_event_t *event)
+{
+    uint64_t deadline = ctest_now_msec() + CTEST_TIMEOUT_MSEC;
+    int err;
+
+    while (PASSWD_ERR_PENDING == (err = passwd_srv_async_next_event(conn,
+                                                                   event)))
+    {
+        struct pollfd pfd = {passwd_srv_async_get_fd(conn), POLLIN, 0};
+
+        if (ctest_now_msec() > deadline)
+        {
+            break;
+        }
+        poll(&pfd, 1, 100);
+        passwd_srv_async_run(conn);
+    }
+    return err;
+}
+
+/**
+ * Wait for the next event of a user, skipping events of others
+ *
+ * @return type of the event, 0 if none arrived
+ */
+static uint32_t
+ctest_next_user_event(passwd_srv_async_t *conn, const char *username,
+                      passwd_srv_event_t *event)
+{
+    while (PASSWD_ERR_SUCCESS == ctest_next_event(conn, event))
+    {
+        if (0 == strcmp(event->username, username))
+        {
+            return event->type;
+        }
+    }
+    return 0;
+}
+
+/**
+ * A subscriber gets ADD_USER, PASSWORD and DEL_USER events of a user in
+ * order, a subscriber resuming after one of them gets the ones after it,
+ * and one resuming after an event no longer kept gets RESYNC
+ *
+ * @return TRUE if passed
+ */
+static int
+ctest_events()
+{
+    static const uint32_t types[] = {
+        PASSWD_SRV_EVENT_ADD_USER,
+        PASSWD_SRV_EVENT_PASSWORD,
+        PASSWD_SRV_EVENT_DEL_USER,
+    };
+    const char *test = "events";
+    const char *user = "ctest_event";
+    char other[PASSWD_PASSWORD_SIZE];
+    passwd_srv_async_t *conn;
+    passwd_srv_event_t event;
+    uint64_t first = 0;
+    int i, ok = 0;
+
+    ctest_other_password(other);
+
+    passwd_srv_del_user(user);
+    if (NULL == (conn = ctest_subscribe(0)))
+    {
+        printf("%s: FAILED at subscribe\n", test);
+        return 0;
+    }
+
+    if (!ctest_expect(test, "add", passwd_srv_add_user(user, s_opts.password),
+                      PASSWD_ERR_SUCCESS) ||
+        !ctest_expect(test, "change",
+                      passwd_srv_change_password(user, s_opts.password,
+                                                 other),
+                      PASSWD_ERR_SUCCESS) ||
+        !ctest_expect(test, "del", passwd_srv_del_user(user),
+                      PASSWD_ERR_SUCCESS))
+    {
+        goto out;
+    }
+
+    for (i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+    {
+        if (!ctest_expect(test, "event",
+                          ctest_next_user_event(conn, user, &event),
+                          types[i]))
+        {
+            goto out;
+        }
+        if (0 == i)
+        {
+            first = event.seq;
+        }
+    }
+    passwd_srv_async_destroy(conn);
+
+    /* resume after the first event, i.e. from a closed connection */
+    if (NULL == (conn = ctest_subscribe(first)))
+    {
+        printf("%s: FAILED at resume\n", test);
+        return 0;
+    }
+    for (i = 1; i < sizeof(types) / sizeof(types[0]); i++)
+    {
+        if (!ctest_expect(test, "resumed event",
+                          ctest_next_user_event(conn, user, &event),
+                          types[i]))
+        {
+            goto out;
+        }
+    }
+    passwd_srv_async_destroy(conn);
+
+    /* seqs start at the start time of the server, 1 is never kept */
+    if (NULL == (conn = ctest_subscribe(1)))
+    {
+        printf("%s: FAILED at stale resume\n", test);
+        return 0;
+    }
+    if (!ctest_expect(test, "stale resume",
+                      ctest_next_event(conn, &event), PASSWD_ERR_SUCCESS) ||
+        !ctest_expect(test, "resync event", event.type,
+                      PASSWD_SRV_EVENT_RESYNC))
+    {
+        goto out;
+    }
+    ok = 1;
+
+out:
+    passwd_srv_async_destroy(conn);
+    return ok;
+}
+
+/**
+ * Poll a job until it is done
+ *
+ * @param job_id id of the job
+ * @param status set to the status of the job
+ * @return PASSWD_ERR_SUCCESS if the job was done within CTEST_TIMEOUT_MSEC,
+ *         status of JOB_STATUS otherwise
+ */
+static int
+ctest_wait_job(uint32_t job_id, int *status)
+{
+    uint64_t deadline = ctest_now_msec() + CTEST_TIMEOUT_MSEC;
+    int err;
+
+    while (PASSWD_ERR_SUCCESS == (err = passwd_srv_job_status(job_id,
+                                                               status)))
+    {
+        if ((PASSWD_ERR_PENDING != *status) || (ctest_now_msec() > deadline))
+        {
+            break;
+        }
+        usleep(50000);
+    }
+    return ((PASSWD_ERR_SUCCESS == err) && (PASSWD_ERR_PENDING == *status)) ?
+           PASSWD_ERR_PENDING : err;
+}
+
+/**
+ * ADD_USER and DEL_USER sent as jobs are accepted with a job id at once, and
+ * JOB_STATUS tells their status until they are done
+ *
+ * @return TRUE if passed
+ */
+static int
+ctest_jobs()
+{
+    const char *test = "jobs";
+    const char *user = "ctest_job";
+    uint32_t job_id;
+    int status = PASSWD_ERR_FATAL, ok = 0;
+
+    passwd_srv_del_user(user);
+    passwd_srv_set_job(1);
+
+    if (!ctest_expect(test, "add", passwd_srv_add_user(user, s_opts.password),
+                      PASSWD_ERR_PENDING))
+    {
+        goto out;
+    }
+    if (0 == (job_id = passwd_srv_job_id()))
+    {
+        printf("%s: FAILED at add, no job id\n", test);
+        goto out;
+    }
+    if (!ctest_expect(test, "add job", ctest_wait_job(job_id, &status),
+                      PASSWD_ERR_SUCCESS) ||
+        !ctest_expect(test, "add status", status, PASSWD_ERR_SUCCESS) ||
+        !ctest_expect(test, "done add job",
+                      passwd_srv_job_status(job_id, &status),
+                      PASSWD_ERR_SUCCESS) ||
+        !ctest_expect(test, "done add status", status, PASSWD_ERR_SUCCESS))
+    {
+        goto out;
+    }
+
+    /* a job which fails has its own status */
+    if (!ctest_expect(test, "add again",
+                      passwd_srv_add_user(user, s_opts.password),
+                      PASSWD_ERR_PENDING) ||
+        !ctest_expect(test, "add again job",
+                      ctest_wait_job(passwd_srv_job_id(), &status),
+                      PASSWD_ERR_SUCCESS) ||
+        !ctest_expect(test, "add again status", status,
+                      PASSWD_ERR_USER_EXIST))
+    {
+        goto out;
+    }
+
+    if (!ctest_expect(test, "del", passwd_srv_del_user(user),
+                      PASSWD_ERR_PENDING) ||
+        !ctest_expect(test, "del job",
+                      ctest_wait_job(passwd_srv_job_id(), &status),
+                      PASSWD_ERR_SUCCESS) ||
+        !ctest_expect(test, "del status", status, PASSWD_ERR_SUCCESS))
+    {
+        goto out;
+    }
+
+    if (!ctest_expect(test, "unknown job",
+                      passwd_srv_job_status(job_id + 1000, &status),
+                      PASSWD_ERR_JOB_NOT_FOUND))
+    {
+        goto out;
+    }
+    ok = 1;
+
+out:
+    passwd_srv_set_job(0);
+    passwd_srv_del_user(user);
+    return ok;
+}
+
+/**
+ * SET_HASH takes the $5$, $6$ and $y$ formats only, without characters
+ * which would end the shadow entry, and stores them as they are
+ *
+ * @return TRUE if passed
+ */
+static int
+ctest_hash()
+{
+    const char *test = "hash";
+    int i, err;
+
+    for (i = 0; i < sizeof(s_hash_cases) / sizeof(s_hash_cases[0]); i++)
+    {
+        err = passwd_srv_set_password_hash(s_opts.user, s_hash_cases[i].hash);
+        if (!ctest_expect(test, s_hash_cases[i].name, err,
+                          s_hash_cases[i].status))
+        {
+            return 0;
+        }
+    }
+
+    if (!ctest_expect(test, "unknown user",
+                      passwd_srv_set_password_hash("ctest_nouser",
+                                                   s_hash_cases[0].hash),
+                      PASSWD_ERR_USER_NOT_FOUND) ||
+        !ctest_expect(test, "root",
+                      passwd_srv_set_password_hash("root",
+                                                   s_hash_cases[0].hash),
+                      PASSWD_ERR_INVALID_USER))
+    {
+        return 0;
+    }
+
+    /* hashes of the password are stored as they are */
+    for (i = 0; i < sizeof(s_hash_salts) / sizeof(s_hash_salts[0]); i++)
+    {
+        err = ctest_set_password(s_opts.user, s_opts.password,
+                                 s_hash_salts[i]);
+        if ((PASSWD_ERR_INVALID_PARAM == err) && ('y' == s_hash_salts[i][1]))
+        {
+            printf("%s: yescrypt is not supported by libcrypt, skipped\n",
+                   test);
+            continue;
+        }
+        if (!ctest_expect(test, s_hash_salts[i], err, PASSWD_ERR_SUCCESS) ||
+            !ctest_expect(test, "verify of stored hash",
+                          passwd_srv_verify_password(s_opts.user,
+                                                     s_opts.password),
+                          PASSWD_ERR_SUCCESS) ||
+            !ctest_expect(test, "shadow entry of stored hash",
+                          ctest_shadow_check(s_opts.password),
+                          PASSWD_ERR_SUCCESS))
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * checks by name, a check which needs settings of the server or none running
+ * says so
+ */
+static const struct {
+    const char *name;
+    int (*run)(void);
+} s_tests[] = {
+    {"sandbox",     ctest_sandbox},
+    {"framing",     ctest_framing},
+    {"activation",  ctest_activation},
+    {"busy",        ctest_busy},
+    {"deadline",    ctest_deadline},
+    {"ratelimit",   ctest_ratelimit},
+    {"backoff",     ctest_backoff},
+    {"sched",       ctest_sched},
+    {"cancel",      ctest_cancel},
+    {"idempotency", ctest_idempotency},
+    {"verify",      ctest_verify},
+    {"vcache",      ctest_vcache},
+    {"queries",     ctest_queries},
+    {"events",      ctest_events},
+    {"jobs",        ctest_jobs},
+    {"hash",        ctest_hash},
+};
+
+#define CTEST_COUNT (sizeof(s_tests) / sizeof(s_tests[0]))
+
+static void
+ctest_usage(const char *name)
+{
+    int i;
+
+    printf("%s: component checks of ops-passwd-srv --root\n"
+           "usage: %s [OPTIONS] --root=DIR --password=PASS CHECK...\n"
+           "  -r, --root=DIR          root directory of the server\n"
+           "  -u, --user=NAME         sandbox user the checks use (%s)\n"
+           "  -p, --password=PASS     password of the user\n"
+           "  -h, --help              display this help message\n"
+           "checks:",
+           name, name, CTEST_DEFAULT_USER);
+    for (i = 0; i < CTEST_COUNT; i++)
+    {
+        printf(" %s", s_tests[i].name);
+    }
+    printf("\n");
+}
+
+/**
+ * Point the client library at the yaml file of the server under test
+ *
+ * @return PASSWD_ERR_SUCCESS if the yaml file can be read
+ */
+static int
+ctest_init()
+{
+    char yaml_file[PATH_MAX];
+
+    if (PASSWD_ERR_SUCCESS != set_passwd_srv_root_dir(s_opts.root_dir))
+    {
+        fprintf(stderr, "invalid root directory %s\n", s_opts.root_dir);
+        return PASSWD_ERR_INVALID_PARAM;
+    }
+
+    snprintf(yaml_file, sizeof(yaml_file), "%s%s",
+             get_passwd_srv_root_dir(), PASSWD_SRV_YAML_FILE);
+    if (PASSWD_ERR_SUCCESS != passwd_srv_client_init(yaml_file))
+    {
+        fprintf(stderr, "failed to read %s\n", yaml_file);
+        return PASSWD_ERR_YAML_FILE;
+    }
+
+    return PASSWD_ERR_SUCCESS;
+}
+
+int
+main(int argc, char *argv[])
+{
+    static const struct option long_options[] = {
+        {"root",     required_argument, NULL, 'r'},
+        {"user",     required_argument, NULL, 'u'},
+        {"password", required_argument, NULL, 'p'},
+        {"help",     no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+    int c, i, failed = 0;
+
+    while (-1 != (c = getopt_long(argc, argv, "r:u:p:h", long_options, NULL)))
+    {
+        switch (c)
+        {
+        case 'r':
+            s_opts.root_dir = optarg;
+            break;
+        case 'u':
+            s_opts.user = optarg;
+            break;
+        case 'p':
+            s_opts.password = optarg;
+            break;
+        case 'h':
+            ctest_usage(argv[0]);
+            exit(EXIT_SUCCESS);
+        default:
+            ctest_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* never run against the live system */
+    if ((NULL == s_opts.root_dir) || (0 == strcmp(s_opts.root_dir, "/")) ||
+        (NULL == s_opts.password) || (optind == argc))
+    {
+        fprintf(stderr, "--root of a sandbox, --password and the checks to "
+                "run are required\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = optind; i < argc; i++)
+    {
+        for (c = 0; c < CTEST_COUNT; c++)
+        {
+            if (0 == strcmp(argv[i], s_tests[c].name))
+            {
+                break;
+            }
+        }
+        if (CTEST_COUNT == c)
+        {
+            fprintf(stderr, "unknown check '%s'\n", argv[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (PASSWD_ERR_SUCCESS != ctest_init())
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    /* in the order given */
+    for (i = optind; i < argc; i++)
+    {
+        for (c = 0; c < CTEST_COUNT; c++)
+        {
+            if (0 != strcmp(argv[i], s_tests[c].name))
+            {
+                continue;
+            }
+            if (s_tests[c].run())
+            {
+                printf("%s: PASSED\n", s_tests[c].name);
+            }
+            else
+            {
+                failed++;
+            }
+        }
+    }
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
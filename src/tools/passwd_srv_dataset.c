@@ -0,0 +1,441 @@
+/*
+ * (c) Copyright 2016 Hewlett Packard Enterprise Development LP
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+/************************************************************************//**
+ * @ingroup passwd-srvd
+ *
+ * @file
+ * Synthetic account database for password server benchmarks.
+ *
+ *    Writes etc/passwd, etc/shadow, etc/group, etc/login.defs and the
+ *     password server YAML file under a root directory.  Users are named
+ *     <prefix><index>, have ops_netop as primary group and are members of
+ *     ovsdb-client, the same way the password server adds users.  Each
+ *     user is also member of 'fanout' synthetic groups grp<index>.
+ ***************************************************************************/
+#include <crypt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+
+#include "passwd_srv_pri.h"
+#include "passwd_srv_dataset.h"
+
+#define DATASET_MAX_METHODS 8
+#define DATASET_SALT_SIZE   192         /* CRYPT_GENSALT_OUTPUT_SIZE */
+#define DATASET_HASH_SIZE   256
+#define DATASET_SALT_CHARS \
+    "./0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+
+/* gid of system groups, below DATASET_GID_BASE */
+#define DATASET_NETOP_GID   1001
+#define DATASET_OVSDB_GID   1002
+#define DATASET_ADMIN_GID   1003
+#define DATASET_VERIFY_GID  1004
+
+static const struct {
+    const char *name;
+    const char *prefix;
+    int        salt_len;
+} s_methods[] = {
+    { "des",      "",    2 },
+    { "md5",      "$1$", 8 },
+    { "sha256",   "$5$", 16 },
+    { "sha512",   "$6$", 16 },
+    { "yescrypt", "$y$", 0 },      /* setting built by crypt_gensalt() */
+};
+
+/**
+ * Build a crypt() setting for a hash method
+ *
+ * @param method index into s_methods
+ * @param buf    buffer to hold the setting
+ * @param len    size of buf
+ * @return PASSWD_ERR_SUCCESS if method is supported
+ */
+static int
+dataset_salt(int method, char *buf, size_t len)
+{
+    size_t pos;
+    int i;
+
+    if (0 == s_methods[method].salt_len)
+    {
+#ifdef CRYPT_GENSALT_IMPLEMENTS_AUTO_ENTROPY
+        return (NULL == crypt_gensalt_rn(s_methods[method].prefix, 0, NULL, 0,
+                                         buf, len)) ?
+                PASSWD_ERR_INVALID_PARAM : PASSWD_ERR_SUCCESS;
+#else
+        return PASSWD_ERR_INVALID_PARAM;
+#endif
+    }
+
+    pos = snprintf(buf, len, "%s", s_methods[method].prefix);
+    for (i = 0; (i < s_methods[method].salt_len) && (pos + 1 < len); i++)
+    {
+        buf[pos++] = DATASET_SALT_CHARS[random() % 64];
+    }
+    buf[pos] = '\0';
+
+    return PASSWD_ERR_SUCCESS;
+}
+
+/**
+ * Hash the dataset password with a hash method
+ *
+ * @param ds     dataset description
+ * @param method index into s_methods
+ * @param hash   buffer to hold the hash
+ * @param len    size of hash
+ * @return PASSWD_ERR_SUCCESS if hashed
+ */
+static int
+dataset_hash(const passwd_srv_dataset_t *ds, int method, char *hash,
+             size_t len)
+{
+    struct crypt_data data;
+    char salt[DATASET_SALT_SIZE];
+    char *result;
+
+    if (PASSWD_ERR_SUCCESS != dataset_salt(method, salt, sizeof(salt)))
+    {
+        return PASSWD_ERR_INVALID_PARAM;
+    }
+
+    memset(&data, 0, sizeof(data));
+    result = crypt_r(ds->password, salt, &data);
+
+    /* libxcrypt returns a string starting with '*' instead of NULL */
+    if ((NULL == result) || ('*' == result[0]) || (strlen(result) >= len))
+    {
+        return PASSWD_ERR_INVALID_PARAM;
+    }
+
+    memcpy(hash, result, strlen(result) + 1);
+    return PASSWD_ERR_SUCCESS;
+}
+
+/**
+ * Translate a comma separated list of hash method names
+ *
+ * @param list    i.e. "sha512,yescrypt"
+ * @param methods array filled with indexes into s_methods
+ * @return number of methods, 0 if list is invalid
+ */
+static int
+dataset_parse_methods(const char *list, int *methods)
+{
+    char *copy, *name, *save = NULL;
+    int count = 0, i;
+
+    if (NULL == (copy = strdup(list)))
+    {
+        return 0;
+    }
+
+    for (name = strtok_r(copy, ",", &save); name;
+         name = strtok_r(NULL, ",", &save))
+    {
+        for (i = 0; i < sizeof(s_methods) / sizeof(s_methods[0]); i++)
+        {
+            if (0 == strcasecmp(name, s_methods[i].name))
+            {
+                break;
+            }
+        }
+
+        if ((i == sizeof(s_methods) / sizeof(s_methods[0])) ||
+            (DATASET_MAX_METHODS == count))
+        {
+            fprintf(stderr, "unknown hash method '%s'\n", name);
+            count = 0;
+            break;
+        }
+        methods[count++] = i;
+    }
+
+    free(copy);
+    return count;
+}
+
+/**
+ * Get username of a dataset user
+ *
+ * @param ds    dataset description
+ * @param index user index, 0 to users - 1
+ * @param buf   buffer to hold the username
+ * @param len   size of buf
+ */
+void
+passwd_srv_dataset_username(const passwd_srv_dataset_t *ds, int index,
+                            char *buf, size_t len)
+{
+    snprintf(buf, len, "%s%d",
+             ds->prefix ? ds->prefix : DATASET_DEFAULT_PREFIX, index);
+}
+
+/**
+ * Get name of a synthetic group
+ *
+ * @param index group index, 0 to groups - 1
+ * @param buf   buffer to hold the group name
+ * @param len   size of buf
+ */
+void
+passwd_srv_dataset_groupname(int index, char *buf, size_t len)
+{
+    snprintf(buf, len, "grp%d", index);
+}
+
+/**
+ * Open a file under the root directory for writing
+ *
+ * @param ds   dataset description
+ * @param file file path relative to the root directory
+ * @param mode file mode
+ * @return opened file, NULL on failure
+ */
+static FILE *
+dataset_open(const passwd_srv_dataset_t *ds, const char *file, mode_t mode)
+{
+    char path[PATH_MAX];
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "%s%s", ds->root_dir, file);
+    if (NULL == (fp = fopen(path, "w")))
+    {
+        fprintf(stderr, "failed to create %s\n", path);
+        return NULL;
+    }
+
+    chmod(path, mode);
+    return fp;
+}
+
+/**
+ * Write passwd and shadow files
+ */
+static int
+dataset_write_users(const passwd_srv_dataset_t *ds)
+{
+    int methods[DATASET_MAX_METHODS];
+    char hashes[DATASET_MAX_METHODS][DATASET_HASH_SIZE];
+    char hash[DATASET_HASH_SIZE];
+    char name[PASSWD_USERNAME_SIZE];
+    int nmethods, i, m;
+    FILE *fpPasswd, *fpShadow;
+
+    if (0 == (nmethods = dataset_parse_methods(ds->methods ? ds->methods :
+                                               DATASET_DEFAULT_METHODS,
+                                               methods)))
+    {
+        return PASSWD_ERR_INVALID_PARAM;
+    }
+
+    /* hashing is the slow part, share one hash per method by default */
+    for (m = 0; m < nmethods; m++)
+    {
+        if (PASSWD_ERR_SUCCESS != dataset_hash(ds, methods[m], hashes[m],
+                                               sizeof(hashes[m])))
+        {
+            fprintf(stderr, "hash method %s is not supported\n",
+                    s_methods[methods[m]].name);
+            return PASSWD_ERR_INVALID_PARAM;
+        }
+    }
+
+    fpPasswd = dataset_open(ds, PASSWD_PASSWORD_FILE, 0644);
+    fpShadow = dataset_open(ds, PASSWD_SHADOW_FILE, 0600);
+    if ((NULL == fpPasswd) || (NULL == fpShadow))
+    {
+        if (fpPasswd) fclose(fpPasswd);
+        if (fpShadow) fclose(fpShadow);
+        return PASSWD_ERR_FATAL;
+    }
+
+    fprintf(fpPasswd, "root:x:0:0:root:/root:/bin/bash\n");
+    fprintf(fpShadow, "root:*:17000:0:99999:7:::\n");
+
+    for (i = 0; i < ds->users; i++)
+    {
+        m = i % nmethods;
+        if (ds->unique_salts &&
+            (PASSWD_ERR_SUCCESS != dataset_hash(ds, methods[m], hash,
+                                                sizeof(hash))))
+        {
+            break;
+        }
+
+        passwd_srv_dataset_username(ds, i, name, sizeof(name));
+        fprintf(fpPasswd, "%s:x:%d:%d::/home/%s:%s\n", name,
+                DATASET_UID_BASE + i, DATASET_NETOP_GID, name, VTYSH_PROMPT);
+        fprintf(fpShadow, "%s:%s:17000:0:99999:7:::\n", name,
+                ds->unique_salts ? hash : hashes[m]);
+    }
+
+    fclose(fpPasswd);
+    fclose(fpShadow);
+
+    return (i == ds->users) ? PASSWD_ERR_SUCCESS : PASSWD_ERR_FATAL;
+}
+
+/**
+ * Write group file.  User i is member of synthetic groups
+ * (i + k) % groups for k < fanout.
+ */
+static int
+dataset_write_groups(const passwd_srv_dataset_t *ds)
+{
+    char name[PASSWD_USERNAME_SIZE];
+    int group, k, i, residue, first;
+    FILE *fp;
+
+    if (NULL == (fp = dataset_open(ds, PASSWD_GROUP_FILE, 0644)))
+    {
+        return PASSWD_ERR_FATAL;
+    }
+
+    fprintf(fp, "root:x:0:\n");
+    fprintf(fp, "%s:x:%d:\n", NETOP_GROUP, DATASET_NETOP_GID);
+    fprintf(fp, "%s:x:%d:root\n", ADMIN_GROUP, DATASET_ADMIN_GID);
+    fprintf(fp, "%s:x:%d:root\n", VERIFY_GROUP, DATASET_VERIFY_GID);
+
+    /* all users are secondary members, as added by useradd -G */
+    fprintf(fp, "%s:x:%d:root", OVSDB_GROUP, DATASET_OVSDB_GID);
+    for (i = 0; i < ds->users; i++)
+    {
+        passwd_srv_dataset_username(ds, i, name, sizeof(name));
+        fprintf(fp, ",%s", name);
+    }
+    fputc('\n', fp);
+
+    for (group = 0; group < ds->groups; group++)
+    {
+        passwd_srv_dataset_groupname(group, name, sizeof(name));
+        fprintf(fp, "%s:x:%d:", name, DATASET_GID_BASE + group);
+
+        first = 1;
+        for (k = 0; (k < ds->fanout) && (k < ds->groups); k++)
+        {
+            residue = (group - k + ds->groups) % ds->groups;
+            for (i = residue; i < ds->users; i += ds->groups)
+            {
+                passwd_srv_dataset_username(ds, i, name, sizeof(name));
+                fprintf(fp, first ? "%s" : ",%s", name);
+                first = 0;
+            }
+        }
+        fputc('\n', fp);
+    }
+
+    fclose(fp);
+    return PASSWD_ERR_SUCCESS;
+}
+
+/**
+ * Write login.defs and the password server YAML file
+ */
+static int
+dataset_write_config(const passwd_srv_dataset_t *ds)
+{
+    FILE *fp;
+
+    if (NULL == (fp = dataset_open(ds, PASSWD_LOGIN_FILE, 0644)))
+    {
+        return PASSWD_ERR_FATAL;
+    }
+
+    /* useradd picks uids/gids in its range, below the synthetic users */
+    fprintf(fp, "ENCRYPT_METHOD SHA512\n"
+                "UID_MIN 1000\nUID_MAX 60000\n"
+                "GID_MIN 1000\nGID_MAX 60000\n");
+    fclose(fp);
+
+    if (NULL == (fp = dataset_open(ds, PASSWD_SRV_YAML_FILE, 0644)))
+    {
+        return PASSWD_ERR_FATAL;
+    }
+
+    fprintf(fp, "# password server configuration of a synthetic dataset\n"
+                "---\n"
+                "files:\n"
+                "  - type: SOCKET\n"
+                "    path: '%s/ops-passwd-srv.sock'\n"
+                "    description: 'File path for password server socket'\n"
+                "\n"
+                "  - type: PUB_KEY\n"
+                "    path: '%s/ops-passwd-srv-pub.pem'\n"
+                "    description: 'Public key location to encrypt message'\n",
+            PASSWD_RUN_DIR, PASSWD_RUN_DIR);
+    fclose(fp);
+
+    return PASSWD_ERR_SUCCESS;
+}
+
+/**
+ * Create directory and its parents
+ */
+static void
+dataset_mkdir(const char *root_dir, const char *dir)
+{
+    char path[PATH_MAX];
+    char *slash;
+
+    snprintf(path, sizeof(path), "%s%s/", root_dir, dir);
+    for (slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/'))
+    {
+        *slash = '\0';
+        mkdir(path, 0755);
+        *slash = '/';
+    }
+}
+
+/**
+ * Write a synthetic account database under the root directory
+ *
+ * @param ds dataset description
+ * @return PASSWD_ERR_SUCCESS if all files are written
+ */
+int
+passwd_srv_dataset_create(const passwd_srv_dataset_t *ds)
+{
+    int err;
+
+    if ((NULL == ds->root_dir) || ('/' != ds->root_dir[0]) ||
+        (NULL == ds->password) || (0 > ds->users) || (0 > ds->groups) ||
+        (0 > ds->fanout))
+    {
+        return PASSWD_ERR_INVALID_PARAM;
+    }
+
+    /* same hashes for the same dataset description */
+    srandom(ds->users);
+
+    dataset_mkdir(ds->root_dir, "/etc/ops-passwd-srv");
+    dataset_mkdir(ds->root_dir, "/var/run");
+
+    if ((PASSWD_ERR_SUCCESS != (err = dataset_write_users(ds))) ||
+        (PASSWD_ERR_SUCCESS != (err = dataset_write_groups(ds))) ||
+        (PASSWD_ERR_SUCCESS != (err = dataset_write_config(ds))))
+    {
+        return err;
+    }
+
+    return PASSWD_ERR_SUCCESS;
+}
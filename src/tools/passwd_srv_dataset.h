@@ -0,0 +1,47 @@
+/*
+ * (c) Copyright 2016 Hewlett Packard Enterprise Development LP
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef PASSWD_SRV_DATASET_H_
+#define PASSWD_SRV_DATASET_H_
+
+#include <stddef.h>
+
+#define DATASET_DEFAULT_PREFIX   "user"
+#define DATASET_DEFAULT_METHODS  "sha512"
+#define DATASET_UID_BASE         100000     /* above UID_MAX of useradd */
+#define DATASET_GID_BASE         100000
+
+/*
+ * synthetic account database written under a root directory, i.e. a
+ * sandbox for 'ops-passwd-srv --root'
+ */
+typedef struct passwd_srv_dataset {
+    const char *root_dir;
+    const char *prefix;         /* users are named <prefix><index> */
+    const char *password;       /* cleartext password of every user */
+    const char *methods;        /* comma separated, assigned round robin */
+    int         users;
+    int         groups;         /* synthetic groups besides system groups */
+    int         fanout;         /* synthetic groups each user is member of */
+    int         unique_salts;   /* hash every user, otherwise per method */
+} passwd_srv_dataset_t;
+
+int passwd_srv_dataset_create(const passwd_srv_dataset_t *ds);
+void passwd_srv_dataset_username(const passwd_srv_dataset_t *ds, int index,
+                                 char *buf, size_t len);
+void passwd_srv_dataset_groupname(int index, char *buf, size_t len);
+
+#endif /* PASSWD_SRV_DATASET_H_ */
@@ -0,0 +1,129 @@
+/*
+ * (c) Copyright 2016 Hewlett Packard Enterprise Development LP
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+/************************************************************************//**
+ * @ingroup passwd-srvd
+ *
+ * @file
+ * Synthetic dataset generator for the Password Server.
+ *
+ *    Populates a root directory with passwd, shadow, group, login.defs and
+ *     YAML files so that 'ops-passwd-srv --root' can be run against a given
+ *     number of accounts.
+ ***************************************************************************/
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "passwd_srv_pri.h"
+#include "passwd_srv_dataset.h"
+
+static void
+gendata_usage(const char *name)
+{
+    printf("%s: synthetic account files for ops-passwd-srv --root\n"
+           "usage: %s [OPTIONS] --root=DIR --password=PASS\n"
+           "  -r, --root=DIR          directory to populate\n"
+           "  -n, --users=N           number of users (1000)\n"
+           "  -g, --groups=N          number of synthetic groups (0)\n"
+           "  -F, --fanout=N          synthetic groups per user (0)\n"
+           "  -m, --methods=LIST      hash methods assigned round robin,\n"
+           "                          des,md5,sha256,sha512,yescrypt (%s)\n"
+           "  -p, --password=PASS     password of every user\n"
+           "  -P, --prefix=PREFIX     username prefix (%s)\n"
+           "  -U, --unique-salts      hash every user with its own salt\n"
+           "                          (slow), default one hash per method\n"
+           "  -h, --help              display this help message\n",
+           name, name, DATASET_DEFAULT_METHODS, DATASET_DEFAULT_PREFIX);
+}
+
+int
+main(int argc, char *argv[])
+{
+    static const struct option long_options[] = {
+        {"root",         required_argument, NULL, 'r'},
+        {"users",        required_argument, NULL, 'n'},
+        {"groups",       required_argument, NULL, 'g'},
+        {"fanout",       required_argument, NULL, 'F'},
+        {"methods",      required_argument, NULL, 'm'},
+        {"password",     required_argument, NULL, 'p'},
+        {"prefix",       required_argument, NULL, 'P'},
+        {"unique-salts", no_argument,       NULL, 'U'},
+        {"help",         no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+    passwd_srv_dataset_t ds = {
+        .prefix  = DATASET_DEFAULT_PREFIX,
+        .methods = DATASET_DEFAULT_METHODS,
+        .users   = 1000,
+    };
+    int c;
+
+    while (-1 != (c = getopt_long(argc, argv, "r:n:g:F:m:p:P:Uh",
+                                  long_options, NULL)))
+    {
+        switch (c)
+        {
+        case 'r':
+            ds.root_dir = optarg;
+            break;
+        case 'n':
+            ds.users = atoi(optarg);
+            break;
+        case 'g':
+            ds.groups = atoi(optarg);
+            break;
+        case 'F':
+            ds.fanout = atoi(optarg);
+            break;
+        case 'm':
+            ds.methods = optarg;
+            break;
+        case 'p':
+            ds.password = optarg;
+            break;
+        case 'P':
+            ds.prefix = optarg;
+            break;
+        case 'U':
+            ds.unique_salts = 1;
+            break;
+        case 'h':
+            gendata_usage(argv[0]);
+            exit(EXIT_SUCCESS);
+        default:
+            gendata_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if ((NULL == ds.root_dir) || (NULL == ds.password))
+    {
+        fprintf(stderr, "--root and --password are required\n");
+        return EXIT_FAILURE;
+    }
+
+    if (PASSWD_ERR_SUCCESS != passwd_srv_dataset_create(&ds))
+    {
+        fprintf(stderr, "failed to create dataset under %s\n", ds.root_dir);
+        return EXIT_FAILURE;
+    }
+
+    printf("%d users, %d groups (fanout %d) written under %s\n",
+           ds.users, ds.groups, ds.fanout, ds.root_dir);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,704 @@
+/*
+ * (c) Copyright 2016 Hewlett Packard Enterprise Development LP
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+/************************************************************************//**
+ * @ingroup passwd-srvd
+ *
+ * @file
+ * Closed-loop load generator for the Password Server.
+ *
+ *    Each worker thread keeps exactly one request outstanding: it builds a
+ *     passwd_srv_msg_t according to the configured opcode mix, sends it with
+ *     passwd_srv_request() and waits for the status before issuing the next
+ *     one.  At the end of the run
+ *     throughput and p50/p99/p999 latency are reported per opcode.
+ *
+ *    CHG_PASSWORD requests re-set the password of --user to the value given
+ *     by --password, so the account is unchanged by the run.  ADD_USER
+ *     creates throw-away users named <prefix><worker>_<n> and DEL_USER
+ *     removes them again; users left at the end of the run are deleted.
+ ***************************************************************************/
+#include <getopt.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "passwd_srv_pub.h"
+
+#define LOADGEN_MAX_WORKERS   256
+#define LOADGEN_MAX_USERS     1024  /* users a worker keeps added at once */
+#define LOADGEN_OPCODE_MAX    (PASSWD_MSG_GET_AGING + 1)
+#define LOADGEN_USER_PREFIX   "lg"
+
+/*
+ * latency samples collected by one worker for one opcode
+ */
+typedef struct loadgen_samples {
+    uint64_t *ns;          /* request latency in nanoseconds */
+    size_t   count;
+    size_t   size;
+    uint64_t errors;       /* requests answered with an error status */
+} loadgen_samples_t;
+
+/*
+ * per-thread state of the load generator
+ */
+typedef struct loadgen_worker {
+    pthread_t         thread;
+    int               id;
+    unsigned int      seed;
+    loadgen_samples_t samples[LOADGEN_OPCODE_MAX];
+    uint64_t          transport_errors;  /* connect/send/recv failures */
+    uint64_t          status_count[PASSWD_ERR_BACKOFF + 2];
+    char              (*users)[PASSWD_USERNAME_SIZE]; /* users added so far */
+    size_t            nusers;
+    unsigned long     next_user;
+} loadgen_worker_t;
+
+static struct {
+    const char *yaml_file;          /* NULL for the default under root_dir */
+    const char *root_dir;
+    const char *user;
+    const char *password;
+    const char *prefix;
+    int         concurrency;
+    int         batch;              /* requests flagged as a bulk job */
+    int         duration;           /* seconds */
+    int         mix[LOADGEN_OPCODE_MAX];
+    int         mix_total;
+} s_opts = {
+    .yaml_file   = NULL,
+    .root_dir    = NULL,
+    .user        = NULL,
+    .password    = NULL,
+    .prefix      = LOADGEN_USER_PREFIX,
+    .concurrency = 1,
+    .duration    = 10,
+};
+
+static uint64_t s_deadline = 0;
+
+static const char *s_opcode_name[LOADGEN_OPCODE_MAX] = {
+    "ALL",
+    "CHG_PASSWORD",
+    "ADD_USER",
+    "DEL_USER",
+    "VERIFY",
+    "LIST_USERS",
+    "GET_USER",
+    "GET_AGING"
+};
+
+/**
+ * Monotonic clock in nanoseconds
+ */
+static uint64_t
+loadgen_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Append one latency sample
+ *
+ * @param samples sample set to update
+ * @param ns      latency of the request
+ * @return PASSWD_ERR_SUCCESS if stored
+ */
+static int
+loadgen_add_sample(loadgen_samples_t *samples, uint64_t ns)
+{
+    uint64_t *new_ns;
+    size_t size;
+
+    if (samples->count == samples->size)
+    {
+        size = samples->size ? samples->size * 2 : 1024;
+        if (NULL == (new_ns = realloc(samples->ns, size * sizeof(*new_ns))))
+        {
+            return PASSWD_ERR_INSUFFICIENT_MEM;
+        }
+        samples->ns = new_ns;
+        samples->size = size;
+    }
+
+    samples->ns[samples->count++] = ns;
+    return PASSWD_ERR_SUCCESS;
+}
+
+/**
+ * Pick the opcode of the next request according to the opcode mix
+ *
+ * @param worker worker issuing the request
+ * @return opcode to use
+ */
+static int
+loadgen_pick_opcode(loadgen_worker_t *worker)
+{
+    int pick = rand_r(&worker->seed) % s_opts.mix_total;
+    int opcode;
+
+    for (opcode = PASSWD_MSG_CHG_PASSWORD; opcode < LOADGEN_OPCODE_MAX;
+         opcode++)
+    {
+        if (pick < s_opts.mix[opcode])
+        {
+            break;
+        }
+        pick -= s_opts.mix[opcode];
+    }
+
+    /* nothing to delete yet, add a user first */
+    if ((PASSWD_MSG_DEL_USER == opcode) && (0 == worker->nusers))
+    {
+        opcode = PASSWD_MSG_ADD_USER;
+    }
+    else if ((PASSWD_MSG_ADD_USER == opcode) &&
+             (LOADGEN_MAX_USERS == worker->nusers))
+    {
+        opcode = PASSWD_MSG_DEL_USER;
+    }
+
+    return opcode;
+}
+
+/**
+ * Fill in request for a given opcode
+ *
+ * @param worker worker issuing the request
+ * @param opcode opcode to use
+ * @param msg    request to fill in
+ */
+static void
+loadgen_build_request(loadgen_worker_t *worker, int opcode,
+                      passwd_srv_msg_t *msg)
+{
+    memset(msg, 0, sizeof(*msg));
+    msg->op_code = opcode;
+
+    switch (opcode)
+    {
+    case PASSWD_MSG_CHG_PASSWORD:
+        snprintf(msg->username, sizeof(msg->username), "%s", s_opts.user);
+        snprintf(msg->oldpasswd, sizeof(msg->oldpasswd), "%s",
+                 s_opts.password);
+        snprintf(msg->newpasswd, sizeof(msg->newpasswd), "%s",
+                 s_opts.password);
+        break;
+    case PASSWD_MSG_ADD_USER:
+        snprintf(msg->username, sizeof(msg->username), "%s%d_%lu",
+                 s_opts.prefix, worker->id, worker->next_user++);
+        snprintf(msg->newpasswd, sizeof(msg->newpasswd), "%s",
+                 s_opts.password);
+        break;
+    case PASSWD_MSG_DEL_USER:
+        memcpy(msg->username, worker->users[worker->nusers - 1],
+               sizeof(msg->username));
+        break;
+    case PASSWD_MSG_VERIFY:
+        snprintf(msg->username, sizeof(msg->username), "%s", s_opts.user);
+        snprintf(msg->oldpasswd, sizeof(msg->oldpasswd), "%s",
+                 s_opts.password);
+        break;
+    case PASSWD_MSG_GET_USER:
+    case PASSWD_MSG_GET_AGING:
+        snprintf(msg->username, sizeof(msg->username), "%s", s_opts.user);
+        break;
+    }
+}
+
+/**
+ * Worker thread: issue requests back to back until the deadline
+ */
+static void *
+loadgen_worker_run(void *arg)
+{
+    loadgen_worker_t *worker = arg;
+    passwd_srv_msg_t msg;
+    uint64_t start;
+    int opcode, status;
+
+    passwd_srv_set_batch(s_opts.batch);
+
+    while (loadgen_now() < s_deadline)
+    {
+        opcode = loadgen_pick_opcode(worker);
+        loadgen_build_request(worker, opcode, &msg);
+
+        start = loadgen_now();
+        if (PASSWD_ERR_SUCCESS != passwd_srv_request(&msg, &status))
+        {
+            worker->transport_errors++;
+            continue;
+        }
+        loadgen_add_sample(&worker->samples[opcode], loadgen_now() - start);
+
+        if ((status >= PASSWD_ERR_FATAL) && (status <= PASSWD_ERR_BACKOFF))
+        {
+            worker->status_count[status + 1]++;
+        }
+
+        if (PASSWD_ERR_SUCCESS != status)
+        {
+            worker->samples[opcode].errors++;
+            continue;
+        }
+
+        if (PASSWD_MSG_ADD_USER == opcode)
+        {
+            memcpy(worker->users[worker->nusers++], msg.username,
+                   sizeof(msg.username));
+        }
+        else if (PASSWD_MSG_DEL_USER == opcode)
+        {
+            worker->nusers--;
+        }
+    }
+
+    passwd_srv_client_disconnect();
+    return NULL;
+}
+
+/**
+ * Delete users which were added by a worker but not deleted during the run
+ */
+static void
+loadgen_cleanup_users(loadgen_worker_t *worker)
+{
+    passwd_srv_msg_t msg;
+    int status;
+
+    while (worker->nusers)
+    {
+        loadgen_build_request(worker, PASSWD_MSG_DEL_USER, &msg);
+        if ((PASSWD_ERR_SUCCESS != passwd_srv_request(&msg, &status)) ||
+            (PASSWD_ERR_SUCCESS != status))
+        {
+            fprintf(stderr, "failed to delete user %s\n", msg.username);
+        }
+        worker->nusers--;
+    }
+}
+
+static int
+loadgen_compare_ns(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * Return percentile of sorted samples in microseconds
+ */
+static double
+loadgen_percentile(const loadgen_samples_t *samples, double pct)
+{
+    size_t idx;
+
+    if (0 == samples->count)
+    {
+        return 0;
+    }
+
+    idx = (size_t)(pct / 100.0 * (samples->count - 1) + 0.5);
+    return samples->ns[idx] / 1000.0;
+}
+
+/**
+ * Merge samples of all workers for a given opcode (0 means all opcodes)
+ *
+ * @return PASSWD_ERR_SUCCESS if merged, out is left empty otherwise
+ */
+static int
+loadgen_merge(loadgen_worker_t *workers, int opcode, loadgen_samples_t *out)
+{
+    uint64_t *new_ns;
+    int i, op;
+
+    memset(out, 0, sizeof(*out));
+
+    for (i = 0; i < s_opts.concurrency; i++)
+    {
+        for (op = PASSWD_MSG_CHG_PASSWORD; op < LOADGEN_OPCODE_MAX; op++)
+        {
+            loadgen_samples_t *in = &workers[i].samples[op];
+
+            if (opcode && (op != opcode))
+            {
+                continue;
+            }
+            if (out->size < out->count + in->count)
+            {
+                if (NULL == (new_ns = realloc(out->ns,
+                        (out->count + in->count) * sizeof(*new_ns))))
+                {
+                    free(out->ns);
+                    memset(out, 0, sizeof(*out));
+                    return PASSWD_ERR_INSUFFICIENT_MEM;
+                }
+                out->ns = new_ns;
+                out->size = out->count + in->count;
+            }
+            if (in->count)
+            {
+                memcpy(&out->ns[out->count], in->ns,
+                       in->count * sizeof(*in->ns));
+            }
+            out->count += in->count;
+            out->errors += in->errors;
+        }
+    }
+
+    if (out->count)
+    {
+        qsort(out->ns, out->count, sizeof(*out->ns), loadgen_compare_ns);
+    }
+    return PASSWD_ERR_SUCCESS;
+}
+
+/**
+ * Print throughput and latency percentiles of the run
+ */
+static void
+loadgen_report(loadgen_worker_t *workers, double elapsed)
+{
+    loadgen_samples_t merged;
+    uint64_t transport_errors = 0, status_count;
+    int opcode, i, status;
+
+    printf("concurrency=%d duration=%.2fs\n", s_opts.concurrency, elapsed);
+    printf("%-14s %10s %8s %12s %10s %10s %10s %10s\n", "opcode", "requests",
+           "errors", "req/s", "p50(us)", "p99(us)", "p999(us)", "max(us)");
+
+    for (opcode = PASSWD_MSG_CHG_PASSWORD; opcode <= LOADGEN_OPCODE_MAX;
+         opcode++)
+    {
+        int op = opcode % LOADGEN_OPCODE_MAX;   /* "ALL" is printed last */
+
+        if (PASSWD_ERR_SUCCESS != loadgen_merge(workers, op, &merged))
+        {
+            fprintf(stderr, "failed to merge the samples of %s\n",
+                    s_opcode_name[op]);
+            return;
+        }
+        if (op && (0 == merged.count))
+        {
+            continue;
+        }
+
+        printf("%-14s %10zu %8llu %12.1f %10.0f %10.0f %10.0f %10.0f\n",
+               s_opcode_name[op], merged.count,
+               (unsigned long long)merged.errors, merged.count / elapsed,
+               loadgen_percentile(&merged, 50.0),
+               loadgen_percentile(&merged, 99.0),
+               loadgen_percentile(&merged, 99.9),
+               loadgen_percentile(&merged, 100.0));
+        free(merged.ns);
+    }
+
+    printf("status:");
+    for (status = PASSWD_ERR_FATAL; status <= PASSWD_ERR_BACKOFF; status++)
+    {
+        status_count = 0;
+        for (i = 0; i < s_opts.concurrency; i++)
+        {
+            status_count += workers[i].status_count[status + 1];
+        }
+        if (status_count)
+        {
+            printf(" %d=%llu", status, (unsigned long long)status_count);
+        }
+    }
+    for (i = 0; i < s_opts.concurrency; i++)
+    {
+        transport_errors += workers[i].transport_errors;
+    }
+    printf(" transport_errors=%llu\n", (unsigned long long)transport_errors);
+}
+
+/**
+ * Parse opcode mix, i.e. "chg=80,add=10,del=10"
+ *
+ * @param mix opcode mix string
+ * @return PASSWD_ERR_SUCCESS if parsed ok
+ */
+static int
+loadgen_parse_mix(const char *mix)
+{
+    char *copy = strdup(mix), *token, *save = NULL;
+    int  weight, err = PASSWD_ERR_SUCCESS;
+
+    memset(s_opts.mix, 0, sizeof(s_opts.mix));
+    s_opts.mix_total = 0;
+
+    for (token = strtok_r(copy, ",", &save); token;
+         token = strtok_r(NULL, ",", &save))
+    {
+        char name[16];
+
+        if (2 != sscanf(token, "%15[a-z]=%d", name, &weight) || weight < 0)
+        {
+            err = PASSWD_ERR_INVALID_PARAM;
+            break;
+        }
+
+        if (0 == strcmp(name, "chg"))
+        {
+            s_opts.mix[PASSWD_MSG_CHG_PASSWORD] = weight;
+        }
+        else if (0 == strcmp(name, "add"))
+        {
+            s_opts.mix[PASSWD_MSG_ADD_USER] = weight;
+        }
+        else if (0 == strcmp(name, "del"))
+        {
+            s_opts.mix[PASSWD_MSG_DEL_USER] = weight;
+        }
+        else if (0 == strcmp(name, "verify"))
+        {
+            s_opts.mix[PASSWD_MSG_VERIFY] = weight;
+        }
+        else if (0 == strcmp(name, "list"))
+        {
+            s_opts.mix[PASSWD_MSG_LIST_USERS] = weight;
+        }
+        else if (0 == strcmp(name, "get"))
+        {
+            s_opts.mix[PASSWD_MSG_GET_USER] = weight;
+        }
+        else if (0 == strcmp(name, "aging"))
+        {
+            s_opts.mix[PASSWD_MSG_GET_AGING] = weight;
+        }
+        else
+        {
+            err = PASSWD_ERR_INVALID_PARAM;
+            break;
+        }
+        s_opts.mix_total += weight;
+    }
+
+    free(copy);
+    return (s_opts.mix_total > 0) ? err : PASSWD_ERR_INVALID_PARAM;
+}
+
+static void
+loadgen_usage(const char *name)
+{
+    printf("%s: closed-loop load generator for ops-passwd-srv\n"
+           "usage: %s [OPTIONS] --user=NAME --password=PASS\n"
+           "  -f, --config=FILE       password server YAML file (default %s\n"
+           "                          under the root directory)\n"
+           "  -r, --root=DIR          root directory of a sandboxed server\n"
+           "  -c, --concurrency=N     number of outstanding requests (1)\n"
+           "  -d, --duration=SEC      length of the run in seconds (10)\n"
+           "  -m, --mix=MIX           opcode mix of chg, add, del, verify,\n"
+           "                          list, get and aging,\n"
+           "                          i.e. chg=80,add=10,del=10\n"
+           "                          (default chg=1)\n"
+           "  -u, --user=NAME         user whose password is changed\n"
+           "  -p, --password=PASS     password of the user, also used for\n"
+           "                          the users added by the run\n"
+           "  -P, --prefix=PREFIX     prefix of users added by the run (%s)\n"
+           "  -b, --batch             flag requests as a bulk job, served\n"
+           "                          after interactive ones\n"
+           "  -h, --help              display this help message\n",
+           name, name, PASSWD_SRV_YAML_FILE, LOADGEN_USER_PREFIX);
+}
+
+static void
+loadgen_parse_options(int argc, char *argv[])
+{
+    static const struct option long_options[] = {
+        {"config",      required_argument, NULL, 'f'},
+        {"root",        required_argument, NULL, 'r'},
+        {"concurrency", required_argument, NULL, 'c'},
+        {"duration",    required_argument, NULL, 'd'},
+        {"mix",         required_argument, NULL, 'm'},
+        {"user",        required_argument, NULL, 'u'},
+        {"password",    required_argument, NULL, 'p'},
+        {"prefix",      required_argument, NULL, 'P'},
+        {"batch",       no_argument,       NULL, 'b'},
+        {"help",        no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+    int c;
+
+    loadgen_parse_mix("chg=1");
+
+    while (-1 != (c = getopt_long(argc, argv, "f:r:c:d:m:u:p:P:bh",
+                                  long_options, NULL)))
+    {
+        switch (c)
+        {
+        case 'f':
+            s_opts.yaml_file = optarg;
+            break;
+        case 'r':
+            s_opts.root_dir = optarg;
+            break;
+        case 'c':
+            s_opts.concurrency = atoi(optarg);
+            break;
+        case 'd':
+            s_opts.duration = atoi(optarg);
+            break;
+        case 'm':
+            if (PASSWD_ERR_SUCCESS != loadgen_parse_mix(optarg))
+            {
+                fprintf(stderr, "invalid opcode mix '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'u':
+            s_opts.user = optarg;
+            break;
+        case 'p':
+            s_opts.password = optarg;
+            break;
+        case 'P':
+            s_opts.prefix = optarg;
+            break;
+        case 'b':
+            s_opts.batch = 1;
+            break;
+        case 'h':
+            loadgen_usage(argv[0]);
+            exit(EXIT_SUCCESS);
+        default:
+            loadgen_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if ((s_opts.concurrency < 1) ||
+        (s_opts.concurrency > LOADGEN_MAX_WORKERS) ||
+        (s_opts.duration < 1))
+    {
+        fprintf(stderr, "concurrency must be 1-%d and duration positive\n",
+                LOADGEN_MAX_WORKERS);
+        exit(EXIT_FAILURE);
+    }
+
+    /* no default, the password of whichever account it is gets changed */
+    if ((NULL == s_opts.user) || (NULL == s_opts.password))
+    {
+        fprintf(stderr, "--user and --password are required\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Point the client library at the yaml file of the server under test
+ *
+ * @return PASSWD_ERR_SUCCESS if the yaml file can be read
+ */
+static int
+loadgen_init()
+{
+    static char yaml_file[PATH_MAX];
+
+    if (PASSWD_ERR_SUCCESS != set_passwd_srv_root_dir(s_opts.root_dir))
+    {
+        fprintf(stderr, "invalid root directory %s\n", s_opts.root_dir);
+        return PASSWD_ERR_INVALID_PARAM;
+    }
+
+    if (NULL == s_opts.yaml_file)
+    {
+        snprintf(yaml_file, sizeof(yaml_file), "%s%s",
+                 get_passwd_srv_root_dir(), PASSWD_SRV_YAML_FILE);
+        s_opts.yaml_file = yaml_file;
+    }
+
+    if (PASSWD_ERR_SUCCESS != passwd_srv_client_init(s_opts.yaml_file))
+    {
+        fprintf(stderr, "failed to read %s\n", s_opts.yaml_file);
+        return PASSWD_ERR_YAML_FILE;
+    }
+
+    return PASSWD_ERR_SUCCESS;
+}
+
+int
+main(int argc, char *argv[])
+{
+    loadgen_worker_t *workers;
+    uint64_t start;
+    int i, op;
+
+    loadgen_parse_options(argc, argv);
+
+    if (PASSWD_ERR_SUCCESS != loadgen_init())
+    {
+        return EXIT_FAILURE;
+    }
+
+    if (NULL == (workers = calloc(s_opts.concurrency, sizeof(*workers))))
+    {
+        return EXIT_FAILURE;
+    }
+
+    start = loadgen_now();
+    s_deadline = start + (uint64_t)s_opts.duration * 1000000000ULL;
+
+    for (i = 0; i < s_opts.concurrency; i++)
+    {
+        workers[i].id = i;
+        workers[i].seed = (unsigned int)(start ^ (i * 2654435761U));
+        workers[i].users = calloc(LOADGEN_MAX_USERS,
+                                  sizeof(*workers[i].users));
+        if ((NULL == workers[i].users) ||
+            (0 != pthread_create(&workers[i].thread, NULL, loadgen_worker_run,
+                                &workers[i])))
+        {
+            fprintf(stderr, "failed to start worker %d\n", i);
+            return EXIT_FAILURE;
+        }
+    }
+
+    for (i = 0; i < s_opts.concurrency; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    loadgen_report(workers, (loadgen_now() - start) / 1e9);
+
+    for (i = 0; i < s_opts.concurrency; i++)
+    {
+        loadgen_cleanup_users(&workers[i]);
+        for (op = 0; op < LOADGEN_OPCODE_MAX; op++)
+        {
+            free(workers[i].samples[op].ns);
+        }
+        free(workers[i].users);
+    }
+
+    free(workers);
+    uninit_yaml_parser();
+
+    return EXIT_SUCCESS;
+}
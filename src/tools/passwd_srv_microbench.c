@@ -0,0 +1,538 @@
+/*
+ * (c) Copyright 2016 Hewlett Packard Enterprise Development LP
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+/************************************************************************//**
+ * @ingroup passwd-srvd
+ *
+ * @file
+ * Per-stage microbenchmarks for the Password Server.
+ *
+ *    Times the building blocks used to serve a request in isolation, over
+ *     many iterations, so the dominating stage on a given platform can be
+ *     identified and builds can be compared:
+ *
+ *       - RSA_private_decrypt() for each supported key size
+ *       - crypt() for each ENCRYPT_METHOD
+ *       - find_password_info()/store_password() against a synthetic
+ *          shadow file
+ *       - check_user_group()
+ *       - get_connected_username()
+ *       - parse_passwd_srv_yaml()
+ *
+ *    One JSON object is printed per benchmark and line.
+ ***************************************************************************/
+#include <getopt.h>
+#include <crypt.h>
+#include <shadow.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <openssl/opensslv.h>
+#include <openssl/rand.h>
+
+#include "passwd_srv_pri.h"
+
+#define BENCH_DEFAULT_ITERATIONS 100
+#define BENCH_DEFAULT_USERS      1000
+#define BENCH_HASH \
+    "$6$benchsalt$IsEdH3.3m6Cx1ux4MBQ9pgFuhWrC6Ho7DaVf8G0l9Ywd1SYkO" \
+    "8e4gqzRoP3kvSvHr2iKmPZUQ3rFsnmP5BPaI."
+
+typedef int (*bench_fn)(void *arg);
+
+static struct {
+    int         iterations;
+    int         users;
+    const char  *filter;
+    const char  *user;
+    const char  *group;
+    const char  *yaml_file;
+    char        work_dir[64];       /* mkdtemp() directory for test files */
+} s_opts = {
+    .iterations = BENCH_DEFAULT_ITERATIONS,
+    .users      = BENCH_DEFAULT_USERS,
+    .filter     = NULL,
+    .user       = "root",
+    .group      = OVSDB_GROUP,
+    .yaml_file  = PASSWD_SRV_YAML_FILE,
+};
+
+/**
+ * Monotonic clock in nanoseconds
+ */
+static uint64_t
+bench_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int
+bench_compare_ns(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * Run one benchmark and print the result as a JSON object
+ *
+ * @param name  benchmark name
+ * @param param benchmark parameter, i.e. key size or hash method
+ * @param fn    function timed once per iteration
+ * @param arg   argument passed to fn
+ */
+static void
+bench_run(const char *name, const char *param, bench_fn fn, void *arg)
+{
+    uint64_t *ns, start, total = 0;
+    int i, errors = 0, n = s_opts.iterations;
+
+    if (s_opts.filter && (NULL == strstr(name, s_opts.filter)))
+    {
+        return;
+    }
+
+    if (NULL == (ns = calloc(n, sizeof(*ns))))
+    {
+        return;
+    }
+
+    /* warm up caches before timing */
+    fn(arg);
+
+    for (i = 0; i < n; i++)
+    {
+        start = bench_now();
+        if (PASSWD_ERR_SUCCESS != fn(arg))
+        {
+            errors++;
+        }
+        ns[i] = bench_now() - start;
+        total += ns[i];
+    }
+
+    qsort(ns, n, sizeof(*ns), bench_compare_ns);
+
+    printf("{\"bench\":\"%s\",\"param\":\"%s\",\"iterations\":%d,"
+           "\"errors\":%d,\"mean_ns\":%llu,\"min_ns\":%llu,\"p50_ns\":%llu,"
+           "\"p99_ns\":%llu,\"max_ns\":%llu}\n",
+           name, param, n, errors, (unsigned long long)(total / n),
+           (unsigned long long)ns[0], (unsigned long long)ns[n / 2],
+           (unsigned long long)ns[(n * 99) / 100],
+           (unsigned long long)ns[n - 1]);
+    fflush(stdout);
+
+    free(ns);
+}
+
+/*
+ * RSA_private_decrypt
+ */
+typedef struct bench_rsa {
+    RSA           *rsa;
+    unsigned char *enc_msg;
+    unsigned char *dec_msg;
+} bench_rsa_t;
+
+static int
+bench_rsa_decrypt(void *arg)
+{
+    bench_rsa_t *ctx = arg;
+
+    return (0 > RSA_private_decrypt(RSA_size(ctx->rsa), ctx->enc_msg,
+                                    ctx->dec_msg, ctx->rsa,
+                                    RSA_PKCS1_OAEP_PADDING)) ?
+            PASSWD_ERR_DECRYPT_FAILED : PASSWD_ERR_SUCCESS;
+}
+
+static void
+bench_rsa()
+{
+    /* OAEP padding leaves too little room for passwd_srv_msg_t below 2048 */
+    const int key_bits[] = { 2048, 3072, 4096 };
+    passwd_srv_msg_t msg;
+    bench_rsa_t ctx;
+    BIGNUM *bne;
+    char param[16];
+    int i;
+
+    if (s_opts.filter && (NULL == strstr("rsa_private_decrypt",
+                                         s_opts.filter)))
+    {
+        return;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.op_code = PASSWD_MSG_CHG_PASSWORD;
+    snprintf(msg.username, sizeof(msg.username), "%s", s_opts.user);
+
+    bne = BN_new();
+    BN_set_word(bne, RSA_F4);
+
+    for (i = 0; i < sizeof(key_bits) / sizeof(key_bits[0]); i++)
+    {
+        memset(&ctx, 0, sizeof(ctx));
+        ctx.rsa = RSA_new();
+        if (1 != RSA_generate_key_ex(ctx.rsa, key_bits[i], bne, NULL))
+        {
+            RSA_free(ctx.rsa);
+            continue;
+        }
+
+        ctx.enc_msg = calloc(1, RSA_size(ctx.rsa));
+        ctx.dec_msg = calloc(1, RSA_size(ctx.rsa));
+        if (ctx.enc_msg && ctx.dec_msg &&
+            (0 < RSA_public_encrypt(sizeof(msg), (unsigned char *)&msg,
+                                    ctx.enc_msg, ctx.rsa,
+                                    RSA_PKCS1_OAEP_PADDING)))
+        {
+            snprintf(param, sizeof(param), "%d", key_bits[i]);
+            bench_run("rsa_private_decrypt", param, bench_rsa_decrypt, &ctx);
+        }
+
+        free(ctx.enc_msg);
+        free(ctx.dec_msg);
+        RSA_free(ctx.rsa);
+    }
+
+    BN_free(bne);
+}
+
+/*
+ * crypt() per ENCRYPT_METHOD
+ */
+static int
+bench_crypt_one(void *arg)
+{
+    struct crypt_data data;
+    char *hash;
+
+    memset(&data, 0, sizeof(data));
+    hash = crypt_r("benchmark-password", arg, &data);
+
+    /* libxcrypt returns a string starting with '*' instead of NULL */
+    return ((NULL == hash) || ('*' == hash[0])) ?
+            PASSWD_ERR_FATAL : PASSWD_ERR_SUCCESS;
+}
+
+static void
+bench_crypt()
+{
+    static const struct {
+        const char *method;
+        const char *salt;
+    } methods[] = {
+        { "DES",      "bs" },
+        { "MD5",      "$1$benchslt" },
+        { "SHA256",   "$5$benchsaltbenchs" },
+        { "SHA512",   "$6$benchsaltbenchs" },
+    };
+    int i;
+
+    for (i = 0; i < sizeof(methods) / sizeof(methods[0]); i++)
+    {
+        bench_run("crypt", methods[i].method, bench_crypt_one,
+                  (void *)methods[i].salt);
+    }
+
+#ifdef CRYPT_GENSALT_IMPLEMENTS_AUTO_ENTROPY
+    /* yescrypt is only provided by libxcrypt, let it build the setting */
+    {
+        char *salt = crypt_gensalt("$y$", 0, NULL, 0);
+
+        if (salt)
+        {
+            bench_run("crypt", "YESCRYPT", bench_crypt_one, salt);
+        }
+    }
+#endif
+}
+
+/*
+ * find_password_info()/store_password() against a synthetic shadow file
+ */
+typedef struct bench_shadow {
+    char shadow_file[PATH_MAX];
+    char username[PASSWD_USERNAME_SIZE];
+} bench_shadow_t;
+
+static int
+bench_find_password_info(void *arg)
+{
+    bench_shadow_t *ctx = arg;
+
+    return (NULL == search_shadow_file(ctx->shadow_file, ctx->username)) ?
+            PASSWD_ERR_USER_NOT_FOUND : PASSWD_ERR_SUCCESS;
+}
+
+static int
+bench_store_password(void *arg)
+{
+    bench_shadow_t *ctx = arg;
+
+    return update_shadow_file(ctx->shadow_file, ctx->username, BENCH_HASH);
+}
+
+static int
+bench_shadow_lock(void *arg)
+{
+    if (0 != lock_shadow_file())
+    {
+        return PASSWD_ERR_SHADOW_FILE;
+    }
+    unlock_shadow_file();
+    return PASSWD_ERR_SUCCESS;
+}
+
+/**
+ * Write a shadow file with a given number of users
+ *
+ * @param shadow_file file to create
+ * @param users       number of entries
+ * @return PASSWD_ERR_SUCCESS if created
+ */
+static int
+bench_create_shadow_file(const char *shadow_file, int users)
+{
+    FILE *fp;
+    int i;
+
+    if (NULL == (fp = fopen(shadow_file, "w")))
+    {
+        return PASSWD_ERR_SHADOW_FILE;
+    }
+
+    for (i = 0; i < users; i++)
+    {
+        fprintf(fp, "bench%d:%s:17000:0:99999:7:::\n", i, BENCH_HASH);
+    }
+
+    fclose(fp);
+    return PASSWD_ERR_SUCCESS;
+}
+
+static void
+bench_shadow()
+{
+    bench_shadow_t ctx;
+    char param[32];
+
+    memset(&ctx, 0, sizeof(ctx));
+    snprintf(ctx.shadow_file, sizeof(ctx.shadow_file), "%s/shadow",
+             s_opts.work_dir);
+
+    if (PASSWD_ERR_SUCCESS !=
+            bench_create_shadow_file(ctx.shadow_file, s_opts.users))
+    {
+        fprintf(stderr, "failed to create %s\n", ctx.shadow_file);
+        return;
+    }
+
+    /* the last entry is the worst case of the file scan */
+    snprintf(ctx.username, sizeof(ctx.username), "bench%d",
+             s_opts.users - 1);
+    snprintf(param, sizeof(param), "users=%d", s_opts.users);
+
+    bench_run("find_password_info", param, bench_find_password_info, &ctx);
+    bench_run("store_password", param, bench_store_password, &ctx);
+
+    /* taking the real shadow lock requires root */
+    if (0 == geteuid())
+    {
+        bench_run("shadow_lock", PASSWD_LOCK_FILE, bench_shadow_lock, NULL);
+    }
+
+    unlink(ctx.shadow_file);
+}
+
+/*
+ * check_user_group()
+ */
+static int
+bench_check_user_group_one(void *arg)
+{
+    check_user_group(s_opts.user, s_opts.group);
+    return PASSWD_ERR_SUCCESS;
+}
+
+static void
+bench_check_user_group()
+{
+    char param[PASSWD_USERNAME_SIZE * 2];
+
+    snprintf(param, sizeof(param), "%s:%s", s_opts.user, s_opts.group);
+    bench_run("check_user_group", param, bench_check_user_group_one, NULL);
+}
+
+/*
+ * get_connected_username()
+ */
+static int
+bench_connected_username_one(void *arg)
+{
+    char *username;
+
+    if (NULL == (username = get_connected_username(*(int *)arg)))
+    {
+        return PASSWD_ERR_INVALID_USER;
+    }
+    free(username);
+    return PASSWD_ERR_SUCCESS;
+}
+
+static void
+bench_connected_username()
+{
+    int sv[2];
+
+    /* both ends belong to this process, the peer lookup still scans /proc */
+    if (0 != socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+    {
+        return;
+    }
+
+    bench_run("get_connected_username", "socketpair",
+              bench_connected_username_one, &sv[0]);
+
+    close(sv[0]);
+    close(sv[1]);
+}
+
+/*
+ * parse_passwd_srv_yaml()
+ */
+static int
+bench_parse_yaml_one(void *arg)
+{
+    int err = parse_passwd_srv_yaml_file(arg);
+
+    uninit_yaml_parser();
+    return err;
+}
+
+static void
+bench_parse_yaml()
+{
+    bench_run("parse_passwd_srv_yaml", s_opts.yaml_file, bench_parse_yaml_one,
+              (void *)s_opts.yaml_file);
+}
+
+static void
+bench_usage(const char *name)
+{
+    printf("%s: per-stage microbenchmarks for ops-passwd-srv\n"
+           "usage: %s [OPTIONS]\n"
+           "  -n, --iterations=N   iterations per benchmark (%d)\n"
+           "  -s, --users=N        entries in the synthetic shadow file (%d)\n"
+           "  -b, --bench=NAME     only run benchmarks containing NAME\n"
+           "  -u, --user=NAME      user for check_user_group (root)\n"
+           "  -g, --group=NAME     group for check_user_group (%s)\n"
+           "  -f, --config=FILE    YAML file to parse (%s)\n"
+           "  -h, --help           display this help message\n",
+           name, name, BENCH_DEFAULT_ITERATIONS, BENCH_DEFAULT_USERS,
+           OVSDB_GROUP, PASSWD_SRV_YAML_FILE);
+}
+
+static void
+bench_parse_options(int argc, char *argv[])
+{
+    static const struct option long_options[] = {
+        {"iterations", required_argument, NULL, 'n'},
+        {"users",      required_argument, NULL, 's'},
+        {"bench",      required_argument, NULL, 'b'},
+        {"user",       required_argument, NULL, 'u'},
+        {"group",      required_argument, NULL, 'g'},
+        {"config",     required_argument, NULL, 'f'},
+        {"help",       no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+    int c;
+
+    while (-1 != (c = getopt_long(argc, argv, "n:s:b:u:g:f:h",
+                                  long_options, NULL)))
+    {
+        switch (c)
+        {
+        case 'n':
+            s_opts.iterations = atoi(optarg);
+            break;
+        case 's':
+            s_opts.users = atoi(optarg);
+            break;
+        case 'b':
+            s_opts.filter = optarg;
+            break;
+        case 'u':
+            s_opts.user = optarg;
+            break;
+        case 'g':
+            s_opts.group = optarg;
+            break;
+        case 'f':
+            s_opts.yaml_file = optarg;
+            break;
+        case 'h':
+            bench_usage(argv[0]);
+            exit(EXIT_SUCCESS);
+        default:
+            bench_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if ((s_opts.iterations < 1) || (s_opts.users < 1))
+    {
+        fprintf(stderr, "iterations and users must be positive\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    bench_parse_options(argc, argv);
+
+    snprintf(s_opts.work_dir, sizeof(s_opts.work_dir),
+             "/tmp/ops-passwd-srv-bench.XXXXXX");
+    if (NULL == mkdtemp(s_opts.work_dir))
+    {
+        fprintf(stderr, "failed to create work directory\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("{\"bench\":\"meta\",\"openssl\":\"%s\",\"iterations\":%d}\n",
+           OPENSSL_VERSION_TEXT, s_opts.iterations);
+
+    bench_rsa();
+    bench_crypt();
+    bench_shadow();
+    bench_check_user_group();
+    bench_connected_username();
+    bench_parse_yaml();
+
+    rmdir(s_opts.work_dir);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,561 @@
+/*
+ * (c) Copyright 2016 Hewlett Packard Enterprise Development LP
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+/************************************************************************//**
+ * @ingroup passwd-srvd
+ *
+ * @file
+ * Request trace replay for the Password Server.
+ *
+ *    Reads a trace recorded with 'ops-passwd-srv --trace=FILE' and issues a
+ *     synthetic request for every record at the recorded arrival time
+ *     (open loop), so bursts seen in production can be reproduced against a
+ *     sandboxed server.  Traces carry no usernames or passwords:
+ *
+ *       - CHG_PASSWORD re-sets the password of --user to --password
+ *       - ADD_USER adds <prefix><n>
+ *       - DEL_USER deletes the most recently added user still present
+ *
+ *    Latency is measured from the scheduled arrival time, so queueing in
+ *     the replay itself is not hidden.  Replayed p50/p99 are reported per
+ *     opcode next to the ones recorded in the trace.
+ ***************************************************************************/
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "passwd_srv_pub.h"
+
+#define REPLAY_MAX_WORKERS   256
+#define REPLAY_OPCODE_MAX    (PASSWD_MSG_GET_AGING + 1)
+#define REPLAY_DEFAULT_USER  "admin"
+#define REPLAY_USER_PREFIX   "rp"
+
+/*
+ * one request of the trace
+ */
+typedef struct replay_req {
+    uint64_t arrival_ns;        /* relative to the first request */
+    int      opcode;
+    int      rec_status;        /* status recorded by the server */
+    uint64_t rec_ns;            /* latency recorded by the server */
+    int      status;            /* status of the replayed request */
+    uint64_t ns;                /* latency of the replayed request */
+    int      sent;
+} replay_req_t;
+
+static struct {
+    const char *trace_file;
+    const char *yaml_file;
+    const char *root_dir;
+    const char *user;
+    const char *password;
+    const char *prefix;
+    double      speed;
+    int         workers;
+} s_opts = {
+    .user     = REPLAY_DEFAULT_USER,
+    .prefix   = REPLAY_USER_PREFIX,
+    .speed    = 1.0,
+    .workers  = 64,
+};
+
+static const char *s_opcode_name[REPLAY_OPCODE_MAX] = {
+    "ALL",
+    "CHG_PASSWORD",
+    "ADD_USER",
+    "DEL_USER",
+    "VERIFY",
+    "LIST_USERS",
+    "GET_USER",
+    "GET_AGING"
+};
+
+static replay_req_t *s_reqs = NULL;
+static size_t s_nreqs = 0;
+static size_t s_next_req = 0;           /* next request to hand to a worker */
+static uint64_t s_start = 0;            /* time of the first arrival */
+
+/* users added by the replay, DEL_USER removes the last one */
+static char (*s_users)[PASSWD_USERNAME_SIZE] = NULL;
+static size_t s_nusers = 0;
+static unsigned long s_next_user = 0;
+
+static pthread_mutex_t s_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t
+replay_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Read all records of a trace file
+ *
+ * @return PASSWD_ERR_SUCCESS if the file is a request trace
+ */
+static int
+replay_load_trace()
+{
+    char line[512];
+    unsigned long long arrival, total;
+    replay_req_t *reqs;
+    size_t size = 0;
+    int opcode, status;
+    FILE *fp;
+
+    if (NULL == (fp = fopen(s_opts.trace_file, "r")))
+    {
+        fprintf(stderr, "failed to open %s\n", s_opts.trace_file);
+        return PASSWD_ERR_FATAL;
+    }
+
+    if ((NULL == fgets(line, sizeof(line), fp)) ||
+        (NULL == strstr(line, PASSWD_SRV_TRACE_MAGIC)))
+    {
+        fprintf(stderr, "%s is not a request trace\n", s_opts.trace_file);
+        fclose(fp);
+        return PASSWD_ERR_INVALID_PARAM;
+    }
+
+    while (fgets(line, sizeof(line), fp))
+    {
+        if (('#' == line[0]) ||
+            (4 != sscanf(line, "%llu %d %d %llu", &arrival, &opcode, &status,
+                         &total)))
+        {
+            continue;
+        }
+
+        if (s_nreqs == size)
+        {
+            size = size ? size * 2 : 1024;
+            if (NULL == (reqs = realloc(s_reqs, size * sizeof(*s_reqs))))
+            {
+                fclose(fp);
+                return PASSWD_ERR_INSUFFICIENT_MEM;
+            }
+            s_reqs = reqs;
+        }
+
+        memset(&s_reqs[s_nreqs], 0, sizeof(s_reqs[s_nreqs]));
+        s_reqs[s_nreqs].arrival_ns = arrival;
+        s_reqs[s_nreqs].opcode = opcode;
+        s_reqs[s_nreqs].rec_status = status;
+        s_reqs[s_nreqs].rec_ns = total;
+        s_nreqs++;
+    }
+
+    fclose(fp);
+
+    /* a trace taken on a live server may start at any time */
+    if (s_nreqs)
+    {
+        uint64_t first = s_reqs[0].arrival_ns;
+        size_t i;
+
+        for (i = 0; i < s_nreqs; i++)
+        {
+            s_reqs[i].arrival_ns -= first;
+        }
+    }
+
+    return PASSWD_ERR_SUCCESS;
+}
+
+/**
+ * Point the client library at the yaml file of the server under test
+ *
+ * @return PASSWD_ERR_SUCCESS if the yaml file can be read
+ */
+static int
+replay_init()
+{
+    static char yaml_file[PATH_MAX];
+
+    if (PASSWD_ERR_SUCCESS != set_passwd_srv_root_dir(s_opts.root_dir))
+    {
+        return PASSWD_ERR_INVALID_PARAM;
+    }
+
+    if (NULL == s_opts.yaml_file)
+    {
+        snprintf(yaml_file, sizeof(yaml_file), "%s%s",
+                 get_passwd_srv_root_dir(), PASSWD_SRV_YAML_FILE);
+        s_opts.yaml_file = yaml_file;
+    }
+
+    if (PASSWD_ERR_SUCCESS != passwd_srv_client_init(s_opts.yaml_file))
+    {
+        fprintf(stderr, "failed to read %s\n", s_opts.yaml_file);
+        return PASSWD_ERR_YAML_FILE;
+    }
+
+    return PASSWD_ERR_SUCCESS;
+}
+
+/**
+ * Fill in a synthetic request for a traced opcode.  Called with s_mutex
+ * held.
+ *
+ * @param opcode opcode recorded in the trace
+ * @param msg    request to fill in
+ */
+static void
+replay_build_request(int opcode, passwd_srv_msg_t *msg)
+{
+    memset(msg, 0, sizeof(*msg));
+    msg->op_code = opcode;
+
+    switch (opcode)
+    {
+    case PASSWD_MSG_CHG_PASSWORD:
+        snprintf(msg->username, sizeof(msg->username), "%s", s_opts.user);
+        snprintf(msg->oldpasswd, sizeof(msg->oldpasswd), "%s",
+                 s_opts.password);
+        snprintf(msg->newpasswd, sizeof(msg->newpasswd), "%s",
+                 s_opts.password);
+        break;
+    case PASSWD_MSG_ADD_USER:
+        snprintf(msg->username, sizeof(msg->username), "%s%lu",
+                 s_opts.prefix, s_next_user++);
+        snprintf(msg->newpasswd, sizeof(msg->newpasswd), "%s",
+                 s_opts.password);
+        break;
+    case PASSWD_MSG_DEL_USER:
+        /* nothing added yet, the server answers USER_NOT_FOUND */
+        if (s_nusers)
+        {
+            memcpy(msg->username, s_users[--s_nusers], sizeof(msg->username));
+        }
+        else
+        {
+            snprintf(msg->username, sizeof(msg->username), "%snone",
+                     s_opts.prefix);
+        }
+        break;
+    case PASSWD_MSG_VERIFY:
+        snprintf(msg->username, sizeof(msg->username), "%s", s_opts.user);
+        snprintf(msg->oldpasswd, sizeof(msg->oldpasswd), "%s",
+                 s_opts.password);
+        break;
+    case PASSWD_MSG_GET_USER:
+    case PASSWD_MSG_GET_AGING:
+        snprintf(msg->username, sizeof(msg->username), "%s", s_opts.user);
+        break;
+    }
+}
+
+/**
+ * Worker thread: take the next request, wait for its arrival time and send
+ */
+static void *
+replay_worker_run(void *arg)
+{
+    passwd_srv_msg_t msg;
+    replay_req_t *req;
+    struct timespec ts;
+    uint64_t due;
+    int status;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&s_mutex);
+        req = (s_next_req < s_nreqs) ? &s_reqs[s_next_req++] : NULL;
+        pthread_mutex_unlock(&s_mutex);
+
+        if (NULL == req)
+        {
+            break;
+        }
+
+        due = s_start + (uint64_t)(req->arrival_ns / s_opts.speed);
+        ts.tv_sec = due / 1000000000ULL;
+        ts.tv_nsec = due % 1000000000ULL;
+        while (0 != clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL))
+        {
+            /* interrupted, sleep again */
+        }
+
+        if ((req->opcode < PASSWD_MSG_CHG_PASSWORD) ||
+            (req->opcode >= REPLAY_OPCODE_MAX))
+        {
+            /* request the server could not decode or a subscription,
+             * nothing to replay */
+            continue;
+        }
+
+        pthread_mutex_lock(&s_mutex);
+        replay_build_request(req->opcode, &msg);
+        pthread_mutex_unlock(&s_mutex);
+
+        if (PASSWD_ERR_SUCCESS != passwd_srv_request(&msg, &status))
+        {
+            status = PASSWD_ERR_FATAL;
+        }
+        req->ns = replay_now() - due;
+        req->status = status;
+        req->sent = 1;
+
+        if ((PASSWD_MSG_ADD_USER == req->opcode) &&
+            (PASSWD_ERR_SUCCESS == status))
+        {
+            pthread_mutex_lock(&s_mutex);
+            memcpy(s_users[s_nusers++], msg.username, sizeof(msg.username));
+            pthread_mutex_unlock(&s_mutex);
+        }
+    }
+
+    passwd_srv_client_disconnect();
+    return NULL;
+}
+
+/**
+ * Delete users added by the replay and left at the end
+ */
+static void
+replay_cleanup_users()
+{
+    passwd_srv_msg_t msg;
+    int status;
+
+    while (s_nusers)
+    {
+        replay_build_request(PASSWD_MSG_DEL_USER, &msg);
+        passwd_srv_request(&msg, &status);
+    }
+}
+
+static int
+replay_compare_ns(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * Print replayed and recorded latency of one opcode
+ */
+static void
+replay_report_opcode(int opcode, uint64_t *ns, uint64_t *rec_ns)
+{
+    size_t i, n = 0;
+    uint64_t errors = 0, rec_errors = 0;
+
+    for (i = 0; i < s_nreqs; i++)
+    {
+        if (!s_reqs[i].sent ||
+            (opcode && (opcode != s_reqs[i].opcode)))
+        {
+            continue;
+        }
+        ns[n] = s_reqs[i].ns;
+        rec_ns[n] = s_reqs[i].rec_ns;
+        errors += (PASSWD_ERR_SUCCESS != s_reqs[i].status);
+        rec_errors += (PASSWD_ERR_SUCCESS != s_reqs[i].rec_status);
+        n++;
+    }
+
+    if (0 == n)
+    {
+        return;
+    }
+
+    qsort(ns, n, sizeof(*ns), replay_compare_ns);
+    qsort(rec_ns, n, sizeof(*rec_ns), replay_compare_ns);
+
+    printf("%-14s %8zu %8llu %8llu %10llu %10llu %10llu %10llu\n",
+           s_opcode_name[opcode], n, (unsigned long long)errors,
+           (unsigned long long)rec_errors,
+           (unsigned long long)(ns[n / 2] / 1000),
+           (unsigned long long)(ns[(n * 99) / 100] / 1000),
+           (unsigned long long)(rec_ns[n / 2] / 1000),
+           (unsigned long long)(rec_ns[(n * 99) / 100] / 1000));
+}
+
+static void
+replay_report(uint64_t elapsed)
+{
+    uint64_t *ns = calloc(s_nreqs, sizeof(*ns));
+    uint64_t *rec_ns = calloc(s_nreqs, sizeof(*rec_ns));
+    int opcode;
+
+    if ((NULL == ns) || (NULL == rec_ns))
+    {
+        free(ns);
+        free(rec_ns);
+        return;
+    }
+
+    printf("requests=%zu speed=%.2f elapsed=%.2fs workers=%d\n", s_nreqs,
+           s_opts.speed, elapsed / 1e9, s_opts.workers);
+    printf("%-14s %8s %8s %8s %10s %10s %10s %10s\n", "opcode", "requests",
+           "errors", "rec_err", "p50(us)", "p99(us)", "rec_p50", "rec_p99");
+
+    for (opcode = PASSWD_MSG_CHG_PASSWORD; opcode < REPLAY_OPCODE_MAX;
+         opcode++)
+    {
+        replay_report_opcode(opcode, ns, rec_ns);
+    }
+    replay_report_opcode(0, ns, rec_ns);
+
+    free(ns);
+    free(rec_ns);
+}
+
+static void
+replay_usage(const char *name)
+{
+    printf("%s: replay a request trace against ops-passwd-srv\n"
+           "usage: %s [OPTIONS] --trace=FILE --password=PASS\n"
+           "  -t, --trace=FILE        trace recorded with ops-passwd-srv "
+           "--trace\n"
+           "  -f, --config=FILE       password server YAML file (default %s\n"
+           "                          under the root directory)\n"
+           "  -r, --root=DIR          root directory of a sandboxed server\n"
+           "  -s, --speed=X           replay X times faster than recorded "
+           "(1.0)\n"
+           "  -c, --workers=N         maximum requests in flight (%d)\n"
+           "  -u, --user=NAME         user whose password is changed (%s)\n"
+           "  -p, --password=PASS     password of the user, also used for\n"
+           "                          the users added by the replay\n"
+           "  -P, --prefix=PREFIX     prefix of users added by the replay "
+           "(%s)\n"
+           "  -h, --help              display this help message\n",
+           name, name, PASSWD_SRV_YAML_FILE, s_opts.workers,
+           REPLAY_DEFAULT_USER, REPLAY_USER_PREFIX);
+}
+
+static void
+replay_parse_options(int argc, char *argv[])
+{
+    static const struct option long_options[] = {
+        {"trace",    required_argument, NULL, 't'},
+        {"config",   required_argument, NULL, 'f'},
+        {"root",     required_argument, NULL, 'r'},
+        {"speed",    required_argument, NULL, 's'},
+        {"workers",  required_argument, NULL, 'c'},
+        {"user",     required_argument, NULL, 'u'},
+        {"password", required_argument, NULL, 'p'},
+        {"prefix",   required_argument, NULL, 'P'},
+        {"help",     no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+    int c;
+
+    while (-1 != (c = getopt_long(argc, argv, "t:f:r:s:c:u:p:P:h",
+                                  long_options, NULL)))
+    {
+        switch (c)
+        {
+        case 't':
+            s_opts.trace_file = optarg;
+            break;
+        case 'f':
+            s_opts.yaml_file = optarg;
+            break;
+        case 'r':
+            s_opts.root_dir = optarg;
+            break;
+        case 's':
+            s_opts.speed = atof(optarg);
+            break;
+        case 'c':
+            s_opts.workers = atoi(optarg);
+            break;
+        case 'u':
+            s_opts.user = optarg;
+            break;
+        case 'p':
+            s_opts.password = optarg;
+            break;
+        case 'P':
+            s_opts.prefix = optarg;
+            break;
+        case 'h':
+            replay_usage(argv[0]);
+            exit(EXIT_SUCCESS);
+        default:
+            replay_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if ((NULL == s_opts.trace_file) || (NULL == s_opts.password))
+    {
+        fprintf(stderr, "--trace and --password are required\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if ((s_opts.speed <= 0) || (s_opts.workers < 1) ||
+        (s_opts.workers > REPLAY_MAX_WORKERS))
+    {
+        fprintf(stderr, "speed must be positive and workers 1-%d\n",
+                REPLAY_MAX_WORKERS);
+        exit(EXIT_FAILURE);
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    pthread_t threads[REPLAY_MAX_WORKERS];
+    uint64_t elapsed;
+    int i;
+
+    replay_parse_options(argc, argv);
+
+    if ((PASSWD_ERR_SUCCESS != replay_load_trace()) ||
+        (PASSWD_ERR_SUCCESS != replay_init()))
+    {
+        return EXIT_FAILURE;
+    }
+
+    /* every request may be an ADD_USER */
+    if (NULL == (s_users = calloc(s_nreqs + 1, sizeof(*s_users))))
+    {
+        return EXIT_FAILURE;
+    }
+
+    s_start = replay_now();
+    for (i = 0; i < s_opts.workers; i++)
+    {
+        pthread_create(&threads[i], NULL, replay_worker_run, NULL);
+    }
+    for (i = 0; i < s_opts.workers; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    elapsed = replay_now() - s_start;
+
+    replay_cleanup_users();
+    replay_report(elapsed);
+
+    free(s_users);
+    free(s_reqs);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,512 @@
+/*
+ * (c) Copyright 2016 Hewlett Packard Enterprise Development LP
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may
+ * not use this file except in compliance with the License. You may obtain
+ * a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied. See the
+ * License for the specific language governing permissions and limitations
+ * under the License.
+ */
+
+/************************************************************************//**
+ * @ingroup passwd-srvd
+ *
+ * @file
+ * Scaling benchmark for the Password Server.
+ *
+ *    Generates a synthetic dataset for each requested number of accounts,
+ *     points the server internals at it (as 'ops-passwd-srv --root' does)
+ *     and times the operations whose cost grows with the account files:
+ *
+ *       - find_password_info() for the first and the last user
+ *       - store_password() for the last user
+ *       - check_user_group() against ovsdb-client and a synthetic group
+ *       - create_user() add and delete (root only, runs useradd/userdel)
+ *
+ *    A table with p50/p99 per size is printed.  With --output, median
+ *     latencies are also written to PREFIX.dat along with a gnuplot script
+ *     PREFIX.gp which plots them against the number of accounts.
+ ***************************************************************************/
+#define _GNU_SOURCE             /* nftw() */
+#include <getopt.h>
+#include <ftw.h>
+#include <limits.h>
+#include <shadow.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "passwd_srv_pri.h"
+#include "passwd_srv_dataset.h"
+
+#define SCALE_DEFAULT_SIZES      "10000,100000,1000000"
+#define SCALE_DEFAULT_ITERATIONS 20
+#define SCALE_MAX_SIZES          16
+#define SCALE_PASSWORD           "scalebench"
+#define SCALE_ADD_USER           "scaleadd"
+
+enum scale_op_e {
+    SCALE_OP_FIND_FIRST = 0,
+    SCALE_OP_FIND_LAST,
+    SCALE_OP_STORE,
+    SCALE_OP_GROUP_OVSDB,
+    SCALE_OP_GROUP_SYNTH,
+    SCALE_OP_USERADD,
+    SCALE_OP_USERDEL,
+    SCALE_OP_MAX
+};
+
+static const char *s_op_name[SCALE_OP_MAX] = {
+    "find_first",
+    "find_last",
+    "store_last",
+    "group_ovsdb",
+    "group_synth",
+    "useradd",
+    "userdel",
+};
+
+static struct {
+    int         sizes[SCALE_MAX_SIZES];
+    int         nsizes;
+    int         iterations;
+    int         user_iterations;    /* create_user add/del, 0 to skip */
+    int         groups;
+    int         fanout;
+    const char  *methods;
+    const char  *output;
+    int         keep;
+    char        work_dir[64];
+} s_opts = {
+    .iterations      = SCALE_DEFAULT_ITERATIONS,
+    .user_iterations = 0,
+    .groups          = 100,
+    .fanout          = 4,
+    .methods         = DATASET_DEFAULT_METHODS,
+};
+
+/* median latency per size and operation, 0 if not measured */
+static uint64_t s_p50[SCALE_MAX_SIZES][SCALE_OP_MAX];
+
+static uint64_t
+scale_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static int
+scale_compare_ns(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * Sort samples, print a table row and keep the median for the plot
+ *
+ * @param size   index into s_opts.sizes
+ * @param op     operation timed
+ * @param ns     samples in nanoseconds
+ * @param n      number of samples
+ * @param errors number of failed iterations
+ */
+static void
+scale_report(int size, enum scale_op_e op, uint64_t *ns, int n, int errors)
+{
+    if (0 == n)
+    {
+        return;
+    }
+
+    qsort(ns, n, sizeof(*ns), scale_compare_ns);
+    s_p50[size][op] = ns[n / 2];
+
+    printf("%10d %-12s %8d %8d %12.1f %12.1f %12.1f\n",
+           s_opts.sizes[size], s_op_name[op], n, errors,
+           ns[n / 2] / 1000.0, ns[(n * 99) / 100] / 1000.0,
+           ns[n - 1] / 1000.0);
+    fflush(stdout);
+}
+
+/**
+ * Time the lookup and update operations against the current dataset
+ */
+static void
+scale_run_ops(int size, const passwd_srv_dataset_t *ds, uint64_t *ns)
+{
+    char first[PASSWD_USERNAME_SIZE], last[PASSWD_USERNAME_SIZE];
+    char group[PASSWD_USERNAME_SIZE];
+    char hash[PASSWD_SRV_MAX_STR_SIZE + 1];
+    struct spwd *entry;
+    enum scale_op_e op;
+    uint64_t start;
+    int i, errors;
+
+    passwd_srv_dataset_username(ds, 0, first, sizeof(first));
+    passwd_srv_dataset_username(ds, ds->users - 1, last, sizeof(last));
+    passwd_srv_dataset_groupname((ds->users - 1) % ds->groups, group,
+                                 sizeof(group));
+
+    /* store the hash the user already has, the dataset stays unchanged */
+    if ((NULL == (entry = find_password_info(last))) ||
+        (sizeof(hash) <= strlen(entry->sp_pwdp)))
+    {
+        fprintf(stderr, "%s is missing in the dataset\n", last);
+        return;
+    }
+    snprintf(hash, sizeof(hash), "%s", entry->sp_pwdp);
+
+    for (op = SCALE_OP_FIND_FIRST; op <= SCALE_OP_GROUP_SYNTH; op++)
+    {
+        errors = 0;
+        for (i = 0; i < s_opts.iterations; i++)
+        {
+            start = scale_now();
+            switch (op)
+            {
+            case SCALE_OP_FIND_FIRST:
+                errors += (NULL == find_password_info(first));
+                break;
+            case SCALE_OP_FIND_LAST:
+                errors += (NULL == find_password_info(last));
+                break;
+            case SCALE_OP_STORE:
+                errors += (PASSWD_ERR_SUCCESS != store_password(last, hash));
+                break;
+            case SCALE_OP_GROUP_OVSDB:
+                errors += !check_user_group(last, OVSDB_GROUP);
+                break;
+            case SCALE_OP_GROUP_SYNTH:
+                errors += !check_user_group(last, group);
+                break;
+            default:
+                break;
+            }
+            ns[i] = scale_now() - start;
+        }
+        scale_report(size, op, ns, s_opts.iterations, errors);
+    }
+}
+
+/**
+ * Time useradd/userdel as run by the password server against the current
+ * dataset
+ */
+static void
+scale_run_create_user(int size, uint64_t *ns_add, uint64_t *ns_del)
+{
+    uint64_t start;
+    int i, add_errors = 0, del_errors = 0;
+
+    for (i = 0; i < s_opts.user_iterations; i++)
+    {
+        start = scale_now();
+        add_errors += (NULL == create_user(SCALE_ADD_USER, TRUE));
+        ns_add[i] = scale_now() - start;
+
+        start = scale_now();
+        create_user(SCALE_ADD_USER, FALSE);
+        ns_del[i] = scale_now() - start;
+        del_errors += (NULL != find_password_info(SCALE_ADD_USER));
+    }
+
+    scale_report(size, SCALE_OP_USERADD, ns_add, s_opts.user_iterations,
+                 add_errors);
+    scale_report(size, SCALE_OP_USERDEL, ns_del, s_opts.user_iterations,
+                 del_errors);
+}
+
+static int
+scale_remove_helper(const char *path, const struct stat *sb, int typeflag,
+                    struct FTW *ftwbuf)
+{
+    return remove(path);
+}
+
+/**
+ * Write median latencies and a gnuplot script plotting them
+ */
+static void
+scale_write_plot()
+{
+    char path[PATH_MAX];
+    FILE *fp;
+    int size, op;
+
+    snprintf(path, sizeof(path), "%s.dat", s_opts.output);
+    if (NULL == (fp = fopen(path, "w")))
+    {
+        fprintf(stderr, "failed to create %s\n", path);
+        return;
+    }
+
+    fprintf(fp, "users");
+    for (op = 0; op < SCALE_OP_MAX; op++)
+    {
+        fprintf(fp, " %s", s_op_name[op]);
+    }
+    fputc('\n', fp);
+
+    for (size = 0; size < s_opts.nsizes; size++)
+    {
+        fprintf(fp, "%d", s_opts.sizes[size]);
+        for (op = 0; op < SCALE_OP_MAX; op++)
+        {
+            /* missing points are skipped by gnuplot */
+            if (s_p50[size][op])
+            {
+                fprintf(fp, " %.1f", s_p50[size][op] / 1000.0);
+            }
+            else
+            {
+                fprintf(fp, " ?");
+            }
+        }
+        fputc('\n', fp);
+    }
+    fclose(fp);
+
+    snprintf(path, sizeof(path), "%s.gp", s_opts.output);
+    if (NULL == (fp = fopen(path, "w")))
+    {
+        fprintf(stderr, "failed to create %s\n", path);
+        return;
+    }
+
+    fprintf(fp, "# gnuplot %s.gp\n"
+                "set terminal pngcairo size 900,600\n"
+                "set output '%s.png'\n"
+                "set title 'ops-passwd-srv operation latency (p50)'\n"
+                "set xlabel 'accounts'\n"
+                "set ylabel 'microseconds'\n"
+                "set logscale xy\n"
+                "set key top left\n"
+                "set datafile missing '?'\n"
+                "plot for [i=2:%d] '%s.dat' using 1:i with linespoints "
+                "title columnhead(i)\n",
+            s_opts.output, s_opts.output, SCALE_OP_MAX + 1, s_opts.output);
+    fclose(fp);
+
+    printf("wrote %s.dat, plot with 'gnuplot %s.gp'\n", s_opts.output,
+           s_opts.output);
+}
+
+static int
+scale_parse_sizes(const char *list)
+{
+    char *copy, *item, *save = NULL;
+
+    if (NULL == (copy = strdup(list)))
+    {
+        return PASSWD_ERR_FATAL;
+    }
+
+    s_opts.nsizes = 0;
+    for (item = strtok_r(copy, ",", &save); item;
+         item = strtok_r(NULL, ",", &save))
+    {
+        if ((SCALE_MAX_SIZES == s_opts.nsizes) || (0 >= atoi(item)))
+        {
+            free(copy);
+            return PASSWD_ERR_INVALID_PARAM;
+        }
+        s_opts.sizes[s_opts.nsizes++] = atoi(item);
+    }
+
+    free(copy);
+    return s_opts.nsizes ? PASSWD_ERR_SUCCESS : PASSWD_ERR_INVALID_PARAM;
+}
+
+static void
+scale_usage(const char *name)
+{
+    printf("%s: account scaling benchmark for ops-passwd-srv\n"
+           "usage: %s [OPTIONS]\n"
+           "  -s, --sizes=LIST        numbers of accounts (%s)\n"
+           "  -n, --iterations=N      iterations per operation (%d)\n"
+           "  -a, --useradd=N         useradd/userdel iterations, root only\n"
+           "                          (0)\n"
+           "  -g, --groups=N          synthetic groups (%d)\n"
+           "  -F, --fanout=N          synthetic groups per user (%d)\n"
+           "  -m, --methods=LIST      hash methods of the dataset (%s)\n"
+           "  -o, --output=PREFIX     write PREFIX.dat and PREFIX.gp\n"
+           "  -k, --keep              keep the generated datasets\n"
+           "  -h, --help              display this help message\n",
+           name, name, SCALE_DEFAULT_SIZES, SCALE_DEFAULT_ITERATIONS,
+           s_opts.groups, s_opts.fanout, DATASET_DEFAULT_METHODS);
+}
+
+static void
+scale_parse_options(int argc, char *argv[])
+{
+    static const struct option long_options[] = {
+        {"sizes",      required_argument, NULL, 's'},
+        {"iterations", required_argument, NULL, 'n'},
+        {"useradd",    required_argument, NULL, 'a'},
+        {"groups",     required_argument, NULL, 'g'},
+        {"fanout",     required_argument, NULL, 'F'},
+        {"methods",    required_argument, NULL, 'm'},
+        {"output",     required_argument, NULL, 'o'},
+        {"keep",       no_argument,       NULL, 'k'},
+        {"help",       no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+    int c;
+
+    scale_parse_sizes(SCALE_DEFAULT_SIZES);
+
+    while (-1 != (c = getopt_long(argc, argv, "s:n:a:g:F:m:o:kh",
+                                  long_options, NULL)))
+    {
+        switch (c)
+        {
+        case 's':
+            if (PASSWD_ERR_SUCCESS != scale_parse_sizes(optarg))
+            {
+                fprintf(stderr, "invalid sizes '%s'\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'n':
+            s_opts.iterations = atoi(optarg);
+            break;
+        case 'a':
+            s_opts.user_iterations = atoi(optarg);
+            break;
+        case 'g':
+            s_opts.groups = atoi(optarg);
+            break;
+        case 'F':
+            s_opts.fanout = atoi(optarg);
+            break;
+        case 'm':
+            s_opts.methods = optarg;
+            break;
+        case 'o':
+            s_opts.output = optarg;
+            break;
+        case 'k':
+            s_opts.keep = 1;
+            break;
+        case 'h':
+            scale_usage(argv[0]);
+            exit(EXIT_SUCCESS);
+        default:
+            scale_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if ((s_opts.iterations < 1) || (s_opts.user_iterations < 0) ||
+        (s_opts.groups < 1) || (s_opts.fanout < 0))
+    {
+        fprintf(stderr, "iterations and groups must be positive\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (s_opts.user_iterations && (0 != geteuid()))
+    {
+        fprintf(stderr, "useradd/userdel need root, skipping them\n");
+        s_opts.user_iterations = 0;
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    passwd_srv_dataset_t ds;
+    char root_dir[PATH_MAX];
+    uint64_t *ns, *ns_del;
+    int size, max;
+
+    scale_parse_options(argc, argv);
+
+    max = (s_opts.iterations > s_opts.user_iterations) ?
+            s_opts.iterations : s_opts.user_iterations;
+    ns = calloc(max, sizeof(*ns));
+    ns_del = calloc(max, sizeof(*ns_del));
+    if ((NULL == ns) || (NULL == ns_del))
+    {
+        return EXIT_FAILURE;
+    }
+
+    snprintf(s_opts.work_dir, sizeof(s_opts.work_dir),
+             "/tmp/ops-passwd-srv-scale.XXXXXX");
+    if (NULL == mkdtemp(s_opts.work_dir))
+    {
+        fprintf(stderr, "failed to create work directory\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("%10s %-12s %8s %8s %12s %12s %12s\n", "users", "operation",
+           "iter", "errors", "p50(us)", "p99(us)", "max(us)");
+
+    for (size = 0; size < s_opts.nsizes; size++)
+    {
+        snprintf(root_dir, sizeof(root_dir), "%s/users-%d", s_opts.work_dir,
+                 s_opts.sizes[size]);
+        mkdir(root_dir, 0755);
+
+        memset(&ds, 0, sizeof(ds));
+        ds.root_dir = root_dir;
+        ds.password = SCALE_PASSWORD;
+        ds.methods  = s_opts.methods;
+        ds.users    = s_opts.sizes[size];
+        ds.groups   = s_opts.groups;
+        ds.fanout   = s_opts.fanout;
+
+        if (PASSWD_ERR_SUCCESS != passwd_srv_dataset_create(&ds))
+        {
+            fprintf(stderr, "failed to create dataset under %s\n", root_dir);
+            break;
+        }
+
+        /* same as 'ops-passwd-srv --root=<root_dir>' */
+        uninit_yaml_parser();
+        if (PASSWD_ERR_SUCCESS != passwd_srv_config_init(root_dir, NULL))
+        {
+            fprintf(stderr, "failed to read configuration of %s\n",
+                    root_dir);
+            break;
+        }
+
+        scale_run_ops(size, &ds, ns);
+        if (s_opts.user_iterations)
+        {
+            scale_run_create_user(size, ns, ns_del);
+        }
+    }
+
+    if (s_opts.output)
+    {
+        scale_write_plot();
+    }
+
+    if (s_opts.keep)
+    {
+        printf("datasets kept under %s\n", s_opts.work_dir);
+    }
+    else
+    {
+        nftw(s_opts.work_dir, scale_remove_helper, 8, FTW_DEPTH | FTW_PHYS);
+    }
+
+    free(ns);
+    free(ns_del);
+
+    return EXIT_SUCCESS;
+}